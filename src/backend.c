@@ -0,0 +1,469 @@
+#include <ctype.h>
+
+#include "epoch.h"
+#include "jobs.h"
+
+#include "mkb.h"
+#include "metrics.h"
+#include "mirror.h"
+#include "stats.h"
+
+static const InputBackend *const backends[] = {&native_backend, &null_backend, &record_backend};
+static const InputBackend *backend = &native_backend;
+
+bool mkb_init(const char *spec)
+{
+  if (spec == NULL)
+  {
+    spec = native_backend.name;
+  }
+  const char *colon = strchr(spec, ':');
+  size_t length = colon != NULL ? (size_t)(colon - spec) : strlen(spec);
+
+  for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i)
+  {
+    if (strlen(backends[i]->name) == length && strncmp(backends[i]->name, spec, length) == 0)
+    {
+      backend = backends[i];
+      return backend->init(colon != NULL ? colon + 1 : NULL);
+    }
+  }
+  fprintf(stderr, "Unknown input backend: %.*s (expected %s, null or record[:<path>])\n", (int)length, spec, native_backend.name);
+  return false;
+}
+
+void mkb_cleanup()
+{
+  backend->cleanup();
+}
+
+const InputBackend *mkb_backend()
+{
+  return backend;
+}
+
+void mouseMove(int x, int y)
+{
+  stats_count(STAT_MOVES);
+  backend->mouse_move(x, y);
+  mirror_moved(x, y);
+}
+
+void mouseDown(int button)
+{
+  stats_count(STAT_CLICKS);
+  backend->mouse_down(button);
+}
+
+void mouseUp(int button)
+{
+  backend->mouse_up(button);
+}
+
+void keyDown(char key)
+{
+  stats_count(STAT_KEYS);
+  backend->key_down(key);
+}
+
+void keyUp(char key)
+{
+  backend->key_up(key);
+}
+
+void mkb_batch_begin()
+{
+  backend->batch_begin();
+}
+
+void mkb_batch_end()
+{
+  uint64_t start = metrics_backend_start(BACKEND_BATCH_END);
+  backend->batch_end();
+  metrics_backend(BACKEND_BATCH_END, start);
+}
+
+void mkb_batch_delay(unsigned long ms)
+{
+  backend->batch_delay(ms);
+}
+
+void mkb_flush()
+{
+  uint64_t start = metrics_backend_start(BACKEND_FLUSH);
+  backend->flush();
+  metrics_backend(BACKEND_FLUSH, start);
+}
+
+MousePos getMousePos()
+{
+  MousePos pos;
+  if (mirror_position(&pos))
+  {
+    return pos;
+  }
+  uint64_t start = metrics_backend_start(BACKEND_POINTER);
+  pos = backend->get_mouse_pos();
+  metrics_backend(BACKEND_POINTER, start);
+  return pos;
+}
+
+bool mkb_screen_size(int *width, int *height)
+{
+  epoch_enter();
+  const ScreenGeometry *geometry = backend->geometry();
+  if (geometry != NULL)
+  {
+    *width = geometry->width;
+    *height = geometry->height;
+  }
+  epoch_exit();
+  return geometry != NULL;
+}
+
+bool mkb_resolve(int monitor, bool proportional, float x, float y, int *px, int *py)
+{
+  epoch_enter();
+  const ScreenGeometry *geometry = backend->geometry();
+  if (geometry == NULL || monitor >= geometry->count)
+  {
+    epoch_exit();
+    return false;
+  }
+  Monitor area = monitor >= 0 ? geometry->monitors[monitor] : (Monitor){0, 0, geometry->width, geometry->height};
+  epoch_exit();
+  if (proportional)
+  {
+    x *= area.width - 1;
+    y *= area.height - 1;
+  }
+  *px = area.x + (int)(x < 0 ? x - 0.5f : x + 0.5f);
+  *py = area.y + (int)(y < 0 ? y - 0.5f : y + 0.5f);
+  return true;
+}
+
+void mouseMoveProportional(float x, float y)
+{
+  int px, py;
+  if (mkb_resolve(-1, true, x, y, &px, &py))
+  {
+    mouseMove(px, py);
+  }
+}
+
+// Without a real pointer, the mouse is wherever it was last moved to
+static atomic_long pointer_x = 0;
+static atomic_long pointer_y = 0;
+
+static MousePos headless_get_mouse_pos()
+{
+  return (MousePos){atomic_load_explicit(&pointer_x, memory_order_relaxed), atomic_load_explicit(&pointer_y, memory_order_relaxed)};
+}
+
+// There is no screen to scale to
+static const ScreenGeometry *headless_geometry()
+{
+  return NULL;
+}
+
+static bool null_init(const char *arg)
+{
+  return true;
+}
+
+static void null_mouse_move(int x, int y)
+{
+  atomic_store_explicit(&pointer_x, x, memory_order_relaxed);
+  atomic_store_explicit(&pointer_y, y, memory_order_relaxed);
+}
+
+static void null_button(int button)
+{
+}
+
+static void null_key(char key)
+{
+}
+
+static void null_delay(unsigned long ms)
+{
+}
+
+static void null_void()
+{
+}
+
+const InputBackend null_backend = {
+    .name = "null",
+    .init = null_init,
+    .cleanup = null_void,
+    .mouse_move = null_mouse_move,
+    .mouse_down = null_button,
+    .mouse_up = null_button,
+    .key_down = null_key,
+    .key_up = null_key,
+    .batch_begin = null_void,
+    .batch_end = null_void,
+    .batch_delay = null_delay,
+    .flush = null_void,
+    .get_mouse_pos = headless_get_mouse_pos,
+    .geometry = headless_geometry,
+};
+
+// Each slot works like a seqlock: a writer claims the next index, marks the
+// slot odd while it fills it in and even once it is done, and a reader only
+// takes an event if the slot held the same even sequence before and after
+// copying it.
+typedef struct
+{
+  atomic_ulong seq; // 2 * index + 1 while being written, 2 * index + 2 after
+  atomic_uint_least64_t time;
+  atomic_int type;
+  atomic_int a;
+  atomic_int b;
+} RecordSlot;
+
+static RecordSlot record_ring[RECORD_EVENTS];
+static atomic_ulong record_head = 0;
+static uint64_t record_start = 0;
+
+static FILE *record_file = NULL;
+static atomic_flag record_draining = ATOMIC_FLAG_INIT;
+static atomic_ulong record_written = 0; // cursor of the file writer
+static _Thread_local int record_depth = 0;
+
+int mkb_read_events(unsigned long *cursor, RecordedEvent *events, int max_events)
+{
+  unsigned long head = atomic_load_explicit(&record_head, memory_order_acquire);
+  unsigned long index = *cursor;
+  if (head - index > RECORD_EVENTS)
+  {
+    index = head - RECORD_EVENTS;
+  }
+
+  int count = 0;
+  for (; index != head && count < max_events; ++index)
+  {
+    RecordSlot *slot = &record_ring[index % RECORD_EVENTS];
+    unsigned long expected = 2 * index + 2;
+    unsigned long before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    RecordedEvent event = {
+        .time = atomic_load_explicit(&slot->time, memory_order_relaxed),
+        .type = atomic_load_explicit(&slot->type, memory_order_relaxed),
+        .a = atomic_load_explicit(&slot->a, memory_order_relaxed),
+        .b = atomic_load_explicit(&slot->b, memory_order_relaxed),
+    };
+    atomic_thread_fence(memory_order_acquire);
+    unsigned long after = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+    if (before == expected && after == expected)
+    {
+      events[count++] = event;
+    }
+    else if (before <= expected && after <= expected)
+    {
+      // Claimed but not written yet; later events wait for it
+      break;
+    }
+  }
+  *cursor = index;
+  return count;
+}
+
+void mkb_format_event(const RecordedEvent *event, char *buf, size_t size)
+{
+  static const char *const names[] = {
+      [EVENT_MOVE] = "move",
+      [EVENT_BUTTON_DOWN] = "button_down",
+      [EVENT_BUTTON_UP] = "button_up",
+      [EVENT_KEY_DOWN] = "key_down",
+      [EVENT_KEY_UP] = "key_up",
+      [EVENT_DELAY] = "delay",
+  };
+  unsigned long long us = event->time / 1000;
+
+  switch (event->type)
+  {
+  case EVENT_MOVE:
+    snprintf(buf, size, "%llu %s %d %d", us, names[event->type], event->a, event->b);
+    break;
+  case EVENT_KEY_DOWN:
+  case EVENT_KEY_UP:
+    if (isgraph(event->a))
+    {
+      snprintf(buf, size, "%llu %s %c", us, names[event->type], event->a);
+    }
+    else
+    {
+      snprintf(buf, size, "%llu %s 0x%02x", us, names[event->type], event->a);
+    }
+    break;
+  default:
+    snprintf(buf, size, "%llu %s %d", us, names[event->type], event->a);
+    break;
+  }
+}
+
+// With record_draining set. Returns true if any event was taken off the ring.
+static bool write_record()
+{
+  unsigned long cursor = atomic_load_explicit(&record_written, memory_order_relaxed);
+  RecordedEvent events[256];
+  char line[64];
+  int count;
+  do
+  {
+    unsigned long start = cursor;
+    count = mkb_read_events(&cursor, events, 256);
+    if (cursor - start > (unsigned long)count)
+    {
+      fprintf(record_file, "# %lu events lost\n", cursor - start - count);
+    }
+    for (int i = 0; i < count; ++i)
+    {
+      mkb_format_event(&events[i], line, sizeof(line));
+      fputs(line, record_file);
+      fputc('\n', record_file);
+    }
+  } while (count == 256);
+  bool progress = cursor != atomic_load_explicit(&record_written, memory_order_relaxed);
+  atomic_store_explicit(&record_written, cursor, memory_order_relaxed);
+  return progress;
+}
+
+// Writes the events recorded so far to the record file. Whoever finds the
+// file busy leaves the events to the thread that is writing it, which looks
+// again once it is done. An event that is still being filled in is left to
+// the thread recording it.
+static void drain_record()
+{
+  if (record_file == NULL)
+  {
+    return;
+  }
+  bool progress;
+  do
+  {
+    if (atomic_flag_test_and_set_explicit(&record_draining, memory_order_acquire))
+    {
+      return;
+    }
+    progress = write_record();
+    atomic_flag_clear_explicit(&record_draining, memory_order_release);
+  } while (progress && atomic_load_explicit(&record_head, memory_order_acquire) != atomic_load_explicit(&record_written, memory_order_relaxed));
+}
+
+static void record(RecordedEventType type, int a, int b)
+{
+  unsigned long index = atomic_fetch_add_explicit(&record_head, 1, memory_order_relaxed);
+  RecordSlot *slot = &record_ring[index % RECORD_EVENTS];
+
+  atomic_store_explicit(&slot->seq, 2 * index + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&slot->time, monotonic_ns() - record_start, memory_order_relaxed);
+  atomic_store_explicit(&slot->type, type, memory_order_relaxed);
+  atomic_store_explicit(&slot->a, a, memory_order_relaxed);
+  atomic_store_explicit(&slot->b, b, memory_order_relaxed);
+  atomic_store_explicit(&slot->seq, 2 * index + 2, memory_order_release);
+
+  // Like the native backends, events outside a batch are sent straight away.
+  // A long batch is written out before the ring wraps around on it.
+  if (record_depth == 0 || index - atomic_load_explicit(&record_written, memory_order_relaxed) >= RECORD_EVENTS / 2)
+  {
+    drain_record();
+  }
+}
+
+static bool record_init(const char *arg)
+{
+  record_start = monotonic_ns();
+  if (arg != NULL && arg[0] != '\0')
+  {
+    record_file = fopen(arg, "w");
+    if (record_file == NULL)
+    {
+      fprintf(stderr, "Cannot open record file %s\n", arg);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void record_cleanup()
+{
+  if (record_file != NULL)
+  {
+    // Waits for a drain on another thread to finish. The flag stays set,
+    // so that no drain starts on the closed file, and record_file is left
+    // as it is for threads still recording to find it busy.
+    while (atomic_flag_test_and_set_explicit(&record_draining, memory_order_acquire))
+    {
+      job_sleep(100);
+    }
+    write_record();
+    fclose(record_file);
+  }
+}
+
+static void record_mouse_move(int x, int y)
+{
+  null_mouse_move(x, y);
+  record(EVENT_MOVE, x, y);
+}
+
+static void record_mouse_down(int button)
+{
+  record(EVENT_BUTTON_DOWN, button, 0);
+}
+
+static void record_mouse_up(int button)
+{
+  record(EVENT_BUTTON_UP, button, 0);
+}
+
+static void record_key_down(char key)
+{
+  record(EVENT_KEY_DOWN, (unsigned char)key, 0);
+}
+
+static void record_key_up(char key)
+{
+  record(EVENT_KEY_UP, (unsigned char)key, 0);
+}
+
+static void record_batch_begin()
+{
+  record_depth++;
+}
+
+static void record_batch_end()
+{
+  if (--record_depth == 0)
+  {
+    drain_record();
+  }
+}
+
+// The pause is recorded rather than waited out, so that headless runs go as
+// fast as the interpreter does
+static void record_batch_delay(unsigned long ms)
+{
+  record(EVENT_DELAY, ms, 0);
+}
+
+const InputBackend record_backend = {
+    .name = "record",
+    .init = record_init,
+    .cleanup = record_cleanup,
+    .mouse_move = record_mouse_move,
+    .mouse_down = record_mouse_down,
+    .mouse_up = record_mouse_up,
+    .key_down = record_key_down,
+    .key_up = record_key_up,
+    .batch_begin = record_batch_begin,
+    .batch_end = record_batch_end,
+    .batch_delay = record_batch_delay,
+    .flush = drain_record,
+    .get_mouse_pos = headless_get_mouse_pos,
+    .geometry = headless_geometry,
+};
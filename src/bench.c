@@ -0,0 +1,957 @@
+#ifdef CLICKER_BENCH
+
+#include "main.h"
+
+#include "files.h"
+#include "script.h"
+
+#ifdef __linux__
+#include <poll.h>
+#endif
+
+// clicker-bench: the interpreter's hot paths, timed against the null input
+// backend so that no display is needed and no X server cost is included.
+// Build the sources with -DCLICKER_BENCH. Every benchmark prints one JSON
+// line to stdout. Single operations are shorter than the clock resolution,
+// so latencies are the mean of a batch of operations, and the percentiles
+// are over batches.
+
+typedef struct
+{
+  const char *name;
+  void (*run)(void *arg, int ops); // performs ops operations
+  void *arg;
+  int batch;   // operations per sample
+  int samples; // samples taken, after one warm-up batch
+} Benchmark;
+
+static int compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void run_benchmark(const Benchmark *bench)
+{
+  double *latencies = malloc(sizeof(double) * bench->samples);
+  bench->run(bench->arg, bench->batch);
+
+  uint64_t total = 0;
+  for (int i = 0; i < bench->samples; ++i)
+  {
+    uint64_t start = monotonic_ns();
+    bench->run(bench->arg, bench->batch);
+    uint64_t elapsed = monotonic_ns() - start;
+    total += elapsed;
+    latencies[i] = (double)elapsed / bench->batch;
+  }
+  qsort(latencies, bench->samples, sizeof(double), compare_doubles);
+
+  double ops = (double)bench->batch * bench->samples;
+  printf("{\"name\": \"%s\", \"ops\": %.0f, \"ops_per_sec\": %.1f, \"p50_ns\": %.1f, \"p99_ns\": %.1f}\n", bench->name, ops, total > 0 ? ops * 1e9 / total : 0.0, latencies[bench->samples / 2], latencies[bench->samples * 99 / 100]);
+  fflush(stdout);
+  free(latencies);
+}
+
+static void set_named_register(char name, const char *command)
+{
+  set_register(&registers[get_register_index(name)], command);
+}
+
+static void execute_line(const char *line)
+{
+  Command cmd;
+  if (parse_command(line, &cmd) == 0)
+  {
+    execute_command(&cmd);
+  }
+  free_command(&cmd);
+}
+
+// Waits until every job and task has finished or been cancelled
+static void wait_idle()
+{
+  JobInfo infos[JOB_SLOTS];
+  while (list_jobs(infos, JOB_SLOTS) > 0 || list_tasks(infos, JOB_SLOTS) > 0)
+  {
+    job_sleep(100);
+  }
+}
+
+static void stop_all()
+{
+  cancel_all_jobs();
+  cancel_all_tasks();
+  wake_registers();
+  wait_idle();
+}
+
+static volatile uintptr_t sink;
+
+// Micro-benchmarks
+
+static const char *const parse_lines[] = {
+    "C 0",
+    "@ n ^ s 1 d c",
+    "= s 1 a b c d",
+    "S Hello world, this is a sequence",
+    "* 1000 c p",
+    "P CPS:@C at @L",
+};
+
+static void bench_parse(void *arg, int ops)
+{
+  const char *line = (const char *)arg;
+  for (int i = 0; i < ops; ++i)
+  {
+    Command cmd;
+    parse_command(line, &cmd);
+    sink += cmd.argc;
+    free_command(&cmd);
+  }
+}
+
+// A script of SCRIPT_LINES lines, parse_lines over and over, loaded with or
+// without its cache
+#define SCRIPT_FILE "clicker-bench.script"
+#define SCRIPT_LINES 10000
+
+static void write_script()
+{
+  FILE *fp = fopen(SCRIPT_FILE, "w");
+  for (int i = 0; i < SCRIPT_LINES; ++i)
+  {
+    fprintf(fp, "%s\n", parse_lines[i % (sizeof(parse_lines) / sizeof(parse_lines[0]))]);
+  }
+  fclose(fp);
+}
+
+static void bench_load(void *arg, int ops)
+{
+  bool use_cache = arg != NULL;
+  for (int i = 0; i < ops; ++i)
+  {
+    Script script;
+    script_load(SCRIPT_FILE, use_cache, &script);
+    sink += script.count;
+    script_free(&script);
+  }
+}
+
+static void bench_dispatch(void *arg, int ops)
+{
+  static const char commands[] = "?&@:#=-/*^~!><MC}{K][SWTPJXQ";
+  for (int i = 0; i < ops; ++i)
+  {
+    sink += (uintptr_t)find_handler(commands[i % (sizeof(commands) - 1)]);
+  }
+}
+
+// Registers a..p form a chain of RECALLs, each recalling the next one, that
+// ends in a MOVE
+static void setup_recall_chain(int depth)
+{
+  for (int i = 0; i < depth; ++i)
+  {
+    char command[8];
+    if (i + 1 < depth)
+    {
+      snprintf(command, sizeof(command), "# %c", 'a' + i + 1);
+    }
+    else
+    {
+      snprintf(command, sizeof(command), "M 1 1");
+    }
+    set_named_register('a' + i, command);
+  }
+}
+
+static void bench_recall(void *arg, int ops)
+{
+  Command *cmd = (Command *)arg;
+  for (int i = 0; i < ops; ++i)
+  {
+    execute_command(cmd);
+  }
+}
+
+static void bench_substitute(void *arg, int ops)
+{
+  size_t length;
+  for (int i = 0; i < ops; ++i)
+  {
+    sink += expand_template((const Command *)arg, &length)[0];
+  }
+}
+
+static void bench_register_read(void *arg, int ops)
+{
+  Register *reg = (Register *)arg;
+  for (int i = 0; i < ops; ++i)
+  {
+    epoch_enter();
+    RegisterValue *value = load_register(reg);
+    sink += value->command[0];
+    epoch_exit();
+  }
+}
+
+static void bench_register_write(void *arg, int ops)
+{
+  Register *reg = (Register *)arg;
+  for (int i = 0; i < ops; ++i)
+  {
+    set_register(reg, i & 1 ? "1" : "0");
+  }
+}
+
+// Jobs that keep a register busy while the main thread is timed
+static void register_writer_job(void *arg)
+{
+  Register *reg = (Register *)arg;
+  for (unsigned long i = 0; job_iteration(); ++i)
+  {
+    set_register(reg, i & 1 ? "1" : "0");
+  }
+}
+
+static void register_reader_job(void *arg)
+{
+  Register *reg = (Register *)arg;
+  while (job_iteration())
+  {
+    epoch_enter();
+    RegisterValue *value = load_register(reg);
+    sink += value->command[0];
+    epoch_exit();
+  }
+}
+
+// RECORD into the register that WHILE_READERS WHILE loops are watching,
+// which keeps its value the same so that none of them stops
+#define WHILE_READERS 8
+
+static void bench_record_command(void *arg, int ops)
+{
+  const Command *cmd = (const Command *)arg;
+  for (int i = 0; i < ops; ++i)
+  {
+    execute_command(cmd);
+  }
+}
+
+// Macro-benchmarks
+
+// The examples from the README, with their hotkeys
+static const char *const toggle_script[] = {
+    "! quiet true",
+    "! enable_hotkey true",
+    "@ s 0",
+    "@ c C 0",
+    "@ n ^ s 1 c",
+    "@ T @ s 1",
+    "@ t # T n",
+    "@ u @ s 0",
+    "& p / s 0 t u",
+    "& q @ s 0",
+    NULL,
+};
+
+static const char *const location_script[] = {
+    "! quiet true",
+    "! enable_hotkey true",
+    "! enable_last_location_register true",
+    "@ U M",
+    "@ j # b",
+    "@ p : L b",
+    "& o # U p",
+    "@ s 0",
+    "@ t @ s 1",
+    "@ u @ s 0",
+    "@ J # B",
+    "@ P : L B",
+    "@ c C 0",
+    "@ D W 1000",
+    "@ n ^ s 1 U P j c J D",
+    "@ T # t n",
+    "& p / s 0 T u",
+    "& q @ s 0",
+    NULL,
+};
+
+static const char *const when_script[] = {
+    "! quiet true",
+    "! enable_hotkey true",
+    "@ s 0",
+    "@ c C 0",
+    "~ s 1 c",
+    "@ t @ s 1",
+    "@ u @ s 0",
+    "& p / s 0 t u",
+    NULL,
+};
+
+static const char *const sequence_script[] = {
+    "! quiet true",
+    "! enable_hotkey true",
+    "& o S n my way!",
+    NULL,
+};
+
+// Loads a script and stops whatever it started
+static void bench_script(void *arg, int ops)
+{
+  const char *const *script = (const char *const *)arg;
+  for (int i = 0; i < ops; ++i)
+  {
+    for (int j = 0; script[j] != NULL; ++j)
+    {
+      execute_line(script[j]);
+    }
+    stop_all();
+  }
+}
+
+// Presses a hotkey that recalls, compares and writes registers
+static void bench_hotkey(void *arg, int ops)
+{
+  int index = get_hotkey_index(*(const char *)arg);
+  for (int i = 0; i < ops; ++i)
+  {
+    execute_hotkey(index);
+  }
+}
+
+// Clicks ops times from a REPEAT loop and waits for it to finish
+static void bench_repeat(void *arg, int ops)
+{
+  char line[32];
+  snprintf(line, sizeof(line), "* %d c", ops);
+  execute_line("@ c C 0");
+  execute_line(line);
+  wait_idle();
+}
+
+// Runs the toggle example's WHILE loop until it has clicked ops times, then
+// stops it through the register it watches, like the OFF hotkey does
+static void bench_while(void *arg, int ops)
+{
+  execute_line("@ c C 0");
+  execute_line("@ s 1");
+  execute_line("^ s 1 c");
+
+  JobInfo infos[JOB_SLOTS];
+  for (;;)
+  {
+    int count = list_jobs(infos, JOB_SLOTS);
+    if (count == 0)
+    {
+      count = list_tasks(infos, JOB_SLOTS);
+    }
+    if (count > 0 && infos[0].iterations >= (unsigned long)ops)
+    {
+      break;
+    }
+    job_sleep(100);
+  }
+  execute_line("@ s 0");
+  wait_idle();
+}
+
+static atomic_int jobs_done = 0;
+
+static void noop_job(void *arg)
+{
+  atomic_fetch_add(&jobs_done, 1);
+}
+
+static void wait_done(int target)
+{
+  while (atomic_load(&jobs_done) < target)
+  {
+    job_sleep(10);
+  }
+}
+
+// Spawns ops jobs that do nothing and waits for all of them to finish
+static void bench_spawn_job(void *arg, int ops)
+{
+  int target = atomic_load(&jobs_done) + ops;
+  for (int i = 0; i < ops; ++i)
+  {
+    spawn_job("noop", noop_job, NULL, NULL);
+  }
+  wait_done(target);
+}
+
+#ifdef __linux__
+static void *noop_thread(void *arg)
+{
+  noop_job(arg);
+  return NULL;
+}
+
+// What REPEAT and WHILE did before the job pool, less reopening the display
+static void bench_spawn_thread(void *arg, int ops)
+{
+  int target = atomic_load(&jobs_done) + ops;
+  for (int i = 0; i < ops; ++i)
+  {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, noop_thread, NULL) == 0)
+    {
+      pthread_detach(thread);
+    }
+    else
+    {
+      target--;
+    }
+  }
+  wait_done(target);
+}
+
+// JITTER_LOOPS loops of W 100 run for JITTER_SECONDS, either as a thread
+// each that sleeps in usleep, as every loop did before the job pool, or as
+// event loop tasks. Lateness is kept in the event loop's buckets.
+#define JITTER_LOOPS 10000
+#define JITTER_SECONDS 3
+#define JITTER_PERIOD_MS 100
+#define JITTER_STACK (64 * 1024)
+
+static atomic_ulong jitter_counts[LATENESS_BUCKETS];
+static atomic_ulong jitter_max_ns = 0;
+static atomic_bool jitter_stop = false;
+
+static double rss_mb()
+{
+  long pages = 0;
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp != NULL)
+  {
+    if (fscanf(fp, "%*s %ld", &pages) != 1)
+    {
+      pages = 0;
+    }
+    fclose(fp);
+  }
+  return pages * (double)sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+static void *sleeper_thread(void *arg)
+{
+  while (!atomic_load(&jitter_stop))
+  {
+    uint64_t start = monotonic_ns();
+    usleep(JITTER_PERIOD_MS * 1000);
+    uint64_t late = monotonic_ns() - start - JITTER_PERIOD_MS * 1000000ULL;
+    uint64_t bucket = late / 1000 / LATENESS_BUCKET_US;
+    atomic_fetch_add(&jitter_counts[bucket < LATENESS_BUCKETS ? bucket : LATENESS_BUCKETS - 1], 1);
+    unsigned long max = atomic_load(&jitter_max_ns);
+    while (late > max && !atomic_compare_exchange_weak(&jitter_max_ns, &max, late))
+    {
+    }
+  }
+  return NULL;
+}
+
+// The upper bound of the bucket the fraction falls into, like JOBS reports
+static double jitter_percentile(unsigned long total, double fraction)
+{
+  unsigned long seen = 0;
+  for (int i = 0; i < LATENESS_BUCKETS; ++i)
+  {
+    seen += atomic_load(&jitter_counts[i]);
+    if (seen > total * fraction)
+    {
+      return (i + 1) * LATENESS_BUCKET_US;
+    }
+  }
+  return LATENESS_BUCKETS * LATENESS_BUCKET_US;
+}
+
+static void print_jitter(const char *name, int loops, double rss, unsigned long wakeups, double p50, double p99, double max)
+{
+  printf("{\"name\": \"%s\", \"loops\": %d, \"rss_added_mb\": %.1f, \"wakeups\": %lu, \"late_p50_us\": %.0f, \"late_p99_us\": %.0f, \"late_max_us\": %.0f}\n", name, loops, rss, wakeups, p50, p99, max);
+  fflush(stdout);
+}
+
+static void bench_jitter_threads()
+{
+  pthread_t *threads = malloc(sizeof(pthread_t) * JITTER_LOOPS);
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setstacksize(&attributes, JITTER_STACK);
+  double before = rss_mb();
+  int loops = 0;
+  while (loops < JITTER_LOOPS && pthread_create(&threads[loops], &attributes, sleeper_thread, NULL) == 0)
+  {
+    loops++;
+  }
+  pthread_attr_destroy(&attributes);
+  Sleep(JITTER_SECONDS * 1000);
+  double rss = rss_mb() - before;
+
+  atomic_store(&jitter_stop, true);
+  for (int i = 0; i < loops; ++i)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  unsigned long total = 0;
+  for (int i = 0; i < LATENESS_BUCKETS; ++i)
+  {
+    total += atomic_load(&jitter_counts[i]);
+  }
+  print_jitter("jitter/threads", loops, rss, total, jitter_percentile(total, 0.50), jitter_percentile(total, 0.99), atomic_load(&jitter_max_ns) / 1000.0);
+}
+
+// The event loop's lateness counts every timer since startup, and no other
+// benchmark sleeps on it
+static void bench_jitter_event_loop()
+{
+  set_option(OPT_EVENT_LOOP, "true", 4);
+  execute_line("@ w W 100");
+  double before = rss_mb();
+  for (int i = 0; i < JITTER_LOOPS; ++i)
+  {
+    execute_line("* 1000000 w");
+  }
+  Sleep(JITTER_SECONDS * 1000);
+  double rss = rss_mb() - before;
+
+  EventLoopStats stats;
+  event_loop_stats(&stats);
+  stop_all();
+  set_option(OPT_EVENT_LOOP, "false", 5);
+  print_jitter("jitter/event_loop", stats.tasks, rss, stats.wakeups, stats.lateness_p50_us, stats.lateness_p99_us, stats.lateness_max_us);
+}
+#endif
+
+// A Bezier path's points, computed a batch at a time
+static void bench_motion_points(void *arg, int ops)
+{
+  MotionPath path = {PATH_BEZIER, 0, 0, 1920, 1080, 200, 900, 1700, 100};
+  MotionPoints points;
+  for (int i = 0; i < ops; i += MOTION_BATCH)
+  {
+    motion_points(&path, i % 1024, 1024, &points);
+    sink += (uintptr_t)points.x[i / MOTION_BATCH % MOTION_BATCH];
+  }
+}
+
+// A 100 ms move at the highest rate. How far its p50 is from 100 ms is the
+// timing error of the path as a whole.
+static void bench_motion_move(void *arg, int ops)
+{
+  for (int i = 0; i < ops; ++i)
+  {
+    execute_line(i % 2 == 0 ? "M 1000 800 100ms EASE" : "M 0 0 100ms EASE");
+  }
+}
+
+// A full-HD screen of one color, searched for one it does not have, so
+// every pixel is looked at. arg is the width of the region, from the top
+// left corner, or 0 for all of the screen.
+static uint8_t *screen_pixels = NULL;
+
+static void bench_pixel_scan(void *arg, int ops)
+{
+  if (screen_pixels == NULL)
+  {
+    screen_pixels = malloc(1920 * 1080 * 4);
+    memset(screen_pixels, 0x20, 1920 * 1080 * 4);
+  }
+  int size = (int)(intptr_t)arg;
+  PixelImage image = {screen_pixels, size > 0 ? size : 1920, size > 0 ? size : 1080, 1920 * 4, 2, 1, 0};
+  int x, y;
+  for (int i = 0; i < ops; ++i)
+  {
+    sink += pixel_find(&image, 0x40a0ff, 8, &x, &y);
+  }
+}
+
+// A 64x64 button cut out of a full-HD screen of overlapping rectangles
+// with noise over them, looked for on all of it
+static GrayImage gray_screen = {NULL, 1920, 1080, 0, 0};
+static Template *button = NULL;
+
+static uint32_t next_noise(uint32_t *noise)
+{
+  *noise = *noise * 1103515245 + 12345;
+  return *noise >> 16;
+}
+
+static void bench_template_find(void *arg, int ops)
+{
+  if (button == NULL)
+  {
+    gray_screen.pixels = malloc(1920 * 1080);
+    memset(gray_screen.pixels, 0xc0, 1920 * 1080);
+    uint32_t noise = 1;
+    for (int i = 0; i < 400; ++i)
+    {
+      int left = next_noise(&noise) % 1920, top = next_noise(&noise) % 1080;
+      int right = left + 20 + next_noise(&noise) % 200, bottom = top + 10 + next_noise(&noise) % 80;
+      uint8_t value = next_noise(&noise) % 240;
+      for (int y = top; y < bottom && y < 1080; ++y)
+      {
+        for (int x = left; x < right && x < 1920; ++x)
+        {
+          gray_screen.pixels[y * 1920 + x] = value;
+        }
+      }
+    }
+    for (int i = 0; i < 1920 * 1080; ++i)
+    {
+      gray_screen.pixels[i] += next_noise(&noise) % 16;
+    }
+    GrayImage cut = {malloc(64 * 64), 64, 64, 0, 0};
+    for (int y = 0; y < 64; ++y)
+    {
+      memcpy(cut.pixels + y * 64, gray_screen.pixels + (777 + y) * 1920 + 1234, 64);
+    }
+    button = template_create(&cut);
+    free(cut.pixels);
+  }
+  TemplateMatch match;
+  for (int i = 0; i < ops; ++i)
+  {
+    template_find(button, &gray_screen, &match);
+    sink += match.x;
+  }
+}
+
+#ifdef __linux__
+#define READBACK_CHARS 20000
+#define READBACK_LINE 1000 // characters a SEQUENCE types
+
+// Types into a window of its own with the xtest backend and reads the keys
+// back from the server, failing if any is lost or arrives out of order.
+// Lowercase letters and digits need no modifier on any layout.
+static int typing_readback()
+{
+  Display *reader = XOpenDisplay(NULL);
+  if (reader == NULL)
+  {
+    fprintf(stderr, "typing/readback needs a display, such as Xvfb's\n");
+    return 1;
+  }
+  Window window = XCreateSimpleWindow(reader, DefaultRootWindow(reader), 0, 0, 200, 200, 0, 0, 0);
+  XSelectInput(reader, window, KeyPressMask | StructureNotifyMask);
+  XMapWindow(reader, window);
+  XEvent event;
+  do
+  {
+    XNextEvent(reader, &event);
+  } while (event.type != MapNotify);
+  XSetInputFocus(reader, window, RevertToParent, CurrentTime);
+  XSync(reader, False);
+
+  static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+  char *expected = malloc(READBACK_CHARS);
+  uint32_t noise = 1;
+  for (int i = 0; i < READBACK_CHARS; ++i)
+  {
+    expected[i] = alphabet[next_noise(&noise) % (sizeof(alphabet) - 1)];
+  }
+
+  uint64_t start = monotonic_ns();
+  char line[READBACK_LINE + 3];
+  for (int i = 0; i < READBACK_CHARS; i += READBACK_LINE)
+  {
+    snprintf(line, sizeof(line), "S %.*s", READBACK_LINE, expected + i);
+    execute_line(line);
+  }
+
+  // Keys that have not arrived after a second without any are lost
+  char *typed = malloc(READBACK_CHARS);
+  int received = 0;
+  uint64_t last = start;
+  struct pollfd readable = {ConnectionNumber(reader), POLLIN, 0};
+  while (received < READBACK_CHARS)
+  {
+    if (XPending(reader) == 0)
+    {
+      if (poll(&readable, 1, 1000) <= 0)
+      {
+        break;
+      }
+      continue;
+    }
+    XNextEvent(reader, &event);
+    char key;
+    if (event.type == KeyPress && XLookupString(&event.xkey, &key, 1, NULL, NULL) == 1)
+    {
+      typed[received++] = key;
+      last = monotonic_ns();
+    }
+  }
+
+  int mismatch = -1;
+  for (int i = 0; i < received && mismatch < 0; ++i)
+  {
+    if (typed[i] != expected[i])
+    {
+      mismatch = i;
+    }
+  }
+  printf("{\"name\": \"typing/readback\", \"chars\": %d, \"received\": %d, \"first_mismatch\": %d, \"chars_per_sec\": %.1f}\n", READBACK_CHARS, received, mismatch, last > start ? received * 1e9 / (last - start) : 0.0);
+  free(typed);
+  free(expected);
+  XCloseDisplay(reader);
+  return received == READBACK_CHARS && mismatch < 0 ? 0 : 1;
+}
+#endif
+
+static const char *filter = "";
+
+static bool selected(const char *name)
+{
+  return strstr(name, filter) != NULL;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1)
+  {
+    filter = argv[1];
+  }
+
+  init_options();
+  init_registers();
+  init_jobs();
+  init_event_loop();
+  // The only check that needs a display, so it only runs on its own
+  bool readback = strcmp(filter, "typing/readback") == 0;
+  if (!mkb_init(readback ? NULL : "null"))
+  {
+    return 1;
+  }
+  set_option(OPT_QUIET, "true", 4);
+  if (readback)
+  {
+#ifdef __linux__
+    int result = typing_readback();
+#else
+    int result = 1;
+#endif
+    mkb_cleanup();
+    return result;
+  }
+
+  char name[64];
+  for (size_t i = 0; i < sizeof(parse_lines) / sizeof(parse_lines[0]); ++i)
+  {
+    snprintf(name, sizeof(name), "parse/%s", parse_lines[i]);
+    name[strcspn(name, " ")] = '\0';
+    if (selected(name))
+    {
+      run_benchmark(&(Benchmark){name, bench_parse, (void *)parse_lines[i], 256, 2000});
+    }
+  }
+  if (selected("load/parsed") || selected("load/cached"))
+  {
+    write_script();
+    if (selected("load/parsed"))
+    {
+      run_benchmark(&(Benchmark){"load/parsed", bench_load, NULL, 1, 200});
+    }
+    if (selected("load/cached"))
+    {
+      run_benchmark(&(Benchmark){"load/cached", bench_load, (void *)SCRIPT_FILE, 1, 200});
+    }
+    remove(SCRIPT_FILE);
+    remove(SCRIPT_FILE SCRIPT_CACHE_SUFFIX);
+  }
+  if (selected("dispatch/find_handler"))
+  {
+    run_benchmark(&(Benchmark){"dispatch/find_handler", bench_dispatch, NULL, 1024, 2000});
+  }
+
+  static const int depths[] = {1, 4, 16};
+  for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); ++i)
+  {
+    snprintf(name, sizeof(name), "recall/depth_%d", depths[i]);
+    if (selected(name))
+    {
+      setup_recall_chain(depths[i]);
+      Command cmd;
+      parse_command("# a", &cmd);
+      run_benchmark(&(Benchmark){name, bench_recall, &cmd, 256, 1000});
+      free_command(&cmd);
+    }
+  }
+  if (selected("recall/depth_4_profiled"))
+  {
+    setup_recall_chain(4);
+    Command cmd;
+    parse_command("# a", &cmd);
+    set_option(OPT_PROFILE, "true", 4);
+    run_benchmark(&(Benchmark){"recall/depth_4_profiled", bench_recall, &cmd, 256, 1000});
+    set_option(OPT_PROFILE, "false", 5);
+    free_command(&cmd);
+  }
+
+  set_named_register('C', "17");
+  set_named_register('L', "M 640 480");
+  if (selected("print/substitute"))
+  {
+    Command cmd;
+    parse_command("P \"CPS:@C at @L, @x is not set\"", &cmd);
+    run_benchmark(&(Benchmark){"print/substitute", bench_substitute, &cmd, 256, 2000});
+    free_command(&cmd);
+  }
+
+  Register *reg = &registers[get_register_index('r')];
+  set_register(reg, "0");
+  if (selected("registers/read"))
+  {
+    run_benchmark(&(Benchmark){"registers/read", bench_register_read, reg, 1024, 2000});
+  }
+  if (selected("registers/write"))
+  {
+    run_benchmark(&(Benchmark){"registers/write", bench_register_write, reg, 256, 2000});
+  }
+  if (selected("registers/read_contended"))
+  {
+    spawn_job("writer", register_writer_job, NULL, reg);
+    run_benchmark(&(Benchmark){"registers/read_contended", bench_register_read, reg, 1024, 2000});
+    stop_all();
+  }
+  if (selected("registers/write_contended"))
+  {
+    for (int i = 0; i < 3; ++i)
+    {
+      spawn_job("reader", register_reader_job, NULL, reg);
+    }
+    run_benchmark(&(Benchmark){"registers/write_contended", bench_register_write, reg, 256, 2000});
+    stop_all();
+  }
+  if (selected("registers/record_vs_while"))
+  {
+    execute_line("@ r v");
+    execute_line("@ x C 0");
+    for (int i = 0; i < WHILE_READERS; ++i)
+    {
+      execute_line("^ r v x");
+    }
+    Command cmd;
+    parse_command("@ r v", &cmd);
+    run_benchmark(&(Benchmark){"registers/record_vs_while", bench_record_command, &cmd, 256, 2000});
+    free_command(&cmd);
+    stop_all();
+    set_register(reg, "0");
+  }
+
+  static const struct
+  {
+    const char *name;
+    const char *const *script;
+  } scripts[] = {
+      {"script/toggle", toggle_script},
+      {"script/location", location_script},
+      {"script/when", when_script},
+      {"script/sequence", sequence_script},
+  };
+  for (size_t i = 0; i < sizeof(scripts) / sizeof(scripts[0]); ++i)
+  {
+    if (selected(scripts[i].name))
+    {
+      run_benchmark(&(Benchmark){scripts[i].name, bench_script, (void *)scripts[i].script, 1, 200});
+    }
+  }
+
+  // The sequence example's hotkey types a string, and the toggle example's
+  // flips s and starts or stops the clicker
+  bench_script((void *)sequence_script, 1);
+  if (selected("hotkey/sequence"))
+  {
+    run_benchmark(&(Benchmark){"hotkey/sequence", bench_hotkey, "o", 64, 1000});
+  }
+  for (int i = 0; toggle_script[i] != NULL; ++i)
+  {
+    execute_line(toggle_script[i]);
+  }
+  if (selected("hotkey/toggle"))
+  {
+    run_benchmark(&(Benchmark){"hotkey/toggle", bench_hotkey, "p", 2, 200});
+  }
+  stop_all();
+
+  if (selected("motion/points"))
+  {
+    run_benchmark(&(Benchmark){"motion/points", bench_motion_points, NULL, 64 * MOTION_BATCH, 2000});
+  }
+  if (selected("motion/move_100ms"))
+  {
+    set_option(OPT_MOTION_RATE, "1000", 4);
+    run_benchmark(&(Benchmark){"motion/move_100ms", bench_motion_move, NULL, 1, 20});
+  }
+
+  if (selected("pixel/scan_100x100"))
+  {
+    run_benchmark(&(Benchmark){"pixel/scan_100x100", bench_pixel_scan, (void *)(intptr_t)100, 64, 1000});
+  }
+  if (selected("pixel/scan_1080p"))
+  {
+    run_benchmark(&(Benchmark){"pixel/scan_1080p", bench_pixel_scan, NULL, 1, 200});
+  }
+
+  if (selected("template/find_64x64_1080p"))
+  {
+    run_benchmark(&(Benchmark){"template/find_64x64_1080p", bench_template_find, NULL, 1, 100});
+  }
+
+  if (selected("loop/repeat"))
+  {
+    run_benchmark(&(Benchmark){"loop/repeat", bench_repeat, NULL, 10000, 20});
+  }
+  if (selected("loop/while"))
+  {
+    run_benchmark(&(Benchmark){"loop/while", bench_while, NULL, 10000, 20});
+  }
+  if (selected("loop/repeat_profiled"))
+  {
+    set_option(OPT_PROFILE, "true", 4);
+    run_benchmark(&(Benchmark){"loop/repeat_profiled", bench_repeat, NULL, 10000, 20});
+    set_option(OPT_PROFILE, "false", 5);
+  }
+  if (selected("jobs/spawn"))
+  {
+    run_benchmark(&(Benchmark){"jobs/spawn", bench_spawn_job, NULL, 64, 200});
+  }
+#ifdef __linux__
+  if (selected("jobs/spawn_thread"))
+  {
+    run_benchmark(&(Benchmark){"jobs/spawn_thread", bench_spawn_thread, NULL, 64, 200});
+  }
+  if (selected("jitter/threads"))
+  {
+    bench_jitter_threads();
+  }
+  if (EVENT_LOOP_SUPPORTED && selected("jitter/event_loop"))
+  {
+    bench_jitter_event_loop();
+  }
+#endif
+
+  if (EVENT_LOOP_SUPPORTED)
+  {
+    set_option(OPT_EVENT_LOOP, "true", 4);
+    if (selected("loop/repeat_event_loop"))
+    {
+      run_benchmark(&(Benchmark){"loop/repeat_event_loop", bench_repeat, NULL, 10000, 20});
+    }
+    if (selected("loop/while_event_loop"))
+    {
+      run_benchmark(&(Benchmark){"loop/while_event_loop", bench_while, NULL, 10000, 20});
+    }
+    set_option(OPT_EVENT_LOOP, "false", 5);
+  }
+
+  mkb_cleanup();
+  return 0;
+}
+
+#endif
@@ -0,0 +1,358 @@
+#include "jobs.h"
+
+#include "capture.h"
+#include "mkb.h"
+
+#if CAPTURE_SUPPORTED
+
+typedef struct
+{
+  uint64_t time; // microseconds, see monotonic_ns()
+  int type;
+  int a;
+  int b;
+} CaptureEvent;
+
+// The capture thread is the only one to push, the writer the only one to pop
+static CaptureEvent ring[CAPTURE_EVENTS];
+static atomic_ulong ring_head = 0;
+static atomic_ulong ring_tail = 0;
+
+static atomic_ulong dropped_events = 0;
+static atomic_ulong written_events = 0;
+static atomic_ullong written_bytes = 0;
+static atomic_bool stopping = false;
+
+// Guarded by capture_lock
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool capturing = false;
+static XRecordContext context;
+static Display *data_display;
+static FILE *capture_file;
+static pthread_t capture_thread_id;
+static pthread_t writer_thread_id;
+static uint64_t start_us;
+
+// The capture thread's own
+static bool have_time;
+static Time last_server_time;
+static int64_t server_us;
+static int64_t clock_offset; // monotonic minus server time, at its smallest
+static uint64_t last_time;
+static unsigned long pending_drops;
+static int shifts_held;
+
+// The server stamps events to the millisecond. Its clock is put onto the
+// monotonic one by the smallest gap seen between the two, which is that of
+// the event delivered the soonest, and within its millisecond an event
+// keeps the time it arrived.
+static uint64_t stamp(Time server_time)
+{
+  int64_t now = monotonic_ns() / 1000;
+  if (!have_time)
+  {
+    have_time = true;
+    server_us = (int64_t)server_time * 1000;
+    clock_offset = now - server_us;
+  }
+  else
+  {
+    // Time is 32 bits of milliseconds, which wrap after 49 days
+    server_us += (int64_t)(int32_t)(uint32_t)(server_time - last_server_time) * 1000;
+  }
+  last_server_time = server_time;
+
+  int64_t gap = now - server_us;
+  if (gap < clock_offset)
+  {
+    clock_offset = gap;
+  }
+  uint64_t time = server_us + clock_offset + (gap - clock_offset < 999 ? gap - clock_offset : 999);
+  if (time < last_time)
+  {
+    time = last_time;
+  }
+  last_time = time;
+  return time;
+}
+
+static bool push(uint64_t time, int type, int a, int b)
+{
+  unsigned long head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&ring_tail, memory_order_acquire) == CAPTURE_EVENTS)
+  {
+    return false;
+  }
+  ring[head % CAPTURE_EVENTS] = (CaptureEvent){time, type, a, b};
+  atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+  return true;
+}
+
+// Drops are marked in the file at the first event that makes it into the
+// ring after them
+static void capture_event(uint64_t time, int type, int a, int b)
+{
+  if (pending_drops > 0 && push(time, CAPTURE_DROPPED, pending_drops, 0))
+  {
+    pending_drops = 0;
+  }
+  if (pending_drops > 0 || !push(time, type, a, b))
+  {
+    pending_drops++;
+    atomic_fetch_add_explicit(&dropped_events, 1, memory_order_relaxed);
+  }
+}
+
+static void intercept(XPointer closure, XRecordInterceptData *data)
+{
+  if (data->category == XRecordFromServer && data->data_len * 4 >= sizeof(xEvent))
+  {
+    const xEvent *event = (const xEvent *)data->data;
+    uint64_t time = stamp(event->u.keyButtonPointer.time);
+    unsigned int detail = event->u.u.detail;
+    switch (event->u.u.type & 0x7f)
+    {
+    case MotionNotify:
+      capture_event(time, CAPTURE_MOTION, event->u.keyButtonPointer.rootX, event->u.keyButtonPointer.rootY);
+      break;
+    case ButtonPress:
+      capture_event(time, CAPTURE_BUTTON_DOWN, detail - 1, 0);
+      break;
+    case ButtonRelease:
+      capture_event(time, CAPTURE_BUTTON_UP, detail - 1, 0);
+      break;
+    case KeyPress:
+      if (mkb_keycode_is_shift(detail))
+      {
+        shifts_held++;
+      }
+      capture_event(time, CAPTURE_KEY_DOWN, detail, mkb_keycode_char(detail, shifts_held > 0));
+      break;
+    case KeyRelease:
+      if (mkb_keycode_is_shift(detail) && shifts_held > 0)
+      {
+        shifts_held--;
+      }
+      capture_event(time, CAPTURE_KEY_UP, detail, mkb_keycode_char(detail, shifts_held > 0));
+      break;
+    }
+  }
+  XRecordFreeData(data);
+}
+
+static void *capture_thread(void *arg)
+{
+  // Returns once the context is disabled
+  XRecordEnableContext(data_display, context, intercept, NULL);
+  return NULL;
+}
+
+static void *writer_thread(void *arg)
+{
+  uint8_t buffer[4096];
+  size_t length = 0;
+  uint64_t time = start_us;
+  int x = 0;
+  int y = 0;
+  for (;;)
+  {
+    // Whatever was pushed before the stop is drained below
+    bool stop = atomic_load(&stopping);
+    unsigned long tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    unsigned long head = atomic_load_explicit(&ring_head, memory_order_acquire);
+    for (; tail != head; ++tail)
+    {
+      const CaptureEvent *event = &ring[tail % CAPTURE_EVENTS];
+      // An event takes at most 1 + 3 * 10 bytes
+      if (length > sizeof(buffer) - 32)
+      {
+        fwrite(buffer, 1, length, capture_file);
+        atomic_fetch_add(&written_bytes, length);
+        length = 0;
+      }
+      buffer[length++] = (uint8_t)event->type;
+      length += varint_put(buffer + length, event->time - time);
+      time = event->time;
+      switch (event->type)
+      {
+      case CAPTURE_MOTION:
+        length += varint_put(buffer + length, zigzag(event->a - x));
+        length += varint_put(buffer + length, zigzag(event->b - y));
+        x = event->a;
+        y = event->b;
+        break;
+      case CAPTURE_KEY_DOWN:
+      case CAPTURE_KEY_UP:
+        length += varint_put(buffer + length, event->a);
+        length += varint_put(buffer + length, event->b + 1);
+        break;
+      default:
+        length += varint_put(buffer + length, event->a);
+        break;
+      }
+      if (event->type != CAPTURE_DROPPED)
+      {
+        atomic_fetch_add_explicit(&written_events, 1, memory_order_relaxed);
+      }
+      atomic_store_explicit(&ring_tail, tail + 1, memory_order_release);
+    }
+    if (length > 0)
+    {
+      fwrite(buffer, 1, length, capture_file);
+      atomic_fetch_add(&written_bytes, length);
+      length = 0;
+      fflush(capture_file);
+    }
+
+    if (stop)
+    {
+      return NULL;
+    }
+    usleep(CAPTURE_DRAIN_MS * 1000);
+  }
+}
+
+int capture_start(const char *path)
+{
+  Display *display = get_display();
+  if (display == NULL)
+  {
+    return -1;
+  }
+
+  pthread_mutex_lock(&capture_lock);
+  int major, minor;
+  if (capturing || !XRecordQueryVersion(display, &major, &minor))
+  {
+    pthread_mutex_unlock(&capture_lock);
+    return -1;
+  }
+
+  // RECORD sends its data on a connection of its own
+  data_display = XOpenDisplay(DisplayString(display));
+  XRecordRange *range = XRecordAllocRange();
+  capture_file = fopen(path, "wb");
+  if (data_display == NULL || range == NULL || capture_file == NULL)
+  {
+    if (data_display != NULL)
+    {
+      XCloseDisplay(data_display);
+    }
+    if (range != NULL)
+    {
+      XFree(range);
+    }
+    if (capture_file != NULL)
+    {
+      fclose(capture_file);
+    }
+    pthread_mutex_unlock(&capture_lock);
+    return -1;
+  }
+
+  range->device_events.first = KeyPress;
+  range->device_events.last = MotionNotify;
+  XRecordClientSpec clients = XRecordAllClients;
+  context = XRecordCreateContext(display, 0, &clients, 1, &range, 1);
+  XFree(range);
+  // The data connection can only use the context once the server has it
+  XSync(display, False);
+
+  int screen = DefaultScreen(display);
+  uint8_t header[32];
+  memcpy(header, CAPTURE_MAGIC, 8);
+  size_t length = 8;
+  length += varint_put(header + length, DisplayWidth(display, screen));
+  length += varint_put(header + length, DisplayHeight(display, screen));
+  fwrite(header, 1, length, capture_file);
+
+  atomic_store(&ring_head, 0);
+  atomic_store(&ring_tail, 0);
+  atomic_store(&dropped_events, 0);
+  atomic_store(&written_events, 0);
+  atomic_store(&written_bytes, length);
+  atomic_store(&stopping, false);
+  have_time = false;
+  last_time = 0;
+  pending_drops = 0;
+  shifts_held = 0;
+  start_us = monotonic_ns() / 1000;
+
+  if (context == 0 || pthread_create(&capture_thread_id, NULL, capture_thread, NULL) != 0)
+  {
+    if (context != 0)
+    {
+      XRecordFreeContext(display, context);
+    }
+    XCloseDisplay(data_display);
+    fclose(capture_file);
+    pthread_mutex_unlock(&capture_lock);
+    return -1;
+  }
+  pthread_create(&writer_thread_id, NULL, writer_thread, NULL);
+  capturing = true;
+  pthread_mutex_unlock(&capture_lock);
+  return 0;
+}
+
+bool capture_stats(CaptureStats *stats)
+{
+  pthread_mutex_lock(&capture_lock);
+  bool running = capturing;
+  if (running)
+  {
+    stats->events = atomic_load(&written_events);
+    stats->dropped = atomic_load(&dropped_events);
+    stats->bytes = atomic_load(&written_bytes);
+    stats->seconds = (monotonic_ns() / 1000 - start_us) / 1e6;
+  }
+  pthread_mutex_unlock(&capture_lock);
+  return running;
+}
+
+int capture_stop(CaptureStats *stats)
+{
+  Display *display = get_display();
+  pthread_mutex_lock(&capture_lock);
+  if (!capturing)
+  {
+    pthread_mutex_unlock(&capture_lock);
+    return -1;
+  }
+
+  XRecordDisableContext(display, context);
+  XFlush(display);
+  pthread_join(capture_thread_id, NULL);
+  atomic_store(&stopping, true);
+  pthread_join(writer_thread_id, NULL);
+  XRecordFreeContext(display, context);
+  XCloseDisplay(data_display);
+  fclose(capture_file);
+  capturing = false;
+
+  stats->events = atomic_load(&written_events);
+  stats->dropped = atomic_load(&dropped_events);
+  stats->bytes = atomic_load(&written_bytes);
+  stats->seconds = (monotonic_ns() / 1000 - start_us) / 1e6;
+  pthread_mutex_unlock(&capture_lock);
+  return 0;
+}
+
+#else
+
+int capture_start(const char *path)
+{
+  return -1;
+}
+
+int capture_stop(CaptureStats *stats)
+{
+  return -1;
+}
+
+bool capture_stats(CaptureStats *stats)
+{
+  return false;
+}
+
+#endif
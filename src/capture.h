@@ -0,0 +1,105 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <X11/Xlib.h>
+#include <X11/Xproto.h>
+#include <X11/extensions/record.h>
+#include <pthread.h>
+
+#define CAPTURE_SUPPORTED 1
+#else
+#define CAPTURE_SUPPORTED 0
+#endif
+
+// Capture of what the user does with the real mouse and keyboard, through
+// the X RECORD extension. A capture thread takes pointer motion, button and
+// key events off a second connection to the server, which RECORD needs for
+// its data, stamps them and puts them in a single-producer ring buffer that
+// never blocks it; a writer thread drains the ring into the capture file
+// every CAPTURE_DRAIN_MS. If the ring ever fills up, events are dropped and
+// counted, and the file says where. The server only stamps events to the
+// millisecond, so an event's time is when the capture thread got it, kept
+// within the millisecond the server gave it. Only Linux has capture.
+// Include jobs.h and mkb.h first, for monotonic_ns() and the display.
+
+#define CAPTURE_EVENTS 65536 // about a minute of a 1 kHz mouse
+#define CAPTURE_DRAIN_MS 10
+
+// A capture file starts with CAPTURE_MAGIC and the width and height of the
+// screen it was captured on, followed by one record per event: a byte with
+// its CaptureEventType, then the microseconds since the previous event and
+// the event's arguments, all as LEB128 varints, signed ones zigzag encoded.
+#define CAPTURE_MAGIC "CLKCAP01"
+
+typedef enum
+{
+  CAPTURE_MOTION,      // dx, dy (signed), from the previous position or 0, 0
+  CAPTURE_BUTTON_DOWN, // button, as mouseDown() takes it
+  CAPTURE_BUTTON_UP,
+  CAPTURE_KEY_DOWN, // keycode, then the character it typed + 1, or 0
+  CAPTURE_KEY_UP,
+  CAPTURE_DROPPED, // how many events were lost right before this point
+} CaptureEventType;
+
+typedef struct
+{
+  unsigned long events; // written to the file
+  unsigned long dropped;
+  uint64_t bytes;
+  double seconds;
+} CaptureStats;
+
+// Starts capturing into the file at path. Returns -1 if there is no display
+// with RECORD, a capture is running already, or the file cannot be created.
+int capture_start(const char *path);
+// Stops capturing and returns once the file is complete. Returns -1 if
+// nothing was being captured.
+int capture_stop(CaptureStats *stats);
+// Returns false if nothing is being captured
+bool capture_stats(CaptureStats *stats);
+
+static inline size_t varint_put(uint8_t *out, uint64_t value)
+{
+  size_t length = 0;
+  while (value >= 0x80)
+  {
+    out[length++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[length++] = (uint8_t)value;
+  return length;
+}
+
+// Reads a varint at *in and moves *in past it. Returns false if it runs
+// past end or is longer than 64 bits can hold.
+static inline bool varint_get(const uint8_t **in, const uint8_t *end, uint64_t *value)
+{
+  uint64_t result = 0;
+  for (int shift = 0; *in < end && shift < 64; shift += 7)
+  {
+    uint8_t byte = *(*in)++;
+    result |= (uint64_t)(byte & 0x7f) << shift;
+    if (byte < 0x80)
+    {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+static inline uint64_t zigzag(int64_t value)
+{
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value)
+{
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
@@ -0,0 +1,10 @@
+#include <stdatomic.h>
+
+// Counters for the metrics and the profiler, which only the thread that owns
+// them writes while any thread may read them
+
+// Adds with a relaxed load and store instead of a locked read-modify-write
+static inline void bump(atomic_ulong *counter, unsigned long amount)
+{
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
@@ -0,0 +1,164 @@
+#include "epoch.h"
+
+// How many retirements happen between two reclamation passes
+#define EPOCH_RECLAIM_INTERVAL 64
+
+typedef struct EpochRecord
+{
+  atomic_ulong epoch; // 0 while the owning thread is outside any critical section
+  atomic_bool in_use;
+  int depth; // only touched by the owning thread
+  struct EpochRecord *next;
+} EpochRecord;
+
+typedef struct Retired
+{
+  void *ptr;
+  EpochFreeFunc free_func;
+  unsigned long epoch;
+  struct Retired *next;
+} Retired;
+
+static atomic_ulong global_epoch = 1;
+static _Atomic(EpochRecord *) records = NULL;
+static _Atomic(Retired *) retired = NULL;
+static atomic_uint retired_count = 0;
+
+static _Thread_local EpochRecord *local_record = NULL;
+
+static EpochRecord *acquire_record()
+{
+  for (EpochRecord *record = atomic_load(&records); record != NULL; record = record->next)
+  {
+    bool expected = false;
+    if (!atomic_load_explicit(&record->in_use, memory_order_relaxed) && atomic_compare_exchange_strong(&record->in_use, &expected, true))
+    {
+      return record;
+    }
+  }
+
+  // Records are never freed, so walking the list above is always safe
+  EpochRecord *record = calloc(1, sizeof(EpochRecord));
+  atomic_init(&record->in_use, true);
+  EpochRecord *head = atomic_load(&records);
+  do
+  {
+    record->next = head;
+  } while (!atomic_compare_exchange_weak(&records, &head, record));
+  return record;
+}
+
+void epoch_enter()
+{
+  if (local_record == NULL)
+  {
+    local_record = acquire_record();
+  }
+
+  if (local_record->depth++ == 0)
+  {
+    // Sequentially consistent so that the store is visible to a reclaiming
+    // thread before any of the pointer loads that follow it
+    atomic_store(&local_record->epoch, atomic_load(&global_epoch));
+  }
+}
+
+void epoch_exit()
+{
+  if (--local_record->depth == 0)
+  {
+    atomic_store_explicit(&local_record->epoch, 0, memory_order_release);
+  }
+}
+
+static void push_retired(Retired *first, Retired *last)
+{
+  Retired *head = atomic_load(&retired);
+  do
+  {
+    last->next = head;
+  } while (!atomic_compare_exchange_weak(&retired, &head, first));
+}
+
+void epoch_retire(void *ptr, EpochFreeFunc free_func)
+{
+  if (ptr == NULL)
+  {
+    return;
+  }
+
+  Retired *node = malloc(sizeof(Retired));
+  node->ptr = ptr;
+  node->free_func = free_func;
+  // Readers that enter from here on see a newer epoch and can no longer
+  // reach ptr, which has already been unlinked by the caller
+  node->epoch = atomic_fetch_add(&global_epoch, 1);
+  push_retired(node, node);
+
+  if (atomic_fetch_add(&retired_count, 1) % EPOCH_RECLAIM_INTERVAL == EPOCH_RECLAIM_INTERVAL - 1)
+  {
+    epoch_reclaim();
+  }
+}
+
+void epoch_reclaim()
+{
+  Retired *list = atomic_exchange(&retired, NULL);
+  if (list == NULL)
+  {
+    return;
+  }
+
+  unsigned long oldest = ULONG_MAX;
+  for (EpochRecord *record = atomic_load(&records); record != NULL; record = record->next)
+  {
+    unsigned long epoch = atomic_load(&record->epoch);
+    if (epoch != 0 && epoch < oldest)
+    {
+      oldest = epoch;
+    }
+  }
+
+  Retired *keep_first = NULL;
+  Retired *keep_last = NULL;
+  while (list != NULL)
+  {
+    Retired *node = list;
+    list = node->next;
+
+    // A reader that entered at or before the retirement epoch may still hold
+    // the pointer
+    if (node->epoch < oldest)
+    {
+      node->free_func(node->ptr);
+      free(node);
+    }
+    else
+    {
+      node->next = keep_first;
+      keep_first = node;
+      if (keep_last == NULL)
+      {
+        keep_last = node;
+      }
+    }
+  }
+
+  if (keep_first != NULL)
+  {
+    push_retired(keep_first, keep_last);
+  }
+}
+
+void epoch_thread_exit()
+{
+  if (local_record == NULL)
+  {
+    return;
+  }
+
+  local_record->depth = 0;
+  atomic_store(&local_record->epoch, 0);
+  atomic_store(&local_record->in_use, false);
+  local_record = NULL;
+}
@@ -0,0 +1,23 @@
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Epoch based reclamation for values that are published through an atomic
+// pointer and read without locks (see the register store in main.c).
+//
+// Readers wrap every access in epoch_enter()/epoch_exit(). Writers swap the
+// new value in and hand the old one to epoch_retire(), which frees it once no
+// thread can still be inside a critical section that began before the swap.
+// Critical sections nest, so a recalled register may recall another one.
+
+typedef void (*EpochFreeFunc)(void *ptr);
+
+void epoch_enter();
+void epoch_exit();
+void epoch_retire(void *ptr, EpochFreeFunc free_func);
+void epoch_reclaim();
+
+// Releases the calling thread's epoch record so that another thread can
+// reuse it. Call when a worker thread is about to exit.
+void epoch_thread_exit();
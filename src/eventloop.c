@@ -0,0 +1,574 @@
+#include "jobs.h"
+
+#include "eventloop.h"
+
+#ifdef __linux__
+
+enum
+{
+  TASK_READY,
+  TASK_SLEEPING,
+  TASK_PARKED,
+};
+
+typedef struct Task
+{
+  unsigned int id;
+  char name[JOB_NAME_LENGTH];
+  TaskFunc run;
+  TaskReleaseFunc release;
+  void *arg;
+  int state;
+  TaskWait wait;
+  Timer timer;
+  uint64_t deadline; // ns, while sleeping
+  struct Task *next; // ready queue or park list, owned by the loop thread
+  struct Task *prev;
+  struct Task *all_next; // every task, guarded by tasks_lock
+  struct Task *all_prev;
+  bool started;  // false while only on the incoming list
+  bool cancelled;
+  atomic_ulong iterations;
+  atomic_ulong run_ns;
+} Task;
+
+#define PARK_LISTS 64
+
+static pthread_mutex_t tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+static Task all_tasks = {.all_next = &all_tasks, .all_prev = &all_tasks};
+static Task *incoming = NULL;
+static int task_count = 0;
+
+// Everything below is only touched by the loop thread, apart from the atomics
+static pthread_t loop_thread;
+static int epoll_fd = -1;
+static int timer_fd = -1;
+static int event_fd = -1;
+static TimerWheel wheel;
+static uint64_t armed_expiry = UINT64_MAX;
+static Task ready = {.next = &ready, .prev = &ready};
+static Task parked[PARK_LISTS];
+static atomic_ullong parked_mask = 0;
+static atomic_ullong dirty_mask = 0;
+static atomic_bool cancel_pending = false;
+static atomic_int sleeping_count = 0;
+static atomic_int parked_count = 0;
+static atomic_ulong lateness[LATENESS_BUCKETS];
+static atomic_ulong lateness_max_ns = 0;
+
+static _Thread_local Task *current_task = NULL;
+
+static void signal_loop()
+{
+  uint64_t one = 1;
+  if (write(event_fd, &one, sizeof(one)) < 0)
+  {
+    // Only fails when the counter would overflow, and then the loop is
+    // already due to wake up
+  }
+}
+
+static void push_task(Task *head, Task *task)
+{
+  task->next = head;
+  task->prev = head->prev;
+  head->prev->next = task;
+  head->prev = task;
+}
+
+static void unlink_task(Task *task)
+{
+  task->prev->next = task->next;
+  task->next->prev = task->prev;
+  task->next = NULL;
+  task->prev = NULL;
+}
+
+static void record_lateness(uint64_t late)
+{
+  uint64_t bucket = late / 1000 / LATENESS_BUCKET_US;
+  if (bucket >= LATENESS_BUCKETS)
+  {
+    bucket = LATENESS_BUCKETS - 1;
+  }
+  atomic_fetch_add_explicit(&lateness[bucket], 1, memory_order_relaxed);
+  if (late > atomic_load_explicit(&lateness_max_ns, memory_order_relaxed))
+  {
+    atomic_store_explicit(&lateness_max_ns, late, memory_order_relaxed);
+  }
+}
+
+static void finish_task(Task *task)
+{
+  pthread_mutex_lock(&tasks_lock);
+  task->all_prev->all_next = task->all_next;
+  task->all_next->all_prev = task->all_prev;
+  task_count--;
+  pthread_mutex_unlock(&tasks_lock);
+
+  task->release(task->arg);
+  free(task);
+}
+
+// Takes a waiting task off whatever it is waiting on
+static void unwait_task(Task *task)
+{
+  switch (task->state)
+  {
+  case TASK_READY:
+    unlink_task(task);
+    break;
+  case TASK_SLEEPING:
+    timer_remove(&wheel, &task->timer);
+    atomic_fetch_sub_explicit(&sleeping_count, 1, memory_order_relaxed);
+    break;
+  case TASK_PARKED:
+  {
+    int index = task->wait.index;
+    unlink_task(task);
+    if (parked[index].next == &parked[index])
+    {
+      atomic_fetch_and(&parked_mask, ~(1ULL << index));
+    }
+    atomic_fetch_sub_explicit(&parked_count, 1, memory_order_relaxed);
+    break;
+  }
+  }
+}
+
+static void make_ready(Task *task)
+{
+  task->state = TASK_READY;
+  push_task(&ready, task);
+}
+
+static void park_task(Task *task)
+{
+  int index = task->wait.index;
+  task->state = TASK_PARKED;
+  push_task(&parked[index], task);
+  atomic_fetch_add_explicit(&parked_count, 1, memory_order_relaxed);
+  // Announce the park before checking the word again. A writer changes the
+  // word before looking at parked_mask, so one of the two sees the other.
+  atomic_fetch_or(&parked_mask, 1ULL << index);
+  if (atomic_load(task->wait.word) != task->wait.generation)
+  {
+    unwait_task(task);
+    make_ready(task);
+  }
+}
+
+static void run_task(Task *task)
+{
+  unlink_task(task);
+  current_task = task;
+  uint64_t start = monotonic_ns();
+  TaskResult result = task->run(task->arg, &task->wait);
+  uint64_t end = monotonic_ns();
+  current_task = NULL;
+  atomic_fetch_add_explicit(&task->run_ns, end - start, memory_order_relaxed);
+
+  switch (result)
+  {
+  case TASK_DONE:
+    finish_task(task);
+    break;
+  case TASK_SLEEP:
+  case TASK_SLEEP_UNTIL:
+    task->state = TASK_SLEEPING;
+    task->deadline = result == TASK_SLEEP ? end + (uint64_t)task->wait.microseconds * 1000 : task->wait.deadline;
+    timer_add(&wheel, &task->timer, task->deadline);
+    atomic_fetch_add_explicit(&sleeping_count, 1, memory_order_relaxed);
+    break;
+  case TASK_PARK:
+    park_task(task);
+    break;
+  case TASK_YIELD:
+    make_ready(task);
+    break;
+  }
+}
+
+static void accept_incoming()
+{
+  pthread_mutex_lock(&tasks_lock);
+  Task *list = incoming;
+  incoming = NULL;
+  for (Task *task = list; task != NULL; task = task->next)
+  {
+    task->started = true;
+    // Cancelled before it started, reap_cancelled skipped it
+    if (task->cancelled)
+    {
+      atomic_store(&cancel_pending, true);
+    }
+  }
+  pthread_mutex_unlock(&tasks_lock);
+
+  // The list is newest first
+  Task *reversed = NULL;
+  while (list != NULL)
+  {
+    Task *next = list->next;
+    list->next = reversed;
+    reversed = list;
+    list = next;
+  }
+  while (reversed != NULL)
+  {
+    Task *next = reversed->next;
+    make_ready(reversed);
+    reversed = next;
+  }
+}
+
+static void wake_parked()
+{
+  uint64_t dirty = atomic_exchange(&dirty_mask, 0);
+  while (dirty != 0)
+  {
+    int index = __builtin_ctzll(dirty);
+    dirty &= dirty - 1;
+    Task *head = &parked[index];
+    for (Task *task = head->next, *next; task != head; task = next)
+    {
+      next = task->next;
+      if (atomic_load(task->wait.word) != task->wait.generation)
+      {
+        unwait_task(task);
+        make_ready(task);
+      }
+    }
+  }
+}
+
+static void reap_cancelled()
+{
+  if (!atomic_exchange(&cancel_pending, false))
+  {
+    return;
+  }
+
+  // Collect them under the lock, release them outside of it
+  Task *list = NULL;
+  pthread_mutex_lock(&tasks_lock);
+  for (Task *task = all_tasks.all_next; task != &all_tasks; task = task->all_next)
+  {
+    if (task->cancelled && task->started)
+    {
+      unwait_task(task);
+      task->next = list;
+      list = task;
+    }
+  }
+  pthread_mutex_unlock(&tasks_lock);
+
+  while (list != NULL)
+  {
+    Task *next = list->next;
+    finish_task(list);
+    list = next;
+  }
+}
+
+static void expire_timers(uint64_t now)
+{
+  for (Timer *timer = timer_advance(&wheel, now), *next; timer != NULL; timer = next)
+  {
+    next = timer->next;
+    timer->next = NULL;
+    Task *task = (Task *)((char *)timer - offsetof(Task, timer));
+    atomic_fetch_sub_explicit(&sleeping_count, 1, memory_order_relaxed);
+    record_lateness(now - task->deadline);
+    make_ready(task);
+  }
+}
+
+static void arm_timer()
+{
+  uint64_t expiry = timer_next_expiry(&wheel);
+  if (expiry == armed_expiry)
+  {
+    return;
+  }
+  armed_expiry = expiry;
+  // A zero it_value disarms the timer
+  struct itimerspec spec = {0};
+  if (expiry != UINT64_MAX)
+  {
+    spec.it_value.tv_sec = expiry / 1000000000ULL;
+    spec.it_value.tv_nsec = expiry % 1000000000ULL;
+  }
+  timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+static void *event_loop_thread(void *arg)
+{
+  // Let the kernel fire our timer as close to the deadline as it can
+  prctl(PR_SET_TIMERSLACK, 1UL);
+
+  struct epoll_event events[2];
+  for (;;)
+  {
+    // Only run the tasks that were ready when this pass started, so that
+    // yielding tasks cannot starve timers and notifications
+    Task *last = ready.prev;
+    while (ready.next != &ready)
+    {
+      Task *task = ready.next;
+      run_task(task);
+      if (task == last)
+      {
+        break;
+      }
+    }
+
+    arm_timer();
+    int count = epoll_wait(epoll_fd, events, 2, ready.next != &ready ? 0 : -1);
+    for (int i = 0; i < count; ++i)
+    {
+      uint64_t value;
+      if (read(events[i].data.fd, &value, sizeof(value)) < 0)
+      {
+        // Nothing to read, both descriptors are non-blocking
+      }
+      if (events[i].data.fd == timer_fd)
+      {
+        armed_expiry = UINT64_MAX;
+      }
+    }
+
+    accept_incoming();
+    wake_parked();
+    reap_cancelled();
+    expire_timers(monotonic_ns());
+  }
+  return NULL;
+}
+
+void init_event_loop()
+{
+  for (int i = 0; i < PARK_LISTS; ++i)
+  {
+    parked[i].next = &parked[i];
+    parked[i].prev = &parked[i];
+  }
+  timer_wheel_init(&wheel, monotonic_ns());
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epoll_fd < 0 || timer_fd < 0 || event_fd < 0)
+  {
+    fprintf(stderr, "Error creating the event loop\n");
+    exit(1);
+  }
+
+  struct epoll_event event = {.events = EPOLLIN};
+  event.data.fd = timer_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event);
+  event.data.fd = event_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &event);
+
+  if (pthread_create(&loop_thread, NULL, event_loop_thread, NULL) != 0)
+  {
+    fprintf(stderr, "Error creating event loop thread\n");
+    exit(1);
+  }
+}
+
+unsigned int spawn_task(const char *name, TaskFunc run, TaskReleaseFunc release, void *arg)
+{
+  Task *task = calloc(1, sizeof(Task));
+  if (task == NULL)
+  {
+    return 0;
+  }
+  task->id = new_job_id();
+  snprintf(task->name, sizeof(task->name), "%s", name);
+  task->run = run;
+  task->release = release;
+  task->arg = arg;
+
+  pthread_mutex_lock(&tasks_lock);
+  task->all_next = &all_tasks;
+  task->all_prev = all_tasks.all_prev;
+  all_tasks.all_prev->all_next = task;
+  all_tasks.all_prev = task;
+  task_count++;
+  task->next = incoming;
+  incoming = task;
+  unsigned int id = task->id;
+  pthread_mutex_unlock(&tasks_lock);
+
+  signal_loop();
+  return id;
+}
+
+int list_tasks(JobInfo *infos, int max_infos)
+{
+  int count = 0;
+  pthread_mutex_lock(&tasks_lock);
+  for (Task *task = all_tasks.all_next; task != &all_tasks && count < max_infos; task = task->all_next)
+  {
+    JobInfo *info = &infos[count++];
+    info->id = task->id;
+    memcpy(info->name, task->name, sizeof(info->name));
+    info->running = task->started;
+    info->iterations = atomic_load_explicit(&task->iterations, memory_order_relaxed);
+    info->cpu_ms = atomic_load_explicit(&task->run_ns, memory_order_relaxed) / 1000000.0;
+  }
+  pthread_mutex_unlock(&tasks_lock);
+  return count;
+}
+
+static double lateness_percentile(unsigned long *counts, unsigned long total, double fraction)
+{
+  unsigned long target = (unsigned long)(total * fraction);
+  unsigned long seen = 0;
+  for (int i = 0; i < LATENESS_BUCKETS; ++i)
+  {
+    seen += counts[i];
+    if (seen > target)
+    {
+      return (i + 1) * LATENESS_BUCKET_US;
+    }
+  }
+  return LATENESS_BUCKETS * LATENESS_BUCKET_US;
+}
+
+void event_loop_stats(EventLoopStats *stats)
+{
+  pthread_mutex_lock(&tasks_lock);
+  stats->tasks = task_count;
+  pthread_mutex_unlock(&tasks_lock);
+  stats->sleeping = atomic_load_explicit(&sleeping_count, memory_order_relaxed);
+  stats->parked = atomic_load_explicit(&parked_count, memory_order_relaxed);
+
+  unsigned long counts[LATENESS_BUCKETS];
+  unsigned long total = 0;
+  for (int i = 0; i < LATENESS_BUCKETS; ++i)
+  {
+    counts[i] = atomic_load_explicit(&lateness[i], memory_order_relaxed);
+    total += counts[i];
+  }
+  stats->wakeups = total;
+  // Bucket upper bounds, so these never understate the lateness
+  stats->lateness_p50_us = total > 0 ? lateness_percentile(counts, total, 0.50) : 0;
+  stats->lateness_p99_us = total > 0 ? lateness_percentile(counts, total, 0.99) : 0;
+  stats->lateness_max_us = atomic_load_explicit(&lateness_max_ns, memory_order_relaxed) / 1000.0;
+}
+
+bool cancel_task(unsigned int id)
+{
+  bool found = false;
+  pthread_mutex_lock(&tasks_lock);
+  for (Task *task = all_tasks.all_next; task != &all_tasks; task = task->all_next)
+  {
+    if (task->id == id)
+    {
+      task->cancelled = true;
+      found = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&tasks_lock);
+
+  if (found)
+  {
+    atomic_store(&cancel_pending, true);
+    signal_loop();
+  }
+  return found;
+}
+
+int cancel_all_tasks()
+{
+  int count = 0;
+  pthread_mutex_lock(&tasks_lock);
+  for (Task *task = all_tasks.all_next; task != &all_tasks; task = task->all_next)
+  {
+    task->cancelled = true;
+    count++;
+  }
+  pthread_mutex_unlock(&tasks_lock);
+
+  if (count > 0)
+  {
+    atomic_store(&cancel_pending, true);
+    signal_loop();
+  }
+  return count;
+}
+
+void event_loop_notify(int index)
+{
+  uint64_t bit = 1ULL << index;
+  if ((atomic_load(&parked_mask) & bit) == 0)
+  {
+    return;
+  }
+  if ((atomic_fetch_or(&dirty_mask, bit) & bit) == 0)
+  {
+    signal_loop();
+  }
+}
+
+void task_iteration()
+{
+  if (current_task != NULL)
+  {
+    atomic_fetch_add_explicit(&current_task->iterations, 1, memory_order_relaxed);
+  }
+}
+
+const char *task_name()
+{
+  return current_task != NULL ? current_task->name : NULL;
+}
+
+#else
+
+void init_event_loop()
+{
+}
+
+unsigned int spawn_task(const char *name, TaskFunc run, TaskReleaseFunc release, void *arg)
+{
+  return 0;
+}
+
+int list_tasks(JobInfo *infos, int max_infos)
+{
+  return 0;
+}
+
+void event_loop_stats(EventLoopStats *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+}
+
+bool cancel_task(unsigned int id)
+{
+  return false;
+}
+
+int cancel_all_tasks()
+{
+  return 0;
+}
+
+void event_loop_notify(int index)
+{
+}
+
+void task_iteration()
+{
+}
+
+const char *task_name()
+{
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,87 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "timerwheel.h"
+
+#define EVENT_LOOP_SUPPORTED 1
+#else
+#define EVENT_LOOP_SUPPORTED 0
+#endif
+
+// An alternative to the job pool for loops that spend most of their time
+// waiting. Tasks are resumable state machines multiplexed on one thread:
+// DELAYs become timer wheel entries and parked WHEN loops become list
+// entries, so ten thousand of them cost a few hundred bytes each instead of a
+// thread each. Only Linux has an event loop; elsewhere spawn_task always
+// fails. Include jobs.h first, for JobInfo.
+
+// How many lateness buckets event_loop_stats keeps, each LATENESS_BUCKET_US
+// wide. The last one also counts everything later than that.
+#define LATENESS_BUCKETS 256
+#define LATENESS_BUCKET_US 8
+
+typedef enum
+{
+  TASK_DONE,
+  TASK_SLEEP,       // resume after wait->microseconds
+  TASK_SLEEP_UNTIL, // resume at wait->deadline, see monotonic_ns()
+  TASK_PARK,        // resume once *wait->word differs from wait->generation
+  TASK_YIELD,       // resume after the other ready tasks had their turn
+} TaskResult;
+
+typedef struct
+{
+  long microseconds;
+  uint64_t deadline;
+  atomic_uint *word;
+  unsigned int generation;
+  int index; // which event_loop_notify() wakes the task, below 64
+} TaskWait;
+
+// Runs a task until it finishes or has to wait. Tasks share the loop thread,
+// so they must return after a bounded amount of work.
+typedef TaskResult (*TaskFunc)(void *arg, TaskWait *wait);
+typedef void (*TaskReleaseFunc)(void *arg);
+
+typedef struct
+{
+  int tasks;
+  int sleeping;
+  int parked;
+  unsigned long wakeups;
+  double lateness_p50_us;
+  double lateness_p99_us;
+  double lateness_max_us;
+} EventLoopStats;
+
+void init_event_loop();
+// Returns the task ID, taken from the same sequence as job IDs, or 0 if the
+// task cannot be started. release(arg) is called on the loop thread once the
+// task is done or cancelled.
+unsigned int spawn_task(const char *name, TaskFunc run, TaskReleaseFunc release, void *arg);
+// Returns the number of tasks written to infos
+int list_tasks(JobInfo *infos, int max_infos);
+void event_loop_stats(EventLoopStats *stats);
+// Returns false if no such task exists
+bool cancel_task(unsigned int id);
+int cancel_all_tasks();
+// Wakes the tasks parked with the given index whose word has changed
+void event_loop_notify(int index);
+
+// For code running inside a task
+void task_iteration();
+// The name the task was spawned with, or NULL outside of one
+const char *task_name();
@@ -0,0 +1,97 @@
+#include "files.h"
+
+int map_file(const char *filename, MappedFile *file)
+{
+  file->data = NULL;
+  file->length = 0;
+#ifdef _WIN32
+  file->mapping = NULL;
+  file->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file->file == INVALID_HANDLE_VALUE)
+  {
+    return -1;
+  }
+  LARGE_INTEGER size;
+  FILETIME mtime;
+  if (!GetFileSizeEx(file->file, &size) || !GetFileTime(file->file, NULL, NULL, &mtime))
+  {
+    CloseHandle(file->file);
+    return -1;
+  }
+  file->length = (size_t)size.QuadPart;
+  file->mtime = (uint64_t)mtime.dwHighDateTime << 32 | mtime.dwLowDateTime;
+  if (file->length == 0)
+  {
+    return 0;
+  }
+  file->mapping = CreateFileMappingA(file->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (file->mapping != NULL)
+  {
+    file->data = MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0);
+  }
+  if (file->data == NULL)
+  {
+    if (file->mapping != NULL)
+    {
+      CloseHandle(file->mapping);
+    }
+    CloseHandle(file->file);
+    return -1;
+  }
+#elif defined(__linux__)
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  file->length = st.st_size;
+  file->mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+  if (file->length > 0)
+  {
+    void *data = mmap(NULL, file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+      close(fd);
+      return -1;
+    }
+    file->data = data;
+  }
+  // The mapping keeps the file open
+  close(fd);
+#endif
+  return 0;
+}
+
+void unmap_file(MappedFile *file)
+{
+#ifdef _WIN32
+  if (file->data != NULL)
+  {
+    UnmapViewOfFile(file->data);
+    CloseHandle(file->mapping);
+  }
+  CloseHandle(file->file);
+#elif defined(__linux__)
+  if (file->data != NULL)
+  {
+    munmap((void *)file->data, file->length);
+  }
+#endif
+  file->data = NULL;
+}
+
+int replace_file(const char *temp, const char *path)
+{
+#ifdef _WIN32
+  // rename() does not replace an existing file on Windows
+  return MoveFileExA(temp, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? 0 : -1;
+#else
+  return rename(temp, path);
+#endif
+}
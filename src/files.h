@@ -0,0 +1,36 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Reading and replacing whole files, for scripts, captures, the journal and
+// the metrics file.
+
+typedef struct
+{
+  const char *data;
+  size_t length;
+  uint64_t mtime; // ns since the epoch, or 100 ns units since 1601 on Windows
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE mapping;
+#endif
+} MappedFile;
+
+// Maps the whole file read-only, or sets data to NULL if it is empty.
+// Returns -1 if it cannot be opened or mapped.
+int map_file(const char *filename, MappedFile *file);
+void unmap_file(MappedFile *file);
+// Moves temp over path in one step, so that readers see the old file or the
+// new one and never half of it. Returns 0 on success.
+int replace_file(const char *temp, const char *path);
@@ -0,0 +1,80 @@
+#include "intern.h"
+
+#define INTERN_BUCKETS 1024
+
+typedef struct InternEntry
+{
+  char *str;
+  size_t length;
+  unsigned int id;
+  unsigned int refs;
+  struct InternEntry *next;
+} InternEntry;
+
+static InternEntry *buckets[INTERN_BUCKETS];
+static unsigned int next_id = 1;
+// Only writers and loop setup intern strings, so a spinlock is plenty
+static atomic_flag lock = ATOMIC_FLAG_INIT;
+
+static size_t hash_string(const char *str, size_t length)
+{
+  size_t hash = 5381;
+  for (size_t i = 0; i < length; ++i)
+  {
+    hash = hash * 33 + (unsigned char)str[i];
+  }
+  return hash % INTERN_BUCKETS;
+}
+
+static InternEntry **find_entry(const char *str, size_t length)
+{
+  InternEntry **entry = &buckets[hash_string(str, length)];
+  while (*entry != NULL && ((*entry)->length != length || memcmp((*entry)->str, str, length) != 0))
+  {
+    entry = &(*entry)->next;
+  }
+  return entry;
+}
+
+unsigned int intern_string(const char *str, size_t length)
+{
+  while (atomic_flag_test_and_set_explicit(&lock, memory_order_acquire))
+  {
+  }
+
+  InternEntry **entry = find_entry(str, length);
+  if (*entry == NULL)
+  {
+    InternEntry *new_entry = malloc(sizeof(InternEntry));
+    new_entry->str = malloc(length);
+    memcpy(new_entry->str, str, length);
+    new_entry->length = length;
+    new_entry->id = next_id++;
+    new_entry->refs = 0;
+    new_entry->next = NULL;
+    *entry = new_entry;
+  }
+  (*entry)->refs++;
+  unsigned int id = (*entry)->id;
+
+  atomic_flag_clear_explicit(&lock, memory_order_release);
+  return id;
+}
+
+void release_string(const char *str, size_t length)
+{
+  while (atomic_flag_test_and_set_explicit(&lock, memory_order_acquire))
+  {
+  }
+
+  InternEntry **entry = find_entry(str, length);
+  if (*entry != NULL && --(*entry)->refs == 0)
+  {
+    InternEntry *old = *entry;
+    *entry = old->next;
+    free(old->str);
+    free(old);
+  }
+
+  atomic_flag_clear_explicit(&lock, memory_order_release);
+}
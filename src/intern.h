@@ -0,0 +1,12 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Interns register values so that loops can compare them by ID instead of
+// by string. Every call to intern_string must be paired with a call to
+// release_string for the same text; equal strings share an ID for as long as
+// any of them is held, so a value written while a loop holds its ID always
+// compares equal to it.
+unsigned int intern_string(const char *str, size_t length);
+void release_string(const char *str, size_t length);
@@ -0,0 +1,381 @@
+#include "jobs.h"
+
+enum
+{
+  JOB_FREE,
+  JOB_QUEUED,
+  JOB_RUNNING,
+};
+
+typedef struct
+{
+  unsigned int id;
+  char name[JOB_NAME_LENGTH];
+  JobFunc func;
+  JobFunc discard;
+  void *arg;
+  int state;
+  int worker;
+  atomic_uint cancelled; // futex word for job_sleep
+  atomic_ulong iterations;
+#ifdef _WIN32
+  ULONGLONG cpu_start;
+#elif defined(__linux__)
+  struct timespec cpu_start;
+#endif
+} Job;
+
+static Job jobs[JOB_SLOTS];
+static int queue[JOB_SLOTS];
+static int queue_head = 0;
+static int queue_length = 0;
+static atomic_uint next_job_id = 1;
+// Guarded by jobs_lock
+static int worker_count = 0;
+static int idle_workers = 0;
+
+static _Thread_local Job *current_job = NULL;
+
+#ifdef _WIN32
+static CRITICAL_SECTION jobs_lock;
+static CONDITION_VARIABLE jobs_available;
+static HANDLE workers[JOB_SLOTS];
+
+#define LOCK_JOBS() EnterCriticalSection(&jobs_lock)
+#define UNLOCK_JOBS() LeaveCriticalSection(&jobs_lock)
+
+static ULONGLONG thread_cpu_time(HANDLE thread)
+{
+  FILETIME creation, exit, kernel, user;
+  GetThreadTimes(thread, &creation, &exit, &kernel, &user);
+  return ((ULONGLONG)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) + ((ULONGLONG)user.dwHighDateTime << 32 | user.dwLowDateTime);
+}
+#elif defined(__linux__)
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_available = PTHREAD_COND_INITIALIZER;
+static pthread_t workers[JOB_SLOTS];
+
+#define LOCK_JOBS() pthread_mutex_lock(&jobs_lock)
+#define UNLOCK_JOBS() pthread_mutex_unlock(&jobs_lock)
+
+static struct timespec thread_cpu_time(pthread_t thread)
+{
+  clockid_t clock;
+  struct timespec ts = {0};
+  if (pthread_getcpuclockid(thread, &clock) == 0)
+  {
+    clock_gettime(clock, &ts);
+  }
+  return ts;
+}
+#endif
+
+static double job_cpu_ms(const Job *job)
+{
+#ifdef _WIN32
+  return (thread_cpu_time(workers[job->worker]) - job->cpu_start) / 10000.0;
+#elif defined(__linux__)
+  struct timespec now = thread_cpu_time(workers[job->worker]);
+  return (now.tv_sec - job->cpu_start.tv_sec) * 1000.0 + (now.tv_nsec - job->cpu_start.tv_nsec) / 1000000.0;
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_thread(LPVOID arg)
+#elif defined(__linux__)
+static void *worker_thread(void *arg)
+#endif
+{
+  int worker = (int)(size_t)arg;
+#ifdef __linux__
+  // The default 50us of timer slack would show up in every paced loop
+  prctl(PR_SET_TIMERSLACK, 1UL);
+#endif
+  for (;;)
+  {
+    LOCK_JOBS();
+    idle_workers++;
+    while (queue_length == 0)
+    {
+#ifdef _WIN32
+      SleepConditionVariableCS(&jobs_available, &jobs_lock, INFINITE);
+#elif defined(__linux__)
+      pthread_cond_wait(&jobs_available, &jobs_lock);
+#endif
+    }
+    idle_workers--;
+    Job *job = &jobs[queue[queue_head]];
+    queue_head = (queue_head + 1) % JOB_SLOTS;
+    queue_length--;
+    job->state = JOB_RUNNING;
+    job->worker = worker;
+#ifdef _WIN32
+    job->cpu_start = thread_cpu_time(GetCurrentThread());
+#elif defined(__linux__)
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &job->cpu_start);
+#endif
+    UNLOCK_JOBS();
+
+    // A job cancelled while it was still queued never starts
+    if (!atomic_load(&job->cancelled))
+    {
+      current_job = job;
+      job->func(job->arg);
+      current_job = NULL;
+    }
+    else if (job->discard != NULL)
+    {
+      job->discard(job->arg);
+    }
+
+    LOCK_JOBS();
+    job->state = JOB_FREE;
+    UNLOCK_JOBS();
+  }
+  return 0;
+}
+
+// With jobs_lock held. Returns false if the thread cannot be started.
+static bool start_worker()
+{
+  int i = worker_count;
+#ifdef _WIN32
+  workers[i] = CreateThread(NULL, 0, worker_thread, (LPVOID)(size_t)i, 0, NULL);
+  if (workers[i] == NULL)
+  {
+    return false;
+  }
+#elif defined(__linux__)
+  if (pthread_create(&workers[i], NULL, worker_thread, (void *)(size_t)i) != 0)
+  {
+    return false;
+  }
+#endif
+  worker_count++;
+  return true;
+}
+
+void init_jobs()
+{
+#ifdef _WIN32
+  InitializeCriticalSection(&jobs_lock);
+  InitializeConditionVariable(&jobs_available);
+#endif
+  LOCK_JOBS();
+  for (int i = 0; i < JOB_WORKERS; ++i)
+  {
+    if (!start_worker())
+    {
+      fprintf(stderr, "Error creating worker thread\n");
+      exit(1);
+    }
+  }
+  UNLOCK_JOBS();
+}
+
+unsigned int spawn_job(const char *name, JobFunc func, JobFunc discard, void *arg)
+{
+  LOCK_JOBS();
+  int slot = -1;
+  for (int i = 0; i < JOB_SLOTS; ++i)
+  {
+    if (jobs[i].state == JOB_FREE)
+    {
+      slot = i;
+      break;
+    }
+  }
+  if (slot < 0)
+  {
+    UNLOCK_JOBS();
+    return 0;
+  }
+
+  Job *job = &jobs[slot];
+  job->id = new_job_id();
+  snprintf(job->name, sizeof(job->name), "%s", name);
+  job->func = func;
+  job->discard = discard;
+  job->arg = arg;
+  job->state = JOB_QUEUED;
+  atomic_store(&job->cancelled, 0);
+  atomic_store(&job->iterations, 0);
+  queue[(queue_head + queue_length) % JOB_SLOTS] = slot;
+  queue_length++;
+  unsigned int id = job->id;
+  // Workers that are busy may never be free again, as a parked WHEN is not.
+  // If starting one fails, the job waits for a worker to finish instead.
+  if (idle_workers < queue_length && worker_count < JOB_SLOTS)
+  {
+    start_worker();
+  }
+#ifdef _WIN32
+  WakeConditionVariable(&jobs_available);
+#elif defined(__linux__)
+  pthread_cond_signal(&jobs_available);
+#endif
+  UNLOCK_JOBS();
+  return id;
+}
+
+unsigned int new_job_id()
+{
+  return atomic_fetch_add(&next_job_id, 1);
+}
+
+int list_jobs(JobInfo *infos, int max_infos)
+{
+  int count = 0;
+  LOCK_JOBS();
+  for (int i = 0; i < JOB_SLOTS && count < max_infos; ++i)
+  {
+    Job *job = &jobs[i];
+    if (job->state == JOB_FREE)
+    {
+      continue;
+    }
+    JobInfo *info = &infos[count++];
+    info->id = job->id;
+    memcpy(info->name, job->name, sizeof(info->name));
+    info->running = job->state == JOB_RUNNING;
+    info->iterations = atomic_load_explicit(&job->iterations, memory_order_relaxed);
+    info->cpu_ms = info->running ? job_cpu_ms(job) : 0;
+  }
+  UNLOCK_JOBS();
+  return count;
+}
+
+static void cancel(Job *job)
+{
+  atomic_store(&job->cancelled, 1);
+#ifdef _WIN32
+  WakeByAddressAll((void *)&job->cancelled);
+#elif defined(__linux__)
+  syscall(SYS_futex, &job->cancelled, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+bool cancel_job(unsigned int id)
+{
+  bool found = false;
+  LOCK_JOBS();
+  for (int i = 0; i < JOB_SLOTS; ++i)
+  {
+    if (jobs[i].state != JOB_FREE && jobs[i].id == id)
+    {
+      cancel(&jobs[i]);
+      found = true;
+      break;
+    }
+  }
+  UNLOCK_JOBS();
+  return found;
+}
+
+int cancel_all_jobs()
+{
+  int count = 0;
+  LOCK_JOBS();
+  for (int i = 0; i < JOB_SLOTS; ++i)
+  {
+    if (jobs[i].state != JOB_FREE)
+    {
+      cancel(&jobs[i]);
+      count++;
+    }
+  }
+  UNLOCK_JOBS();
+  return count;
+}
+
+bool job_cancelled()
+{
+  return current_job != NULL && atomic_load_explicit(&current_job->cancelled, memory_order_relaxed);
+}
+
+const char *job_name()
+{
+  return current_job != NULL ? current_job->name : NULL;
+}
+
+bool job_iteration()
+{
+  if (current_job == NULL)
+  {
+    return true;
+  }
+  atomic_fetch_add_explicit(&current_job->iterations, 1, memory_order_relaxed);
+  return !atomic_load_explicit(&current_job->cancelled, memory_order_relaxed);
+}
+
+uint64_t monotonic_ns()
+{
+#ifdef _WIN32
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000ULL + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000ULL / frequency.QuadPart;
+#elif defined(__linux__)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+uint64_t thread_cpu_ns()
+{
+#ifdef _WIN32
+  return thread_cpu_time(GetCurrentThread()) * 100;
+#elif defined(__linux__)
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+bool job_sleep(long microseconds)
+{
+  return job_sleep_until(monotonic_ns() + (uint64_t)microseconds * 1000);
+}
+
+bool job_sleep_until(uint64_t deadline_ns)
+{
+#ifdef _WIN32
+  unsigned int not_cancelled = 0;
+  for (;;)
+  {
+    uint64_t now = monotonic_ns();
+    if ((current_job != NULL && atomic_load(&current_job->cancelled)) || now >= deadline_ns)
+    {
+      break;
+    }
+    // Round up, so that the deadline is never missed by waking early
+    DWORD ms = (DWORD)((deadline_ns - now + 999999) / 1000000);
+    if (current_job == NULL)
+    {
+      Sleep(ms);
+    }
+    else
+    {
+      WaitOnAddress((void *)&current_job->cancelled, &not_cancelled, sizeof(not_cancelled), ms);
+    }
+  }
+#elif defined(__linux__)
+  struct timespec deadline = {deadline_ns / 1000000000ULL, deadline_ns % 1000000000ULL};
+  if (current_job == NULL)
+  {
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+    {
+    }
+    return true;
+  }
+
+  // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC timeout and returns
+  // early once the job is cancelled
+  while (!atomic_load(&current_job->cancelled) && monotonic_ns() < deadline_ns)
+  {
+    syscall(SYS_futex, &current_job->cancelled, FUTEX_WAIT_BITSET_PRIVATE, 0, &deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+  }
+#endif
+  return current_job == NULL || !atomic_load(&current_job->cancelled);
+}
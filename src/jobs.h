@@ -0,0 +1,71 @@
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__linux__)
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// Background jobs (REPEAT, WHILE, WHEN) run on a pool of worker threads.
+// JOB_WORKERS are started up front, and another one whenever a job is queued
+// with no worker free to take it, so a WHEN parked for good never holds up
+// the jobs after it. Jobs are cooperative: loops call job_iteration()
+// between commands and stop once it returns false, and sleeps go through
+// job_sleep() so that cancelling a job wakes it immediately.
+
+#define JOB_WORKERS 16 // started up front; the pool grows to JOB_SLOTS
+#define JOB_SLOTS 256
+#define JOB_NAME_LENGTH 64
+
+typedef void (*JobFunc)(void *arg);
+
+typedef struct
+{
+  unsigned int id;
+  char name[JOB_NAME_LENGTH];
+  bool running; // false while still queued
+  unsigned long iterations;
+  double cpu_ms;
+} JobInfo;
+
+void init_jobs();
+// Queues func(arg) on the pool. A job cancelled before it starts calls
+// discard(arg) instead, if discard is not NULL, so that arg is not leaked.
+// Returns the job ID, or 0 if too many jobs are queued or running.
+unsigned int spawn_job(const char *name, JobFunc func, JobFunc discard, void *arg);
+// Job IDs are never reused, and event loop tasks draw from the same sequence
+unsigned int new_job_id();
+// Returns the number of jobs written to infos
+int list_jobs(JobInfo *infos, int max_infos);
+// Returns false if no such job exists
+bool cancel_job(unsigned int id);
+int cancel_all_jobs();
+
+// For code running inside a job; outside of one these never cancel
+bool job_cancelled();
+// The name the job was spawned with, or NULL outside of one
+const char *job_name();
+bool job_iteration();
+// Sleeps for the given time. Returns false if the job was cancelled.
+bool job_sleep(long microseconds);
+// Sleeps until an absolute monotonic_ns() deadline, so that time spent
+// before the call does not push the wake-up back. Returns false if the job
+// was cancelled.
+bool job_sleep_until(uint64_t deadline_ns);
+// CLOCK_MONOTONIC on Linux, the performance counter on Windows
+uint64_t monotonic_ns();
+// CPU time used by the calling thread, in nanoseconds
+uint64_t thread_cpu_ns();
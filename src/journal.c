@@ -0,0 +1,553 @@
+#include "main.h"
+
+#include "files.h"
+#include "journal.h"
+
+// A record is a RecordHeader followed by length bytes of text, a line of the
+// state without its newline, e.g. "@ a C 1"
+typedef struct
+{
+  uint32_t length;
+  uint32_t checksum; // CRC-32 of the text
+} RecordHeader;
+
+static uint32_t crc_table[256];
+
+static atomic_bool active = false;
+// Guarded by append_lock
+static char *snapshot_path = NULL;
+static char *journal_path = NULL;
+static int journal_fd = -1;
+static uint64_t journal_length = 0; // what was appended, synced or not
+static bool dirty = false;
+static bool compact_requested = false;
+
+static _Thread_local char *record_buffer = NULL;
+static _Thread_local size_t record_capacity = 0;
+
+// append_lock is only ever held for a write, maintenance_lock for as long as
+// a sync or a compaction takes. Opening and closing the journal take both.
+// order_lock is held from a change to its append, and taken before the
+// others.
+#ifdef _WIN32
+static CRITICAL_SECTION append_lock;
+static CRITICAL_SECTION maintenance_lock;
+static CRITICAL_SECTION order_lock;
+static CONDITION_VARIABLE work_available;
+
+#define LOCK_APPEND() EnterCriticalSection(&append_lock)
+#define UNLOCK_APPEND() LeaveCriticalSection(&append_lock)
+#define LOCK_MAINTENANCE() EnterCriticalSection(&maintenance_lock)
+#define UNLOCK_MAINTENANCE() LeaveCriticalSection(&maintenance_lock)
+#define LOCK_ORDER() EnterCriticalSection(&order_lock)
+#define UNLOCK_ORDER() LeaveCriticalSection(&order_lock)
+#define SIGNAL_WORK() WakeConditionVariable(&work_available)
+#define WAIT_FOR_WORK() SleepConditionVariableCS(&work_available, &append_lock, INFINITE)
+#elif defined(__linux__)
+static pthread_mutex_t append_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t maintenance_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t order_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_available = PTHREAD_COND_INITIALIZER;
+
+#define LOCK_APPEND() pthread_mutex_lock(&append_lock)
+#define UNLOCK_APPEND() pthread_mutex_unlock(&append_lock)
+#define LOCK_MAINTENANCE() pthread_mutex_lock(&maintenance_lock)
+#define UNLOCK_MAINTENANCE() pthread_mutex_unlock(&maintenance_lock)
+#define LOCK_ORDER() pthread_mutex_lock(&order_lock)
+#define UNLOCK_ORDER() pthread_mutex_unlock(&order_lock)
+#define SIGNAL_WORK() pthread_cond_signal(&work_available)
+#define WAIT_FOR_WORK() pthread_cond_wait(&work_available, &append_lock)
+#endif
+
+static uint32_t crc32(const char *data, size_t length)
+{
+  uint32_t crc = 0xffffffff;
+  for (size_t i = 0; i < length; ++i)
+  {
+    crc = crc_table[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc ^ 0xffffffff;
+}
+
+static int open_journal(const char *path, bool truncate)
+{
+#ifdef _WIN32
+  return _open(path, _O_RDWR | _O_CREAT | _O_APPEND | _O_BINARY | (truncate ? _O_TRUNC : 0), _S_IREAD | _S_IWRITE);
+#elif defined(__linux__)
+  return open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+#endif
+}
+
+static void close_fd(int fd)
+{
+#ifdef _WIN32
+  _close(fd);
+#elif defined(__linux__)
+  close(fd);
+#endif
+}
+
+static void sync_fd(int fd)
+{
+#ifdef _WIN32
+  _commit(fd);
+#elif defined(__linux__)
+  fdatasync(fd);
+#endif
+}
+
+static bool write_all(int fd, const char *data, size_t length)
+{
+  while (length > 0)
+  {
+#ifdef _WIN32
+    int written = _write(fd, data, (unsigned int)length);
+#elif defined(__linux__)
+    ssize_t written = write(fd, data, length);
+    if (written < 0 && errno == EINTR)
+    {
+      continue;
+    }
+#endif
+    if (written <= 0)
+    {
+      return false;
+    }
+    data += written;
+    length -= written;
+  }
+  return true;
+}
+
+static bool read_at(int fd, char *data, size_t length, uint64_t offset)
+{
+#ifdef _WIN32
+  if (_lseeki64(fd, offset, SEEK_SET) < 0)
+  {
+    return false;
+  }
+#endif
+  while (length > 0)
+  {
+#ifdef _WIN32
+    int count = _read(fd, data, (unsigned int)length);
+#elif defined(__linux__)
+    ssize_t count = pread(fd, data, length, offset);
+    if (count < 0 && errno == EINTR)
+    {
+      continue;
+    }
+#endif
+    if (count <= 0)
+    {
+      return false;
+    }
+    data += count;
+    length -= count;
+    offset += count;
+  }
+  return true;
+}
+
+static int truncate_fd(int fd, uint64_t length)
+{
+#ifdef _WIN32
+  return _chsize_s(fd, length) == 0 ? 0 : -1;
+#elif defined(__linux__)
+  return ftruncate(fd, length);
+#endif
+}
+
+// Makes a rename in the directory of path durable, so that a snapshot is on
+// disk before the journal it makes redundant is cut short
+static void sync_directory(const char *path)
+{
+#ifdef __linux__
+  char *directory = strdup(path);
+  char *slash = strrchr(directory, '/');
+  if (slash == NULL)
+  {
+    strcpy(directory, ".");
+  }
+  else
+  {
+    slash[slash == directory ? 1 : 0] = '\0';
+  }
+  int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0)
+  {
+    fsync(fd);
+    close(fd);
+  }
+  free(directory);
+#endif
+}
+
+int save_state(const char *path, bool snapshot)
+{
+  char temp[4096];
+  if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp))
+  {
+    return -1;
+  }
+  FILE *fp = fopen(temp, "wb");
+  if (fp == NULL)
+  {
+    return -1;
+  }
+
+  int result = write_state(fp, snapshot);
+  if (fflush(fp) != 0)
+  {
+    result = -1;
+  }
+  if (result == 0)
+  {
+#ifdef _WIN32
+    sync_fd(_fileno(fp));
+#else
+    sync_fd(fileno(fp));
+#endif
+  }
+  if (fclose(fp) != 0 || result != 0 || replace_file(temp, path) != 0)
+  {
+    remove(temp);
+    return -1;
+  }
+  sync_directory(path);
+  return 0;
+}
+
+static char *read_file(const char *path, size_t *length)
+{
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL)
+  {
+    return NULL;
+  }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  rewind(fp);
+  char *data = size >= 0 ? malloc(size + 1) : NULL;
+  *length = data != NULL ? fread(data, 1, size, fp) : 0;
+  fclose(fp);
+  return data;
+}
+
+static void restore_snapshot(const char *path)
+{
+  size_t length;
+  char *data = read_file(path, &length);
+  if (data == NULL)
+  {
+    return;
+  }
+  for (size_t start = 0; start < length;)
+  {
+    const char *newline = memchr(data + start, '\n', length - start);
+    size_t end = newline != NULL ? (size_t)(newline - data) : length;
+    size_t line = end;
+    if (line > start && data[line - 1] == '\r')
+    {
+      line--;
+    }
+    restore_state(data + start, line - start);
+    start = end + 1;
+  }
+  free(data);
+}
+
+// Returns how much of the journal holds whole records
+static uint64_t restore_journal(const char *path)
+{
+  size_t length;
+  char *data = read_file(path, &length);
+  if (data == NULL)
+  {
+    return 0;
+  }
+  size_t offset = 0;
+  while (length - offset >= sizeof(RecordHeader))
+  {
+    RecordHeader header;
+    memcpy(&header, data + offset, sizeof(header));
+    const char *text = data + offset + sizeof(header);
+    if (header.length > length - offset - sizeof(header) || crc32(text, header.length) != header.checksum)
+    {
+      break;
+    }
+    restore_state(text, header.length);
+    offset += sizeof(header) + header.length;
+  }
+  free(data);
+  return offset;
+}
+
+// Writes a snapshot of the state as it is now, which holds at least the
+// first length bytes of the journal, and starts the journal over with what
+// came after those. Called with maintenance_lock held; appends only wait
+// while the journal is swapped.
+static void compact_journal(uint64_t length)
+{
+  if (save_state(snapshot_path, true) != 0)
+  {
+    return;
+  }
+
+  char temp[4096];
+  snprintf(temp, sizeof(temp), "%s.tmp", journal_path);
+
+  LOCK_APPEND();
+  size_t tail = journal_length - length;
+  char *data = malloc(tail + 1);
+  bool written = read_at(journal_fd, data, tail, length);
+  if (written)
+  {
+    int fd = open_journal(temp, true);
+    written = fd >= 0 && write_all(fd, data, tail);
+    if (fd >= 0)
+    {
+      close_fd(fd);
+    }
+  }
+  // Windows cannot replace an open file, so the journal is reopened either
+  // way. Should the new journal not make it to disk, the old one still
+  // holds everything, and replaying it onto the snapshot comes out the same.
+  close_fd(journal_fd);
+  if (written && replace_file(temp, journal_path) == 0)
+  {
+    journal_length = tail;
+  }
+  else
+  {
+    remove(temp);
+  }
+  journal_fd = open_journal(journal_path, false);
+  if (journal_fd < 0)
+  {
+    atomic_store(&active, false);
+  }
+  UNLOCK_APPEND();
+  free(data);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI journal_thread(LPVOID arg)
+#elif defined(__linux__)
+static void *journal_thread(void *arg)
+#endif
+{
+  for (;;)
+  {
+    LOCK_APPEND();
+    while (!dirty && !compact_requested)
+    {
+      WAIT_FOR_WORK();
+    }
+    UNLOCK_APPEND();
+
+    // Whatever is appended in the meantime is synced along with it
+    Sleep(JOURNAL_SYNC_MS);
+
+    LOCK_MAINTENANCE();
+    LOCK_APPEND();
+    int fd = journal_fd;
+    uint64_t length = journal_length;
+    bool sync = dirty;
+    bool compact = fd >= 0 && (compact_requested || length > JOURNAL_COMPACT_BYTES);
+    dirty = false;
+    compact_requested = false;
+    UNLOCK_APPEND();
+
+    if (fd >= 0 && sync)
+    {
+      sync_fd(fd);
+    }
+    if (compact)
+    {
+      compact_journal(length);
+    }
+    UNLOCK_MAINTENANCE();
+  }
+  return 0;
+}
+
+// Called with maintenance_lock held
+static void close_journal()
+{
+  LOCK_APPEND();
+  atomic_store(&active, false);
+  int fd = journal_fd;
+  journal_fd = -1;
+  free(snapshot_path);
+  free(journal_path);
+  snapshot_path = NULL;
+  journal_path = NULL;
+  dirty = false;
+  compact_requested = false;
+  UNLOCK_APPEND();
+
+  if (fd >= 0)
+  {
+    sync_fd(fd);
+    close_fd(fd);
+  }
+}
+
+static void sync_at_exit()
+{
+  LOCK_APPEND();
+  if (journal_fd >= 0)
+  {
+    sync_fd(journal_fd);
+  }
+  UNLOCK_APPEND();
+}
+
+void init_journal()
+{
+  for (uint32_t i = 0; i < 256; ++i)
+  {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit)
+    {
+      crc = crc & 1 ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+    }
+    crc_table[i] = crc;
+  }
+
+#ifdef _WIN32
+  InitializeCriticalSection(&append_lock);
+  InitializeCriticalSection(&maintenance_lock);
+  InitializeCriticalSection(&order_lock);
+  InitializeConditionVariable(&work_available);
+  HANDLE thread = CreateThread(NULL, 0, journal_thread, NULL, 0, NULL);
+  if (thread != NULL)
+  {
+    CloseHandle(thread);
+  }
+#elif defined(__linux__)
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, journal_thread, NULL) == 0)
+  {
+    pthread_detach(thread);
+  }
+#endif
+  atexit(sync_at_exit);
+}
+
+int journal_open(const char *path)
+{
+  LOCK_MAINTENANCE();
+  close_journal();
+  if (*path == '\0')
+  {
+    UNLOCK_MAINTENANCE();
+    return 0;
+  }
+
+  size_t length = strlen(path) + sizeof(JOURNAL_SUFFIX);
+  char *journal = malloc(length);
+  snprintf(journal, length, "%s" JOURNAL_SUFFIX, path);
+
+  // Nothing is journaled while the state is restored
+  restore_snapshot(path);
+  uint64_t valid = restore_journal(journal);
+
+  int fd = open_journal(journal, false);
+  if (fd < 0 || truncate_fd(fd, valid) != 0)
+  {
+    if (fd >= 0)
+    {
+      close_fd(fd);
+    }
+    free(journal);
+    UNLOCK_MAINTENANCE();
+    return -1;
+  }
+
+  LOCK_APPEND();
+  snapshot_path = strdup(path);
+  journal_path = journal;
+  journal_fd = fd;
+  journal_length = valid;
+  // The first snapshot takes in whatever was set before the journal was
+  // opened
+  compact_requested = true;
+  atomic_store(&active, true);
+  SIGNAL_WORK();
+  UNLOCK_APPEND();
+  UNLOCK_MAINTENANCE();
+  return 0;
+}
+
+void journal_append(const char *format, ...)
+{
+  if (!atomic_load_explicit(&active, memory_order_relaxed))
+  {
+    return;
+  }
+
+  va_list args;
+  va_start(args, format);
+  va_list copy;
+  va_copy(copy, args);
+  size_t room = record_capacity > sizeof(RecordHeader) ? record_capacity - sizeof(RecordHeader) : 0;
+  int length = vsnprintf(record_buffer != NULL ? record_buffer + sizeof(RecordHeader) : NULL, room, format, copy);
+  va_end(copy);
+  if (length >= 0 && (size_t)length >= room)
+  {
+    record_capacity = sizeof(RecordHeader) + length + 1 > 256 ? sizeof(RecordHeader) + length + 1 : 256;
+    record_buffer = realloc(record_buffer, record_capacity);
+    vsnprintf(record_buffer + sizeof(RecordHeader), record_capacity - sizeof(RecordHeader), format, args);
+  }
+  va_end(args);
+  if (length < 0)
+  {
+    return;
+  }
+
+  RecordHeader header = {length, crc32(record_buffer + sizeof(RecordHeader), length)};
+  memcpy(record_buffer, &header, sizeof(header));
+  size_t size = sizeof(header) + length;
+
+  LOCK_APPEND();
+  if (journal_fd >= 0)
+  {
+    if (write_all(journal_fd, record_buffer, size))
+    {
+      journal_length += size;
+      dirty = true;
+      SIGNAL_WORK();
+    }
+    else
+    {
+      // A record cut short would hide every record after it
+      truncate_fd(journal_fd, journal_length);
+    }
+  }
+  UNLOCK_APPEND();
+}
+
+int journal_save()
+{
+  LOCK_APPEND();
+  int result = journal_fd >= 0 ? 0 : -1;
+  if (journal_fd >= 0)
+  {
+    compact_requested = true;
+    SIGNAL_WORK();
+  }
+  UNLOCK_APPEND();
+  return result;
+}
+
+void journal_begin()
+{
+  LOCK_ORDER();
+}
+
+void journal_end()
+{
+  UNLOCK_ORDER();
+}
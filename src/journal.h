@@ -0,0 +1,52 @@
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#include <windows.h>
+#elif defined(__linux__)
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// State journal. With the journal option set to a file, every RECORD,
+// HOTKEY, CLONE and OPT is appended to <file>.journal as the line SAVE
+// would write for it, framed by its length and a CRC-32. Appends are
+// written straight away and made durable together, at most JOURNAL_SYNC_MS
+// later, by a background thread, which also folds the journal into a
+// snapshot at <file> once it passes JOURNAL_COMPACT_BYTES. Opening the
+// journal restores the snapshot and then the journal on top of it, up to
+// the first record a crash tore. Snapshots, like every SAVE, are written to
+// a temporary file and only renamed over the old one once they are on disk.
+// Include main.h first, for write_state() and restore_state().
+
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_SYNC_MS 50
+#define JOURNAL_COMPACT_BYTES (64 * 1024)
+
+void init_journal();
+// Restores the state kept at path and journals from then on. An empty path
+// closes the journal. Returns -1 if the journal cannot be opened.
+int journal_open(const char *path);
+// Appends a line of the state. Does nothing while the journal is closed.
+void journal_append(const char *format, ...);
+// Bracket a change and the journal_append for it, so that changes made by
+// several threads at once are journaled in the order they took effect
+void journal_begin();
+void journal_end();
+// Has the journal synced and compacted into the snapshot in the background,
+// for SAVE. Returns -1 if the journal is closed.
+int journal_save();
+// Replaces path with the state. A snapshot leaves out the journal option.
+int save_state(const char *path, bool snapshot);
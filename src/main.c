@@ -1,13 +1,28 @@
 #include "main.h"
 
-OptionDefinition option_definitions[] = {
-    {"quiet", "false", "Whether the program will print feedback after command"},
-    {"leader", "\0", "The leader that will printed when waiting for a command"},
-    {"enable_cps_register", "false", "Whether the program will store cps into the C register"},
-    {"enable_last_location_register", "false", "Whether the program will put the COMMAND for last location of the mouse in the @L register"},
-    {"enable_hotkey", "true", "Enable hotkeys"}};
-
-#define OPTCOUNT (sizeof(option_definitions) / sizeof(option_definitions[0]))
+#include "files.h"
+#include "journal.h"
+#include "script.h"
+
+OptionDefinition option_definitions[OPTCOUNT] = {
+    [OPT_QUIET] = {"quiet", OPTION_BOOL, "false", "Whether the program will print feedback after command"},
+    [OPT_LEADER] = {"leader", OPTION_STRING, "", "The leader that will printed when waiting for a command"},
+    [OPT_ENABLE_CPS_REGISTER] = {"enable_cps_register", OPTION_BOOL, "false", "Whether the program will store cps into the C register"},
+    [OPT_ENABLE_LAST_LOCATION_REGISTER] = {"enable_last_location_register", OPTION_BOOL, "false", "Whether the program will put the COMMAND for last location of the mouse in the @L register"},
+    [OPT_ENABLE_HOTKEY] = {"enable_hotkey", OPTION_BOOL, "true", "Enable hotkeys"},
+    [OPT_EVENT_LOOP] = {"event_loop", OPTION_BOOL, "false", "Whether REPEAT, WHILE and WHEN run as tasks on a single event loop thread instead of on the job pool (Linux only)"},
+    [OPT_PACE_CATCH_UP] = {"pace_catch_up", OPTION_BOOL, "false", "Whether PACE makes up for missed deadlines by running late ones back to back, instead of skipping them"},
+    [OPT_ENABLE_PACE_REGISTER] = {"enable_pace_register", OPTION_BOOL, "false", "Whether PACE will put its requested and achieved period in the T register"},
+    [OPT_KEY_DELAY] = {"key_delay", OPTION_INT, "0", "Milliseconds between the keys typed by SEQUENCE"},
+    [OPT_ENABLE_RATE_REGISTER] = {"enable_rate_register", OPTION_BOOL, "false", "Whether the program will put the input rates and click intervals in the R register"},
+    [OPT_METRICS_FILE] = {"metrics_file", OPTION_STRING, "", "File that metrics are written to in the Prometheus text format every metrics_interval seconds, if set"},
+    [OPT_METRICS_INTERVAL] = {"metrics_interval", OPTION_INT, "10", "Seconds between two writes of metrics_file"},
+    [OPT_PROFILE] = {"profile", OPTION_BOOL, "false", "Whether recalled registers and loops are timed for the PROFILE command (not together with event_loop)"},
+    [OPT_PROFILE_COMMANDS] = {"profile_commands", OPTION_BOOL, "false", "Whether the profile also times every command on its own, which makes it about twice as slow"},
+    [OPT_SCRIPT_CACHE] = {"script_cache", OPTION_BOOL, "true", "Whether scripts are parsed once and kept in <file>.cache for as long as they do not change"},
+    [OPT_JOURNAL] = {"journal", OPTION_STRING, "", "File that the options, registers and hotkeys are kept in, with every change appended to <file>.journal as it is made, if set"},
+    [OPT_MOTION_RATE] = {"motion_rate", OPTION_INT, "500", "Points per second, up to 1000, of a MOVE, MOVE_BY or DRAG that takes a duration"},
+    [OPT_PIXEL_RATE] = {"pixel_rate", OPTION_INT, "100", "Times per second, up to 1000, that a FIND_COLOR with a timeout looks at the screen"}};
 
 Option options[OPTCOUNT];
 
@@ -15,22 +30,102 @@ void init_options()
 {
   for (int i = 0; i < OPTCOUNT; ++i)
   {
-    Option option = {strdup(option_definitions[i].key), strdup(option_definitions[i].default_value)};
-    options[i] = option;
+    const char *value = option_definitions[i].default_value;
+    set_option(i, value, strlen(value));
   }
 }
 
-void get_option_value(char *key, char **value)
+int find_option(const char *key, int length)
 {
   for (int i = 0; i < OPTCOUNT; ++i)
   {
-    if (strcmp(options[i].key, key) == 0)
+    if (strncmp(option_definitions[i].key, key, length) == 0 && option_definitions[i].key[length] == '\0')
     {
-      *value = strdup(options[i].value);
-      return;
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Parses value according to the option's type. Returns -1 if it does not
+// parse, leaving the option untouched
+int set_option(int index, const char *value, int length)
+{
+  switch (option_definitions[index].type)
+  {
+  case OPTION_BOOL:
+    if (length == 4 && strncmp(value, "true", 4) == 0)
+    {
+      atomic_store(&options[index].number, 1);
+    }
+    else if (length == 5 && strncmp(value, "false", 5) == 0)
+    {
+      atomic_store(&options[index].number, 0);
+    }
+    else
+    {
+      return -1;
     }
+    break;
+  case OPTION_INT:
+  {
+    char *copy = strndup(value, length);
+    char *end;
+    long number = strtol(copy, &end, 10);
+    bool valid = length > 0 && *end == '\0';
+    free(copy);
+    if (!valid)
+    {
+      return -1;
+    }
+    atomic_store(&options[index].number, number);
+    break;
+  }
+  case OPTION_STRING:
+  {
+    // Readers hold on to the old value inside the epoch
+    char *old = atomic_exchange(&options[index].string, strndup(value, length));
+    if (old != NULL)
+    {
+      epoch_retire(old, free);
+    }
+    break;
+  }
+  }
+  return 0;
+}
+
+bool get_option_bool(int index)
+{
+  return atomic_load_explicit(&options[index].number, memory_order_relaxed) != 0;
+}
+
+long get_option_int(int index)
+{
+  return atomic_load_explicit(&options[index].number, memory_order_relaxed);
+}
+
+const char *get_option_string(int index)
+{
+  return atomic_load(&options[index].string);
+}
+
+void format_option(int index, char *buf, size_t size)
+{
+  switch (option_definitions[index].type)
+  {
+  case OPTION_BOOL:
+    snprintf(buf, size, "%s", get_option_bool(index) ? "true" : "false");
+    break;
+  case OPTION_INT:
+    snprintf(buf, size, "%ld", get_option_int(index));
+    break;
+  case OPTION_STRING:
+    epoch_enter();
+    snprintf(buf, size, "%s", get_option_string(index));
+    epoch_exit();
+    break;
   }
-  *value = strdup("Option not found");
 }
 
 CommandDefinition command_definitions[] = {
@@ -42,21 +137,38 @@ CommandDefinition command_definitions[] = {
     {"=", "RECALLIF <register: char> <value: string> <register: char> [register: char] ... - Executes a command from all register(s) listed, in order, if the value of the register is equal to the value specified", recallif_handler},
     {"-", "RECALLIFNOT <register: char> <value: string> <register: char> [register: char] ... - Executes a command from all register(s) listed, in order, if the value of the register is not equal to the value specified", recallifnot_handler},
     {"/", "RECALLIFELSE <register: char> <value: string> <register_true: char> <register_false: char> -  Recalls a command from the register specified if the value of the register is equal to the value specified. Otherwise, the command from the register_false will be recalled", recallifelse_handler},
+    {"H", "RECALLIFHELD <key: char | SHIFT | CTRL | ALT | BUTTON<n>> <register: char> [register: char] ... - Executes a command from all register(s) listed, in order, if the key or mouse button is held down on the real keyboard or mouse", recallifheld_handler},
+    {"U", "RECALLIFNOTHELD <key: char | SHIFT | CTRL | ALT | BUTTON<n>> <register: char> [register: char] ... - Executes a command from all register(s) listed, in order, if the key or mouse button is not held down", recallifnotheld_handler},
     {"*", "REPEAT <times: int> <register: char> [register: char] ... - Launches a new thread for every register listed to repeat the defined times.", repeat_handler},
     {"^", "WHILE <register: char> <value: string> <register: char> [register: char] ... - Repeats the commands in the register(s) listed, in order, while the value of the register is equal to the value specified", while_handler},
+    {"~", "WHEN <register: char> <value: string> <register: char> [register: char] ... - Like WHILE, but instead of exiting when the value no longer matches, the thread sleeps until the register is written again", when_handler},
     {"!", "OPT [opt: word] [value: string] - Sets or prints an option", opt_handler},
     {">", "SAVE [filename: string] - Saves the current script options to a file. Defaults to .clickerrc", save_handler},
     {"<", "LOAD <filename: string> - Loads a script from a file", load_handler},
-    {"M", "MOVE [x: int] [y: int] - Moves the mouse to the specified coordinates. If nothing is provided, just save the mouse location to the L register if it is enabled", move_handler},
+    {"M", "MOVE [MONITOR <n: int>] [x: int | float] [y: int | float] [duration: time] [LINEAR | EASE | BEZIER <cx: int> <cy: int> [cx: int] [cy: int]] - Moves the mouse to the specified coordinates, over the duration along the path if one is given. Coordinates with a decimal point go from 0 to 1 across the screen, or the monitor if one is given, where 1 is the primary one. If nothing is provided, just save the mouse location to the L register if it is enabled", move_handler},
+    {"N", "MOVE_BY <dx: float> <dy: float> [duration: time] [LINEAR | EASE | BEZIER <cx: float> <cy: float> [cx: float] [cy: float]] - Moves the mouse by the specified distance, carrying fractions of a pixel over to the next MOVE_BY. Control points are relative to where the mouse starts", move_by_handler},
+    {"D", "DRAG <button: int> [MONITOR <n: int>] <x: int | float> <y: int | float> <duration: time> [LINEAR | EASE | BEZIER <cx: int> <cy: int> [cx: int] [cy: int]] - Holds the button down while the mouse moves to the specified coordinates over the duration", drag_handler},
+    {"G", "PIXEL <register: char> [MONITOR <n: int>] <x: int | float> <y: int | float> - Puts the color of the pixel into the register, as rrggbb in hex (Linux only)", pixel_handler},
+    {"B", "FIND_COLOR <register: char> <color: rrggbb> <tolerance: int> [MONITOR <n: int>] <x: int | float> <y: int | float> <width: int> <height: int> [timeout: time] - Looks for a pixel within the tolerance of the color on every channel in the rectangle, until the timeout if one is given, and puts a MOVE to the first one into the register, or a COMMENT if there is none (Linux only)", find_color_handler},
+    {"O", "FIND_IMAGE <register: char> <score register: char> <filename: string> [MONITOR <n: int>] <x: int | float> <y: int | float> <width: int> <height: int> [threshold: float] - Looks for the image in a binary PPM or PGM file in the rectangle, puts a MOVE to the middle of where it looks most alike into the register, or a COMMENT if its score is below the threshold (0.8 if not given), and the score, from -1 to 1, into the score register (Linux only)", find_image_handler},
     {"C", "CLICK <button: int> - Clicks the button specified", click_handler},
     {"}", "CLICK_DOWN <button: int> - Clicks the button specified", click_down_handler},
     {"{", "CLICK_UP <button: int> - Clicks the button specified", click_up_handler},
-    {"K", "KEY <key: char> - Presses the key specified", key_handler},
+    {"K", "KEY <key: char> [key: char] ... - Presses the key specified, or several keys together as a chord", key_handler},
     {"]", "KEY_DOWN <key: char> - Presses the key specified", key_down_handler},
     {"[", "KEY_UP <key: char> - Presses the key specified", key_up_handler},
     {"S", "SEQUENCE <keys: string> [keys: string] ... - Presses the specified keys in sequence", sequence_handler},
     {"W", "DELAY <ms: int> - Waits for the specified amount of milliseconds", delay_handler},
+    {"T", "PACE <period: string> - Waits for the next deadline of a fixed-rate schedule. The period is in ms, or has a us, ms or s suffix, or is a rate such as 20/s", pace_handler},
     {"P", "PRINT <string: string> - Prints the specified string to the console replaces '@<register: char>' with the value of the register unless escaped", print_handler},
+    {"%", "STATS - Prints the click, key press and move rates over the last second, and the intervals between them", stats_handler},
+    {"$", "METRICS [filename: string] - Prints the command, input backend and hotkey metrics in the Prometheus text format, or writes them to a file", metrics_handler},
+    {"F", "PROFILE [RESET | filename: string [WALL | CPU]] - Prints the time spent in each stack of registers and commands since the profile option was turned on, writes it to a file as folded stacks for flame graphs, or starts over", profile_handler},
+    {"I", "CAPTURE [filename: string | STOP] - Captures the real mouse and keyboard into a file, stops capturing, or shows how many events were captured so far (Linux only)", capture_handler},
+    {"R", "REPLAY <filename: string> [speed: float] [start: time] [end: time] [loops: int] - Replays a CAPTURE file at 0.5 to 10 times its speed, from start to end (0 for the end of the file) and as many times as asked (0 repeats until the job is cancelled), then prints how late events went out", replay_handler},
+    {"Y", "HELD [events: int] - Prints where the mouse is and which keys and buttons are held, as mirrored from XInput2, and the latest events (Linux only)", held_handler},
+    {"J", "JOBS - Lists the running REPEAT, WHILE and WHEN jobs", jobs_handler},
+    {"X", "CANCEL [job: int] ... - Stops the jobs listed, or every job if none are listed", cancel_handler},
     {"Q", "QUIT - Quits the program", quit_handler},
 };
 
@@ -94,27 +206,28 @@ void trim(char *str)
 
 void quiet_printf(char *format, ...)
 {
-  char *quiet;
-  get_option_value("quiet", &quiet);
-  if (strcmp(quiet, "true") == 0)
+  if (get_option_bool(OPT_QUIET))
   {
     return;
   }
   va_list args;
   va_start(args, format);
-  vprintf(format, args);
+  output_vprintf(format, args);
   va_end(args);
 }
 
-char *next_token(char **str_ptr, const char *delim)
+// Scans the token starting at *pos and advances *pos past its delimiter.
+// Returns false once the end of the input has been consumed. Tokens are
+// spans into the input, which is never modified.
+bool next_token(const char *input, int *pos, const char *delim, Token *token)
 {
-  if (*str_ptr == NULL)
+  if (*pos < 0)
   {
-    return NULL;
+    return false;
   }
 
-  char *token_start = *str_ptr;
-  char *cur = *str_ptr;
+  const char *token_start = input + *pos;
+  const char *cur = token_start;
   bool in_quotes = false;
 
   while (*cur != '\0')
@@ -130,57 +243,287 @@ char *next_token(char **str_ptr, const char *delim)
     cur++;
   }
 
-  if (*cur == '\0')
+  token->offset = *pos;
+  token->length = cur - token_start;
+  *pos = *cur == '\0' ? -1 : cur - input + 1;
+
+  if (token->length > 0 && *token_start == '\"')
   {
-    *str_ptr = NULL;
+    token->offset++;
+    token->length--;
+    if (token->length > 0 && input[token->offset + token->length - 1] == '\"')
+    {
+      token->length--;
+    }
   }
-  else
+
+  return true;
+}
+
+int tokenize(const char *input, Token *tokens, int max_tokens)
+{
+  int count = 0;
+  int pos = 0;
+  Token token;
+  while (next_token(input, &pos, " ", &token))
+  {
+    if (count < max_tokens)
+    {
+      token.reg = token.length > 0 ? get_register_index(input[token.offset]) : -1;
+      token.number = atoi(input + token.offset);
+      tokens[count] = token;
+    }
+    count++;
+  }
+  return count;
+}
+
+// Splits the text of a PRINT into literal spans and register references
+// once, when it is parsed, instead of every time it is printed
+static void compile_template(Command *cmd)
+{
+  const char *text = ARG_PTR(cmd, 1);
+  int start = 0;
+  int end = ARG_LEN(cmd, 1);
+  while (start < end && isspace((unsigned char)text[start]))
+  {
+    start++;
+  }
+  while (end > start && isspace((unsigned char)text[end - 1]))
+  {
+    end--;
+  }
+
+  // At most one literal span before every reference, and one at the end
+  int references = 0;
+  for (int i = start; i + 1 < end; ++i)
   {
-    *cur = '\0';
-    *str_ptr = cur + 1;
+    if (text[i] == '@' && get_register_index(text[i + 1]) != -1)
+    {
+      references++;
+      i++;
+    }
   }
+  cmd->segments = malloc(sizeof(Token) * (2 * references + 1));
 
-  return token_start;
+  int literal = start;
+  for (int i = start; i < end; ++i)
+  {
+    if (text[i] != '@' || i + 1 == end || get_register_index(text[i + 1]) == -1)
+    {
+      continue;
+    }
+    if (i > literal)
+    {
+      cmd->segments[cmd->segmentc++] = (Token){cmd->args[1].offset + literal, i - literal, -1, 0};
+    }
+    cmd->segments[cmd->segmentc++] = (Token){cmd->args[1].offset + i, 2, get_register_index(text[i + 1]), 0};
+    i++;
+    literal = i + 1;
+  }
+  if (end > literal)
+  {
+    cmd->segments[cmd->segmentc++] = (Token){cmd->args[1].offset + literal, end - literal, -1, 0};
+  }
 }
 
 int parse_command(const char *input, Command *cmd)
 {
   cmd->argc = 0;
+  cmd->args = cmd->inline_args;
+  cmd->segments = NULL;
+  cmd->segmentc = 0;
 
   if (sscanf(input, " %c", &cmd->command) != 1)
   {
     return -1;
   }
 
-  char *input_copy = strdup(input);
-  char *cur = input_copy;
-  char *token = next_token(&cur, " ");
-  while (token != NULL)
+  cmd->source = input;
+  cmd->argc = tokenize(input, cmd->inline_args, INLINE_ARGS);
+  if (cmd->argc > INLINE_ARGS)
   {
-    if (*token == '\"')
-    {
-      token++;
-      size_t len = strlen(token);
-      if (len > 0 && token[len - 1] == '\"')
-      {
-        token[len - 1] = '\0';
-      }
-    }
-    cmd->args[cmd->argc++] = strdup(token);
-    token = next_token(&cur, " ");
+    cmd->args = malloc(sizeof(Token) * cmd->argc);
+    tokenize(input, cmd->args, cmd->argc);
   }
 
-  free(input_copy);
+  resolve_command(cmd);
 
   return 0;
 }
 
+void resolve_command(Command *cmd)
+{
+  cmd->segments = NULL;
+  cmd->segmentc = 0;
+  cmd->handler = find_handler(cmd->command);
+  if (cmd->handler == print_handler && cmd->argc == 2)
+  {
+    compile_template(cmd);
+  }
+}
+
 void free_command(Command *cmd)
 {
-  for (int i = 0; i < cmd->argc; ++i)
+  if (cmd->args != cmd->inline_args)
+  {
+    free(cmd->args);
+  }
+  cmd->args = cmd->inline_args;
+  cmd->argc = 0;
+  free(cmd->segments);
+  cmd->segments = NULL;
+  cmd->segmentc = 0;
+}
+
+char arg_char(const Command *cmd, int i)
+{
+  return cmd->args[i].length > 0 ? ARG_PTR(cmd, i)[0] : '\0';
+}
+
+bool arg_equals(const Command *cmd, int i, const char *str)
+{
+  return strncmp(ARG_PTR(cmd, i), str, ARG_LEN(cmd, i)) == 0 && str[ARG_LEN(cmd, i)] == '\0';
+}
+
+char *arg_dup(const Command *cmd, int i)
+{
+  return strndup(ARG_PTR(cmd, i), ARG_LEN(cmd, i));
+}
+
+// Joins args[first..] with single spaces, the way they were typed minus the
+// quoting
+char *join_args(const Command *cmd, int first)
+{
+  size_t size = 1;
+  for (int i = first; i < cmd->argc; ++i)
+  {
+    size += ARG_LEN(cmd, i) + 1;
+  }
+
+  char *joined = malloc(size);
+  char *dst = joined;
+  for (int i = first; i < cmd->argc; ++i)
+  {
+    memcpy(dst, ARG_PTR(cmd, i), ARG_LEN(cmd, i));
+    dst += ARG_LEN(cmd, i);
+    *dst++ = ' ';
+  }
+  *dst = '\0';
+
+  trim(joined);
+  return joined;
+}
+
+Register registers[REGISTERCOUNT];
+
+void free_register_value(void *ptr)
+{
+  RegisterValue *value = ptr;
+  if (value->is_compiled)
+  {
+    free_command(&value->compiled);
+  }
+  release_string(value->command, strlen(value->command));
+  free(value);
+}
+
+// Takes a reference to the register's current value, which stays valid
+// until unhold_register_value. Returns NULL if the register is empty.
+RegisterValue *hold_register_value(Register *reg)
+{
+  epoch_enter();
+  RegisterValue *value = load_register(reg);
+  if (value != NULL)
+  {
+    atomic_fetch_add(&value->refs, 1);
+  }
+  epoch_exit();
+  return value;
+}
+
+void unhold_register_value(void *ptr)
+{
+  RegisterValue *value = ptr;
+  if (atomic_fetch_sub(&value->refs, 1) == 1)
+  {
+    free_register_value(value);
+  }
+}
+
+// Publishes a new immutable value for the register. The old value is
+// reclaimed once no reader can still be using it. Passing NULL clears the
+// register.
+void set_register(Register *reg, const char *command)
+{
+  RegisterValue *value = NULL;
+  if (command != NULL)
+  {
+    size_t len = strlen(command);
+    value = malloc(sizeof(RegisterValue) + len + 1);
+    memcpy(value->command, command, len + 1);
+    value->is_compiled = parse_command(value->command, &value->compiled) == 0;
+    value->value_id = intern_string(value->command, len);
+    atomic_init(&value->refs, 1);
+  }
+
+  // The register's own reference is dropped once no reader can still be
+  // using the value, tasks holding it keep it alive past that
+  RegisterValue *old = atomic_exchange(&reg->value, value);
+  epoch_retire(old, unhold_register_value);
+
+  wake_register(reg);
+}
+
+void wake_register(Register *reg)
+{
+  atomic_fetch_add(&reg->generation, 1);
+  if (atomic_load(&reg->waiters) > 0)
+  {
+#ifdef _WIN32
+    WakeByAddressAll((void *)&reg->generation);
+#elif defined(__linux__)
+    syscall(SYS_futex, &reg->generation, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#endif
+  }
+  // Hotkeys are registers too, but no loop can wait on them
+  if (reg >= registers && reg < registers + REGISTERCOUNT)
+  {
+    event_loop_notify(reg - registers);
+  }
+}
+
+// Blocks until the register is written, unless it already has been since
+// generation was read
+void wait_register(Register *reg, unsigned int generation)
+{
+  atomic_fetch_add(&reg->waiters, 1);
+  while (atomic_load(&reg->generation) == generation && !job_cancelled())
   {
-    free(cmd->args[i]);
+#ifdef _WIN32
+    WaitOnAddress((void *)&reg->generation, &generation, sizeof(generation), INFINITE);
+#elif defined(__linux__)
+    syscall(SYS_futex, &reg->generation, FUTEX_WAIT_PRIVATE, generation, NULL, NULL, 0);
+#endif
   }
+  atomic_fetch_sub(&reg->waiters, 1);
+}
+
+// Whether the register currently holds the interned value
+bool register_holds(Register *reg, unsigned int value_id)
+{
+  epoch_enter();
+  RegisterValue *value = load_register(reg);
+  bool holds = value != NULL && value->value_id == value_id;
+  epoch_exit();
+  return holds;
+}
+
+// Must be called between epoch_enter() and epoch_exit(), and the value must
+// not be used after epoch_exit()
+RegisterValue *load_register(Register *reg)
+{
+  return atomic_load_explicit(&reg->value, memory_order_acquire);
 }
 
 CommandHandler find_handler(char command)
@@ -195,12 +538,53 @@ CommandHandler find_handler(char command)
   return NULL;
 }
 
-void execute_command(Command *cmd)
+// Enters a profiler frame if the profile option is on
+static void profile_frame(ProfileFrame *frame, const char *name, size_t length, bool cpu)
+{
+  frame->node = NULL;
+  if (get_option_bool(OPT_PROFILE))
+  {
+    profile_enter(frame, name, length, cpu);
+  }
+}
+
+static bool is_recall(CommandHandler handler)
+{
+  return handler == recall_handler || handler == recallif_handler || handler == recallifnot_handler || handler == recallifelse_handler ||
+         handler == recallifheld_handler || handler == recallifnotheld_handler;
+}
+
+static void run_command(const Command *cmd)
+{
+  if (metrics_command_count(cmd->command))
+  {
+    metrics_time_command(cmd, cmd->handler, cmd->command);
+  }
+  else
+  {
+    cmd->handler(cmd);
+  }
+}
+
+void execute_command(const Command *cmd)
 {
-  CommandHandler handler = find_handler(cmd->command);
-  if (handler != NULL)
+  if (cmd->handler == NULL)
+  {
+    return;
+  }
+
+  // The frames of the registers a RECALL runs go straight below the
+  // register it is in
+  if (get_option_bool(OPT_PROFILE_COMMANDS) && get_option_bool(OPT_PROFILE) && !is_recall(cmd->handler))
+  {
+    ProfileFrame frame;
+    profile_enter(&frame, &cmd->command, 1, false);
+    run_command(cmd);
+    profile_exit(&frame);
+  }
+  else
   {
-    handler(cmd);
+    run_command(cmd);
   }
 }
 
@@ -208,7 +592,7 @@ int help_handler(const Command *cmd)
 {
   for (int i = 0; i < sizeof(command_definitions) / sizeof(command_definitions[0]); ++i)
   {
-    printf("%s - %s\n", command_definitions[i].aliases, command_definitions[i].usage);
+    output_printf("%s - %s\n", command_definitions[i].aliases, command_definitions[i].usage);
   }
   return 0;
 }
@@ -233,7 +617,7 @@ int hotkey_handler(const Command *cmd)
     return -1;
   }
 
-  char hotkey_name = cmd->args[1][0];
+  char hotkey_name = arg_char(cmd, 1);
   int hotkey_index = get_hotkey_index(hotkey_name);
   if (hotkey_index < 0)
   {
@@ -241,30 +625,33 @@ int hotkey_handler(const Command *cmd)
     return -1;
   }
 
-  if (hotkeys[hotkey_index].command)
-  {
-    free(hotkeys[hotkey_index].command);
-  }
-
-  char *command = malloc(1);
-  command[0] = '\0';
-  for (int i = 2; i < cmd->argc; ++i)
-  {
-    command = realloc(command, strlen(command) + strlen(cmd->args[i]) + 2);
-    strcat(command, cmd->args[i]);
-    strcat(command, " ");
-  }
-
-  trim(command);
-  hotkeys[hotkey_index].register_name = hotkey_name;
-  hotkeys[hotkey_index].command = command;
+  char *command = join_args(cmd, 2);
+  journal_begin();
+  set_register(&hotkeys[hotkey_index], command);
+  journal_append("& %c %s", hotkey_name, command);
+  journal_end();
 
   quiet_printf("Hotkey '%c' set to command: %s\n", hotkey_name, command);
+  free(command);
   return 0;
 }
 
-#define REGISTERCOUNT 62
-Register registers[REGISTERCOUNT];
+void execute_hotkey(int hotkey_index)
+{
+  uint64_t start = metrics_hotkey_start();
+  // Held rather than read inside the epoch, which the command could keep
+  // open for as long as it runs
+  RegisterValue *value = hold_register_value(&hotkeys[hotkey_index]);
+  if (value != NULL)
+  {
+    if (value->is_compiled)
+    {
+      execute_command(&value->compiled);
+    }
+    unhold_register_value(value);
+  }
+  metrics_hotkey(start);
+}
 
 int get_register_index(char register_name)
 {
@@ -283,6 +670,31 @@ int get_register_index(char register_name)
   return -1;
 }
 
+void init_registers()
+{
+  for (char name = ' '; name <= '~'; ++name)
+  {
+    int register_index = get_register_index(name);
+    if (register_index != -1)
+    {
+      registers[register_index].register_name = name;
+    }
+    hotkeys[get_hotkey_index(name)].register_name = name;
+  }
+}
+
+// Wakes every thread parked on a register, so that cancelled jobs notice
+void wake_registers()
+{
+  for (int i = 0; i < REGISTERCOUNT; ++i)
+  {
+    if (atomic_load(&registers[i].waiters) > 0)
+    {
+      wake_register(&registers[i]);
+    }
+  }
+}
+
 int record_handler(const Command *cmd)
 {
   if (cmd->argc < 3)
@@ -291,33 +703,22 @@ int record_handler(const Command *cmd)
     return -1;
   }
 
-  char register_name = cmd->args[1][0];
-  int register_index = get_register_index(register_name);
+  char register_name = arg_char(cmd, 1);
+  int register_index = cmd->args[1].reg;
   if (register_index < 0)
   {
     quiet_printf("Invalid register name for the RECORD command.\n");
     return -1;
   }
 
-  if (registers[register_index].command)
-  {
-    free(registers[register_index].command);
-  }
-
-  char *command = malloc(1);
-  command[0] = '\0';
-  for (int i = 2; i < cmd->argc; ++i)
-  {
-    command = realloc(command, strlen(command) + strlen(cmd->args[i]) + 2);
-    strcat(command, cmd->args[i]);
-    strcat(command, " ");
-  }
-
-  trim(command);
-  registers[register_index].register_name = register_name;
-  registers[register_index].command = command;
+  char *command = join_args(cmd, 2);
+  journal_begin();
+  set_register(&registers[register_index], command);
+  journal_append("@ %c %s", register_name, command);
+  journal_end();
 
   quiet_printf("Recorded command in register '%c': %s\n", register_name, command);
+  free(command);
   return 0;
 }
 
@@ -329,26 +730,74 @@ int clone_handler(const Command *cmd)
     return -1;
   }
 
-  int from_register_index = get_register_index(cmd->args[1][0]);
-  int to_register_index = get_register_index(cmd->args[2][0]);
+  int from_register_index = cmd->args[1].reg;
+  int to_register_index = cmd->args[2].reg;
   if (from_register_index < 0 || to_register_index < 0)
   {
     quiet_printf("Invalid register name for the CLONE command.\n");
     return -1;
   }
 
-  if (registers[to_register_index].command)
+  epoch_enter();
+  RegisterValue *value = load_register(&registers[from_register_index]);
+  if (value == NULL)
   {
-    free(registers[to_register_index].command);
+    epoch_exit();
+    quiet_printf("No command found in register '%c'\n", arg_char(cmd, 1));
+    return -1;
   }
 
-  registers[to_register_index].command = strdup(registers[from_register_index].command);
+  journal_begin();
+  set_register(&registers[to_register_index], value->command);
+  journal_append("@ %c %s", arg_char(cmd, 2), value->command);
+  journal_end();
 
-  quiet_printf("Cloned command from register '%c' to register '%c': %s\n", cmd->args[1][0], cmd->args[2][0], registers[to_register_index].command);
+  quiet_printf("Cloned command from register '%c' to register '%c': %s\n", arg_char(cmd, 1), arg_char(cmd, 2), value->command);
+  epoch_exit();
 
   return 0;
 }
 
+// Executes the command held by a register. Returns -1 if the register is
+// empty.
+int execute_register(int register_index, char register_name)
+{
+  // Held, as in execute_hotkey, so that a long command does not hold back
+  // every retired value
+  RegisterValue *value = hold_register_value(&registers[register_index]);
+  if (value == NULL)
+  {
+    quiet_printf("No command found in register '%c'\n", register_name);
+    return -1;
+  }
+
+  quiet_printf("Recalling command in register '%c': %s\n", register_name, value->command);
+  if (value->is_compiled)
+  {
+    ProfileFrame frame;
+    profile_frame(&frame, &register_name, 1, true);
+    execute_command(&value->compiled);
+    profile_exit(&frame);
+  }
+  unhold_register_value(value);
+  return 0;
+}
+
+// Compares the value of a register against a string. Returns -1 if the
+// register is empty, 1 if they are equal and 0 otherwise.
+int compare_register(int register_index, const char *str, int length)
+{
+  epoch_enter();
+  RegisterValue *value = load_register(&registers[register_index]);
+  int result = -1;
+  if (value != NULL)
+  {
+    result = strncmp(value->command, str, length) == 0 && value->command[length] == '\0';
+  }
+  epoch_exit();
+  return result;
+}
+
 int recall_handler(const Command *cmd)
 {
   if (cmd->argc < 2)
@@ -359,26 +808,18 @@ int recall_handler(const Command *cmd)
 
   for (int i = 1; i < cmd->argc; ++i)
   {
-    char register_name = cmd->args[i][0];
-    int register_index = get_register_index(register_name);
+    char register_name = arg_char(cmd, i);
+    int register_index = cmd->args[i].reg;
     if (register_index < 0)
     {
       quiet_printf("Invalid register name for the RECALL command.\n");
       return -1;
     }
 
-    if (registers[register_index].command == NULL)
+    if (execute_register(register_index, register_name) != 0)
     {
-      quiet_printf("No command found in register '%c'\n", register_name);
       return -1;
     }
-
-    quiet_printf("Recalling command in register '%c': %s\n", register_name, registers[register_index].command);
-    Command saved_cmd;
-    if (parse_command(registers[register_index].command, &saved_cmd) == 0)
-    {
-      execute_command(&saved_cmd);
-    }
   }
 
   return 0;
@@ -392,44 +833,37 @@ int recallif_handler(const Command *cmd)
     return -1;
   }
 
-  char cond_register_name = cmd->args[1][0];
-  int cond_register_index = get_register_index(cond_register_name);
+  char cond_register_name = arg_char(cmd, 1);
+  int cond_register_index = cmd->args[1].reg;
   if (cond_register_index < 0)
   {
     quiet_printf("Invalid register name for the RECALLIF command.\n");
     return -1;
   }
 
-  if (registers[cond_register_index].command == NULL)
+  int equal = compare_register(cond_register_index, ARG_PTR(cmd, 2), ARG_LEN(cmd, 2));
+  if (equal < 0)
   {
     quiet_printf("No value found in register '%c'\n", cond_register_name);
     return -1;
   }
 
-  if (strcmp(registers[cond_register_index].command, cmd->args[2]) == 0)
+  if (equal)
   {
     for (int i = 3; i < cmd->argc; ++i)
     {
-      char register_name = cmd->args[i][0];
-      int register_index = get_register_index(register_name);
+      char register_name = arg_char(cmd, i);
+      int register_index = cmd->args[i].reg;
       if (register_index < 0)
       {
         quiet_printf("Invalid register name for the RECALLIF command.\n");
         return -1;
       }
 
-      if (registers[register_index].command == NULL)
+      if (execute_register(register_index, register_name) != 0)
       {
-        quiet_printf("No command found in register '%c'\n", register_name);
         return -1;
       }
-
-      quiet_printf("Recalling command in register '%c': %s\n", register_name, registers[register_index].command);
-      Command saved_cmd;
-      if (parse_command(registers[register_index].command, &saved_cmd) == 0)
-      {
-        execute_command(&saved_cmd);
-      }
     }
   }
 
@@ -444,44 +878,37 @@ int recallifnot_handler(const Command *cmd)
     return -1;
   }
 
-  char cond_register_name = cmd->args[1][0];
-  int cond_register_index = get_register_index(cond_register_name);
+  char cond_register_name = arg_char(cmd, 1);
+  int cond_register_index = cmd->args[1].reg;
   if (cond_register_index < 0)
   {
     quiet_printf("Invalid register name for the RECALLIFNOT command.\n");
     return -1;
   }
 
-  if (registers[cond_register_index].command == NULL)
+  int equal = compare_register(cond_register_index, ARG_PTR(cmd, 2), ARG_LEN(cmd, 2));
+  if (equal < 0)
   {
     quiet_printf("No value found in register '%c'\n", cond_register_name);
     return -1;
   }
 
-  if (strcmp(registers[cond_register_index].command, cmd->args[2]) != 0)
+  if (!equal)
   {
     for (int i = 3; i < cmd->argc; ++i)
     {
-      char register_name = cmd->args[i][0];
-      int register_index = get_register_index(register_name);
+      char register_name = arg_char(cmd, i);
+      int register_index = cmd->args[i].reg;
       if (register_index < 0)
       {
         quiet_printf("Invalid register name for the RECALLIFNOT command.\n");
         return -1;
       }
 
-      if (registers[register_index].command == NULL)
+      if (execute_register(register_index, register_name) != 0)
       {
-        quiet_printf("No command found in register '%c'\n", register_name);
         return -1;
       }
-
-      quiet_printf("Recalling command in register '%c': %s\n", register_name, registers[register_index].command);
-      Command saved_cmd;
-      if (parse_command(registers[register_index].command, &saved_cmd) == 0)
-      {
-        execute_command(&saved_cmd);
-      }
     }
   }
 
@@ -496,489 +923,1883 @@ int recallifelse_handler(const Command *cmd)
     return -1;
   }
 
-  char cond_register_name = cmd->args[1][0];
-  int cond_register_index = get_register_index(cond_register_name);
+  char cond_register_name = arg_char(cmd, 1);
+  int cond_register_index = cmd->args[1].reg;
   if (cond_register_index < 0)
   {
     quiet_printf("Invalid register name for the RECALLIFELSE command.\n");
     return -1;
   }
 
-  if (registers[cond_register_index].command == NULL)
+  int equal = compare_register(cond_register_index, ARG_PTR(cmd, 2), ARG_LEN(cmd, 2));
+  if (equal < 0)
   {
     quiet_printf("No value found in register '%c'\n", cond_register_name);
     return -1;
   }
 
-  if (strcmp(registers[cond_register_index].command, cmd->args[2]) == 0)
+  if (equal)
   {
-    char register_name = cmd->args[3][0];
-    int register_index = get_register_index(register_name);
+    char register_name = arg_char(cmd, 3);
+    int register_index = cmd->args[3].reg;
     if (register_index < 0)
     {
       quiet_printf("Invalid register name for the RECALLIFELSE command.\n");
       return -1;
     }
 
-    if (registers[register_index].command == NULL)
+    if (execute_register(register_index, register_name) != 0)
     {
-      quiet_printf("No command found in register '%c'\n", register_name);
       return -1;
     }
-
-    quiet_printf("Recalling command in register '%c': %s\n", register_name, registers[register_index].command);
-    Command saved_cmd;
-    if (parse_command(registers[register_index].command, &saved_cmd) == 0)
-    {
-      execute_command(&saved_cmd);
-    }
   }
   else
   {
-    char register_name = cmd->args[4][0];
-    int register_index = get_register_index(register_name);
+    char register_name = arg_char(cmd, 4);
+    int register_index = cmd->args[4].reg;
     if (register_index < 0)
     {
       quiet_printf("Invalid register name for the RECALLIFELSE command.\n");
       return -1;
     }
 
-    if (registers[register_index].command == NULL)
+    if (execute_register(register_index, register_name) != 0)
     {
-      quiet_printf("No command found in register '%c'\n", register_name);
       return -1;
     }
-
-    quiet_printf("Recalling command in register '%c': %s\n", register_name, registers[register_index].command);
-    Command saved_cmd;
-    if (parse_command(registers[register_index].command, &saved_cmd) == 0)
-    {
-      execute_command(&saved_cmd);
-    }
   }
 
   return 0;
 }
 
-typedef struct
-{
-  char **commands;
-  int commandc;
-  int times;
-} RepeatCommand;
-
-#ifdef _WIN32
-DWORD WINAPI repeat_thread(LPVOID arg)
-#elif defined(__linux__)
-void *repeat_thread(void *arg)
-#endif
+// Whether the key, modifier or button argument i names is held, -1 if that
+// cannot be told, or -2 if it names none
+static int held_arg(const Command *cmd, int i)
 {
-  RepeatCommand *r_cmd = (RepeatCommand *)arg;
-  Command saved_cmd[r_cmd->commandc];
-  for (int i = 0; i < r_cmd->commandc; ++i)
+  if (arg_equals(cmd, i, "SHIFT"))
   {
-    if (parse_command(r_cmd->commands[i], &saved_cmd[i]) != 0)
-    {
-      quiet_printf("Invalid command in REPEAT command: %s\n", r_cmd->commands[i]);
-      free(r_cmd->commands);
-      free(r_cmd);
-      return -1;
-    }
+    return mirror_modifier_held(MIRROR_SHIFT);
   }
-
-  for (int i = 0; i < r_cmd->times; ++i)
+  if (arg_equals(cmd, i, "CTRL"))
+  {
+    return mirror_modifier_held(MIRROR_CTRL);
+  }
+  if (arg_equals(cmd, i, "ALT"))
+  {
+    return mirror_modifier_held(MIRROR_ALT);
+  }
+  if (ARG_LEN(cmd, i) > 6 && strncmp(ARG_PTR(cmd, i), "BUTTON", 6) == 0)
   {
-    for (int j = 0; j < r_cmd->commandc; ++j)
+    int button = 0;
+    for (int j = 6; j < ARG_LEN(cmd, i); ++j)
     {
-      execute_command(&saved_cmd[j]);
+      if (!isdigit((unsigned char)ARG_PTR(cmd, i)[j]) || button > 31)
+      {
+        return -2;
+      }
+      button = button * 10 + ARG_PTR(cmd, i)[j] - '0';
     }
+    return button < 32 ? mirror_button_held(button) : -2;
   }
-  free(r_cmd->commands);
-  free(r_cmd);
-  return 0;
+  return ARG_LEN(cmd, i) == 1 ? mirror_key_held(arg_char(cmd, i)) : -2;
 }
 
-int repeat_handler(const Command *cmd)
+static int recall_held(const Command *cmd, const char *name, bool when_held)
 {
   if (cmd->argc < 3)
   {
-    quiet_printf("Invalid number of arguments for the REPEAT command.\n");
+    quiet_printf("Invalid number of arguments for the %s command.\n", name);
     return -1;
   }
 
-  int times = atoi(cmd->args[1]);
-  if (times <= 0)
+  int held = held_arg(cmd, 1);
+  if (held == -2)
   {
-    quiet_printf("Invalid number of times for the REPEAT command.\n");
+    quiet_printf("Invalid key for the %s command.\n", name);
+    return -1;
+  }
+  if (held < 0)
+  {
+    quiet_printf("The %s command needs XInput2 and the xtest backend\n", name);
     return -1;
   }
 
-  RepeatCommand *repeatCommand = (RepeatCommand *)malloc(sizeof(RepeatCommand));
+  if (held == when_held)
+  {
+    for (int i = 2; i < cmd->argc; ++i)
+    {
+      char register_name = arg_char(cmd, i);
+      int register_index = cmd->args[i].reg;
+      if (register_index < 0)
+      {
+        quiet_printf("Invalid register name for the %s command.\n", name);
+        return -1;
+      }
 
-  repeatCommand->commandc = cmd->argc - 2;
-  repeatCommand->commands = (char **)malloc(sizeof(char *) * repeatCommand->commandc);
+      if (execute_register(register_index, register_name) != 0)
+      {
+        return -1;
+      }
+    }
+  }
 
-  for (int i = 2, j = 0; i < cmd->argc; ++i, ++j)
+  return 0;
+}
+
+int recallifheld_handler(const Command *cmd)
+{
+  return recall_held(cmd, "RECALLIFHELD", true);
+}
+
+int recallifnotheld_handler(const Command *cmd)
+{
+  return recall_held(cmd, "RECALLIFNOTHELD", false);
+}
+
+// Loops started while the event_loop option is on run as event loop tasks.
+// A task interprets its commands one at a time and keeps a stack of the
+// RECALLs it is inside of, so that a DELAY anywhere below the loop suspends
+// the task instead of blocking the loop thread.
+
+#define TASK_FRAMES 16
+#define TASK_BUDGET 64 // commands per turn, so one busy loop cannot hog the thread
+
+// A command that a task steps through between timer waits instead of
+// sleeping in it. step() does what is due and sets deadline to when it
+// wants to run again, or returns false once it is done. end() is called
+// once either way, with cancelled set if the task stopped first, and frees
+// the stepper.
+typedef struct Stepper Stepper;
+struct Stepper
+{
+  bool (*step)(Stepper *stepper, uint64_t *deadline);
+  void (*end)(Stepper *stepper, bool cancelled);
+};
+
+// Set while a task runs a command of its own, for the command to leave a
+// stepper in
+static _Thread_local Stepper **stepper_slot = NULL;
+
+// Returns false outside of a task, where the caller waits itself
+static bool defer_to_task(Stepper *stepper)
+{
+  if (stepper_slot == NULL)
+  {
+    return false;
+  }
+  *stepper_slot = stepper;
+  stepper_slot = NULL;
+  return true;
+}
+
+typedef struct
+{
+  const Command *cmd;
+  RegisterValue *value; // held, or NULL for the loop body
+  int next;             // next argument to recall
+  int end;
+} Frame;
+
+typedef struct
+{
+  RegisterValue **body;
+  int bodyc;
+  int position; // next body command
+  int times;    // REPEAT, 0 for WHILE and WHEN
+  int count;
+  int register_index; // WHILE and WHEN
+  unsigned int value_id;
+  char *value;
+  bool wait;
+  Frame frames[TASK_FRAMES];
+  int depth;
+  Pacer pacer;
+  bool paced;       // woken up from a PACE, which still has to be recorded
+  Stepper *stepper; // of the command the task is in, if it waits
+} LoopTask;
+
+static void pop_frame(LoopTask *task)
+{
+  Frame *frame = &task->frames[--task->depth];
+  if (frame->value != NULL)
+  {
+    unhold_register_value(frame->value);
+  }
+}
+
+// Works out which arguments a RECALL style command will recall. Commands
+// with invalid arguments are left to their handler, which only reports the
+// problem.
+static void push_frame(LoopTask *task, const Command *cmd, RegisterValue *value)
+{
+  int next = 0;
+  int end = 0;
+  if (cmd->handler == recall_handler && cmd->argc >= 2)
+  {
+    next = 1;
+    end = cmd->argc;
+  }
+  else if ((cmd->handler == recallif_handler || cmd->handler == recallifnot_handler) && cmd->argc >= 4 && cmd->args[1].reg >= 0)
+  {
+    int equal = compare_register(cmd->args[1].reg, ARG_PTR(cmd, 2), ARG_LEN(cmd, 2));
+    if (equal >= 0)
+    {
+      next = 3;
+      end = equal == (cmd->handler == recallif_handler) ? cmd->argc : 3;
+    }
+  }
+  else if ((cmd->handler == recallifheld_handler || cmd->handler == recallifnotheld_handler) && cmd->argc >= 3)
+  {
+    int held = held_arg(cmd, 1);
+    if (held >= 0)
+    {
+      next = 2;
+      end = held == (cmd->handler == recallifheld_handler) ? cmd->argc : 2;
+    }
+  }
+  else if (cmd->handler == recallifelse_handler && cmd->argc == 5 && cmd->args[1].reg >= 0)
+  {
+    int equal = compare_register(cmd->args[1].reg, ARG_PTR(cmd, 2), ARG_LEN(cmd, 2));
+    if (equal >= 0)
+    {
+      next = equal ? 3 : 4;
+      end = next + 1;
+    }
+  }
+
+  if (next == 0)
+  {
+    // Not a recall, or one that fails straight away
+    next = end = -1;
+  }
+  task->frames[task->depth++] = (Frame){cmd, value, next, end};
+}
+
+TaskResult run_loop_task(LoopTask *task, TaskWait *wait)
+{
+  if (task->paced)
+  {
+    pace_record(&task->pacer, monotonic_ns());
+    task->paced = false;
+  }
+
+  for (int budget = TASK_BUDGET; budget > 0; --budget)
   {
-    char register_name = cmd->args[i][0];
-    int register_index = get_register_index(register_name);
+    if (task->stepper != NULL)
+    {
+      if (task->stepper->step(task->stepper, &wait->deadline))
+      {
+        return TASK_SLEEP_UNTIL;
+      }
+      task->stepper->end(task->stepper, false);
+      task->stepper = NULL;
+    }
+
+    if (task->depth == 0)
+    {
+      if (task->position == task->bodyc)
+      {
+        task->position = 0;
+        task_iteration();
+        if (task->times > 0 && ++task->count == task->times)
+        {
+          return TASK_DONE;
+        }
+      }
+
+      if (task->value != NULL)
+      {
+        // Read the generation before testing the condition, so that a write
+        // in between wakes the task straight away
+        Register *reg = &registers[task->register_index];
+        unsigned int generation = atomic_load(&reg->generation);
+        if (!register_holds(reg, task->value_id))
+        {
+          task->position = 0;
+          if (!task->wait)
+          {
+            return TASK_DONE;
+          }
+          wait->word = &reg->generation;
+          wait->generation = generation;
+          wait->index = task->register_index;
+          return TASK_PARK;
+        }
+      }
+
+      push_frame(task, &task->body[task->position++]->compiled, NULL);
+      continue;
+    }
+
+    Frame *frame = &task->frames[task->depth - 1];
+    const Command *cmd = frame->cmd;
+    if (frame->next < 0)
+    {
+      pop_frame(task);
+      if (cmd->handler == delay_handler && cmd->argc == 2 && cmd->args[1].number >= 0)
+      {
+        wait->microseconds = cmd->args[1].number * 1000L;
+        return TASK_SLEEP;
+      }
+      uint64_t period;
+      if (cmd->handler == pace_handler && cmd->argc == 2 && parse_period(ARG_PTR(cmd, 1), ARG_LEN(cmd, 1), &period) == 0)
+      {
+        wait->deadline = pace_next(&task->pacer, period, monotonic_ns());
+        task->paced = true;
+        return TASK_SLEEP_UNTIL;
+      }
+      stepper_slot = &task->stepper;
+      execute_command(cmd);
+      stepper_slot = NULL;
+      continue;
+    }
+
+    if (frame->next == frame->end)
+    {
+      pop_frame(task);
+      continue;
+    }
+
+    char register_name = arg_char(cmd, frame->next);
+    int register_index = cmd->args[frame->next].reg;
+    frame->next++;
     if (register_index < 0)
     {
-      quiet_printf("Invalid register name for the REPEAT command.\n");
-      return -1;
+      quiet_printf("Invalid register name for the RECALL command.\n");
+      pop_frame(task);
+      continue;
     }
 
-    if (registers[register_index].command == NULL)
+    RegisterValue *value = hold_register_value(&registers[register_index]);
+    if (value == NULL)
     {
       quiet_printf("No command found in register '%c'\n", register_name);
-      return -1;
+      pop_frame(task);
+      continue;
     }
 
-    repeatCommand->times = times;
-    repeatCommand->commands[j] = strdup(registers[register_index].command);
+    quiet_printf("Recalling command in register '%c': %s\n", register_name, value->command);
+    if (!value->is_compiled)
+    {
+      unhold_register_value(value);
+    }
+    else if (task->depth == TASK_FRAMES)
+    {
+      // Too deep to suspend, so this one runs to completion
+      execute_command(&value->compiled);
+      unhold_register_value(value);
+    }
+    else
+    {
+      push_frame(task, &value->compiled, value);
+    }
   }
+  return TASK_YIELD;
+}
 
-#ifdef _WIN32
-  HANDLE new_thread;
-  new_thread = CreateThread(NULL, 0, repeat_thread, repeatCommand, 0, NULL);
-  if (new_thread == NULL)
+// Input from one turn is sent together when the task stops to wait
+TaskResult loop_task(void *arg, TaskWait *wait)
+{
+  // Frames cannot stay open while the task waits, so the registers a task
+  // is in are not part of its stacks
+  const char *name = task_name();
+  ProfileFrame frame;
+  profile_frame(&frame, name, strlen(name), true);
+  mkb_batch_begin();
+  TaskResult result = run_loop_task((LoopTask *)arg, wait);
+  mkb_batch_end();
+  profile_exit(&frame);
+  return result;
+}
+
+void release_loop_task(void *arg)
+{
+  LoopTask *task = (LoopTask *)arg;
+  if (task->stepper != NULL)
   {
-    fprintf(stderr, "Error creating thread\n");
-    return 1;
+    task->stepper->end(task->stepper, true);
   }
-  CloseHandle(new_thread);
-#elif defined(__linux__)
-  init_linux();
+  while (task->depth > 0)
+  {
+    pop_frame(task);
+  }
+  for (int i = 0; i < task->bodyc; ++i)
+  {
+    unhold_register_value(task->body[i]);
+  }
+  if (task->value != NULL)
+  {
+    release_string(task->value, strlen(task->value));
+    free(task->value);
+  }
+  free(task->body);
+  free(task);
+}
 
-  pthread_t thread;
-  int err = pthread_create(&thread, NULL, repeat_thread, repeatCommand);
-  if (err != 0)
+// Starts a task running the registers listed from cmd's argument first on.
+// Returns -1 if any of them is empty or does not parse.
+int start_loop_task(const Command *cmd, int first, const char *name, LoopTask *task)
+{
+  task->bodyc = cmd->argc - first;
+  task->body = (RegisterValue **)malloc(sizeof(RegisterValue *) * task->bodyc);
+  int held = 0;
+  bool valid = true;
+  for (int i = first; i < cmd->argc && valid; ++i)
+  {
+    char register_name = arg_char(cmd, i);
+    int register_index = cmd->args[i].reg;
+    if (register_index < 0)
+    {
+      quiet_printf("Invalid register name for the %s command.\n", name);
+      valid = false;
+      continue;
+    }
+
+    RegisterValue *value = hold_register_value(&registers[register_index]);
+    if (value == NULL)
+    {
+      quiet_printf("No command found in register '%c'\n", register_name);
+      valid = false;
+      continue;
+    }
+    task->body[held++] = value;
+    if (!value->is_compiled)
+    {
+      quiet_printf("Invalid command in %s command: %s\n", name, value->command);
+      valid = false;
+    }
+  }
+
+  unsigned int id = 0;
+  if (valid)
   {
-    fprintf(stderr, "Error creating thread\n");
-    return 1;
+    id = spawn_task(cmd->source, loop_task, release_loop_task, task);
+    if (id == 0)
+    {
+      quiet_printf("Could not start a task for the %s command.\n", name);
+    }
+  }
+  if (id == 0)
+  {
+    task->bodyc = held;
+    release_loop_task(task);
+    return -1;
   }
-  pthread_detach(thread);
-#endif
 
+  quiet_printf("Started job %u\n", id);
   return 0;
 }
 
+// PACE's schedule outside of event loop tasks. Each job starts a fresh one.
+_Thread_local Pacer thread_pacer;
+
 typedef struct
 {
   char **commands;
+  char *names; // the register each command was copied from
   int commandc;
-  char reg;
-  char *value;
-} WhileCommand;
+  int times;
+} RepeatCommand;
 
-#ifdef _WIN32
-DWORD WINAPI while_thread(LPVOID arg)
-#elif defined(__linux__)
-void *while_thread(void *arg)
-#endif
+// Frees a RepeatCommand whose first copied commands have been filled in
+static void free_repeat_command(RepeatCommand *r_cmd, int copied)
 {
-  WhileCommand *w_cmd = (WhileCommand *)arg;
-  Command *saved_cmds = malloc(sizeof(Command) * w_cmd->commandc);
-  for (int i = 0; i < w_cmd->commandc; ++i)
+  for (int i = 0; i < copied; ++i)
   {
-    if (parse_command(w_cmd->commands[i], &saved_cmds[i]) != 0)
+    free(r_cmd->commands[i]);
+  }
+  free(r_cmd->commands);
+  free(r_cmd->names);
+  free(r_cmd);
+}
+
+static void discard_repeat_command(void *arg)
+{
+  RepeatCommand *r_cmd = (RepeatCommand *)arg;
+  free_repeat_command(r_cmd, r_cmd->commandc);
+}
+
+void repeat_job(void *arg)
+{
+  RepeatCommand *r_cmd = (RepeatCommand *)arg;
+  thread_pacer = (Pacer){0};
+  Command saved_cmd[r_cmd->commandc];
+  int parsed = r_cmd->commandc;
+  for (int i = 0; i < r_cmd->commandc; ++i)
+  {
+    if (parse_command(r_cmd->commands[i], &saved_cmd[i]) != 0)
     {
-      free(saved_cmds);
-      free(w_cmd->commands);
-      free(w_cmd->value);
-      free(w_cmd);
-      return -1;
+      quiet_printf("Invalid command in REPEAT command: %s\n", r_cmd->commands[i]);
+      r_cmd->times = 0;
+      parsed = i;
+      break;
     }
   }
 
-  free(w_cmd->commands);
-  int register_index = get_register_index(w_cmd->reg);
-  for (;;)
+  const char *name = job_name();
+  ProfileFrame job_frame;
+  profile_frame(&job_frame, name, strlen(name), true);
+
+  // Input is sent once per iteration, or before a DELAY or PACE
+  mkb_batch_begin();
+  for (int i = 0; i < r_cmd->times && job_iteration(); ++i)
   {
-    for (int i = 0; i < w_cmd->commandc; ++i)
+    for (int j = 0; j < r_cmd->commandc && !job_cancelled(); ++j)
     {
-      if (registers[register_index].command == NULL || strcmp(registers[register_index].command, w_cmd->value) != 0)
-      {
-        break;
-      }
-      execute_command(&saved_cmds[i]);
+      ProfileFrame frame;
+      profile_frame(&frame, &r_cmd->names[j], 1, true);
+      execute_command(&saved_cmd[j]);
+      profile_exit(&frame);
     }
+    mkb_flush();
   }
-  free(saved_cmds);
-  free(w_cmd->value);
-  free(w_cmd);
-  return 0;
+  mkb_batch_end();
+  profile_exit(&job_frame);
+
+  // The parsed commands point into the copied register text, so it can only
+  // be released once they are done with
+  for (int i = 0; i < parsed; ++i)
+  {
+    free_command(&saved_cmd[i]);
+  }
+  free_repeat_command(r_cmd, r_cmd->commandc);
 }
 
-int while_handler(const Command *cmd)
+int repeat_handler(const Command *cmd)
 {
-  if (cmd->argc < 4)
+  if (cmd->argc < 3)
+  {
+    quiet_printf("Invalid number of arguments for the REPEAT command.\n");
+    return -1;
+  }
+
+  int times = cmd->args[1].number;
+  if (times <= 0)
   {
-    quiet_printf("Invalid number of arguments for the WHILE command.\n");
+    quiet_printf("Invalid number of times for the REPEAT command.\n");
     return -1;
   }
 
-  WhileCommand *whileCommand = (WhileCommand *)malloc(sizeof(WhileCommand));
+  if (EVENT_LOOP_SUPPORTED && get_option_bool(OPT_EVENT_LOOP))
+  {
+    LoopTask *task = (LoopTask *)calloc(1, sizeof(LoopTask));
+    task->times = times;
+    return start_loop_task(cmd, 2, "REPEAT", task);
+  }
 
-  whileCommand->commandc = cmd->argc - 3;
-  whileCommand->commands = (char **)malloc(sizeof(char *) * whileCommand->commandc);
+  RepeatCommand *repeatCommand = (RepeatCommand *)malloc(sizeof(RepeatCommand));
 
-  whileCommand->reg = cmd->args[1][0];
-  whileCommand->value = strdup(cmd->args[2]);
+  repeatCommand->commandc = cmd->argc - 2;
+  repeatCommand->commands = (char **)malloc(sizeof(char *) * repeatCommand->commandc);
+  repeatCommand->names = (char *)malloc(repeatCommand->commandc);
 
-  for (int i = 3, j = 0; i < cmd->argc; ++i, ++j)
+  for (int i = 2, j = 0; i < cmd->argc; ++i, ++j)
   {
-    char register_name = cmd->args[i][0];
-    int register_index = get_register_index(register_name);
+    char register_name = arg_char(cmd, i);
+    int register_index = cmd->args[i].reg;
     if (register_index < 0)
     {
-      quiet_printf("Invalid register name for the WHILE command.\n");
-      free(whileCommand->commands);
-      free(whileCommand);
+      quiet_printf("Invalid register name for the REPEAT command.\n");
+      free_repeat_command(repeatCommand, j);
       return -1;
     }
 
-    if (registers[register_index].command == NULL)
+    epoch_enter();
+    RegisterValue *value = load_register(&registers[register_index]);
+    if (value == NULL)
     {
+      epoch_exit();
       quiet_printf("No command found in register '%c'\n", register_name);
-      free(whileCommand->commands);
-      free(whileCommand);
+      free_repeat_command(repeatCommand, j);
       return -1;
     }
 
-    whileCommand->commands[j] = strdup(registers[register_index].command);
+    repeatCommand->times = times;
+    repeatCommand->commands[j] = strdup(value->command);
+    repeatCommand->names[j] = register_name;
+    epoch_exit();
+  }
+
+  unsigned int id = spawn_job(cmd->source, repeat_job, discard_repeat_command, repeatCommand);
+  if (id == 0)
+  {
+    quiet_printf("Too many jobs to start the REPEAT command.\n");
+    free_repeat_command(repeatCommand, repeatCommand->commandc);
+    return -1;
+  }
+
+  quiet_printf("Started job %u\n", id);
+  return 0;
+}
+
+typedef struct
+{
+  char **commands;
+  char *names; // the register each command was copied from
+  int commandc;
+  int register_index;
+  char *value;
+  bool wait; // WHEN: park until the register is written instead of exiting
+} WhileCommand;
+
+// Frees a WhileCommand whose first copied commands have been filled in
+static void free_while_command(WhileCommand *w_cmd, int copied)
+{
+  for (int i = 0; i < copied; ++i)
+  {
+    free(w_cmd->commands[i]);
+  }
+  free(w_cmd->commands);
+  free(w_cmd->names);
+  free(w_cmd->value);
+  free(w_cmd);
+}
+
+static void discard_while_command(void *arg)
+{
+  WhileCommand *w_cmd = (WhileCommand *)arg;
+  free_while_command(w_cmd, w_cmd->commandc);
+}
+
+void while_job(void *arg)
+{
+  WhileCommand *w_cmd = (WhileCommand *)arg;
+  thread_pacer = (Pacer){0};
+  Command *saved_cmds = malloc(sizeof(Command) * w_cmd->commandc);
+  for (int i = 0; i < w_cmd->commandc; ++i)
+  {
+    if (parse_command(w_cmd->commands[i], &saved_cmds[i]) != 0)
+    {
+      for (int j = 0; j < i; ++j)
+      {
+        free_command(&saved_cmds[j]);
+      }
+      free(saved_cmds);
+      free_while_command(w_cmd, w_cmd->commandc);
+      return;
+    }
+  }
+
+  Register *reg = &registers[w_cmd->register_index];
+  size_t value_length = strlen(w_cmd->value);
+  unsigned int value_id = intern_string(w_cmd->value, value_length);
+  const char *name = job_name();
+  ProfileFrame job_frame;
+  profile_frame(&job_frame, name, strlen(name), true);
+
+  bool running = true;
+  mkb_batch_begin();
+  while (running && job_iteration())
+  {
+    mkb_flush();
+    // Read the generation before testing the condition, so that a write in
+    // between makes wait_register return straight away
+    unsigned int generation = atomic_load(&reg->generation);
+    if (!register_holds(reg, value_id))
+    {
+      if (!w_cmd->wait)
+      {
+        break;
+      }
+      wait_register(reg, generation);
+      continue;
+    }
+
+    for (int i = 0; i < w_cmd->commandc && !job_cancelled(); ++i)
+    {
+      if (!register_holds(reg, value_id))
+      {
+        running = w_cmd->wait;
+        break;
+      }
+      ProfileFrame frame;
+      profile_frame(&frame, &w_cmd->names[i], 1, true);
+      execute_command(&saved_cmds[i]);
+      profile_exit(&frame);
+    }
+  }
+  mkb_batch_end();
+  profile_exit(&job_frame);
+  release_string(w_cmd->value, value_length);
+
+  for (int i = 0; i < w_cmd->commandc; ++i)
+  {
+    free_command(&saved_cmds[i]);
+  }
+  free(saved_cmds);
+  free_while_command(w_cmd, w_cmd->commandc);
+}
+
+int start_while(const Command *cmd, const char *name, bool wait)
+{
+  if (cmd->argc < 4)
+  {
+    quiet_printf("Invalid number of arguments for the %s command.\n", name);
+    return -1;
+  }
+
+  if (cmd->args[1].reg < 0)
+  {
+    quiet_printf("Invalid register name for the %s command.\n", name);
+    return -1;
+  }
+
+  if (EVENT_LOOP_SUPPORTED && get_option_bool(OPT_EVENT_LOOP))
+  {
+    LoopTask *task = (LoopTask *)calloc(1, sizeof(LoopTask));
+    task->register_index = cmd->args[1].reg;
+    task->value = arg_dup(cmd, 2);
+    task->value_id = intern_string(task->value, ARG_LEN(cmd, 2));
+    task->wait = wait;
+    return start_loop_task(cmd, 3, name, task);
+  }
+
+  WhileCommand *whileCommand = (WhileCommand *)malloc(sizeof(WhileCommand));
+
+  whileCommand->commandc = cmd->argc - 3;
+  whileCommand->commands = (char **)malloc(sizeof(char *) * whileCommand->commandc);
+  whileCommand->names = (char *)malloc(whileCommand->commandc);
+
+  whileCommand->register_index = cmd->args[1].reg;
+  whileCommand->value = arg_dup(cmd, 2);
+  whileCommand->wait = wait;
+
+  for (int i = 3, j = 0; i < cmd->argc; ++i, ++j)
+  {
+    char register_name = arg_char(cmd, i);
+    int register_index = cmd->args[i].reg;
+    if (register_index < 0)
+    {
+      quiet_printf("Invalid register name for the %s command.\n", name);
+      free_while_command(whileCommand, j);
+      return -1;
+    }
+
+    epoch_enter();
+    RegisterValue *value = load_register(&registers[register_index]);
+    if (value == NULL)
+    {
+      epoch_exit();
+      quiet_printf("No command found in register '%c'\n", register_name);
+      free_while_command(whileCommand, j);
+      return -1;
+    }
+
+    whileCommand->commands[j] = strdup(value->command);
+    whileCommand->names[j] = register_name;
+    epoch_exit();
+  }
+
+  unsigned int id = spawn_job(cmd->source, while_job, discard_while_command, whileCommand);
+  if (id == 0)
+  {
+    quiet_printf("Too many jobs to start the %s command.\n", name);
+    free_while_command(whileCommand, whileCommand->commandc);
+    return -1;
+  }
+
+  quiet_printf("Started job %u\n", id);
+  return 0;
+}
+
+int while_handler(const Command *cmd)
+{
+  return start_while(cmd, "WHILE", false);
+}
+
+int when_handler(const Command *cmd)
+{
+  return start_while(cmd, "WHEN", true);
+}
+
+int jobs_handler(const Command *cmd)
+{
+  if (cmd->argc != 1)
+  {
+    quiet_printf("Invalid number of arguments for the JOBS command.\n");
+    return -1;
+  }
+
+  JobInfo infos[JOB_SLOTS];
+  int count = list_jobs(infos, JOB_SLOTS);
+  for (int i = 0; i < count; ++i)
+  {
+    output_printf("%u %s %lu iterations %.1f ms CPU - %s\n", infos[i].id, infos[i].running ? "running" : "queued", infos[i].iterations, infos[i].cpu_ms, infos[i].name);
+  }
+
+  EventLoopStats stats;
+  event_loop_stats(&stats);
+  if (stats.tasks == 0 && stats.wakeups == 0)
+  {
+    return 0;
+  }
+
+  JobInfo *task_infos = malloc(sizeof(JobInfo) * stats.tasks);
+  count = list_tasks(task_infos, stats.tasks);
+  for (int i = 0; i < count; ++i)
+  {
+    output_printf("%u task %lu iterations %.1f ms - %s\n", task_infos[i].id, task_infos[i].iterations, task_infos[i].cpu_ms, task_infos[i].name);
+  }
+  free(task_infos);
+  output_printf("Event loop: %d tasks, %d sleeping, %d parked, %lu wake-ups, lateness p50 %.0f us p99 %.0f us max %.0f us\n", stats.tasks, stats.sleeping, stats.parked, stats.wakeups, stats.lateness_p50_us, stats.lateness_p99_us, stats.lateness_max_us);
+  return 0;
+}
+
+int cancel_handler(const Command *cmd)
+{
+  if (cmd->argc == 1)
+  {
+    int count = cancel_all_jobs() + cancel_all_tasks();
+    wake_registers();
+    quiet_printf("Cancelled %d job(s)\n", count);
+    return 0;
+  }
+
+  for (int i = 1; i < cmd->argc; ++i)
+  {
+    if (!cancel_job(cmd->args[i].number) && !cancel_task(cmd->args[i].number))
+    {
+      quiet_printf("No job with ID %.*s\n", ARG_LEN(cmd, i), ARG_PTR(cmd, i));
+    }
+  }
+  wake_registers();
+  return 0;
+}
+
+int opt_handler(const Command *cmd)
+{
+  if (cmd->argc > 3)
+  {
+    quiet_printf("Invalid number of arguments for the OPT command.\n");
+    return -1;
+  }
+
+  char value[256];
+
+  if (cmd->argc == 1)
+  {
+    for (int i = 0; i < OPTCOUNT; ++i)
+    {
+      format_option(i, value, sizeof(value));
+      output_printf("%s = %s\n", option_definitions[i].key, value);
+    }
+    return 0;
+  }
+
+  int index = find_option(ARG_PTR(cmd, 1), ARG_LEN(cmd, 1));
+  if (index < 0)
+  {
+    quiet_printf("Option %.*s not found\n", ARG_LEN(cmd, 1), ARG_PTR(cmd, 1));
+    return -1;
+  }
+
+  if (cmd->argc == 2)
+  {
+    format_option(index, value, sizeof(value));
+    output_printf("%s = %s\n", option_definitions[index].key, value);
+  }
+  else if (cmd->argc == 3)
+  {
+    // A loop task cannot keep the frames of its registers open while it
+    // waits, so its profile would be missing them
+    int other = index == OPT_PROFILE ? OPT_EVENT_LOOP : index == OPT_EVENT_LOOP ? OPT_PROFILE : -1;
+    if (EVENT_LOOP_SUPPORTED && other >= 0 && get_option_bool(other) && arg_equals(cmd, 2, "true"))
+    {
+      quiet_printf("The profile and event_loop options cannot both be on.\n");
+      return -1;
+    }
+
+    journal_begin();
+    if (set_option(index, ARG_PTR(cmd, 2), ARG_LEN(cmd, 2)) != 0)
+    {
+      journal_end();
+      quiet_printf("Invalid value %.*s for option %s\n", ARG_LEN(cmd, 2), ARG_PTR(cmd, 2), option_definitions[index].key);
+      return -1;
+    }
+    format_option(index, value, sizeof(value));
+    if (index != OPT_JOURNAL)
+    {
+      journal_append("! %s %s", option_definitions[index].key, value);
+    }
+    journal_end();
+
+    if (index == OPT_JOURNAL)
+    {
+      char path[4096];
+      format_option(OPT_JOURNAL, path, sizeof(path));
+      if (journal_open(path) != 0)
+      {
+        quiet_printf("Failed to open journal %s\n", value);
+        set_option(OPT_JOURNAL, "", 0);
+        return -1;
+      }
+    }
+    quiet_printf("Option %s set to %s\n", option_definitions[index].key, value);
+  }
+
+  return 0;
+}
+
+// Writes the options, registers and hotkeys as the commands that set them,
+// one per line. Returns -1 if the output fails.
+int write_state(FILE *fp, bool snapshot)
+{
+  char value[256];
+  for (int i = 0; i < OPTCOUNT; ++i)
+  {
+    // The journal's own snapshot would open the journal again
+    if (snapshot && i == OPT_JOURNAL)
+    {
+      continue;
+    }
+    format_option(i, value, sizeof(value));
+    fprintf(fp, "! %s %s\n", option_definitions[i].key, value);
+  }
+
+  epoch_enter();
+  for (int i = 0; i < REGISTERCOUNT; ++i)
+  {
+    RegisterValue *value = load_register(&registers[i]);
+    if (value != NULL)
+    {
+      fprintf(fp, "@ %c %s\n", registers[i].register_name, value->command);
+    }
+  }
+
+  for (int i = 0; i < HOTKEYCOUNT; ++i)
+  {
+    RegisterValue *value = load_register(&hotkeys[i]);
+    if (value != NULL)
+    {
+      fprintf(fp, "& %c %s\n", hotkeys[i].register_name, value->command);
+    }
+  }
+  epoch_exit();
+
+  return ferror(fp) ? -1 : 0;
+}
+
+// Applies a line written by write_state() or journaled by a handler directly,
+// so that restoring the journal neither prints feedback nor is journaled
+// again. Anything else is ignored.
+void restore_state(const char *line, size_t length)
+{
+  if (length < 4 || line[1] != ' ')
+  {
+    return;
+  }
+
+  if (line[0] == '!')
+  {
+    const char *space = memchr(line + 2, ' ', length - 2);
+    int index = space != NULL ? find_option(line + 2, space - line - 2) : -1;
+    if (index >= 0 && index != OPT_JOURNAL)
+    {
+      set_option(index, space + 1, line + length - space - 1);
+    }
+    return;
+  }
+
+  Register *reg = NULL;
+  if (line[0] == '@' && get_register_index(line[2]) != -1)
+  {
+    reg = &registers[get_register_index(line[2])];
+  }
+  else if (line[0] == '&' && get_hotkey_index(line[2]) != -1)
+  {
+    reg = &hotkeys[get_hotkey_index(line[2])];
+  }
+  if (reg == NULL || line[3] != ' ')
+  {
+    return;
+  }
+  char *command = strndup(line + 4, length - 4);
+  set_register(reg, command);
+  free(command);
+}
+
+int save_handler(const Command *cmd)
+{
+  if (cmd->argc > 3)
+  {
+    quiet_printf("Invalid number of arguments for the SAVE command.\n");
+    return -1;
+  }
+
+  // With the journal on, the state is already on its way to disk
+  if (cmd->argc == 1 && journal_save() == 0)
+  {
+    return 0;
+  }
+
+  char *filename;
+
+  if (cmd->argc == 1)
+  {
+    filename = strdup(DOTFILE);
+  }
+  else
+  {
+    filename = arg_dup(cmd, 1);
+  }
+
+  if (save_state(filename, false) != 0)
+  {
+    quiet_printf("Failed to save to file %s\n", filename);
+    free(filename);
+    return -1;
+  }
+
+  free(filename);
+
+  return 0;
+}
+
+void execute_file(char *filename)
+{
+  Script script;
+  if (script_load(filename, get_option_bool(OPT_SCRIPT_CACHE), &script) != 0)
+  {
+    quiet_printf("Failed to open file %s\n", filename);
+    return;
+  }
+
+  // The whole script is parsed before the first command runs, so a SAVE
+  // over the script does not change what is left of it
+  for (uint32_t i = 0; i < script.count; ++i)
+  {
+    Command cmd;
+    script_command(&script, i, &cmd);
+    execute_command(&cmd);
+    free_command(&cmd);
+  }
+  script_free(&script);
+}
+
+int load_handler(const Command *cmd)
+{
+  if (cmd->argc > 3)
+  {
+    quiet_printf("Invalid number of arguments for the LOAD command.\n");
+    return -1;
+  }
+
+  char *filename;
+
+  if (cmd->argc == 1)
+  {
+    filename = strdup(DOTFILE);
+  }
+  else
+  {
+    filename = arg_dup(cmd, 1);
+  }
+
+  execute_file(filename);
+  free(filename);
+
+  return 0;
+}
+
+static int arg_float(const Command *cmd, int i, float *value)
+{
+  char buf[32];
+  if (ARG_LEN(cmd, i) <= 0 || ARG_LEN(cmd, i) >= (int)sizeof(buf))
+  {
+    return -1;
+  }
+  memcpy(buf, ARG_PTR(cmd, i), ARG_LEN(cmd, i));
+  buf[ARG_LEN(cmd, i)] = '\0';
+  char *end;
+  *value = strtof(buf, &end);
+  return end != buf && *end == '\0' ? 0 : -1;
+}
+
+// Reads the <duration> [LINEAR | EASE | BEZIER ...] that MOVE, MOVE_BY and
+// DRAG end in, from argument first on, into a path whose ends are set.
+// Control points are relative to origin. One control point makes a
+// quadratic curve.
+static int parse_motion(const Command *cmd, int first, float origin_x, float origin_y, MotionPath *path, uint64_t *duration)
+{
+  if (parse_period(ARG_PTR(cmd, first), ARG_LEN(cmd, first), duration) != 0 || *duration > MOTION_MAX_SECONDS * 1000000000ULL)
+  {
+    return -1;
+  }
+
+  path->kind = PATH_LINEAR;
+  if (cmd->argc == first + 1 || (cmd->argc == first + 2 && arg_equals(cmd, first + 1, "LINEAR")))
+  {
+    return 0;
+  }
+  if (cmd->argc == first + 2 && arg_equals(cmd, first + 1, "EASE"))
+  {
+    path->kind = PATH_EASE;
+    return 0;
+  }
+  float c[4];
+  int controls = cmd->argc - first - 2;
+  if (!arg_equals(cmd, first + 1, "BEZIER") || (controls != 2 && controls != 4))
+  {
+    return -1;
+  }
+  for (int i = 0; i < controls; ++i)
+  {
+    if (arg_float(cmd, first + 2 + i, &c[i]) != 0)
+    {
+      return -1;
+    }
+    c[i] += i % 2 == 0 ? origin_x : origin_y;
+  }
+
+  path->kind = PATH_BEZIER;
+  if (controls == 4)
+  {
+    path->cx0 = c[0];
+    path->cy0 = c[1];
+    path->cx1 = c[2];
+    path->cy1 = c[3];
+  }
+  else
+  {
+    path->cx0 = path->x0 + (c[0] - path->x0) * 2 / 3;
+    path->cy0 = path->y0 + (c[1] - path->y0) * 2 / 3;
+    path->cx1 = path->x1 + (c[0] - path->x1) * 2 / 3;
+    path->cy1 = path->y1 + (c[1] - path->y1) * 2 / 3;
+  }
+  return 0;
+}
+
+// Reads the [MONITOR <n>] <x> <y> at argument *i into screen pixels and
+// moves *i past it. Monitor 1 is the primary one. A coordinate with a
+// decimal point is proportional, from 0 to 1 across the monitor or the
+// screen, and the others are pixels from the monitor's corner. Plain
+// pixels do not look at the geometry at all.
+static int parse_position(const Command *cmd, int *i, int *x, int *y)
+{
+  int monitor = -1;
+  if (*i < cmd->argc && arg_equals(cmd, *i, "MONITOR"))
+  {
+    if (*i + 1 >= cmd->argc || cmd->args[*i + 1].number < 1)
+    {
+      return -1;
+    }
+    monitor = cmd->args[*i + 1].number - 1;
+    *i += 2;
+  }
+  if (*i + 2 > cmd->argc)
+  {
+    return -1;
+  }
+
+  bool proportional = memchr(ARG_PTR(cmd, *i), '.', ARG_LEN(cmd, *i)) != NULL || memchr(ARG_PTR(cmd, *i + 1), '.', ARG_LEN(cmd, *i + 1)) != NULL;
+  if (monitor < 0 && !proportional)
+  {
+    *x = cmd->args[*i].number;
+    *y = cmd->args[*i + 1].number;
+  }
+  else
+  {
+    float fx, fy;
+    if (arg_float(cmd, *i, &fx) != 0 || arg_float(cmd, *i + 1, &fy) != 0 || !mkb_resolve(monitor, proportional, fx, fy, x, y))
+    {
+      return -1;
+    }
+  }
+  *i += 2;
+  return 0;
+}
+
+typedef struct
+{
+  Stepper stepper;
+  Motion motion;
+  int button; // held for a DRAG, or -1
+} MotionStepper;
+
+static bool step_motion(Stepper *stepper, uint64_t *deadline)
+{
+  return motion_advance(&((MotionStepper *)stepper)->motion, deadline);
+}
+
+static void end_motion(Stepper *stepper, bool cancelled)
+{
+  MotionStepper *motion = (MotionStepper *)stepper;
+  if (motion->button >= 0)
+  {
+    mouseUp(motion->button);
+    mkb_flush();
+  }
+  free(motion);
+}
+
+// Moves along the path with the button held, unless it is -1. Inside a
+// task the task steps through the path instead, so that the loop thread is
+// not held up and the task can be cancelled on the way.
+static void run_motion(const MotionPath *path, uint64_t duration, int button)
+{
+  if (button >= 0)
+  {
+    mouseDown(button);
+  }
+  if (stepper_slot != NULL)
+  {
+    MotionStepper *motion = (MotionStepper *)malloc(sizeof(MotionStepper));
+    motion->stepper = (Stepper){step_motion, end_motion};
+    motion_begin(&motion->motion, path, duration, get_option_int(OPT_MOTION_RATE));
+    motion->button = button;
+    defer_to_task(&motion->stepper);
+    return;
+  }
+
+  // The button comes up even if the job is cancelled halfway
+  unsigned long moves;
+  motion_run(path, duration, get_option_int(OPT_MOTION_RATE), &moves);
+  if (button >= 0)
+  {
+    mouseUp(button);
+    mkb_flush();
+  }
+}
+
+int move_handler(const Command *cmd)
+{
+  if (cmd->argc == 2)
+  {
+    quiet_printf("Invalid number of arguments for the MOVE command.\n");
+    return -1;
+  }
+
+  if (get_option_bool(OPT_ENABLE_LAST_LOCATION_REGISTER))
+  {
+    int index = get_register_index('L');
+    if (index != -1)
+    {
+      MousePos pos = getMousePos();
+      char command[32];
+      snprintf(command, sizeof(command), "M %ld %ld", pos.x, pos.y);
+      set_register(&registers[index], command);
+    }
+  }
+
+  if (cmd->argc == 1)
+  {
+    return 0;
+  }
+
+  int i = 1;
+  int x, y;
+  if (parse_position(cmd, &i, &x, &y) != 0)
+  {
+    quiet_printf("Invalid coordinates or monitor for the MOVE command.\n");
+    return -1;
+  }
+
+  if (i == cmd->argc)
+  {
+    mouseMove(x, y);
+  }
+  else
+  {
+    MousePos pos = getMousePos();
+    MotionPath path = {.x0 = pos.x, .y0 = pos.y, .x1 = x, .y1 = y};
+    uint64_t duration;
+    if (parse_motion(cmd, i, 0, 0, &path, &duration) != 0)
+    {
+      quiet_printf("Invalid duration or path for the MOVE command.\n");
+      return -1;
+    }
+    run_motion(&path, duration, -1);
+  }
+
+  return 0;
+}
+
+int move_by_handler(const Command *cmd)
+{
+  if (cmd->argc < 3)
+  {
+    quiet_printf("Invalid number of arguments for the MOVE_BY command.\n");
+    return -1;
+  }
+
+  float dx, dy;
+  if (arg_float(cmd, 1, &dx) != 0 || arg_float(cmd, 2, &dy) != 0)
+  {
+    quiet_printf("Invalid distance for the MOVE_BY command.\n");
+    return -1;
+  }
+
+  MousePos pos = getMousePos();
+  MotionPath path = {.x0 = pos.x, .y0 = pos.y};
+  uint64_t duration;
+  if (cmd->argc > 3 && parse_motion(cmd, 3, pos.x, pos.y, &path, &duration) != 0)
+  {
+    quiet_printf("Invalid duration or path for the MOVE_BY command.\n");
+    return -1;
+  }
+  motion_end_by(&path, dx, dy);
+
+  if (cmd->argc == 3)
+  {
+    mouseMove((int)path.x1, (int)path.y1);
+  }
+  else
+  {
+    run_motion(&path, duration, -1);
+  }
+  return 0;
+}
+
+int drag_handler(const Command *cmd)
+{
+  if (cmd->argc < 5)
+  {
+    quiet_printf("Invalid number of arguments for the DRAG command.\n");
+    return -1;
+  }
+
+  int button = cmd->args[1].number;
+  if (button != 0 && button != 1 && button != 2)
+  {
+    quiet_printf("Invalid button number for the DRAG command.\n");
+    return -1;
+  }
+
+  int i = 2;
+  int x, y;
+  if (parse_position(cmd, &i, &x, &y) != 0 || i == cmd->argc)
+  {
+    quiet_printf("Invalid coordinates or monitor for the DRAG command.\n");
+    return -1;
+  }
+
+  MousePos pos = getMousePos();
+  MotionPath path = {.x0 = pos.x, .y0 = pos.y, .x1 = x, .y1 = y};
+  uint64_t duration;
+  if (parse_motion(cmd, i, 0, 0, &path, &duration) != 0)
+  {
+    quiet_printf("Invalid duration or path for the DRAG command.\n");
+    return -1;
+  }
+
+  run_motion(&path, duration, button);
+  return 0;
+}
+
+// Writes a register only if its value changes, so that loops waiting on it
+// do not wake up for nothing
+static void update_register(char register_name, const char *command)
+{
+  int index = get_register_index(register_name);
+  if (compare_register(index, command, strlen(command)) != 1)
+  {
+    set_register(&registers[index], command);
+  }
+}
+
+#ifdef _WIN32
+DWORD WINAPI stats_thread(LPVOID arg)
+#elif defined(__linux__)
+void *stats_thread(void *arg)
+#endif
+{
+  uint64_t deadline = monotonic_ns();
+  long ticks = 0;
+  for (;;)
+  {
+    stats_sample();
+
+    InputStat stats[STATCOUNT];
+    input_stats(stats);
+    if (get_option_bool(OPT_ENABLE_CPS_REGISTER))
+    {
+      char command[32];
+      snprintf(command, sizeof(command), "%.0f", stats[STAT_CLICKS].rate);
+      update_register('C', command);
+    }
+    if (get_option_bool(OPT_ENABLE_RATE_REGISTER))
+    {
+      char command[128];
+      snprintf(command, sizeof(command), "%.0f %.0f %.0f %.0f %.0f %.0f", stats[STAT_CLICKS].rate, stats[STAT_KEYS].rate, stats[STAT_MOVES].rate, stats[STAT_CLICKS].interval_p50_us, stats[STAT_CLICKS].interval_p99_us, stats[STAT_CLICKS].interval_max_us);
+      update_register('R', command);
+    }
+
+    char metrics_file[4096];
+    format_option(OPT_METRICS_FILE, metrics_file, sizeof(metrics_file));
+    long interval = get_option_int(OPT_METRICS_INTERVAL);
+    if (metrics_file[0] != '\0' && interval > 0 && ++ticks >= interval * STAT_SAMPLES_PER_SECOND)
+    {
+      ticks = 0;
+      if (metrics_write_file(metrics_file) != 0)
+      {
+        quiet_printf("Failed to write metrics to %s\n", metrics_file);
+      }
+    }
+
+    deadline += 1000000000 / STAT_SAMPLES_PER_SECOND;
+    job_sleep_until(deadline);
+  }
+  return 0;
+}
+
+int metrics_handler(const Command *cmd)
+{
+  if (cmd->argc > 2)
+  {
+    quiet_printf("Invalid number of arguments for the METRICS command.\n");
+    return -1;
+  }
+  if (!METRICS_ENABLED)
+  {
+    quiet_printf("Metrics are compiled out.\n");
+    return -1;
+  }
+
+  if (cmd->argc == 1)
+  {
+    output_flush();
+    metrics_write(stdout);
+    fflush(stdout);
+    return 0;
+  }
+
+  char *filename = arg_dup(cmd, 1);
+  int result = metrics_write_file(filename);
+  if (result != 0)
+  {
+    quiet_printf("Failed to write metrics to %s\n", filename);
+  }
+  else
+  {
+    quiet_printf("Wrote metrics to %s\n", filename);
+  }
+  free(filename);
+  return result;
+}
+
+int profile_handler(const Command *cmd)
+{
+  if (cmd->argc > 3 || (cmd->argc == 3 && !arg_equals(cmd, 2, "WALL") && !arg_equals(cmd, 2, "CPU")))
+  {
+    quiet_printf("Invalid number of arguments for the PROFILE command.\n");
+    return -1;
+  }
+
+  if (cmd->argc == 1)
+  {
+    output_flush();
+    profile_write_summary(stdout);
+    fflush(stdout);
+    return 0;
+  }
+  if (cmd->argc == 2 && arg_equals(cmd, 1, "RESET"))
+  {
+    profile_reset();
+    quiet_printf("Profile reset\n");
+    return 0;
+  }
+
+  char *filename = arg_dup(cmd, 1);
+  FILE *fp = fopen(filename, "w");
+  int result = -1;
+  if (fp != NULL)
+  {
+    result = profile_write_folded(fp, cmd->argc == 3 && arg_equals(cmd, 2, "CPU"));
+    if (fclose(fp) != 0)
+    {
+      result = -1;
+    }
+  }
+  if (result != 0)
+  {
+    quiet_printf("Failed to write profile to %s\n", filename);
+  }
+  else
+  {
+    quiet_printf("Wrote profile to %s\n", filename);
+  }
+  free(filename);
+  return result;
+}
+
+int pixel_handler(const Command *cmd)
+{
+  int i = 2;
+  int x, y;
+  if (cmd->argc < 4 || cmd->args[1].reg < 0 || parse_position(cmd, &i, &x, &y) != 0 || i != cmd->argc)
+  {
+    quiet_printf("Invalid arguments for the PIXEL command.\n");
+    return -1;
+  }
+
+  uint32_t color;
+  if (pixel_read(x, y, &color) != 0)
+  {
+    quiet_printf("Cannot read the pixel at %d %d, which needs the xtest backend and a point on the screen\n", x, y);
+    return -1;
+  }
+  char value[8];
+  snprintf(value, sizeof(value), "%06x", (unsigned int)color);
+  set_register(&registers[cmd->args[1].reg], value);
+  return 0;
+}
+
+static void unreadable_color(const PixelSearch *search)
+{
+  quiet_printf("Cannot read the screen at %d %d, which needs the xtest backend and a rectangle on the screen\n", search->x, search->y);
+}
+
+// Recalling the register moves to the match
+static void found_color(int register_index, const PixelMatch *match)
+{
+  char value[32];
+  if (match->found)
+  {
+    snprintf(value, sizeof(value), "M %d %d", match->x, match->y);
+  }
+  else
+  {
+    snprintf(value, sizeof(value), ".");
+  }
+  set_register(&registers[register_index], value);
+}
+
+// A FIND_COLOR with a timeout inside a task looks once a turn
+typedef struct
+{
+  Stepper stepper;
+  PixelSearch search;
+  uint64_t start;
+  PixelMatch match;
+  int register_index;
+} ColorStepper;
+
+static bool step_color(Stepper *stepper, uint64_t *deadline)
+{
+  ColorStepper *color = (ColorStepper *)stepper;
+  int result = pixel_poll(&color->search, color->start, &color->match, deadline);
+  if (result < 0)
+  {
+    unreadable_color(&color->search);
+    color->register_index = -1;
+  }
+  return result == 1;
+}
+
+static void end_color(Stepper *stepper, bool cancelled)
+{
+  ColorStepper *color = (ColorStepper *)stepper;
+  if (!cancelled && color->register_index >= 0)
+  {
+    found_color(color->register_index, &color->match);
+  }
+  free(color);
+}
+
+int find_color_handler(const Command *cmd)
+{
+  PixelSearch search = {.rate = get_option_int(OPT_PIXEL_RATE)};
+  char *color = cmd->argc > 2 ? arg_dup(cmd, 2) : NULL;
+  // strtoul() alone would take a sign or a 0x in front
+  bool valid = color != NULL && ARG_LEN(cmd, 2) == 6;
+  for (int i = 0; valid && i < 6; ++i)
+  {
+    valid = isxdigit((unsigned char)color[i]);
+  }
+  if (valid)
+  {
+    search.color = strtoul(color, NULL, 16);
+  }
+  free(color);
+
+  int i = 4;
+  if (!valid || cmd->argc < 8 || cmd->args[1].reg < 0 || cmd->args[3].number < 0 || cmd->args[3].number > 255 ||
+      parse_position(cmd, &i, &search.x, &search.y) != 0 || i + 2 > cmd->argc || i + 3 < cmd->argc ||
+      cmd->args[i].number < 1 || cmd->args[i + 1].number < 1)
+  {
+    quiet_printf("Invalid arguments for the FIND_COLOR command.\n");
+    return -1;
+  }
+  search.tolerance = cmd->args[3].number;
+  search.width = cmd->args[i].number;
+  search.height = cmd->args[i + 1].number;
+  if (i + 3 == cmd->argc && parse_period(ARG_PTR(cmd, i + 2), ARG_LEN(cmd, i + 2), &search.timeout) != 0)
+  {
+    quiet_printf("Invalid timeout for the FIND_COLOR command.\n");
+    return -1;
+  }
+
+  if (search.timeout > 0 && stepper_slot != NULL)
+  {
+    ColorStepper *color = (ColorStepper *)malloc(sizeof(ColorStepper));
+    color->stepper = (Stepper){step_color, end_color};
+    color->search = search;
+    color->start = monotonic_ns();
+    color->match = (PixelMatch){0};
+    color->register_index = cmd->args[1].reg;
+    defer_to_task(&color->stepper);
+    return 0;
+  }
+
+  PixelMatch match;
+  if (pixel_search(&search, &match) != 0)
+  {
+    unreadable_color(&search);
+    return -1;
+  }
+  found_color(cmd->args[1].reg, &match);
+  return 0;
+}
+
+int find_image_handler(const Command *cmd)
+{
+  int i = 4;
+  GrayImage image;
+  float threshold = TEMPLATE_THRESHOLD;
+  if (cmd->argc < 8 || cmd->args[1].reg < 0 || cmd->args[2].reg < 0 || parse_position(cmd, &i, &image.x, &image.y) != 0 ||
+      i + 2 > cmd->argc || i + 3 < cmd->argc || cmd->args[i].number < 1 || cmd->args[i + 1].number < 1 ||
+      (i + 3 == cmd->argc && (arg_float(cmd, i + 2, &threshold) != 0 || threshold < -1 || threshold > 1)))
+  {
+    quiet_printf("Invalid arguments for the FIND_IMAGE command.\n");
+    return -1;
+  }
+
+  // Held, so that a template replaced in the cache meanwhile stays valid
+  char *filename = arg_dup(cmd, 3);
+  Template *template = template_load(filename);
+  if (template == NULL)
+  {
+    quiet_printf("Cannot load %s, which needs to be a binary PPM or PGM with 8 bits a channel and more than one color\n", filename);
+    free(filename);
+    return -1;
   }
-
-#ifdef _WIN32
-  HANDLE new_thread;
-  new_thread = CreateThread(NULL, 0, while_thread, whileCommand, 0, NULL);
-  if (new_thread == NULL)
+  free(filename);
+  int x = image.x, y = image.y;
+  if (pixel_grab_gray(x, y, cmd->args[i].number, cmd->args[i + 1].number, &image) != 0)
   {
-    fprintf(stderr, "Error creating thread\n");
-    return 1;
+    template_release(template);
+    quiet_printf("Cannot read the screen at %d %d, which needs the xtest backend and a rectangle on the screen\n", x, y);
+    return -1;
   }
-  CloseHandle(new_thread);
-#elif defined(__linux__)
-  init_linux();
 
-  pthread_t thread;
-  int err = pthread_create(&thread, NULL, while_thread, whileCommand);
-  if (err != 0)
+  TemplateMatch match;
+  template_find(template, &image, &match);
+  int width, height;
+  template_size(template, &width, &height);
+  template_release(template);
+  free(image.pixels);
+  // Recalling the register moves to the middle of the match
+  char value[32];
+  if (match.found && match.score >= threshold)
   {
-    fprintf(stderr, "Error creating thread\n");
-    return 1;
+    snprintf(value, sizeof(value), "M %d %d", image.x + match.x + width / 2, image.y + match.y + height / 2);
   }
-  pthread_detach(thread);
-#endif
+  else
+  {
+    snprintf(value, sizeof(value), ".");
+  }
+  set_register(&registers[cmd->args[1].reg], value);
+  snprintf(value, sizeof(value), "%.3f", match.found ? match.score : 0);
+  set_register(&registers[cmd->args[2].reg], value);
   return 0;
 }
 
-int opt_handler(const Command *cmd)
+int capture_handler(const Command *cmd)
 {
-  if (cmd->argc > 3)
+  if (cmd->argc > 2)
   {
-    quiet_printf("Invalid number of arguments for the OPT command.\n");
+    quiet_printf("Invalid number of arguments for the CAPTURE command.\n");
     return -1;
   }
 
+  CaptureStats stats;
   if (cmd->argc == 1)
   {
-    for (int i = 0; i < sizeof(options) / sizeof(options[0]); ++i)
+    if (!capture_stats(&stats))
     {
-      printf("%s = %s\n", options[i].key, options[i].value);
+      output_printf("Not capturing\n");
+      return 0;
     }
+    output_printf("Captured %lu events in %.1f s, %llu bytes, %lu dropped\n", stats.events, stats.seconds, (unsigned long long)stats.bytes, stats.dropped);
+    return 0;
   }
-  else if (cmd->argc == 2)
+
+  if (arg_equals(cmd, 1, "STOP"))
   {
-    char *value;
-    get_option_value(cmd->args[1], &value);
-    if (strcmp(value, "Option not found") == 0)
+    if (capture_stop(&stats) != 0)
     {
-      quiet_printf("Option %s not found\n", cmd->args[1]);
+      quiet_printf("Not capturing\n");
       return -1;
     }
-    printf("%s = %s\n", cmd->args[1], value);
-    free(value);
+    quiet_printf("Captured %lu events in %.1f s, %llu bytes, %lu dropped\n", stats.events, stats.seconds, (unsigned long long)stats.bytes, stats.dropped);
+    return 0;
   }
-  else if (cmd->argc == 3)
+
+  char *filename = arg_dup(cmd, 1);
+  if (capture_start(filename) != 0)
   {
-    for (int i = 0; i < sizeof(options) / sizeof(options[0]); ++i)
-    {
-      if (strcmp(options[i].key, cmd->args[1]) == 0)
-      {
-        free(options[i].value);
-        options[i].value = strdup(cmd->args[2]);
-        quiet_printf("Option %s set to %s\n", cmd->args[1], cmd->args[2]);
-        return 0;
-      }
-    }
-    quiet_printf("Option %s not found\n", cmd->args[1]);
+    quiet_printf("Failed to capture to %s, which needs the xtest backend and the RECORD extension\n", filename);
+    free(filename);
+    return -1;
   }
-
+  quiet_printf("Capturing to %s\n", filename);
+  free(filename);
   return 0;
 }
 
-int save_handler(const Command *cmd)
+// A time into a capture, as a PACE period, or 0
+static int parse_offset(const Command *cmd, int i, uint64_t *us)
 {
-  if (cmd->argc > 3)
-  {
-    quiet_printf("Invalid number of arguments for the SAVE command.\n");
-    return -1;
-  }
-
-  char *filename;
-
-  if (cmd->argc == 1)
-  {
-    filename = DOTFILE;
-  }
-  else
+  if (ARG_LEN(cmd, i) == 1 && ARG_PTR(cmd, i)[0] == '0')
   {
-    filename = cmd->args[1];
+    *us = 0;
+    return 0;
   }
-
-  FILE *fp = fopen(filename, "wb");
-  if (fp == NULL)
+  uint64_t ns;
+  if (parse_period(ARG_PTR(cmd, i), ARG_LEN(cmd, i), &ns) != 0)
   {
-    quiet_printf("Failed to open file %s\n", filename);
     return -1;
   }
+  *us = ns / 1000;
+  return 0;
+}
 
-  for (int i = 0; i < OPTCOUNT; ++i)
+int replay_handler(const Command *cmd)
+{
+  if (cmd->argc < 2 || cmd->argc > 6)
   {
-    fprintf(fp, "! %s %s\n", options[i].key, options[i].value);
+    quiet_printf("Invalid number of arguments for the REPLAY command.\n");
+    return -1;
   }
-
-  for (int i = 0; i < REGISTERCOUNT; ++i)
+  // A replay would hold up the loop thread for as long as it lasts, with no
+  // way to cancel it
+  if (task_name() != NULL)
   {
-    if (registers[i].command != NULL)
-    {
-      fprintf(fp, "@ %c %s\n", registers[i].register_name, registers[i].command);
-    }
+    quiet_printf("REPLAY cannot run inside an event loop task; start the loop with event_loop off.\n");
+    return -1;
   }
 
-  for (int i = 0; i < HOTKEYCOUNT; ++i)
+  ReplayOptions options = {.speed = 1, .loops = 1};
+  if (cmd->argc > 2)
   {
-    if (hotkeys[i].command != NULL)
+    char *speed = arg_dup(cmd, 2);
+    char *end;
+    options.speed = strtod(speed, &end);
+    bool valid = end != speed && *end == '\0' && options.speed >= REPLAY_MIN_SPEED && options.speed <= REPLAY_MAX_SPEED;
+    free(speed);
+    if (!valid)
     {
-      fprintf(fp, "& %s %s\n", hotkeys[i].register_name, hotkeys[i].command);
+      quiet_printf("Invalid speed for the REPLAY command, which takes 0.5 to 10.\n");
+      return -1;
     }
   }
-
-  fclose(fp);
-
-  return 0;
-}
-
-void execute_file(char *filename)
-{
-  FILE *fp = fopen(filename, "r");
-
-  if (fp == NULL)
+  if ((cmd->argc > 3 && parse_offset(cmd, 3, &options.start) != 0) ||
+      (cmd->argc > 4 && parse_offset(cmd, 4, &options.end) != 0) ||
+      (options.end != 0 && options.end <= options.start))
   {
-    quiet_printf("Failed to open file %s\n", filename);
-    return;
+    quiet_printf("Invalid start or end for the REPLAY command.\n");
+    return -1;
   }
-
-  char buf[256];
-
-  while (fgets(buf, 256, fp))
+  if (cmd->argc > 5)
   {
-    buf[strcspn(buf, "\r\n")] = 0;
-    Command cmd;
-    if (parse_command(buf, &cmd) == 0)
+    if (cmd->args[5].number < 0)
     {
-      execute_command(&cmd);
+      quiet_printf("Invalid number of loops for the REPLAY command.\n");
+      return -1;
     }
+    options.loops = cmd->args[5].number;
   }
-  fclose(fp);
-}
-
-int load_handler(const Command *cmd)
-{
-  if (cmd->argc > 3)
+  if (options.loops == 0 && job_name() == NULL)
   {
-    quiet_printf("Invalid number of arguments for the LOAD command.\n");
+    quiet_printf("REPLAY only loops until cancelled inside of a REPEAT, WHILE or WHEN.\n");
     return -1;
   }
 
-  char *filename;
-
-  if (cmd->argc == 1)
-  {
-    filename = DOTFILE;
-  }
-  else
+  char *filename = arg_dup(cmd, 1);
+  ReplayStats stats;
+  if (replay_file(filename, &options, &stats) != 0)
   {
-    filename = cmd->args[1];
+    quiet_printf("Failed to replay %s\n", filename);
+    free(filename);
+    return -1;
   }
-
-  execute_file(filename);
-
+  free(filename);
+  output_printf("Replayed %lu events in %.1f s%s, %lu without a character, %lu lost in capture, late by p50 %.0f us p99 %.0f us p99.9 %.0f us max %.0f us\n", stats.events, stats.seconds, stats.cancelled ? " until cancelled" : "", stats.skipped, stats.dropped, stats.late_p50_us, stats.late_p99_us, stats.late_p999_us, stats.late_max_us);
   return 0;
 }
 
-int move_handler(const Command *cmd)
+int held_handler(const Command *cmd)
 {
-  if (cmd->argc != 3 && cmd->argc != 1)
+  if (cmd->argc > 2 || (cmd->argc == 2 && (cmd->args[1].number < 0 || cmd->args[1].number > MIRROR_HISTORY)))
   {
-    quiet_printf("Invalid number of arguments for the MOVE command.\n");
+    quiet_printf("Invalid arguments for the HELD command, which takes up to %d events.\n", MIRROR_HISTORY);
     return -1;
   }
 
-  char *enable_last_location_register;
-  get_option_value("enable_last_location_register", &enable_last_location_register);
-  if (strcmp(enable_last_location_register, "true") == 0)
+  MirrorState state;
+  if (!mirror_snapshot(&state))
   {
-    int index = get_register_index('L');
-    if (index != -1)
+    quiet_printf("Nothing is mirrored, which needs XInput2 and the xtest backend\n");
+    return -1;
+  }
+#if MIRROR_SUPPORTED
+  // Keys go by the character they type, or by keycode as #<n>
+  char held[1024];
+  size_t length = 0;
+  for (int button = 0; button < 32; ++button)
+  {
+    if (state.buttons & (1u << button) && length < sizeof(held) - 16)
     {
-      free(registers[index].command);
-      MousePos pos = getMousePos();
-      char *command = malloc(sizeof(char) * (strlen("M 00000 00000") + 1));
-      sprintf(command, "M %d %d", pos.x, pos.y);
-      registers[index].command = strdup(command);
-      free(command);
+      length += snprintf(held + length, sizeof(held) - length, " BUTTON%d", button);
     }
   }
-
-  if (cmd->argc == 3)
+  for (int code = 0; code < 256; ++code)
   {
-    int x = atoi(cmd->args[1]);
-    int y = atoi(cmd->args[2]);
-
-    mouseMove(x, y);
+    if (state.keys[code / 64] >> (code % 64) & 1 && length < sizeof(held) - 16)
+    {
+      int c = mkb_keycode_char(code, false);
+      length += isgraph(c) ? snprintf(held + length, sizeof(held) - length, " %c", c) : snprintf(held + length, sizeof(held) - length, " #%d", code);
+    }
   }
+  output_printf("Mouse at %ld %ld, held:%s\n", state.position.x, state.position.y, length > 0 ? held : " nothing");
 
+  RecordedEvent events[MIRROR_HISTORY];
+  int count = mirror_history(events, cmd->argc == 2 ? cmd->args[1].number : 0);
+  char line[64];
+  for (int i = 0; i < count; ++i)
+  {
+    mkb_format_event(&events[i], line, sizeof(line));
+    if (events[i].type == EVENT_KEY_DOWN || events[i].type == EVENT_KEY_UP)
+    {
+      output_printf("%s #%d\n", line, events[i].b);
+    }
+    else
+    {
+      output_printf("%s\n", line);
+    }
+  }
+#endif
   return 0;
 }
 
-int clicks_last_second = 0;
-int clicks_tally = 0;
-
-#ifdef _WIN32
-DWORD WINAPI click_tally_thread(LPVOID arg)
-#elif defined(__linux__)
-void *click_tally_thread(void *arg)
-#endif
+int stats_handler(const Command *cmd)
 {
-  for (;;)
+  if (cmd->argc != 1)
   {
-    clicks_last_second = clicks_tally;
-    clicks_tally = 0;
-    char *enable_cps_register;
-    get_option_value("enable_cps_register", &enable_cps_register);
-    if (strcmp(enable_cps_register, "true") == 0)
-    {
-      int index = get_register_index('C');
-      if (index != -1)
-      {
-        free(registers[index].command);
-        registers[index].command = malloc(4);
-        sprintf(registers[index].command, "%d", clicks_last_second);
-      }
-    }
-    Sleep(1000);
+    quiet_printf("Invalid number of arguments for the STATS command.\n");
+    return -1;
+  }
+
+  static const char *const names[STATCOUNT] = {
+      [STAT_CLICKS] = "Clicks",
+      [STAT_KEYS] = "Keys",
+      [STAT_MOVES] = "Moves",
+  };
+  InputStat stats[STATCOUNT];
+  input_stats(stats);
+  for (int i = 0; i < STATCOUNT; ++i)
+  {
+    output_printf("%s: %.1f/s, %lu total, interval p50 %.0f us p99 %.0f us max %.0f us\n", names[i], stats[i].rate, stats[i].total, stats[i].interval_p50_us, stats[i].interval_p99_us, stats[i].interval_max_us);
   }
   return 0;
 }
@@ -991,23 +2812,23 @@ int click_handler(const Command *cmd)
 
     for (int i = 0; i < cmd->argc; ++i)
     {
-      quiet_printf("cmd->args[%d] = %s\n", i, cmd->args[i]);
+      quiet_printf("cmd->args[%d] = %.*s\n", i, ARG_LEN(cmd, i), ARG_PTR(cmd, i));
     }
 
     return -1;
   }
 
-  int button = atoi(cmd->args[1]);
+  int button = cmd->args[1].number;
   if (button != 0 && button != 1 && button != 2)
   {
     quiet_printf("Invalid button number for the CLICK command.\n");
     return -1;
   }
 
+  mkb_batch_begin();
   mouseDown(button);
   mouseUp(button);
-
-  clicks_tally++;
+  mkb_batch_end();
 
   return 0;
 }
@@ -1020,7 +2841,7 @@ int click_down_handler(const Command *cmd)
     return -1;
   }
 
-  int button = atoi(cmd->args[1]);
+  int button = cmd->args[1].number;
   if (button != 0 && button != 1 && button != 2)
   {
     quiet_printf("Invalid button number for the CLICK_DOWN command.\n");
@@ -1039,7 +2860,7 @@ int click_up_handler(const Command *cmd)
     return -1;
   }
 
-  int button = atoi(cmd->args[1]);
+  int button = cmd->args[1].number;
   if (button != 0 && button != 1 && button != 2)
   {
     quiet_printf("Invalid button number for the CLICK_UP command.\n");
@@ -1052,14 +2873,24 @@ int click_up_handler(const Command *cmd)
 
 int key_handler(const Command *cmd)
 {
-  if (cmd->argc != 2)
+  if (cmd->argc < 2)
   {
     quiet_printf("Invalid number of arguments for the KEY command.\n");
     return -1;
   }
 
-  keyDown(cmd->args[1][0]);
-  keyUp(cmd->args[1][0]);
+  // Several keys make a chord: all of them go down, then come back up in
+  // reverse order, and the whole chord is sent at once
+  mkb_batch_begin();
+  for (int i = 1; i < cmd->argc; ++i)
+  {
+    keyDown(arg_char(cmd, i));
+  }
+  for (int i = cmd->argc - 1; i >= 1; --i)
+  {
+    keyUp(arg_char(cmd, i));
+  }
+  mkb_batch_end();
   return 0;
 }
 
@@ -1071,7 +2902,7 @@ int key_down_handler(const Command *cmd)
     return -1;
   }
 
-  keyDown(cmd->args[1][0]);
+  keyDown(arg_char(cmd, 1));
   return 0;
 }
 
@@ -1083,7 +2914,7 @@ int key_up_handler(const Command *cmd)
     return -1;
   }
 
-  keyUp(cmd->args[1][0]);
+  keyUp(arg_char(cmd, 1));
   return 0;
 }
 
@@ -1095,19 +2926,32 @@ int sequence_handler(const Command *cmd)
     return -1;
   }
 
+  // The whole sequence is sent at once, with key_delay between the keys
+  // kept by the X server
+  long delay = get_option_int(OPT_KEY_DELAY);
+  mkb_batch_begin();
   for (int i = 1; i < cmd->argc; ++i)
   {
-    for (int j = 0; j < strlen(cmd->args[i]); ++j)
+    for (int j = 0; j < ARG_LEN(cmd, i); ++j)
     {
-      keyDown(cmd->args[i][j]);
-      keyUp(cmd->args[i][j]);
+      if (delay > 0 && (i > 1 || j > 0))
+      {
+        mkb_batch_delay(delay);
+      }
+      keyDown(ARG_PTR(cmd, i)[j]);
+      keyUp(ARG_PTR(cmd, i)[j]);
     }
     if (cmd->argc > 2 && i < cmd->argc - 1)
     {
+      if (delay > 0)
+      {
+        mkb_batch_delay(delay);
+      }
       keyDown(' ');
       keyUp(' ');
     }
   }
+  mkb_batch_end();
   return 0;
 }
 
@@ -1119,118 +2963,212 @@ int delay_handler(const Command *cmd)
     return -1;
   }
 
-  int ms = atoi(cmd->args[1]);
+  int ms = cmd->args[1].number;
   if (ms < 0)
   {
     quiet_printf("Invalid number of milliseconds for the WAIT command.\n");
     return -1;
   }
 
-  usleep(ms * 1000);
+  mkb_flush();
+  job_sleep(ms * 1000L);
   return 0;
 }
 
-void find_register_references(const char *input, char **output)
-{
-  int i = 0;
-  int j = 0;
+static _Thread_local char *print_buffer = NULL;
+static _Thread_local size_t print_capacity = 0;
 
-  while (input[i] != '\0')
-  {
-    if (input[i] == '@' && isalpha(input[i + 1]))
+// Expands a compiled PRINT into the calling thread's buffer, which is valid
+// until the thread's next call, and ends it with a newline. An empty
+// register ends the text.
+const char *expand_template(const Command *cmd, size_t *length)
+{
+  size_t used = 0;
+  epoch_enter();
+  for (int i = 0; i < cmd->segmentc; ++i)
+  {
+    const Token *segment = &cmd->segments[i];
+    const char *text = cmd->source + segment->offset;
+    size_t text_length = segment->length;
+    if (segment->reg >= 0)
     {
-      (*output)[j++] = input[i + 1];
-      i += 2;
+      RegisterValue *value = load_register(&registers[segment->reg]);
+      if (value == NULL)
+      {
+        break;
+      }
+      text = value->command;
+      text_length = strlen(value->command);
     }
-    else
+
+    if (used + text_length + 2 > print_capacity)
     {
-      i++;
+      print_capacity = used + text_length + 2 > 2 * print_capacity ? used + text_length + 2 : 2 * print_capacity;
+      print_buffer = realloc(print_buffer, print_capacity);
     }
+    memcpy(print_buffer + used, text, text_length);
+    used += text_length;
   }
-  (*output)[j] = '\0';
+  epoch_exit();
+
+  if (print_capacity < used + 2)
+  {
+    print_capacity = 64;
+    print_buffer = realloc(print_buffer, print_capacity);
+  }
+  print_buffer[used++] = '\n';
+  print_buffer[used] = '\0';
+  *length = used;
+  return print_buffer;
 }
 
-void replace_register_references(const char *input, char **output, Register *registers)
+// Parses a PACE period: "15" or "15ms", "250us", "2s", or a rate such as
+// "20/s". Returns -1 if it does not parse or is below a microsecond.
+int parse_period(const char *str, int length, uint64_t *period)
 {
-  find_register_references(input, output);
-
-  char *temp = (char *)malloc(512);
-  if (temp == NULL)
+  char buf[32];
+  if (length <= 0 || length >= (int)sizeof(buf))
   {
-    printf("Memory allocation failed.\n");
-    return;
+    return -1;
   }
+  memcpy(buf, str, length);
+  buf[length] = '\0';
 
-  const char *src = input;
-  char *dst = temp;
+  char *end;
+  double number = strtod(buf, &end);
+  if (end == buf || !(number > 0))
+  {
+    return -1;
+  }
 
-  while (*src != '\0')
+  double ns;
+  if (strcmp(end, "") == 0 || strcmp(end, "ms") == 0)
   {
-    if (*src == '@' && get_register_index(src[1]) != -1)
-    {
-      int index = get_register_index(src[1]);
+    ns = number * 1e6;
+  }
+  else if (strcmp(end, "us") == 0)
+  {
+    ns = number * 1e3;
+  }
+  else if (strcmp(end, "s") == 0)
+  {
+    ns = number * 1e9;
+  }
+  else if (strcmp(end, "/s") == 0)
+  {
+    ns = 1e9 / number;
+  }
+  else
+  {
+    return -1;
+  }
 
-      if (index == -1)
-      {
-        break;
-      }
+  if (ns < 1e3 || ns > 1e15)
+  {
+    return -1;
+  }
+  *period = (uint64_t)ns;
+  return 0;
+}
 
-      char *value = registers[index].command;
-      if (value == NULL)
-      {
-        break;
-      }
+// Returns the deadline of the next tick. A new or changed period starts a
+// new schedule one period from now.
+uint64_t pace_next(Pacer *pacer, uint64_t period, uint64_t now)
+{
+  if (pacer->period != period || pacer->deadline == 0)
+  {
+    *pacer = (Pacer){.period = period, .deadline = now + period};
+    return pacer->deadline;
+  }
 
-      strcpy(dst, value);
-      dst += strlen(value);
-      src += 2;
+  pacer->deadline += period;
+  if (pacer->deadline < now)
+  {
+    if (get_option_bool(OPT_PACE_CATCH_UP))
+    {
+      // Run the late tick straight away and keep the original schedule
+      pacer->missed++;
+      pacer->window_missed++;
     }
     else
     {
-      *dst++ = *src++;
+      // Drop the ticks that are already over, staying on the same grid
+      uint64_t skipped = (now - pacer->deadline) / period + 1;
+      pacer->deadline += skipped * period;
+      pacer->missed += skipped;
+      pacer->window_missed += skipped;
     }
   }
-
-  *dst = '\0';
-  strcpy(*output, temp);
-  free(temp);
+  return pacer->deadline;
 }
 
-int print_handler(const Command *cmd)
+// Records a wake-up. Once a second, publishes "<requested us> <achieved us>
+// <mean lateness us> <missed>" to the T register if enable_pace_register is
+// on.
+void pace_record(Pacer *pacer, uint64_t now)
 {
-  if (cmd->argc != 2)
+  if (pacer->window_start == 0)
   {
-    quiet_printf("Invalid number of arguments for the PRINT command.\n");
-
-    return -1;
+    pacer->window_start = now;
+    return;
   }
 
-  char *input = malloc(1);
-  input[0] = '\0';
-  for (int i = 1; i < cmd->argc; ++i)
+  pacer->window_ticks++;
+  pacer->window_late += now > pacer->deadline ? now - pacer->deadline : 0;
+  if (now - pacer->window_start < 1000000000ULL)
   {
-    input = realloc(input, strlen(input) + strlen(cmd->args[i]) + 2);
-    strcat(input, cmd->args[i]);
-    strcat(input, " ");
+    return;
   }
 
-  trim(input);
+  if (get_option_bool(OPT_ENABLE_PACE_REGISTER))
+  {
+    int index = get_register_index('T');
+    if (index != -1)
+    {
+      char command[96];
+      snprintf(command, sizeof(command), "%.1f %.1f %.1f %lu", pacer->period / 1e3, (now - pacer->window_start) / 1e3 / pacer->window_ticks, pacer->window_late / 1e3 / pacer->window_ticks, pacer->window_missed);
+      set_register(&registers[index], command);
+    }
+  }
+  pacer->window_start = now;
+  pacer->window_ticks = 0;
+  pacer->window_late = 0;
+  pacer->window_missed = 0;
+}
 
-  int max_output_size = 512;
+int pace_handler(const Command *cmd)
+{
+  if (cmd->argc != 2)
+  {
+    quiet_printf("Invalid number of arguments for the PACE command.\n");
+    return -1;
+  }
 
-  char *output = (char *)malloc(max_output_size * sizeof(char));
-  if (output == NULL)
+  uint64_t period;
+  if (parse_period(ARG_PTR(cmd, 1), ARG_LEN(cmd, 1), &period) != 0)
   {
-    quiet_printf("Memory allocation failed in PRINT.\n");
-    return 1;
+    quiet_printf("Invalid period for the PACE command.\n");
+    return -1;
   }
 
-  replace_register_references(input, &output, registers);
+  mkb_flush();
+  job_sleep_until(pace_next(&thread_pacer, period, monotonic_ns()));
+  pace_record(&thread_pacer, monotonic_ns());
+  return 0;
+}
+
+int print_handler(const Command *cmd)
+{
+  if (cmd->argc != 2)
+  {
+    quiet_printf("Invalid number of arguments for the PRINT command.\n");
 
-  printf("%s\n", output);
+    return -1;
+  }
 
-  free(input);
-  free(output);
+  size_t length;
+  const char *output = expand_template(cmd, &length);
+  output_write(output, length);
 
   return 0;
 }
@@ -1339,9 +3277,7 @@ void detect_keypresses()
 #ifdef _WIN32
   for (;;)
   {
-    char *hotkey_enable;
-    get_option_value("enable_hotkey", &hotkey_enable);
-    if (hotkey_enable == NULL || strcmp(hotkey_enable, "true") != 0)
+    if (!get_option_bool(OPT_ENABLE_HOTKEY))
     {
       Sleep(100);
       continue;
@@ -1357,13 +3293,9 @@ void detect_keypresses()
         char actual_key = shift_char(key, shiftState);
 
         int hotkey_index = get_hotkey_index(actual_key);
-        if (hotkey_index != -1 && hotkeys[hotkey_index].command != NULL)
+        if (hotkey_index != -1)
         {
-          Command saved_cmd;
-          if (parse_command(hotkeys[hotkey_index].command, &saved_cmd) == 0)
-          {
-            execute_command(&saved_cmd);
-          }
+          execute_hotkey(hotkey_index);
         }
       }
     }
@@ -1378,18 +3310,21 @@ void detect_keypresses()
   char buf[32];
   Status status;
 
+  // Events are read whether hotkeys are enabled or not, so that the keymap
+  // and the screen geometry never go stale
   for (;;)
   {
-    char *hotkey_enable;
-    get_option_value("enable_hotkey", &hotkey_enable);
-    if (hotkey_enable == NULL || strcmp(hotkey_enable, "true") != 0)
+    XNextEvent(get_display(), &ev);
+    if (ev.type == MappingNotify)
     {
-      Sleep(100);
-      continue;
+      mkb_mapping_changed(&ev.xmapping);
     }
-    XNextEvent(get_display(), &ev);
-    if (ev.type == KeyPress)
+    else if (ev.type == KeyPress)
     {
+      if (!get_option_bool(OPT_ENABLE_HOTKEY))
+      {
+        continue;
+      }
       XKeyPressedEvent *kev = (XKeyPressedEvent *)&ev;
       int len = Xutf8LookupString(get_input_context(), kev, buf, sizeof(buf), &ks, &status);
       if (len > 0)
@@ -1397,14 +3332,14 @@ void detect_keypresses()
         int hotkey_index = get_hotkey_index(buf[0]);
         if (hotkey_index != -1)
         {
-          Command saved_cmd;
-          if (parse_command(hotkeys[hotkey_index].command, &saved_cmd) == 0)
-          {
-            execute_command(&saved_cmd);
-          }
+          execute_hotkey(hotkey_index);
         }
       }
     }
+    else
+    {
+      mkb_screen_changed(&ev);
+    }
   }
 #endif
 }
@@ -1419,45 +3354,80 @@ void *detect_keypresses_thread(void *arg)
   return 0;
 }
 
-int main()
+#ifndef CLICKER_BENCH
+int main(int argc, char **argv)
 {
-#ifdef _WIN32
-  HANDLE hotkey_thread;
-  hotkey_thread = CreateThread(NULL, 0, detect_keypresses_thread, NULL, 0, NULL);
-  if (hotkey_thread == NULL)
+  const char *backend = NULL;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc)
+    {
+      backend = argv[++i];
+    }
+    else
+    {
+      fprintf(stderr, "Usage: %s [--backend <name>[:<arg>]]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  init_output();
+  init_journal();
+  init_options();
+  init_registers();
+  init_jobs();
+  init_event_loop();
+  if (!mkb_init(backend))
   {
-    fprintf(stderr, "Error creating hotkey_thread\n");
     return 1;
   }
-  HANDLE cps_thread;
-  cps_thread = CreateThread(NULL, 0, click_tally_thread, NULL, 0, NULL);
-  if (cps_thread == NULL)
+  // Hotkeys come from the real keyboard, which only the native backend has
+  bool hotkeys = mkb_backend() == &native_backend;
+  if (hotkeys && MIRROR_SUPPORTED && !mirror_start())
+  {
+    fprintf(stderr, "XInput2 is missing, so held keys are not mirrored\n");
+  }
+
+#ifdef _WIN32
+  HANDLE hotkey_thread = NULL;
+  if (hotkeys)
+  {
+    hotkey_thread = CreateThread(NULL, 0, detect_keypresses_thread, NULL, 0, NULL);
+    if (hotkey_thread == NULL)
+    {
+      fprintf(stderr, "Error creating hotkey_thread\n");
+      return 1;
+    }
+  }
+  HANDLE sampler_thread;
+  sampler_thread = CreateThread(NULL, 0, stats_thread, NULL, 0, NULL);
+  if (sampler_thread == NULL)
   {
-    fprintf(stderr, "Error creating cps_thread\n");
+    fprintf(stderr, "Error creating stats_thread\n");
     return 1;
   }
 
 #elif defined(__linux__)
-  init_linux();
-
   pthread_t hotkey_thread;
-  int err = pthread_create(&hotkey_thread, NULL, detect_keypresses_thread, registers);
-  if (err != 0)
+  int err;
+  if (hotkeys)
   {
-    fprintf(stderr, "Error creating hotkey_thread\n");
-    return 1;
+    err = pthread_create(&hotkey_thread, NULL, detect_keypresses_thread, registers);
+    if (err != 0)
+    {
+      fprintf(stderr, "Error creating hotkey_thread\n");
+      return 1;
+    }
   }
-  pthread_t cps_thread;
-  err = pthread_create(&cps_thread, NULL, click_tally_thread, NULL);
+  pthread_t sampler_thread;
+  err = pthread_create(&sampler_thread, NULL, stats_thread, NULL);
   if (err != 0)
   {
-    fprintf(stderr, "Error creating cps_thread\n");
+    fprintf(stderr, "Error creating stats_thread\n");
     return 1;
   }
 #endif
 
-  init_options();
-
   if (access(DOTFILE, F_OK) != -1)
   {
     execute_file(DOTFILE);
@@ -1466,10 +3436,10 @@ int main()
   char input[256];
   Command cmd = {0};
 
-  char *leader;
-  get_option_value("leader", &leader);
+  char leader[256];
+  format_option(OPT_LEADER, leader, sizeof(leader));
 
-  printf(leader);
+  output_printf("%s", leader);
 
   while (fgets(input, sizeof(input), stdin) != NULL)
   {
@@ -1490,19 +3460,21 @@ int main()
     }
     free_command(&cmd);
 
-    get_option_value("leader", &leader);
-    printf(leader);
+    format_option(OPT_LEADER, leader, sizeof(leader));
+    output_printf("%s", leader);
   }
 
-  free(leader);
-
+  if (hotkeys)
+  {
 #ifdef _WIN32
-  WaitForSingleObject(hotkey_thread, INFINITE);
-  CloseHandle(hotkey_thread);
+    WaitForSingleObject(hotkey_thread, INFINITE);
+    CloseHandle(hotkey_thread);
 #elif defined(__linux__)
-  pthread_join(thread, NULL);
-  cleanup_linux();
+    pthread_join(hotkey_thread, NULL);
 #endif
+  }
+  mkb_cleanup();
 
   return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -1,4 +1,7 @@
+#include <ctype.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,7 +9,22 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "epoch.h"
+#include "intern.h"
+#include "jobs.h"
+
+#include "capture.h"
+#include "eventloop.h"
+#include "metrics.h"
 #include "mkb.h"
+#include "mirror.h"
+#include "motion.h"
+#include "output.h"
+#include "pixel.h"
+#include "profile.h"
+#include "replay.h"
+#include "stats.h"
+#include "template.h"
 
 #ifdef _WIN32
 #define HOME getenv("USERPROFILE")
@@ -17,24 +35,51 @@
 #define HOME getenv("HOME")
 
 #include <X11/Xlib.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #define THREAD_FUNC_RETURN_TYPE void *
 #define THREAD_FUNC_ARG_TYPE void *
-#define Sleep(x) usleep((x))
+#define Sleep(x) usleep((x) * 1000)
 #endif
 
 #define DOTFILE ".clickerrc"
 
+typedef struct Command Command;
+
+typedef int (*CommandHandler)(const Command *cmd);
+
+// A token is a span into the (immutable) source of its command, along with
+// the register index and integer it resolves to, so that the executor does
+// not have to look anything up again when the command is recalled
 typedef struct
+{
+  int offset;
+  int length;
+  int reg;
+  int number;
+} Token;
+
+#define INLINE_ARGS 16
+
+struct Command
 {
   char command;
-  char *args[16];
+  const char *source;
+  Token *args; // inline_args unless the command has more than INLINE_ARGS tokens
+  Token inline_args[INLINE_ARGS];
   int argc;
-} Command;
+  CommandHandler handler;
+  // PRINT: the text split into literal spans (reg -1) and the register
+  // references to expand, see compile_template()
+  Token *segments;
+  int segmentc;
+};
 
-typedef int (*CommandHandler)(const Command *cmd);
+#define ARG_PTR(cmd, i) ((cmd)->source + (cmd)->args[i].offset)
+#define ARG_LEN(cmd, i) ((cmd)->args[i].length)
 
 typedef struct
 {
@@ -51,8 +96,13 @@ int recall_handler(const Command *cmd);
 int recallif_handler(const Command *cmd);
 int recallifnot_handler(const Command *cmd);
 int recallifelse_handler(const Command *cmd);
+int recallifheld_handler(const Command *cmd);
+int recallifnotheld_handler(const Command *cmd);
 int repeat_handler(const Command *cmd);
 int while_handler(const Command *cmd);
+int when_handler(const Command *cmd);
+int jobs_handler(const Command *cmd);
+int cancel_handler(const Command *cmd);
 int opt_handler(const Command *cmd);
 int save_handler(const Command *cmd);
 int load_handler(const Command *cmd);
@@ -65,24 +115,145 @@ int key_down_handler(const Command *cmd);
 int key_up_handler(const Command *cmd);
 int sequence_handler(const Command *cmd);
 int delay_handler(const Command *cmd);
+int pace_handler(const Command *cmd);
 int print_handler(const Command *cmd);
+int stats_handler(const Command *cmd);
+int metrics_handler(const Command *cmd);
+int profile_handler(const Command *cmd);
+int move_by_handler(const Command *cmd);
+int drag_handler(const Command *cmd);
+int pixel_handler(const Command *cmd);
+int find_color_handler(const Command *cmd);
+int find_image_handler(const Command *cmd);
+int capture_handler(const Command *cmd);
+int replay_handler(const Command *cmd);
+int held_handler(const Command *cmd);
 int quit_handler(const Command *cmd);
 
+typedef enum
+{
+  OPTION_BOOL,
+  OPTION_INT,
+  OPTION_STRING,
+} OptionType;
+
+// Indices into option_definitions/options, so that hot paths never have to
+// look an option up by name
+enum
+{
+  OPT_QUIET,
+  OPT_LEADER,
+  OPT_ENABLE_CPS_REGISTER,
+  OPT_ENABLE_LAST_LOCATION_REGISTER,
+  OPT_ENABLE_HOTKEY,
+  OPT_EVENT_LOOP,
+  OPT_PACE_CATCH_UP,
+  OPT_ENABLE_PACE_REGISTER,
+  OPT_KEY_DELAY,
+  OPT_ENABLE_RATE_REGISTER,
+  OPT_METRICS_FILE,
+  OPT_METRICS_INTERVAL,
+  OPT_PROFILE,
+  OPT_PROFILE_COMMANDS,
+  OPT_SCRIPT_CACHE,
+  OPT_JOURNAL,
+  OPT_MOTION_RATE,
+  OPT_PIXEL_RATE,
+  OPTCOUNT
+};
+
 typedef struct
 {
-  char *key;
-  char *value;
+  atomic_long number; // OPTION_BOOL and OPTION_INT
+  _Atomic(char *) string;
 } Option;
 
 typedef struct
 {
   const char *key;
+  OptionType type;
   const char *default_value;
   const char *description;
 } OptionDefinition;
 
+int find_option(const char *key, int length);
+int set_option(int index, const char *value, int length);
+bool get_option_bool(int index);
+long get_option_int(int index);
+// Only valid until epoch_exit(); format_option() copies it out instead
+const char *get_option_string(int index);
+void format_option(int index, char *buf, size_t size);
+
+// Register values are immutable once published. Writers swap in a new value
+// with set_register and readers access it through load_register inside an
+// epoch_enter()/epoch_exit() critical section. Event loop tasks suspend in
+// the middle of a value, so they take a reference with hold_register_value
+// instead.
+typedef struct
+{
+  Command compiled; // points into command
+  bool is_compiled;
+  unsigned int value_id; // see intern.h
+  atomic_int refs;       // one for the register, one per event loop task using it
+  char command[];
+} RegisterValue;
+
 typedef struct
 {
   char register_name;
-  char *command;
+  _Atomic(RegisterValue *) value;
+  atomic_uint generation; // bumped on every write, threads park on it
+  atomic_int waiters;
 } Register;
+
+void set_register(Register *reg, const char *command);
+RegisterValue *load_register(Register *reg);
+RegisterValue *hold_register_value(Register *reg);
+void unhold_register_value(void *ptr);
+void wait_register(Register *reg, unsigned int generation);
+void wake_register(Register *reg);
+void wake_registers();
+bool register_holds(Register *reg, unsigned int value_id);
+
+#define REGISTERCOUNT 62
+extern Register registers[REGISTERCOUNT];
+
+void init_options();
+void init_registers();
+int get_hotkey_index(char hotkey_name);
+void execute_hotkey(int hotkey_index);
+void execute_file(char *filename);
+int write_state(FILE *fp, bool snapshot);
+void restore_state(const char *line, size_t length);
+const char *expand_template(const Command *cmd, size_t *length);
+
+// Fixed-rate schedule for PACE. Deadlines are absolute (see monotonic_ns()),
+// so time spent in the commands between two PACEs does not stretch the
+// period. Every thread and every event loop task has its own.
+typedef struct
+{
+  uint64_t period; // ns
+  uint64_t deadline;
+  unsigned long missed;
+  // Statistics for the T register, reset every second
+  uint64_t window_start;
+  unsigned long window_ticks;
+  uint64_t window_late;
+  unsigned long window_missed;
+} Pacer;
+
+int parse_period(const char *str, int length, uint64_t *period);
+uint64_t pace_next(Pacer *pacer, uint64_t period, uint64_t now);
+void pace_record(Pacer *pacer, uint64_t now);
+
+int parse_command(const char *input, Command *cmd);
+// Looks up the handler of a tokenized command and prepares what it needs
+void resolve_command(Command *cmd);
+void free_command(Command *cmd);
+char arg_char(const Command *cmd, int i);
+bool arg_equals(const Command *cmd, int i, const char *str);
+char *arg_dup(const Command *cmd, int i);
+char *join_args(const Command *cmd, int first);
+void execute_command(const Command *cmd);
+CommandHandler find_handler(char command);
+int get_register_index(char register_name);
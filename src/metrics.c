@@ -0,0 +1,254 @@
+#include "jobs.h"
+
+#include "counter.h"
+#include "files.h"
+#include "metrics.h"
+#include "stats.h"
+
+#if METRICS_ENABLED
+
+typedef struct
+{
+  atomic_ulong samples;
+  atomic_ullong sum_ns;
+  atomic_ulong buckets[METRIC_BUCKETS];
+} Histogram;
+
+typedef struct MetricShard
+{
+  MetricCounts *counts; // the owning thread's metric_counts
+  Histogram commands[128];
+  Histogram backend[BACKENDCALLCOUNT];
+  Histogram hotkeys;
+  struct MetricShard *next;
+} MetricShard;
+
+_Thread_local MetricCounts metric_counts;
+static _Atomic(MetricShard *) shards = NULL;
+static _Thread_local MetricShard *shard = NULL;
+
+// Shards live as long as the program, like the threads that own them, none
+// of which exits once it has run a command
+static MetricShard *thread_shard()
+{
+  if (shard != NULL)
+  {
+    return shard;
+  }
+  shard = calloc(1, sizeof(MetricShard));
+  shard->counts = &metric_counts;
+  MetricShard *head = atomic_load(&shards);
+  do
+  {
+    shard->next = head;
+  } while (!atomic_compare_exchange_weak(&shards, &head, shard));
+  return shard;
+}
+
+static int metric_bucket(uint64_t ns)
+{
+  if (ns < 8)
+  {
+    return (int)ns;
+  }
+  int msb = 3;
+  while (ns >> (msb + 1))
+  {
+    msb++;
+  }
+  int bucket = (msb - 1) * 4 + (int)((ns >> (msb - 2)) & 3);
+  return bucket < METRIC_BUCKETS ? bucket : METRIC_BUCKETS - 1;
+}
+
+// The middle of the bucket, in nanoseconds
+static double metric_bucket_value(int bucket)
+{
+  if (bucket < 8)
+  {
+    return bucket;
+  }
+  int shift = bucket / 4 - 1;
+  return (double)((uint64_t)(4 + bucket % 4) << shift) + (double)((uint64_t)1 << shift) / 2;
+}
+
+static void record(Histogram *histogram, uint64_t start)
+{
+  uint64_t elapsed = monotonic_ns() - start;
+  bump(&histogram->samples, 1);
+  atomic_store_explicit(&histogram->sum_ns, atomic_load_explicit(&histogram->sum_ns, memory_order_relaxed) + elapsed, memory_order_relaxed);
+  bump(&histogram->buckets[metric_bucket(elapsed)], 1);
+}
+
+void metrics_time_command(const Command *cmd, int (*handler)(const Command *cmd), char command)
+{
+  uint64_t start = monotonic_ns();
+  handler(cmd);
+  record(&thread_shard()->commands[command & 127], start);
+}
+
+void metrics_record_backend(BackendCall call, uint64_t start)
+{
+  record(&thread_shard()->backend[call], start);
+}
+
+void metrics_record_hotkey(uint64_t start)
+{
+  record(&thread_shard()->hotkeys, start);
+}
+
+typedef struct
+{
+  unsigned long count;
+  unsigned long samples;
+  unsigned long long sum_ns;
+  unsigned long buckets[METRIC_BUCKETS];
+} HistogramTotal;
+
+// count_offset is into MetricCounts, offset into MetricShard
+static void sum_histograms(size_t count_offset, size_t offset, HistogramTotal *total)
+{
+  memset(total, 0, sizeof(HistogramTotal));
+  for (MetricShard *s = atomic_load(&shards); s != NULL; s = s->next)
+  {
+    total->count += atomic_load_explicit((atomic_ulong *)((char *)s->counts + count_offset), memory_order_relaxed);
+    Histogram *histogram = (Histogram *)((char *)s + offset);
+    total->samples += atomic_load_explicit(&histogram->samples, memory_order_relaxed);
+    total->sum_ns += atomic_load_explicit(&histogram->sum_ns, memory_order_relaxed);
+    for (int i = 0; i < METRIC_BUCKETS; ++i)
+    {
+      total->buckets[i] += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+    }
+  }
+}
+
+// One summary series: quantiles of the timed calls, their sum and count
+static void write_summary(FILE *fp, const char *name, const char *labels, const HistogramTotal *total)
+{
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999, 1};
+  unsigned long samples = 0;
+  for (int i = 0; i < METRIC_BUCKETS; ++i)
+  {
+    samples += total->buckets[i];
+  }
+  for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]) && samples > 0; ++q)
+  {
+    unsigned long rank = (unsigned long)(quantiles[q] * (samples - 1)) + 1;
+    unsigned long seen = 0;
+    int bucket = 0;
+    for (; bucket < METRIC_BUCKETS - 1; ++bucket)
+    {
+      seen += total->buckets[bucket];
+      if (seen >= rank)
+      {
+        break;
+      }
+    }
+    fprintf(fp, "%s{%s%squantile=\"%g\"} %.9g\n", name, labels, labels[0] != '\0' ? "," : "", quantiles[q], metric_bucket_value(bucket) / 1e9);
+  }
+  const char *open = labels[0] != '\0' ? "{" : "";
+  const char *close = labels[0] != '\0' ? "}" : "";
+  fprintf(fp, "%s_sum%s%s%s %.9g\n", name, open, labels, close, total->sum_ns / 1e9);
+  fprintf(fp, "%s_count%s%s%s %lu\n", name, open, labels, close, total->samples);
+}
+
+int metrics_write(FILE *fp)
+{
+  static const char *const calls[BACKENDCALLCOUNT] = {
+      [BACKEND_BATCH_END] = "batch_end",
+      [BACKEND_FLUSH] = "flush",
+      [BACKEND_POINTER] = "pointer",
+  };
+  HistogramTotal *totals = malloc(sizeof(HistogramTotal) * 128);
+  char labels[32];
+
+  for (int c = 0; c < 128; ++c)
+  {
+    sum_histograms(offsetof(MetricCounts, commands) + c * sizeof(atomic_ulong), offsetof(MetricShard, commands) + c * sizeof(Histogram), &totals[c]);
+  }
+  fprintf(fp, "# HELP clicker_commands_total Commands executed, by command letter.\n");
+  fprintf(fp, "# TYPE clicker_commands_total counter\n");
+  for (int c = 0; c < 128; ++c)
+  {
+    if (totals[c].count > 0)
+    {
+      fprintf(fp, "clicker_commands_total{command=\"%s%c\"} %lu\n", c == '"' || c == '\\' ? "\\" : "", c, totals[c].count);
+    }
+  }
+  fprintf(fp, "# HELP clicker_command_duration_seconds Time to execute a command, including the commands it recalls. Every %dth is timed.\n", METRIC_SAMPLE_RATE);
+  fprintf(fp, "# TYPE clicker_command_duration_seconds summary\n");
+  for (int c = 0; c < 128; ++c)
+  {
+    if (totals[c].count > 0)
+    {
+      snprintf(labels, sizeof(labels), "command=\"%s%c\"", c == '"' || c == '\\' ? "\\" : "", c);
+      write_summary(fp, "clicker_command_duration_seconds", labels, &totals[c]);
+    }
+  }
+
+  for (int i = 0; i < BACKENDCALLCOUNT; ++i)
+  {
+    sum_histograms(offsetof(MetricCounts, backend) + i * sizeof(atomic_ulong), offsetof(MetricShard, backend) + i * sizeof(Histogram), &totals[i]);
+  }
+  fprintf(fp, "# HELP clicker_backend_calls_total Calls into the input backend.\n");
+  fprintf(fp, "# TYPE clicker_backend_calls_total counter\n");
+  // As of the input telemetry's last sample
+  InputStat stats[STATCOUNT];
+  input_stats(stats);
+  fprintf(fp, "clicker_backend_calls_total{call=\"move\"} %lu\n", stats[STAT_MOVES].total);
+  fprintf(fp, "clicker_backend_calls_total{call=\"button_down\"} %lu\n", stats[STAT_CLICKS].total);
+  fprintf(fp, "clicker_backend_calls_total{call=\"key_down\"} %lu\n", stats[STAT_KEYS].total);
+  for (int i = 0; i < BACKENDCALLCOUNT; ++i)
+  {
+    fprintf(fp, "clicker_backend_calls_total{call=\"%s\"} %lu\n", calls[i], totals[i].count);
+  }
+  fprintf(fp, "# HELP clicker_backend_call_duration_seconds Time spent in a batch_end, flush or pointer call into the input backend. Every %dth is timed.\n", METRIC_SAMPLE_RATE);
+  fprintf(fp, "# TYPE clicker_backend_call_duration_seconds summary\n");
+  for (int i = 0; i < BACKENDCALLCOUNT; ++i)
+  {
+    snprintf(labels, sizeof(labels), "call=\"%s\"", calls[i]);
+    write_summary(fp, "clicker_backend_call_duration_seconds", labels, &totals[i]);
+  }
+
+  sum_histograms(offsetof(MetricCounts, hotkeys), offsetof(MetricShard, hotkeys), &totals[0]);
+  fprintf(fp, "# HELP clicker_hotkeys_total Hotkeys dispatched.\n");
+  fprintf(fp, "# TYPE clicker_hotkeys_total counter\n");
+  fprintf(fp, "clicker_hotkeys_total %lu\n", totals[0].count);
+  fprintf(fp, "# HELP clicker_hotkey_duration_seconds Time to run the command bound to a hotkey. Every %dth is timed.\n", METRIC_HOTKEY_SAMPLE_RATE);
+  fprintf(fp, "# TYPE clicker_hotkey_duration_seconds summary\n");
+  write_summary(fp, "clicker_hotkey_duration_seconds", "", &totals[0]);
+
+  free(totals);
+  return ferror(fp) ? -1 : 0;
+}
+
+int metrics_write_file(const char *path)
+{
+  char temp[4096];
+  snprintf(temp, sizeof(temp), "%s.tmp", path);
+  FILE *fp = fopen(temp, "w");
+  if (fp == NULL)
+  {
+    return -1;
+  }
+  int result = metrics_write(fp);
+  if (fclose(fp) != 0 || result != 0)
+  {
+    remove(temp);
+    return -1;
+  }
+  return replace_file(temp, path);
+}
+
+#else
+
+int metrics_write(FILE *fp)
+{
+  return -1;
+}
+
+int metrics_write_file(const char *path)
+{
+  return -1;
+}
+
+#endif
@@ -0,0 +1,119 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Counters and latency histograms for the hot paths: every executed command
+// by letter, the calls into the input backend, and hotkey dispatch. Each
+// thread writes to a shard of its own, so recording is a handful of plain
+// increments. Only every METRIC_SAMPLE_RATE-th command, batch_end, flush
+// and pointer query of a kind is timed, starting with the first, which keeps
+// the clock off the hot path without missing rare commands; counts are
+// exact. Hotkeys are timed every METRIC_HOTKEY_SAMPLE_RATE-th. Build with
+// -DCLICKER_NO_METRICS to compile all of it out. Include jobs.h first, for monotonic_ns().
+
+#ifndef CLICKER_NO_METRICS
+#define METRICS_ENABLED 1
+#else
+#define METRICS_ENABLED 0
+#endif
+
+#define METRIC_SAMPLE_RATE 256
+// Hotkeys are pressed by hand, far less often, so more of them are timed
+#define METRIC_HOTKEY_SAMPLE_RATE 16
+// Exact below 8 ns, then 4 buckets per power of two, up to about 18 minutes
+#define METRIC_BUCKETS 160
+
+// The backend calls that are timed. Moves, button presses and key presses
+// are taken from the counts stats_count() keeps anyway, and what they cost
+// shows up in the batch_end or flush that sends them.
+typedef enum
+{
+  BACKEND_BATCH_END,
+  BACKEND_FLUSH,
+  BACKEND_POINTER,
+  BACKENDCALLCOUNT
+} BackendCall;
+
+#if METRICS_ENABLED
+// The calling thread's counts. They are bumped on every command, so they
+// live in thread-local storage, where bumping one takes no pointer to load
+// or check. They join the metrics the first time the
+// thread times something, which its first command does.
+typedef struct
+{
+  atomic_ulong commands[128];
+  atomic_ulong backend[BACKENDCALLCOUNT];
+  atomic_ulong hotkeys;
+} MetricCounts;
+
+typedef struct Command Command;
+
+extern _Thread_local MetricCounts metric_counts;
+// Runs a command through its handler and records how long it took
+void metrics_time_command(const Command *cmd, int (*handler)(const Command *cmd), char command);
+void metrics_record_backend(BackendCall call, uint64_t start);
+void metrics_record_hotkey(uint64_t start);
+
+// Only the owning thread writes a count, so it needs no locked increment.
+// Returns whether this call is to be timed.
+static inline bool metrics_count(atomic_ulong *counter, unsigned long rate)
+{
+  unsigned long count = atomic_load_explicit(counter, memory_order_relaxed);
+  atomic_store_explicit(counter, count + 1, memory_order_relaxed);
+  return count % rate == 0;
+}
+
+// Counts a command as it starts, so that commands nested in it see the new
+// count. One that is to be timed goes through metrics_time_command(), and
+// the rest straight to their handler, which keeps the timing out of their
+// way.
+static inline bool metrics_command_count(char command)
+{
+  return metrics_count(&metric_counts.commands[command & 127], METRIC_SAMPLE_RATE);
+}
+
+// Returns a start time if this call is to be timed, or 0
+static inline uint64_t metrics_backend_start(BackendCall call)
+{
+  return metrics_count(&metric_counts.backend[call], METRIC_SAMPLE_RATE) ? monotonic_ns() : 0;
+}
+
+static inline void metrics_backend(BackendCall call, uint64_t start)
+{
+  if (start != 0)
+  {
+    metrics_record_backend(call, start);
+  }
+}
+
+static inline uint64_t metrics_hotkey_start()
+{
+  return metrics_count(&metric_counts.hotkeys, METRIC_HOTKEY_SAMPLE_RATE) ? monotonic_ns() : 0;
+}
+
+static inline void metrics_hotkey(uint64_t start)
+{
+  if (start != 0)
+  {
+    metrics_record_hotkey(start);
+  }
+}
+#else
+#define metrics_command_count(command) false
+#define metrics_backend_start(call) ((uint64_t)0)
+#define metrics_time_command(cmd, handler, command) ((void)0)
+#define metrics_backend(call, start) ((void)(start))
+#define metrics_hotkey_start() ((uint64_t)0)
+#define metrics_hotkey(start) ((void)(start))
+#endif
+
+// Writes every metric in the Prometheus text format. Returns -1 if metrics
+// are compiled out or the output fails.
+int metrics_write(FILE *fp);
+// Writes to path through a temporary file, so that a scraper reading path
+// never sees half of it
+int metrics_write_file(const char *path);
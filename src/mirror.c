@@ -0,0 +1,377 @@
+#include "jobs.h"
+
+#include "mkb.h"
+#include "mirror.h"
+
+#if MIRROR_SUPPORTED
+
+// Written by the mirror thread only, read like the record backend's ring
+typedef struct
+{
+  atomic_ulong seq; // 2 * index + 1 while being written, 2 * index + 2 after
+  atomic_uint_least64_t time;
+  atomic_int type;
+  atomic_int a;
+  atomic_int b;
+} HistorySlot;
+
+static Display *mirror_display = NULL;
+static pthread_t mirror_thread_id;
+static atomic_bool running = false;
+static int xi_opcode;
+static uint64_t start_time;
+
+// x in the high half and y in the low one, so that both are read at once
+static atomic_uint_least64_t position = 0;
+// Odd while the mirror thread changes keys or buttons
+static atomic_uint state_seq = 0;
+static atomic_uint buttons = 0;
+static atomic_uint_least64_t keys[4];
+// The left and right keys of each MirrorModifier, 0 if there is none
+static atomic_uint modifier_keys[3][2];
+
+static HistorySlot history[MIRROR_HISTORY];
+static atomic_ulong history_head = 0;
+
+static uint64_t pack(int x, int y)
+{
+  return (uint64_t)(uint32_t)x << 32 | (uint32_t)y;
+}
+
+static void load_modifiers()
+{
+  static const KeySym syms[3][2] = {{XK_Shift_L, XK_Shift_R}, {XK_Control_L, XK_Control_R}, {XK_Alt_L, XK_Alt_R}};
+  for (int i = 0; i < 3; ++i)
+  {
+    for (int j = 0; j < 2; ++j)
+    {
+      atomic_store_explicit(&modifier_keys[i][j], XKeysymToKeycode(mirror_display, syms[i][j]), memory_order_relaxed);
+    }
+  }
+}
+
+static void remember(RecordedEventType type, int a, int b)
+{
+  unsigned long index = atomic_load_explicit(&history_head, memory_order_relaxed);
+  HistorySlot *slot = &history[index % MIRROR_HISTORY];
+
+  atomic_store_explicit(&slot->seq, 2 * index + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&slot->time, monotonic_ns() - start_time, memory_order_relaxed);
+  atomic_store_explicit(&slot->type, type, memory_order_relaxed);
+  atomic_store_explicit(&slot->a, a, memory_order_relaxed);
+  atomic_store_explicit(&slot->b, b, memory_order_relaxed);
+  atomic_store_explicit(&slot->seq, 2 * index + 2, memory_order_release);
+  atomic_store_explicit(&history_head, index + 1, memory_order_release);
+}
+
+static bool key_bit(unsigned int code)
+{
+  return code < 256 && (atomic_load_explicit(&keys[code / 64], memory_order_relaxed) >> (code % 64) & 1);
+}
+
+// Only the mirror thread changes keys and buttons, so it needs no atomic
+// read-modify-write, only the sequence around the change
+static void set_held(int type, unsigned int detail, bool down)
+{
+  unsigned int seq = atomic_load_explicit(&state_seq, memory_order_relaxed);
+  atomic_store_explicit(&state_seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  if (type == XI_RawKeyPress || type == XI_RawKeyRelease)
+  {
+    uint64_t word = atomic_load_explicit(&keys[detail / 64], memory_order_relaxed);
+    uint64_t bit = (uint64_t)1 << (detail % 64);
+    atomic_store_explicit(&keys[detail / 64], down ? word | bit : word & ~bit, memory_order_relaxed);
+  }
+  else
+  {
+    unsigned int held = atomic_load_explicit(&buttons, memory_order_relaxed);
+    unsigned int bit = 1u << (detail - 1);
+    atomic_store_explicit(&buttons, down ? held | bit : held & ~bit, memory_order_relaxed);
+  }
+  atomic_store_explicit(&state_seq, seq + 2, memory_order_release);
+}
+
+// Returns true for motion, which is looked up once the events that came
+// together have all been taken
+static bool handle(const XIRawEvent *event)
+{
+  unsigned int detail = event->detail;
+  bool shift;
+  int c;
+  switch (event->evtype)
+  {
+  case XI_RawMotion:
+    return true;
+  case XI_RawButtonPress:
+  case XI_RawButtonRelease:
+    if (detail >= 1 && detail <= 32)
+    {
+      set_held(event->evtype, detail, event->evtype == XI_RawButtonPress);
+      remember(event->evtype == XI_RawButtonPress ? EVENT_BUTTON_DOWN : EVENT_BUTTON_UP, detail - 1, 0);
+    }
+    break;
+  case XI_RawKeyPress:
+  case XI_RawKeyRelease:
+    if (detail < 256)
+    {
+      set_held(event->evtype, detail, event->evtype == XI_RawKeyPress);
+      shift = key_bit(modifier_keys[MIRROR_SHIFT][0]) || key_bit(modifier_keys[MIRROR_SHIFT][1]);
+      c = mkb_keycode_char(detail, shift);
+      remember(event->evtype == XI_RawKeyPress ? EVENT_KEY_DOWN : EVENT_KEY_UP, c >= 0 ? c : 0, detail);
+    }
+    break;
+  }
+  return false;
+}
+
+// A move written through while the query was on its way is newer than
+// what the server answered, so the answer is dropped; the move's own
+// motion event brings another query.
+static void query_pointer()
+{
+  uint64_t seen = atomic_load_explicit(&position, memory_order_relaxed);
+  Window root, child;
+  int x, y, window_x, window_y;
+  unsigned int mask;
+  if (XQueryPointer(mirror_display, DefaultRootWindow(mirror_display), &root, &child, &x, &y, &window_x, &window_y, &mask) &&
+      pack(x, y) != seen && atomic_compare_exchange_strong_explicit(&position, &seen, pack(x, y), memory_order_relaxed, memory_order_relaxed))
+  {
+    remember(EVENT_MOVE, x, y);
+  }
+}
+
+static void *mirror_thread(void *arg)
+{
+  XEvent event;
+  for (;;)
+  {
+    bool moved = false;
+    do
+    {
+      XNextEvent(mirror_display, &event);
+      if (event.type == MappingNotify)
+      {
+        XRefreshKeyboardMapping(&event.xmapping);
+        load_modifiers();
+      }
+      else if (event.xcookie.type == GenericEvent && event.xcookie.extension == xi_opcode && XGetEventData(mirror_display, &event.xcookie))
+      {
+        moved |= handle(event.xcookie.data);
+        XFreeEventData(mirror_display, &event.xcookie);
+      }
+    } while (XPending(mirror_display) > 0);
+    if (moved)
+    {
+      query_pointer();
+    }
+  }
+  return NULL;
+}
+
+bool mirror_start()
+{
+  if (get_display() == NULL)
+  {
+    return false;
+  }
+  mirror_display = XOpenDisplay(DisplayString(get_display()));
+  if (mirror_display == NULL)
+  {
+    return false;
+  }
+  int event_base, error_base, major = 2, minor = 2;
+  if (!XQueryExtension(mirror_display, "XInputExtension", &xi_opcode, &event_base, &error_base) || XIQueryVersion(mirror_display, &major, &minor) != Success)
+  {
+    XCloseDisplay(mirror_display);
+    mirror_display = NULL;
+    return false;
+  }
+
+  // Raw events come from every device, whichever window has the focus and
+  // even while the keyboard is grabbed
+  unsigned char bits[XIMaskLen(XI_RawMotion)] = {0};
+  XISetMask(bits, XI_RawKeyPress);
+  XISetMask(bits, XI_RawKeyRelease);
+  XISetMask(bits, XI_RawButtonPress);
+  XISetMask(bits, XI_RawButtonRelease);
+  XISetMask(bits, XI_RawMotion);
+  XIEventMask mask = {XIAllMasterDevices, sizeof(bits), bits};
+  XISelectEvents(mirror_display, DefaultRootWindow(mirror_display), &mask, 1);
+  load_modifiers();
+
+  // What is held already, after selecting, so that nothing falls in between
+  char keymap[32];
+  XQueryKeymap(mirror_display, keymap);
+  for (int code = 0; code < 256; ++code)
+  {
+    if (keymap[code / 8] & (1 << (code % 8)))
+    {
+      atomic_fetch_or(&keys[code / 64], (uint64_t)1 << (code % 64));
+    }
+  }
+  Window root, child;
+  int x = 0, y = 0, window_x, window_y;
+  unsigned int state = 0;
+  XQueryPointer(mirror_display, DefaultRootWindow(mirror_display), &root, &child, &x, &y, &window_x, &window_y, &state);
+  atomic_store(&position, pack(x, y));
+  atomic_store(&buttons, (state >> 8) & 0x1f); // Button1Mask to Button5Mask
+
+  start_time = monotonic_ns();
+  atomic_store(&running, true);
+  if (pthread_create(&mirror_thread_id, NULL, mirror_thread, NULL) != 0)
+  {
+    atomic_store(&running, false);
+    XCloseDisplay(mirror_display);
+    mirror_display = NULL;
+    return false;
+  }
+  return true;
+}
+
+bool mirror_position(MousePos *pos)
+{
+  if (!atomic_load_explicit(&running, memory_order_relaxed))
+  {
+    return false;
+  }
+  uint64_t packed = atomic_load_explicit(&position, memory_order_relaxed);
+  pos->x = (int32_t)(packed >> 32);
+  pos->y = (int32_t)packed;
+  return true;
+}
+
+void mirror_moved(int x, int y)
+{
+  if (atomic_load_explicit(&running, memory_order_relaxed))
+  {
+    atomic_store_explicit(&position, pack(x, y), memory_order_relaxed);
+  }
+}
+
+int mirror_key_held(char key)
+{
+  if (!atomic_load_explicit(&running, memory_order_relaxed))
+  {
+    return -1;
+  }
+  unsigned int code = mkb_char_keycode(key);
+  return code != 0 && key_bit(code);
+}
+
+int mirror_modifier_held(MirrorModifier modifier)
+{
+  if (!atomic_load_explicit(&running, memory_order_relaxed))
+  {
+    return -1;
+  }
+  unsigned int left = atomic_load_explicit(&modifier_keys[modifier][0], memory_order_relaxed);
+  unsigned int right = atomic_load_explicit(&modifier_keys[modifier][1], memory_order_relaxed);
+  return (left != 0 && key_bit(left)) || (right != 0 && key_bit(right));
+}
+
+int mirror_button_held(int button)
+{
+  if (!atomic_load_explicit(&running, memory_order_relaxed))
+  {
+    return -1;
+  }
+  return button >= 0 && button < 32 && (atomic_load_explicit(&buttons, memory_order_relaxed) >> button & 1);
+}
+
+bool mirror_snapshot(MirrorState *state)
+{
+  if (!atomic_load_explicit(&running, memory_order_relaxed))
+  {
+    return false;
+  }
+  mirror_position(&state->position);
+  for (;;)
+  {
+    unsigned int before = atomic_load_explicit(&state_seq, memory_order_acquire);
+    state->buttons = atomic_load_explicit(&buttons, memory_order_relaxed);
+    for (int i = 0; i < 4; ++i)
+    {
+      state->keys[i] = atomic_load_explicit(&keys[i], memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (before % 2 == 0 && atomic_load_explicit(&state_seq, memory_order_relaxed) == before)
+    {
+      return true;
+    }
+  }
+}
+
+int mirror_history(RecordedEvent *events, int max_events)
+{
+  unsigned long head = atomic_load_explicit(&history_head, memory_order_acquire);
+  unsigned long available = head < MIRROR_HISTORY ? head : MIRROR_HISTORY;
+  unsigned long index = head - (available < (unsigned long)max_events ? available : (unsigned long)max_events);
+
+  int count = 0;
+  for (; index != head; ++index)
+  {
+    HistorySlot *slot = &history[index % MIRROR_HISTORY];
+    unsigned long expected = 2 * index + 2;
+    unsigned long before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    RecordedEvent event = {
+        .time = atomic_load_explicit(&slot->time, memory_order_relaxed),
+        .type = atomic_load_explicit(&slot->type, memory_order_relaxed),
+        .a = atomic_load_explicit(&slot->a, memory_order_relaxed),
+        .b = atomic_load_explicit(&slot->b, memory_order_relaxed),
+    };
+    atomic_thread_fence(memory_order_acquire);
+    // Events overwritten while being copied are left out
+    if (before == expected && atomic_load_explicit(&slot->seq, memory_order_relaxed) == expected)
+    {
+      events[count++] = event;
+    }
+  }
+  return count;
+}
+
+#else
+
+bool mirror_start()
+{
+  return false;
+}
+
+bool mirror_position(MousePos *pos)
+{
+  return false;
+}
+
+void mirror_moved(int x, int y)
+{
+}
+
+int mirror_key_held(char key)
+{
+  SHORT scan = VkKeyScanA(key);
+  return scan != -1 && (GetAsyncKeyState(scan & 0xff) & 0x8000) != 0;
+}
+
+int mirror_modifier_held(MirrorModifier modifier)
+{
+  static const int keys[] = {[MIRROR_SHIFT] = VK_SHIFT, [MIRROR_CTRL] = VK_CONTROL, [MIRROR_ALT] = VK_MENU};
+  return (GetAsyncKeyState(keys[modifier]) & 0x8000) != 0;
+}
+
+// The same buttons as mouseDown()
+int mirror_button_held(int button)
+{
+  return (GetAsyncKeyState(button == 0 ? VK_LBUTTON : VK_RBUTTON) & 0x8000) != 0;
+}
+
+bool mirror_snapshot(MirrorState *state)
+{
+  return false;
+}
+
+int mirror_history(RecordedEvent *events, int max_events)
+{
+  return 0;
+}
+
+#endif
@@ -0,0 +1,58 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+#include <pthread.h>
+
+#define MIRROR_SUPPORTED 1
+#else
+#define MIRROR_SUPPORTED 0
+#endif
+
+// A local copy of where the pointer is and which keys and buttons are held,
+// kept up to date from XInput2 raw events by a thread of its own, so that
+// reading it costs an atomic load instead of a round trip to the server.
+// Raw events carry no position, so a run of motion events is followed by
+// one XQueryPointer from the mirror thread, and moves the clicker sends are
+// written through straight away. The mirror also keeps the last
+// MIRROR_HISTORY events. Without XInput2 nothing is mirrored; on Windows
+// the held tests ask GetAsyncKeyState instead.
+// Include jobs.h and mkb.h first, for monotonic_ns() and the event types.
+
+#define MIRROR_HISTORY 256
+
+typedef enum
+{
+  MIRROR_SHIFT,
+  MIRROR_CTRL,
+  MIRROR_ALT,
+} MirrorModifier;
+
+typedef struct
+{
+  MousePos position;
+  uint32_t buttons; // bit n for mouseDown(n)'s button
+  uint64_t keys[4]; // bit n for keycode n
+} MirrorState;
+
+// Starts mirroring the native backend's display. Returns false if there is
+// no display or it has no XInput2.
+bool mirror_start();
+// Returns false if nothing is mirrored
+bool mirror_position(MousePos *pos);
+// Tells the mirror where mouseMove() sent the pointer
+void mirror_moved(int x, int y);
+// Whether the key that types the character, either key of the modifier or
+// the button is held, or -1 if that cannot be told
+int mirror_key_held(char key);
+int mirror_modifier_held(MirrorModifier modifier);
+int mirror_button_held(int button);
+// Keys and buttons are read together, consistent with one another
+bool mirror_snapshot(MirrorState *state);
+// Copies up to max_events of the latest events, oldest first, timed from
+// when the mirror started. Key events have the keycode in b.
+int mirror_history(RecordedEvent *events, int max_events);
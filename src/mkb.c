@@ -1,24 +1,56 @@
+#include "epoch.h"
 #include "mkb.h"
 #ifdef _WIN32
 
-void mouseMoveProportional(float x, float y)
+#define BATCH_INPUTS 64
+
+static _Thread_local int batch_depth = 0;
+static _Thread_local INPUT batch[BATCH_INPUTS];
+static _Thread_local UINT batch_length = 0;
+
+static void native_flush()
 {
-  x *= 65535;
-  y *= 65535;
+  if (batch_length > 0)
+  {
+    SendInput(batch_length, batch, sizeof(INPUT));
+    batch_length = 0;
+  }
+}
 
-  INPUT input;
-  input.type = INPUT_MOUSE;
-  input.mi.dx = x;
-  input.mi.dy = y;
-  input.mi.dwFlags = MOUSEEVENTF_MOVE | MOUSEEVENTF_ABSOLUTE;
-  input.mi.mouseData = 0;
-  input.mi.dwExtraInfo = 0;
-  input.mi.time = 0;
+static void send_input(INPUT *input)
+{
+  if (batch_depth == 0)
+  {
+    SendInput(1, input, sizeof(INPUT));
+    return;
+  }
+  if (batch_length == BATCH_INPUTS)
+  {
+    native_flush();
+  }
+  batch[batch_length++] = *input;
+}
+
+static void native_batch_begin()
+{
+  batch_depth++;
+}
+
+static void native_batch_end()
+{
+  if (--batch_depth == 0)
+  {
+    native_flush();
+  }
+}
 
-  SendInput(1, &input, sizeof(INPUT));
+static void native_batch_delay(unsigned long ms)
+{
+  native_flush();
+  Sleep(ms);
 }
 
-void mouseMove(int x, int y)
+static void native_mouse_move(int x, int y)
 {
   int screenWidth = GetSystemMetrics(SM_CXSCREEN);
   int screenHeight = GetSystemMetrics(SM_CYSCREEN);
@@ -34,10 +66,10 @@ void mouseMove(int x, int y)
   input.mi.time = 0;
   input.mi.dwExtraInfo = 0;
 
-  SendInput(1, &input, sizeof(INPUT));
+  send_input(&input);
 }
 
-void mouseDown(int button)
+static void native_mouse_down(int button)
 {
   INPUT input;
   input.type = INPUT_MOUSE;
@@ -49,10 +81,10 @@ void mouseDown(int button)
   input.mi.dwExtraInfo = 0;
   input.mi.time = 0;
 
-  SendInput(1, &input, sizeof(INPUT));
+  send_input(&input);
 }
 
-void mouseUp(int button)
+static void native_mouse_up(int button)
 {
   INPUT input;
   input.type = INPUT_MOUSE;
@@ -63,42 +95,158 @@ void mouseUp(int button)
   input.mi.dwExtraInfo = 0;
   input.mi.time = 0;
 
-  SendInput(1, &input, sizeof(INPUT));
+  send_input(&input);
+}
+
+// VkKeyScanA results for the current keyboard layout, refilled when the
+// layout changes. The high byte holds the Shift (1), Ctrl (2) and Alt (4)
+// states the character needs, and -1 means the layout cannot type it.
+static HKL key_layout = NULL;
+static SHORT key_scans[256];
+static SRWLOCK key_lock = SRWLOCK_INIT;
+
+static SHORT lookup_key(char key)
+{
+  HKL layout = GetKeyboardLayout(0);
+  AcquireSRWLockExclusive(&key_lock);
+  if (layout != key_layout)
+  {
+    for (int c = 0; c < 256; ++c)
+    {
+      key_scans[c] = VkKeyScanExA((CHAR)c, layout);
+    }
+    key_layout = layout;
+  }
+  SHORT scan = key_scans[(unsigned char)key];
+  ReleaseSRWLockExclusive(&key_lock);
+  return scan;
 }
 
-void keyDown(char key)
+static void send_key(WORD vk, WORD scan, DWORD flags)
 {
   INPUT input;
   input.type = INPUT_KEYBOARD;
-  input.ki.wVk = VkKeyScanA(key);
-  input.ki.wScan = 0;
-  input.ki.dwFlags = 0;
+  input.ki.wVk = vk;
+  input.ki.wScan = scan;
+  input.ki.dwFlags = flags;
   input.ki.dwExtraInfo = 0;
   input.ki.time = 0;
 
-  SendInput(1, &input, sizeof(INPUT));
+  send_input(&input);
 }
 
-void keyUp(char key)
+// Modifiers the character needs go down before it and come up after it.
+// Characters the layout has no key for are typed as Unicode input.
+static void native_key_down(char key)
 {
-  INPUT input;
-  input.type = INPUT_KEYBOARD;
-  input.ki.wVk = VkKeyScanA(key);
-  input.ki.wScan = 0;
-  input.ki.dwFlags = KEYEVENTF_KEYUP;
-  input.ki.dwExtraInfo = 0;
-  input.ki.time = 0;
+  SHORT scan = lookup_key(key);
+  if (scan == -1)
+  {
+    send_key(0, (unsigned char)key, KEYEVENTF_UNICODE);
+    return;
+  }
+  if (scan & 0x100)
+  {
+    send_key(VK_SHIFT, 0, 0);
+  }
+  if (scan & 0x200)
+  {
+    send_key(VK_CONTROL, 0, 0);
+  }
+  if (scan & 0x400)
+  {
+    send_key(VK_MENU, 0, 0);
+  }
+  send_key(scan & 0xff, 0, 0);
+}
 
-  SendInput(1, &input, sizeof(INPUT));
+static void native_key_up(char key)
+{
+  SHORT scan = lookup_key(key);
+  if (scan == -1)
+  {
+    send_key(0, (unsigned char)key, KEYEVENTF_UNICODE | KEYEVENTF_KEYUP);
+    return;
+  }
+  send_key(scan & 0xff, 0, KEYEVENTF_KEYUP);
+  if (scan & 0x400)
+  {
+    send_key(VK_MENU, 0, KEYEVENTF_KEYUP);
+  }
+  if (scan & 0x200)
+  {
+    send_key(VK_CONTROL, 0, KEYEVENTF_KEYUP);
+  }
+  if (scan & 0x100)
+  {
+    send_key(VK_SHIFT, 0, KEYEVENTF_KEYUP);
+  }
 }
 
-MousePos getMousePos()
+static MousePos native_get_mouse_pos()
 {
   POINT p;
   GetCursorPos(&p);
   return (MousePos){p.x, p.y};
 }
 
+// Mouse coordinates are relative to the primary monitor, which comes first
+static ScreenGeometry geometry;
+
+static BOOL CALLBACK add_monitor(HMONITOR monitor, HDC dc, LPRECT rect, LPARAM data)
+{
+  MONITORINFO info = {.cbSize = sizeof(info)};
+  if (geometry.count < MAX_MONITORS && GetMonitorInfo(monitor, &info))
+  {
+    int i = geometry.count++;
+    if (info.dwFlags & MONITORINFOF_PRIMARY)
+    {
+      memmove(&geometry.monitors[1], &geometry.monitors[0], sizeof(Monitor) * i);
+      i = 0;
+    }
+    geometry.monitors[i] = (Monitor){info.rcMonitor.left, info.rcMonitor.top, info.rcMonitor.right - info.rcMonitor.left, info.rcMonitor.bottom - info.rcMonitor.top};
+  }
+  return TRUE;
+}
+
+static const ScreenGeometry *native_geometry()
+{
+  return &geometry;
+}
+
+static bool native_init(const char *arg)
+{
+  geometry.width = GetSystemMetrics(SM_CXSCREEN);
+  geometry.height = GetSystemMetrics(SM_CYSCREEN);
+  EnumDisplayMonitors(NULL, NULL, add_monitor, 0);
+  if (geometry.count == 0)
+  {
+    geometry.monitors[geometry.count++] = (Monitor){0, 0, geometry.width, geometry.height};
+  }
+  return true;
+}
+
+static void native_cleanup()
+{
+}
+
+const InputBackend native_backend = {
+    .name = "sendinput",
+    .init = native_init,
+    .cleanup = native_cleanup,
+    .mouse_move = native_mouse_move,
+    .mouse_down = native_mouse_down,
+    .mouse_up = native_mouse_up,
+    .key_down = native_key_down,
+    .key_up = native_key_up,
+    .batch_begin = native_batch_begin,
+    .batch_end = native_batch_end,
+    .batch_delay = native_batch_delay,
+    .flush = native_flush,
+    .get_mouse_pos = native_get_mouse_pos,
+    .geometry = native_geometry,
+};
+
 #elif defined(__linux__)
 
 Display *display;
@@ -126,19 +274,335 @@ XIC get_input_context()
   return ic;
 }
 
-void init_linux()
+static _Thread_local int batch_depth = 0;
+static _Thread_local unsigned long batch_delay = 0;
+
+// The delay queued by mkb_batch_delay, for the next event to carry. XTest
+// delays hold back the whole connection, not only this thread's events.
+static unsigned long take_delay()
+{
+  unsigned long delay = batch_delay;
+  batch_delay = 0;
+  return delay;
+}
+
+static void send_events()
+{
+  if (batch_depth == 0)
+  {
+    XFlush(display);
+  }
+}
+
+static void native_batch_begin()
+{
+  batch_depth++;
+}
+
+static void native_batch_end()
+{
+  if (--batch_depth == 0)
+  {
+    XFlush(display);
+  }
+}
+
+static void native_batch_delay(unsigned long ms)
+{
+  batch_delay += ms;
+}
+
+static void native_flush()
+{
+  XFlush(display);
+}
+
+// Which keycode types each character, and with which modifiers. Built from
+// the server's keyboard mapping once and again after every MappingNotify,
+// so typing a key is a single array lookup. Readers look a table up inside
+// the epoch, and a replaced one is retired.
+
+#define KEY_SHIFT 0x100
+#define KEY_LEVEL3 0x200 // AltGr
+#define SCRATCH_KEYCODES 8
+
+typedef struct
+{
+  atomic_uint entries[256]; // keycode | KEY_* flags, 0 if there is none
+  // The other way round, for captured keys: the character a keycode types,
+  // plain and with Shift, or -1
+  short chars[256][2];
+  bool shift_keys[256];
+  KeyCode shift;
+  KeyCode level3;
+  // Keycodes without any keysym, which characters missing from the keymap
+  // are temporarily bound to
+  KeyCode scratch[SCRATCH_KEYCODES];
+  KeySym scratch_sym[SCRATCH_KEYCODES];
+  int scratch_count;
+  int scratch_next;
+} Keymap;
+
+static _Atomic(Keymap *) keymap = NULL;
+static pthread_mutex_t keymap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static KeySym char_keysym(unsigned char c)
+{
+  switch (c)
+  {
+  case '\n':
+    return XK_Return;
+  case '\t':
+    return XK_Tab;
+  case '\b':
+    return XK_BackSpace;
+  case 0x1b:
+    return XK_Escape;
+  }
+  // Latin-1 keysyms are the characters themselves
+  return c >= 0x20 && c != 0x7f ? c : NoSymbol;
+}
+
+// The inverse of char_keysym, or -1 for keysyms no character types
+static int keysym_char(KeySym sym)
+{
+  switch (sym)
+  {
+  case XK_Return:
+    return '\n';
+  case XK_Tab:
+    return '\t';
+  case XK_BackSpace:
+    return '\b';
+  case XK_Escape:
+    return 0x1b;
+  }
+  return sym >= 0x20 && sym <= 0xff ? (int)sym : -1;
+}
+
+static void load_keymap()
+{
+  Keymap *map = calloc(1, sizeof(Keymap));
+  Keymap *old = atomic_load(&keymap);
+
+  int min, max, per;
+  XDisplayKeycodes(display, &min, &max);
+  KeySym *syms = XGetKeyboardMapping(display, min, max - min + 1, &per);
+
+  // Columns in order of preference: plain, Shift, AltGr, AltGr+Shift
+  static const int columns[] = {0, 1, 4, 5};
+  static const unsigned int flags[] = {0, KEY_SHIFT, KEY_LEVEL3, KEY_LEVEL3 | KEY_SHIFT};
+  for (int i = 0; i < 4 && columns[i] < per; ++i)
+  {
+    for (int code = min; code <= max; ++code)
+    {
+      KeySym *row = &syms[(code - min) * per];
+      KeySym sym = row[columns[i]];
+      if (columns[i] == 1 && sym == NoSymbol)
+      {
+        // A lone letter is shifted into its uppercase form
+        KeySym lower, upper;
+        XConvertCase(row[0], &lower, &upper);
+        sym = upper != lower ? upper : NoSymbol;
+      }
+      int c = keysym_char(sym);
+      if (c >= 0 && atomic_load_explicit(&map->entries[c], memory_order_relaxed) == 0)
+      {
+        atomic_store_explicit(&map->entries[c], code | flags[i], memory_order_relaxed);
+      }
+    }
+  }
+
+  // Keep scratch keycodes that still hold what we bound them to, and top
+  // up with keycodes that have no keysyms at all
+  for (int i = 0; old != NULL && i < old->scratch_count; ++i)
+  {
+    int code = old->scratch[i];
+    if (code >= min && code <= max && (syms[(code - min) * per] == old->scratch_sym[i] || syms[(code - min) * per] == NoSymbol))
+    {
+      map->scratch[map->scratch_count] = code;
+      map->scratch_sym[map->scratch_count] = syms[(code - min) * per];
+      map->scratch_count++;
+    }
+  }
+  for (int code = max; code >= min && map->scratch_count < SCRATCH_KEYCODES; --code)
+  {
+    bool empty = true;
+    for (int i = 0; i < per && empty; ++i)
+    {
+      empty = syms[(code - min) * per + i] == NoSymbol;
+    }
+    bool taken = false;
+    for (int i = 0; i < map->scratch_count && !taken; ++i)
+    {
+      taken = map->scratch[i] == code;
+    }
+    if (empty && !taken)
+    {
+      map->scratch[map->scratch_count++] = code;
+    }
+  }
+  for (int code = 0; code < 256; ++code)
+  {
+    map->chars[code][0] = map->chars[code][1] = -1;
+  }
+  for (int code = min; code <= max && code < 256; ++code)
+  {
+    KeySym *row = &syms[(code - min) * per];
+    KeySym lower, upper;
+    XConvertCase(row[0], &lower, &upper);
+    map->chars[code][0] = keysym_char(row[0]);
+    map->chars[code][1] = keysym_char(per > 1 && row[1] != NoSymbol ? row[1] : upper);
+    map->shift_keys[code] = row[0] == XK_Shift_L || row[0] == XK_Shift_R;
+  }
+  XFree(syms);
+
+  map->shift = XKeysymToKeycode(display, XK_Shift_L);
+  map->level3 = XKeysymToKeycode(display, XK_ISO_Level3_Shift);
+  atomic_store_explicit(&keymap, map, memory_order_release);
+  epoch_retire(old, free);
+}
+
+// Binds a character that is missing from the keymap to a scratch keycode.
+// Returns 0 if there is no keycode to spare.
+static unsigned int remap_key(Keymap *map, unsigned char c)
+{
+  pthread_mutex_lock(&keymap_lock);
+  unsigned int entry = atomic_load(&map->entries[c]);
+  if (entry == 0 && map->scratch_count > 0 && char_keysym(c) != NoSymbol)
+  {
+    int slot = map->scratch_next;
+    map->scratch_next = (slot + 1) % map->scratch_count;
+
+    // Whatever the slot was bound to has to be remapped next time
+    int previous = keysym_char(map->scratch_sym[slot]);
+    if (previous >= 0)
+    {
+      atomic_store(&map->entries[previous], 0);
+    }
+
+    KeySym sym = char_keysym(c);
+    XChangeKeyboardMapping(display, map->scratch[slot], 1, &sym, 1);
+    map->scratch_sym[slot] = sym;
+    entry = map->scratch[slot];
+    atomic_store(&map->entries[c], entry);
+  }
+  pthread_mutex_unlock(&keymap_lock);
+  return entry;
+}
+
+// Call between epoch_enter() and epoch_exit(), like the other readers of
+// the keymap
+static unsigned int lookup_key(char key)
+{
+  Keymap *map = atomic_load_explicit(&keymap, memory_order_acquire);
+  unsigned int entry = atomic_load_explicit(&map->entries[(unsigned char)key], memory_order_relaxed);
+  return entry != 0 ? entry : remap_key(map, key);
+}
+
+int mkb_keycode_char(unsigned int keycode, bool shift)
+{
+  epoch_enter();
+  Keymap *map = atomic_load_explicit(&keymap, memory_order_acquire);
+  int c = map != NULL && keycode < 256 ? map->chars[keycode][shift] : -1;
+  epoch_exit();
+  return c;
+}
+
+bool mkb_keycode_is_shift(unsigned int keycode)
+{
+  epoch_enter();
+  Keymap *map = atomic_load_explicit(&keymap, memory_order_acquire);
+  bool shift = map != NULL && keycode < 256 && map->shift_keys[keycode];
+  epoch_exit();
+  return shift;
+}
+
+unsigned int mkb_char_keycode(char key)
+{
+  epoch_enter();
+  Keymap *map = atomic_load_explicit(&keymap, memory_order_acquire);
+  unsigned int code = map != NULL ? atomic_load_explicit(&map->entries[(unsigned char)key], memory_order_relaxed) & 0xff : 0;
+  epoch_exit();
+  return code;
+}
+
+// The screen geometry, with the monitors RandR 1.5 reports, or the whole
+// screen as one monitor on older servers. Like keymaps, replaced
+// geometries are retired.
+static _Atomic(ScreenGeometry *) geometry = NULL;
+static int randr_event_base = -1;
+static bool randr_monitors = false;
+
+static void load_geometry()
+{
+  ScreenGeometry *map = calloc(1, sizeof(ScreenGeometry));
+  int screen = DefaultScreen(display);
+  map->width = DisplayWidth(display, screen);
+  map->height = DisplayHeight(display, screen);
+  int count = 0;
+  XRRMonitorInfo *monitors = randr_monitors ? XRRGetMonitors(display, RootWindow(display, screen), True, &count) : NULL;
+  for (int i = 0; i < count && map->count < MAX_MONITORS; ++i)
+  {
+    int j = map->count++;
+    if (monitors[i].primary)
+    {
+      memmove(&map->monitors[1], &map->monitors[0], sizeof(Monitor) * j);
+      j = 0;
+    }
+    map->monitors[j] = (Monitor){monitors[i].x, monitors[i].y, monitors[i].width, monitors[i].height};
+  }
+  if (monitors != NULL)
+  {
+    XRRFreeMonitors(monitors);
+  }
+  if (map->count == 0)
+  {
+    map->monitors[map->count++] = (Monitor){0, 0, map->width, map->height};
+  }
+  ScreenGeometry *old = atomic_exchange_explicit(&geometry, map, memory_order_acq_rel);
+  epoch_retire(old, free);
+}
+
+bool mkb_screen_changed(XEvent *event)
+{
+  if (randr_event_base < 0 || (event->type != randr_event_base + RRScreenChangeNotify && event->type != randr_event_base + RRNotify))
+  {
+    return false;
+  }
+  if (event->type == randr_event_base + RRScreenChangeNotify)
+  {
+    // Brings DisplayWidth() and DisplayHeight() up to date
+    XRRUpdateConfiguration(event);
+  }
+  load_geometry();
+  return true;
+}
+
+void mkb_mapping_changed(XMappingEvent *event)
+{
+  XRefreshKeyboardMapping(event);
+  if (event->request == MappingKeyboard || event->request == MappingModifier)
+  {
+    pthread_mutex_lock(&keymap_lock);
+    load_keymap();
+    pthread_mutex_unlock(&keymap_lock);
+  }
+}
+
+static bool native_init(const char *arg)
 {
   if (!XInitThreads())
   {
     fprintf(stderr, "Failed to initialize Xlib multithreading support.\n");
-    exit(1);
+    return false;
   }
 
   display = XOpenDisplay(NULL);
   if (display == NULL)
   {
     fprintf(stderr, "Cannot open display\n");
-    exit(1);
+    return false;
   }
 
   int screen = DefaultScreen(display);
@@ -152,23 +616,38 @@ void init_linux()
   if (im == NULL)
   {
     fprintf(stderr, "Cannot open input method\n");
-    exit(1);
+    return false;
   }
 
   ic = XCreateIC(im, XNInputStyle, XIMPreeditNothing | XIMStatusNothing, XNClientWindow, root, XNFocusWindow, root, NULL);
   if (ic == NULL)
   {
     fprintf(stderr, "Cannot create input context\n");
-    exit(1);
+    return false;
+  }
+
+  load_keymap();
+
+  int error_base, major, minor;
+  if (XRRQueryExtension(display, &randr_event_base, &error_base) && XRRQueryVersion(display, &major, &minor))
+  {
+    randr_monitors = major > 1 || (major == 1 && minor >= 5);
+    XRRSelectInput(display, RootWindow(display, screen), RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask | RROutputChangeNotifyMask);
+  }
+  else
+  {
+    randr_event_base = -1;
   }
+  load_geometry();
 
   XMapWindow(display, root);
   XFlush(display);
 
   XGrabKeyboard(display, root, true, GrabModeAsync, GrabModeAsync, CurrentTime);
+  return true;
 }
 
-void cleanup_linux()
+static void native_cleanup()
 {
   XCloseDisplay(display);
   XUngrabKeyboard(display, CurrentTime);
@@ -176,39 +655,72 @@ void cleanup_linux()
   XCloseIM(im);
 }
 
-void mouseMove(int x, int y)
+static void native_mouse_move(int x, int y)
 {
-  XTestFakeMotionEvent(display, -1, x, y, CurrentTime);
-  XFlush(display);
+  XTestFakeMotionEvent(display, -1, x, y, take_delay());
+  send_events();
 }
 
-void mouseDown(int button)
+static void native_mouse_down(int button)
 {
-  XTestFakeButtonEvent(display, button + 1, True, CurrentTime);
-  XFlush(display);
+  XTestFakeButtonEvent(display, button + 1, True, take_delay());
+  send_events();
 }
 
-void mouseUp(int button)
+static void native_mouse_up(int button)
 {
-  XTestFakeButtonEvent(display, button + 1, False, CurrentTime);
-  XFlush(display);
+  XTestFakeButtonEvent(display, button + 1, False, take_delay());
+  send_events();
 }
 
-void keyDown(char key)
+// Modifiers the character needs go down before it and come up after it
+static void native_key_down(char key)
 {
-  KeyCode keyCode = XKeysymToKeycode(display, key);
-  XTestFakeKeyEvent(display, keyCode, True, 0);
-  XFlush(display);
+  epoch_enter();
+  unsigned int entry = lookup_key(key);
+  if (entry == 0)
+  {
+    epoch_exit();
+    return;
+  }
+  Keymap *map = atomic_load_explicit(&keymap, memory_order_relaxed);
+  if (entry & KEY_SHIFT)
+  {
+    XTestFakeKeyEvent(display, map->shift, True, take_delay());
+  }
+  if (entry & KEY_LEVEL3)
+  {
+    XTestFakeKeyEvent(display, map->level3, True, take_delay());
+  }
+  XTestFakeKeyEvent(display, entry & 0xff, True, take_delay());
+  epoch_exit();
+  send_events();
 }
 
-void keyUp(char key)
+static void native_key_up(char key)
 {
-  KeyCode keyCode = XKeysymToKeycode(display, key);
-  XTestFakeKeyEvent(display, keyCode, False, 0);
-  XFlush(display);
+  epoch_enter();
+  unsigned int entry = lookup_key(key);
+  if (entry == 0)
+  {
+    epoch_exit();
+    return;
+  }
+  Keymap *map = atomic_load_explicit(&keymap, memory_order_relaxed);
+  XTestFakeKeyEvent(display, entry & 0xff, False, take_delay());
+  if (entry & KEY_LEVEL3)
+  {
+    XTestFakeKeyEvent(display, map->level3, False, 0);
+  }
+  if (entry & KEY_SHIFT)
+  {
+    XTestFakeKeyEvent(display, map->shift, False, 0);
+  }
+  epoch_exit();
+  send_events();
 }
 
-MousePos getMousePos()
+static MousePos native_get_mouse_pos()
 {
   int x, y;
   Window child;
@@ -216,4 +728,26 @@ MousePos getMousePos()
   return (MousePos){x, y};
 }
 
+static const ScreenGeometry *native_geometry()
+{
+  return atomic_load_explicit(&geometry, memory_order_acquire);
+}
+
+const InputBackend native_backend = {
+    .name = "xtest",
+    .init = native_init,
+    .cleanup = native_cleanup,
+    .mouse_move = native_mouse_move,
+    .mouse_down = native_mouse_down,
+    .mouse_up = native_mouse_up,
+    .key_down = native_key_down,
+    .key_up = native_key_up,
+    .batch_begin = native_batch_begin,
+    .batch_end = native_batch_end,
+    .batch_delay = native_batch_delay,
+    .flush = native_flush,
+    .get_mouse_pos = native_get_mouse_pos,
+    .geometry = native_geometry,
+};
+
 #endif
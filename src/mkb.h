@@ -1,3 +1,8 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
 #ifdef _WIN32
 
 #define WIN32_LEAN_AND_MEAN
@@ -6,8 +11,12 @@
 #elif defined(__linux__)
 
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
 #include <X11/extensions/XTest.h>
+#include <X11/extensions/Xrandr.h>
 #include <X11/keysym.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,22 +27,140 @@ Window get_window();
 XIM get_input_method();
 XIC get_input_context();
 
-void init_linux();
-void cleanup_linux();
+// Call for every MappingNotify, so that typed characters follow the new
+// keyboard mapping
+void mkb_mapping_changed(XMappingEvent *event);
+// The character a keycode types, with or without Shift, or -1 if it types
+// none. Table lookups, for the capture thread.
+int mkb_keycode_char(unsigned int keycode, bool shift);
+bool mkb_keycode_is_shift(unsigned int keycode);
+// The keycode that types a character, or 0 if the keymap has none. Unlike
+// typing it, this never binds a spare keycode.
+unsigned int mkb_char_keycode(char key);
+// Call for every event, so that the screen geometry follows RandR changes.
+// Returns false if the event was not one of them.
+bool mkb_screen_changed(XEvent *event);
 
 #endif
 
+typedef struct
+{
+  long x;
+  long y;
+} MousePos;
+
+#define MAX_MONITORS 16
+
+typedef struct
+{
+  int x;
+  int y;
+  int width;
+  int height;
+} Monitor;
+
+// The screen and the monitors on it, in root window pixels, with the
+// primary monitor first. Built once and again whenever the layout changes,
+// so that looking up a position costs no round trip to the server.
+typedef struct
+{
+  int width;
+  int height;
+  int count;
+  Monitor monitors[MAX_MONITORS];
+} ScreenGeometry;
+
 void mouseMove(int x, int y);
+// Moves to x and y from 0 to 1 across the screen
 void mouseMoveProportional(float x, float y);
 void mouseDown(int button);
 void mouseUp(int button);
 void keyDown(char key);
 void keyUp(char key);
 
+// Between mkb_batch_begin() and mkb_batch_end() the calls above only queue
+// their events, and mkb_batch_end() sends them all at once instead of one
+// flush per event. Batches nest and belong to the calling thread.
+void mkb_batch_begin();
+void mkb_batch_end();
+// Queues a pause before the next event. On Linux the X server waits, so the
+// spacing survives the batching, but as the connection is shared every
+// thread's events wait with it; on Windows the queue is sent and the
+// calling thread sleeps.
+void mkb_batch_delay(unsigned long ms);
+// Sends whatever the current batch has queued so far
+void mkb_flush();
+
+MousePos getMousePos();
+// The size of the screen mouseMove() moves on, in pixels. Returns false if
+// the backend has none.
+bool mkb_screen_size(int *width, int *height);
+// Turns x and y into screen pixels. They are from 0 to 1 across the screen
+// or the monitor if proportional, and pixels from the monitor's corner
+// otherwise. monitor is -1 for the whole screen. Returns false if the
+// backend has no screen or there is no such monitor.
+bool mkb_resolve(int monitor, bool proportional, float x, float y, int *px, int *py);
+
+// The calls above go through an input backend, picked once at startup before
+// any other thread uses it. The native one (XTest on Linux, SendInput on
+// Windows) is the default; "null" discards events and "record" keeps them.
 typedef struct
 {
-  long x;
-  long y;
-} MousePos;
+  const char *name;
+  // arg is whatever followed the ':' in the backend spec, or NULL
+  bool (*init)(const char *arg);
+  void (*cleanup)();
+  void (*mouse_move)(int x, int y);
+  void (*mouse_down)(int button);
+  void (*mouse_up)(int button);
+  void (*key_down)(char key);
+  void (*key_up)(char key);
+  void (*batch_begin)();
+  void (*batch_end)();
+  void (*batch_delay)(unsigned long ms);
+  void (*flush)();
+  MousePos (*get_mouse_pos)();
+  // The current geometry, or NULL if the backend has no screen. Read it
+  // between epoch_enter() and epoch_exit().
+  const ScreenGeometry *(*geometry)();
+} InputBackend;
+
+extern const InputBackend native_backend;
+extern const InputBackend null_backend;
+extern const InputBackend record_backend;
+
+// spec is "<name>[:<arg>]", or NULL for the native backend. Returns false if
+// there is no such backend or it failed to start.
+bool mkb_init(const char *spec);
+void mkb_cleanup();
+const InputBackend *mkb_backend();
+
+// The record backend keeps the last RECORD_EVENTS events in a ring buffer
+// that any number of threads append to without locking. With "record:<path>"
+// they are also written to the file, one "<us> <event> <args>" line each.
+#define RECORD_EVENTS 65536
+
+typedef enum
+{
+  EVENT_MOVE,        // a = x, b = y
+  EVENT_BUTTON_DOWN, // a = button
+  EVENT_BUTTON_UP,
+  EVENT_KEY_DOWN, // a = key
+  EVENT_KEY_UP,
+  EVENT_DELAY, // a = milliseconds
+} RecordedEventType;
+
+typedef struct
+{
+  uint64_t time; // nanoseconds since the backend started
+  RecordedEventType type;
+  int a;
+  int b;
+} RecordedEvent;
 
-MousePos getMousePos();
\ No newline at end of file
+// Copies up to max_events events, starting at *cursor (0 for the first one),
+// and advances *cursor past them. Events that were overwritten before they
+// could be read are skipped. Returns the number of events copied.
+int mkb_read_events(unsigned long *cursor, RecordedEvent *events, int max_events);
+// Writes the event as a line of the record file, without the newline
+void mkb_format_event(const RecordedEvent *event, char *buf, size_t size);
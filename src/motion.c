@@ -0,0 +1,139 @@
+#include "main.h"
+
+// What the calling thread's relative moves could not place on a pixel yet
+static _Thread_local float carry_x = 0;
+static _Thread_local float carry_y = 0;
+
+static int round_pixel(float value)
+{
+  return (int)(value < 0 ? value - 0.5f : value + 0.5f);
+}
+
+void motion_points(const MotionPath *path, int first, int steps, MotionPoints *points)
+{
+  float t[MOTION_BATCH];
+  float step = 1.0f / steps;
+  for (int i = 0; i < MOTION_BATCH; ++i)
+  {
+    t[i] = (float)(first + i) * step;
+  }
+
+  // In locals, so that the loops do not read them back through path
+  float x0 = path->x0, y0 = path->y0;
+  float x1 = path->x1, y1 = path->y1;
+  float cx0 = path->cx0, cy0 = path->cy0;
+  float cx1 = path->cx1, cy1 = path->cy1;
+  float dx = x1 - x0, dy = y1 - y0;
+  switch (path->kind)
+  {
+  case PATH_LINEAR:
+    for (int i = 0; i < MOTION_BATCH; ++i)
+    {
+      points->x[i] = x0 + dx * t[i];
+      points->y[i] = y0 + dy * t[i];
+    }
+    break;
+  case PATH_EASE:
+    for (int i = 0; i < MOTION_BATCH; ++i)
+    {
+      float s = t[i] * t[i] * (3 - 2 * t[i]);
+      points->x[i] = x0 + dx * s;
+      points->y[i] = y0 + dy * s;
+    }
+    break;
+  case PATH_BEZIER:
+    for (int i = 0; i < MOTION_BATCH; ++i)
+    {
+      float u = 1 - t[i];
+      float b0 = u * u * u;
+      float b1 = 3 * u * u * t[i];
+      float b2 = 3 * u * t[i] * t[i];
+      float b3 = t[i] * t[i] * t[i];
+      points->x[i] = b0 * x0 + b1 * cx0 + b2 * cx1 + b3 * x1;
+      points->y[i] = b0 * y0 + b1 * cy0 + b2 * cy1 + b3 * y1;
+    }
+    break;
+  }
+}
+
+void motion_begin(Motion *motion, const MotionPath *path, uint64_t duration_ns, int rate)
+{
+  rate = rate < 1 ? 1 : rate > MOTION_MAX_RATE ? MOTION_MAX_RATE : rate;
+  uint64_t steps = duration_ns * rate / 1000000000;
+  motion->path = *path;
+  motion->start = monotonic_ns();
+  motion->duration_ns = duration_ns > 0 ? duration_ns : 1;
+  motion->steps = steps < 1 ? 1 : steps > INT_MAX ? INT_MAX : steps;
+  motion->step = 1;
+  motion->batch_first = 0;
+  motion->last_x = round_pixel(path->x0);
+  motion->last_y = round_pixel(path->y0);
+  motion->moves = 0;
+}
+
+bool motion_advance(Motion *motion, uint64_t *deadline)
+{
+  const MotionPath *path = &motion->path;
+  uint64_t steps = motion->steps;
+  uint64_t step = motion->step;
+  uint64_t now = monotonic_ns();
+  if (now >= motion->start + motion->duration_ns * step / steps)
+  {
+    uint64_t due = (now - motion->start) * steps / motion->duration_ns;
+    step = due > step ? (due < steps ? due : steps) : step;
+
+    if (motion->batch_first == 0 || step >= motion->batch_first + MOTION_BATCH)
+    {
+      motion->batch_first = step;
+      motion_points(path, (int)step, (int)steps, &motion->points);
+    }
+    // The last point is the end itself, whatever the rounding of t
+    int px = step == steps ? round_pixel(path->x1) : round_pixel(motion->points.x[step - motion->batch_first]);
+    int py = step == steps ? round_pixel(path->y1) : round_pixel(motion->points.y[step - motion->batch_first]);
+    if (px != motion->last_x || py != motion->last_y)
+    {
+      mouseMove(px, py);
+      motion->moves++;
+      motion->last_x = px;
+      motion->last_y = py;
+    }
+    motion->step = ++step;
+  }
+
+  if (step > steps)
+  {
+    return false;
+  }
+  *deadline = motion->start + motion->duration_ns * step / steps;
+  return true;
+}
+
+bool motion_run(const MotionPath *path, uint64_t duration_ns, int rate, unsigned long *moves)
+{
+  Motion motion;
+  motion_begin(&motion, path, duration_ns, rate);
+  uint64_t deadline;
+  bool finished = true;
+  while (motion_advance(&motion, &deadline))
+  {
+    mkb_flush();
+    if (!job_sleep_until(deadline))
+    {
+      finished = false;
+      break;
+    }
+  }
+  mkb_flush();
+  *moves = motion.moves;
+  return finished;
+}
+
+void motion_end_by(MotionPath *path, float dx, float dy)
+{
+  float x = path->x0 + dx + carry_x;
+  float y = path->y0 + dy + carry_y;
+  path->x1 = (float)round_pixel(x);
+  path->y1 = (float)round_pixel(y);
+  carry_x = x - path->x1;
+  carry_y = y - path->y1;
+}
@@ -0,0 +1,77 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Smooth pointer motion, for MOVE, MOVE_BY and DRAG with a duration. A path
+// goes from one point to another in a straight line at a constant speed, in
+// a straight line that eases in and out, or along a cubic Bezier curve. Its
+// points are computed MOTION_BATCH at a time into plain float arrays, with
+// the kind of path picked outside of the loops, and are sent at a fixed
+// rate of up to MOTION_MAX_RATE a second, each against an absolute deadline
+// and flushed on its own. A missed deadline is not made up for: the pointer
+// goes to wherever the path is by then, so the duration holds, and a point
+// that lands on the pixel sent last is skipped.
+
+#define MOTION_MAX_RATE 1000
+#define MOTION_MAX_SECONDS 3600
+#define MOTION_BATCH 64
+
+typedef enum
+{
+  PATH_LINEAR,
+  PATH_EASE, // smoothstep
+  PATH_BEZIER,
+} PathKind;
+
+typedef struct
+{
+  PathKind kind;
+  float x0;
+  float y0;
+  float x1;
+  float y1;
+  // Bezier control points
+  float cx0;
+  float cy0;
+  float cx1;
+  float cy1;
+} MotionPath;
+
+typedef struct
+{
+  float x[MOTION_BATCH];
+  float y[MOTION_BATCH];
+} MotionPoints;
+
+// A path on its way, for code that waits between its points itself
+typedef struct
+{
+  MotionPath path;
+  uint64_t start;
+  uint64_t duration_ns;
+  uint64_t steps;
+  uint64_t step;        // next one to send
+  uint64_t batch_first; // 0 before the first batch
+  MotionPoints points;
+  int last_x;
+  int last_y;
+  unsigned long moves;
+} Motion;
+
+// Fills points with the path at t = (first + i) / steps. Points past the
+// end carry on along the curve.
+void motion_points(const MotionPath *path, int first, int steps, MotionPoints *points);
+// Starts the path now, like motion_run, without sending anything yet
+void motion_begin(Motion *motion, const MotionPath *path, uint64_t duration_ns, int rate);
+// Sends the point that is due, if any, and sets deadline to when the next
+// one is. Returns false once the end has been sent.
+bool motion_advance(Motion *motion, uint64_t *deadline);
+// Moves the pointer along the path, which starts where the pointer is, in
+// duration_ns (at most MOTION_MAX_SECONDS) at rate points a second. moves
+// is set to the number of moves sent. Returns false if the job was
+// cancelled on the way.
+bool motion_run(const MotionPath *path, uint64_t duration_ns, int rate, unsigned long *moves);
+// Ends the path dx, dy away from its start, to within a pixel. What is
+// left over is carried to the calling thread's next relative move, so that
+// a hundred moves by 0.25 go 25 pixels.
+void motion_end_by(MotionPath *path, float dx, float dy);
@@ -0,0 +1,318 @@
+#include "output.h"
+
+typedef struct OutputMessage
+{
+  _Atomic(struct OutputMessage *) next;
+  size_t length;
+  char text[];
+} OutputMessage;
+
+// A Vyukov queue: a thread swaps its message in as the new tail and only
+// then links the previous tail to it, and the writer takes messages off at
+// the head. The stub keeps the queue from ever being empty.
+static OutputMessage stub;
+static _Atomic(OutputMessage *) tail = &stub;
+static OutputMessage *head = &stub; // the writer's alone
+
+static atomic_bool started = false;
+static atomic_size_t queued_bytes = 0;
+static atomic_ulong queued_messages = 0;
+static atomic_ulong written_messages = 0;
+static atomic_ulong dropped_messages = 0;
+// Futex words, bumped for every queued message and every written batch
+static atomic_uint queued_generation = 0;
+static atomic_uint written_generation = 0;
+static atomic_int writer_waiting = 0;
+static atomic_int flush_waiters = 0;
+
+static _Thread_local char *format_buffer = NULL;
+static _Thread_local size_t format_capacity = 0;
+
+static void wake(atomic_uint *word)
+{
+#ifdef _WIN32
+  WakeByAddressAll((void *)word);
+#elif defined(__linux__)
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+static void wait_for(atomic_uint *word, unsigned int generation)
+{
+#ifdef _WIN32
+  WaitOnAddress((void *)word, &generation, sizeof(generation), INFINITE);
+#elif defined(__linux__)
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, generation, NULL, NULL, 0);
+#endif
+}
+
+static void push(OutputMessage *message)
+{
+  atomic_store_explicit(&message->next, NULL, memory_order_relaxed);
+  OutputMessage *prev = atomic_exchange_explicit(&tail, message, memory_order_acq_rel);
+  atomic_store_explicit(&prev->next, message, memory_order_release);
+}
+
+// Returns NULL if the queue is empty, or if the next message is still being
+// linked in, in which case its generation bump is still to come
+static OutputMessage *pop()
+{
+  OutputMessage *first = head;
+  OutputMessage *next = atomic_load_explicit(&first->next, memory_order_acquire);
+  if (first == &stub)
+  {
+    if (next == NULL)
+    {
+      return NULL;
+    }
+    head = first = next;
+    next = atomic_load_explicit(&first->next, memory_order_acquire);
+  }
+  if (next != NULL)
+  {
+    head = next;
+    return first;
+  }
+  if (first != atomic_load_explicit(&tail, memory_order_acquire))
+  {
+    return NULL;
+  }
+
+  // first is the last message, so the stub goes in behind it before it is
+  // taken off
+  push(&stub);
+  next = atomic_load_explicit(&first->next, memory_order_acquire);
+  if (next != NULL)
+  {
+    head = next;
+    return first;
+  }
+  return NULL;
+}
+
+static void write_text(const char *text, size_t length)
+{
+#ifdef _WIN32
+  DWORD written;
+  WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), text, (DWORD)length, &written, NULL);
+#elif defined(__linux__)
+  while (length > 0)
+  {
+    ssize_t written = write(STDOUT_FILENO, text, length);
+    if (written < 0 && errno != EINTR)
+    {
+      return;
+    }
+    if (written > 0)
+    {
+      text += written;
+      length -= written;
+    }
+  }
+#endif
+}
+
+// Writes a batch with as few system calls as the terminal takes. Once
+// stdout fails, output is thrown away.
+static void write_messages(OutputMessage **messages, int count)
+{
+#ifdef _WIN32
+  // There is no writev, but the writer thread is the one waiting either way
+  for (int i = 0; i < count; ++i)
+  {
+    write_text(messages[i]->text, messages[i]->length);
+  }
+#elif defined(__linux__)
+  struct iovec iov[OUTPUT_BATCH];
+  for (int i = 0; i < count; ++i)
+  {
+    iov[i] = (struct iovec){messages[i]->text, messages[i]->length};
+  }
+
+  struct iovec *next = iov;
+  int left = count;
+  while (left > 0)
+  {
+    ssize_t written = writev(STDOUT_FILENO, next, left);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return;
+    }
+    while (left > 0 && (size_t)written >= next->iov_len)
+    {
+      written -= next->iov_len;
+      next++;
+      left--;
+    }
+    if (left > 0)
+    {
+      next->iov_base = (char *)next->iov_base + written;
+      next->iov_len -= written;
+    }
+  }
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI output_thread(LPVOID arg)
+#elif defined(__linux__)
+static void *output_thread(void *arg)
+#endif
+{
+  OutputMessage *messages[OUTPUT_BATCH];
+  for (;;)
+  {
+    // Read the generation before looking at the queue, so that a message
+    // queued in between keeps the writer from going to sleep
+    unsigned int generation = atomic_load(&queued_generation);
+    int count = 0;
+    size_t bytes = 0;
+    OutputMessage *message;
+    while (count < OUTPUT_BATCH && (message = pop()) != NULL)
+    {
+      messages[count++] = message;
+      bytes += message->length;
+    }
+
+    if (count > 0)
+    {
+      write_messages(messages, count);
+      for (int i = 0; i < count; ++i)
+      {
+        free(messages[i]);
+      }
+      atomic_fetch_sub(&queued_bytes, bytes);
+      atomic_fetch_add(&written_messages, count);
+      atomic_fetch_add(&written_generation, 1);
+      if (atomic_load(&flush_waiters) > 0)
+      {
+        wake(&written_generation);
+      }
+    }
+
+    unsigned long dropped = atomic_exchange(&dropped_messages, 0);
+    if (dropped > 0)
+    {
+      char notice[64];
+      int length = snprintf(notice, sizeof(notice), "(%lu messages dropped)\n", dropped);
+      write_text(notice, length);
+    }
+
+    if (count == 0)
+    {
+      atomic_store(&writer_waiting, 1);
+      if (atomic_load(&queued_generation) == generation)
+      {
+        wait_for(&queued_generation, generation);
+      }
+      atomic_store(&writer_waiting, 0);
+    }
+  }
+  return 0;
+}
+
+void init_output()
+{
+  // Whatever was printed so far has to come out before the writer's output
+  fflush(stdout);
+#ifdef _WIN32
+  HANDLE thread = CreateThread(NULL, 0, output_thread, NULL, 0, NULL);
+  if (thread == NULL)
+  {
+    return;
+  }
+  CloseHandle(thread);
+#elif defined(__linux__)
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, output_thread, NULL) != 0)
+  {
+    return;
+  }
+  pthread_detach(thread);
+#endif
+  atomic_store(&started, true);
+  atexit(output_flush);
+}
+
+bool output_write(const char *text, size_t length)
+{
+  if (!atomic_load_explicit(&started, memory_order_relaxed))
+  {
+    fwrite(text, 1, length, stdout);
+    return true;
+  }
+
+  if (atomic_fetch_add(&queued_bytes, length) + length > OUTPUT_QUEUE_BYTES)
+  {
+    atomic_fetch_sub(&queued_bytes, length);
+    atomic_fetch_add(&dropped_messages, 1);
+    return false;
+  }
+
+  OutputMessage *message = malloc(sizeof(OutputMessage) + length);
+  message->length = length;
+  memcpy(message->text, text, length);
+  atomic_fetch_add(&queued_messages, 1);
+  push(message);
+
+  atomic_fetch_add(&queued_generation, 1);
+  if (atomic_load(&writer_waiting))
+  {
+    wake(&queued_generation);
+  }
+  return true;
+}
+
+void output_vprintf(const char *format, va_list args)
+{
+  va_list copy;
+  va_copy(copy, args);
+  int length = vsnprintf(format_buffer, format_capacity, format, copy);
+  va_end(copy);
+  if (length < 0)
+  {
+    return;
+  }
+
+  if ((size_t)length >= format_capacity)
+  {
+    format_capacity = length + 1 > 256 ? length + 1 : 256;
+    format_buffer = realloc(format_buffer, format_capacity);
+    vsnprintf(format_buffer, format_capacity, format, args);
+  }
+  output_write(format_buffer, length);
+}
+
+void output_printf(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  output_vprintf(format, args);
+  va_end(args);
+}
+
+void output_flush()
+{
+  if (!atomic_load(&started))
+  {
+    fflush(stdout);
+    return;
+  }
+
+  unsigned long target = atomic_load(&queued_messages);
+  atomic_fetch_add(&flush_waiters, 1);
+  for (;;)
+  {
+    unsigned int generation = atomic_load(&written_generation);
+    if (atomic_load(&written_messages) >= target)
+    {
+      break;
+    }
+    wait_for(&written_generation, generation);
+  }
+  atomic_fetch_sub(&flush_waiters, 1);
+}
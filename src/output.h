@@ -0,0 +1,41 @@
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__linux__)
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+// Console output. Threads queue what they print on a lock-free list and a
+// single writer thread takes it off in batches, so a loop that prints never
+// waits on the terminal. Lines from one thread come out in the order they
+// were queued. Once OUTPUT_QUEUE_BYTES are waiting, further output is
+// dropped and counted instead of holding up the thread. Before
+// init_output(), output is written straight away.
+
+#define OUTPUT_QUEUE_BYTES (1 << 20)
+#define OUTPUT_BATCH 64 // lines per write
+
+// Starts the writer thread, and makes sure that what is queued is written
+// before the program exits
+void init_output();
+// Queues length bytes of text. Returns false if the queue is full.
+bool output_write(const char *text, size_t length);
+void output_printf(const char *format, ...);
+void output_vprintf(const char *format, va_list args);
+// Waits until everything queued so far has been written, so that the
+// caller can write to stdout itself
+void output_flush();
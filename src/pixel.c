@@ -0,0 +1,439 @@
+#include "jobs.h"
+
+#include "mkb.h"
+#include "pixel.h"
+
+// The lowest value each byte of a block may take and how far above it it
+// may go, repeated for every pixel, so that a byte is tested by a single
+// unsigned compare and the loop over a block has no branch. The byte a
+// pixel does not use may take any value.
+typedef struct
+{
+  uint8_t low[4 * PIXEL_BLOCK];
+  uint8_t span[4 * PIXEL_BLOCK];
+} PixelRange;
+
+static void set_range(PixelRange *range, const PixelImage *image, uint32_t color, int tolerance)
+{
+  int channels[4] = {-1, -1, -1, -1};
+  channels[image->red_byte] = (color >> 16) & 0xff;
+  channels[image->green_byte] = (color >> 8) & 0xff;
+  channels[image->blue_byte] = color & 0xff;
+  for (int i = 0; i < 4 * PIXEL_BLOCK; ++i)
+  {
+    int value = channels[i % 4];
+    int low = value - tolerance > 0 ? value - tolerance : 0;
+    int high = value + tolerance < 255 ? value + tolerance : 255;
+    range->low[i] = value < 0 ? 0 : low;
+    range->span[i] = value < 0 ? 255 : high - low;
+  }
+}
+
+static bool block_matches(const uint8_t *bytes, const PixelRange *range)
+{
+  uint8_t outside[4 * PIXEL_BLOCK];
+  for (int i = 0; i < 4 * PIXEL_BLOCK; ++i)
+  {
+    outside[i] = (uint8_t)(bytes[i] - range->low[i]) > range->span[i];
+  }
+  // A pixel matches if none of its bytes is outside
+  uint32_t pixels[PIXEL_BLOCK];
+  memcpy(pixels, outside, sizeof(pixels));
+  unsigned int any = 0;
+  for (int i = 0; i < PIXEL_BLOCK; ++i)
+  {
+    any |= pixels[i] == 0;
+  }
+  return any != 0;
+}
+
+static bool pixel_matches(const uint8_t *bytes, const PixelRange *range)
+{
+  for (int i = 0; i < 4; ++i)
+  {
+    if ((uint8_t)(bytes[i] - range->low[i]) > range->span[i])
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns the first matching pixel of the count starting at bytes, or -1
+static long find_in_span(const uint8_t *bytes, long count, const PixelRange *range)
+{
+  long i = 0;
+  for (; i + PIXEL_BLOCK <= count; i += PIXEL_BLOCK)
+  {
+    if (block_matches(bytes + 4 * i, range))
+    {
+      break;
+    }
+  }
+  // The block with the match, or what is left
+  for (; i < count; ++i)
+  {
+    if (pixel_matches(bytes + 4 * i, range))
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool pixel_find(const PixelImage *image, uint32_t color, int tolerance, int *x, int *y)
+{
+  PixelRange range;
+  set_range(&range, image, color, tolerance);
+  // Rows without padding between them are scanned as one
+  bool contiguous = image->stride == 4 * image->width;
+  long rows = contiguous ? 1 : image->height;
+  long count = contiguous ? (long)image->width * image->height : image->width;
+  for (long row = 0; row < rows; ++row)
+  {
+    long i = find_in_span(image->pixels + row * image->stride, count, &range);
+    if (i >= 0)
+    {
+      *x = (int)(i % image->width);
+      *y = (int)(row + i / image->width);
+      return true;
+    }
+  }
+  return false;
+}
+
+#if PIXEL_SUPPORTED
+
+// Guarded by sampler_lock
+static pthread_mutex_t sampler_lock = PTHREAD_MUTEX_INITIALIZER;
+static Display *sampler_display = NULL;
+static bool have_shm = false;
+static XShmSegmentInfo segment = {.shmid = -1};
+static size_t segment_size = 0;
+
+// Which of a pixel's four bytes the channel is in, or -1 if it is not a
+// byte of its own
+static int mask_byte(const XImage *image, unsigned long mask)
+{
+  for (int shift = 0; shift < 32; shift += 8)
+  {
+    if (mask == 0xffUL << shift)
+    {
+      return image->byte_order == LSBFirst ? shift / 8 : 3 - shift / 8;
+    }
+  }
+  return -1;
+}
+
+static int shm_opcode = 0;
+static XErrorHandler next_handler = NULL;
+static bool attach_failed = false;
+
+// Error handlers are shared by every thread, so this one stays installed and
+// only takes the errors of an XShmAttach on the sampler's connection; any
+// other error goes on to the handler that was there before
+static int on_x_error(Display *display, XErrorEvent *error)
+{
+  if (display == sampler_display && error->request_code == shm_opcode && error->minor_code == X_ShmAttach)
+  {
+    attach_failed = true;
+    return 0;
+  }
+  return next_handler(display, error);
+}
+
+// The server may still refuse the segment, as one in another container
+// does, which without a handler of our own would end the process
+static bool attach_segment()
+{
+  attach_failed = false;
+  bool attached = XShmAttach(sampler_display, &segment);
+  XSync(sampler_display, False);
+  return attached && !attach_failed;
+}
+
+// The segment is marked for removal as soon as the server has it, so it
+// goes away with the process whatever happens. If it cannot be attached,
+// XGetImage is used from then on.
+static bool reserve_segment(size_t size)
+{
+  if (size <= segment_size)
+  {
+    return true;
+  }
+  if (segment_size > 0)
+  {
+    XShmDetach(sampler_display, &segment);
+    XSync(sampler_display, False);
+    shmdt(segment.shmaddr);
+    segment_size = 0;
+  }
+  size = (size + (1 << 20) - 1) & ~(size_t)((1 << 20) - 1);
+  segment.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+  if (segment.shmid < 0)
+  {
+    return false;
+  }
+  segment.shmaddr = shmat(segment.shmid, NULL, 0);
+  segment.readOnly = False;
+  if (segment.shmaddr == (char *)-1)
+  {
+    shmctl(segment.shmid, IPC_RMID, NULL);
+    return false;
+  }
+  if (!attach_segment())
+  {
+    shmdt(segment.shmaddr);
+    shmctl(segment.shmid, IPC_RMID, NULL);
+    have_shm = false;
+    return false;
+  }
+  shmctl(segment.shmid, IPC_RMID, NULL);
+  segment_size = size;
+  return true;
+}
+
+static bool open_sampler()
+{
+  if (sampler_display != NULL)
+  {
+    return true;
+  }
+  if (get_display() == NULL)
+  {
+    return false;
+  }
+  sampler_display = XOpenDisplay(DisplayString(get_display()));
+  if (sampler_display == NULL)
+  {
+    return false;
+  }
+  // The server can only attach a segment on this machine
+  const char *name = DisplayString(sampler_display);
+  int event, error;
+  have_shm = XShmQueryExtension(sampler_display) && (name[0] == ':' || strncmp(name, "unix:", 5) == 0) &&
+             XQueryExtension(sampler_display, "MIT-SHM", &shm_opcode, &event, &error);
+  if (have_shm && next_handler == NULL)
+  {
+    next_handler = XSetErrorHandler(on_x_error);
+  }
+  return true;
+}
+
+// Copies the rectangle, which is on the screen, out of the root window
+static XImage *grab(int x, int y, int width, int height)
+{
+  int screen = DefaultScreen(sampler_display);
+  Window root = RootWindow(sampler_display, screen);
+  if (!have_shm || !reserve_segment((size_t)width * height * 4))
+  {
+    return XGetImage(sampler_display, root, x, y, width, height, AllPlanes, ZPixmap);
+  }
+  XImage *image = XShmCreateImage(sampler_display, DefaultVisual(sampler_display, screen), DefaultDepth(sampler_display, screen), ZPixmap, segment.shmaddr, &segment, width, height);
+  if (image != NULL && !XShmGetImage(sampler_display, root, image, x, y, AllPlanes))
+  {
+    image->data = NULL; // the segment's
+    XDestroyImage(image);
+    image = NULL;
+  }
+  return image;
+}
+
+static void release(XImage *image)
+{
+  if (have_shm && segment_size > 0 && image->data == segment.shmaddr)
+  {
+    image->data = NULL;
+  }
+  XDestroyImage(image);
+}
+
+// Grabs the part of the rectangle that is on the screen, with sampler_lock
+// held, and sets left and top to where it starts. Returns NULL if none of
+// it is, or the screen has other than 8 bits a channel.
+static XImage *grab_clipped(int x, int y, int width, int height, PixelImage *pixels, int *left, int *top)
+{
+  if (!open_sampler())
+  {
+    return NULL;
+  }
+  int screen = DefaultScreen(sampler_display);
+  int screen_width = DisplayWidth(sampler_display, screen);
+  int screen_height = DisplayHeight(sampler_display, screen);
+  *left = x > 0 ? x : 0;
+  *top = y > 0 ? y : 0;
+  int right = x + width < screen_width ? x + width : screen_width;
+  int bottom = y + height < screen_height ? y + height : screen_height;
+  XImage *image = *left < right && *top < bottom ? grab(*left, *top, right - *left, bottom - *top) : NULL;
+  if (image == NULL)
+  {
+    return NULL;
+  }
+
+  *pixels = (PixelImage){
+      .pixels = (const uint8_t *)image->data,
+      .width = image->width,
+      .height = image->height,
+      .stride = image->bytes_per_line,
+      .red_byte = mask_byte(image, image->red_mask),
+      .green_byte = mask_byte(image, image->green_mask),
+      .blue_byte = mask_byte(image, image->blue_mask),
+  };
+  if (image->bits_per_pixel != 32 || pixels->red_byte < 0 || pixels->green_byte < 0 || pixels->blue_byte < 0)
+  {
+    release(image);
+    return NULL;
+  }
+  return image;
+}
+
+int pixel_read(int x, int y, uint32_t *color)
+{
+  pthread_mutex_lock(&sampler_lock);
+  PixelImage pixels;
+  int left, top;
+  XImage *image = grab_clipped(x, y, 1, 1, &pixels, &left, &top);
+  int result = -1;
+  if (image != NULL)
+  {
+    *color = (uint32_t)pixels.pixels[pixels.red_byte] << 16 | pixels.pixels[pixels.green_byte] << 8 | pixels.pixels[pixels.blue_byte];
+    release(image);
+    result = 0;
+  }
+  pthread_mutex_unlock(&sampler_lock);
+  return result;
+}
+
+static int look(const PixelSearch *search, PixelMatch *match)
+{
+  pthread_mutex_lock(&sampler_lock);
+  PixelImage pixels;
+  int left, top;
+  XImage *image = grab_clipped(search->x, search->y, search->width, search->height, &pixels, &left, &top);
+  int result = -1;
+  if (image != NULL)
+  {
+    match->found = pixel_find(&pixels, search->color, search->tolerance, &match->x, &match->y);
+    match->x += left;
+    match->y += top;
+    release(image);
+    result = 0;
+  }
+  pthread_mutex_unlock(&sampler_lock);
+  return result;
+}
+
+// BT.601 luma, with the weights in 256ths
+static uint8_t luma(const uint8_t *pixel, const PixelImage *image)
+{
+  return (pixel[image->red_byte] * 77 + pixel[image->green_byte] * 150 + pixel[image->blue_byte] * 29) >> 8;
+}
+
+// Pixels are taken as words, with the channels shifted out of them, so
+// that the loop vectorizes
+static void gray_block(const uint8_t *bytes, uint8_t *out, const PixelImage *image)
+{
+  uint32_t pixels[PIXEL_BLOCK];
+  memcpy(pixels, bytes, sizeof(pixels));
+  // Where each byte of a pixel ends up in its word on this machine
+  static const uint32_t order = 0x03020100;
+  uint8_t bits[4];
+  memcpy(bits, &order, sizeof(bits));
+  int red = 8 * bits[image->red_byte], green = 8 * bits[image->green_byte], blue = 8 * bits[image->blue_byte];
+  for (int i = 0; i < PIXEL_BLOCK; ++i)
+  {
+    out[i] = ((pixels[i] >> red & 0xff) * 77 + (pixels[i] >> green & 0xff) * 150 + (pixels[i] >> blue & 0xff) * 29) >> 8;
+  }
+}
+
+int pixel_grab_gray(int x, int y, int width, int height, GrayImage *image)
+{
+  pthread_mutex_lock(&sampler_lock);
+  PixelImage pixels;
+  XImage *grabbed = grab_clipped(x, y, width, height, &pixels, &image->x, &image->y);
+  int result = -1;
+  if (grabbed != NULL)
+  {
+    image->width = pixels.width;
+    image->height = pixels.height;
+    image->pixels = malloc((size_t)pixels.width * pixels.height);
+    for (int row = 0; row < pixels.height; ++row)
+    {
+      const uint8_t *in = pixels.pixels + (size_t)row * pixels.stride;
+      uint8_t *out = image->pixels + (size_t)row * pixels.width;
+      int column = 0;
+      for (; column + PIXEL_BLOCK <= pixels.width; column += PIXEL_BLOCK)
+      {
+        gray_block(in + 4 * column, out + column, &pixels);
+      }
+      for (; column < pixels.width; ++column)
+      {
+        out[column] = luma(in + 4 * column, &pixels);
+      }
+    }
+    release(grabbed);
+    result = 0;
+  }
+  pthread_mutex_unlock(&sampler_lock);
+  return result;
+}
+
+int pixel_poll(const PixelSearch *search, uint64_t start, PixelMatch *match, uint64_t *deadline)
+{
+  if (look(search, match) != 0)
+  {
+    return -1;
+  }
+  match->polls++;
+  if (match->found)
+  {
+    return 0;
+  }
+  // A look that overran its period skips the deadlines it missed
+  int rate = search->rate < 1 ? 1 : search->rate > PIXEL_MAX_RATE ? PIXEL_MAX_RATE : search->rate;
+  uint64_t period = 1000000000 / rate;
+  uint64_t now = monotonic_ns();
+  *deadline = start + ((now - start) / period + 1) * period;
+  return *deadline > start + search->timeout ? 0 : 1;
+}
+
+int pixel_search(const PixelSearch *search, PixelMatch *match)
+{
+  *match = (PixelMatch){0};
+  uint64_t start = monotonic_ns();
+  uint64_t deadline;
+  int result;
+  while ((result = pixel_poll(search, start, match, &deadline)) == 1)
+  {
+    if (!job_sleep_until(deadline))
+    {
+      match->cancelled = true;
+      return 0;
+    }
+  }
+  return result;
+}
+
+#else
+
+int pixel_read(int x, int y, uint32_t *color)
+{
+  return -1;
+}
+
+int pixel_search(const PixelSearch *search, PixelMatch *match)
+{
+  return -1;
+}
+
+int pixel_poll(const PixelSearch *search, uint64_t start, PixelMatch *match, uint64_t *deadline)
+{
+  return -1;
+}
+
+int pixel_grab_gray(int x, int y, int width, int height, GrayImage *image)
+{
+  return -1;
+}
+
+#endif
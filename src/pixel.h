@@ -0,0 +1,98 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <X11/Xlib.h>
+#include <X11/Xproto.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/shmproto.h>
+#include <pthread.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#define PIXEL_SUPPORTED 1
+#else
+#define PIXEL_SUPPORTED 0
+#endif
+
+// Reading the screen, for PIXEL, FIND_COLOR and FIND_IMAGE. Rectangles are
+// copied out of the root window with MIT-SHM into a shared segment that is
+// kept and only grows, so a grab costs one round trip and no copy through
+// the socket; without MIT-SHM, as on a remote display, XGetImage does it
+// instead. Pixels are compared PIXEL_BLOCK at a time, byte by byte against
+// the lowest value and the span each byte may take, and only a block with a
+// match is looked at pixel by pixel. Waiting for a color polls at up to
+// PIXEL_MAX_RATE a second against absolute deadlines. Only Linux can read
+// the screen. Include jobs.h and mkb.h first, for job_sleep_until() and the
+// display.
+
+#define PIXEL_MAX_RATE 1000
+#define PIXEL_BLOCK 64
+
+// 32 bits a pixel with 8 bits a channel, as X servers keep a 24 bit screen
+typedef struct
+{
+  const uint8_t *pixels;
+  int width;
+  int height;
+  int stride; // bytes from one row to the next
+  // Where in its four bytes a pixel keeps each channel
+  int red_byte;
+  int green_byte;
+  int blue_byte;
+} PixelImage;
+
+// One byte of luma a pixel, rows without padding
+typedef struct
+{
+  uint8_t *pixels;
+  int width;
+  int height;
+  // Where the image starts on the screen
+  int x;
+  int y;
+} GrayImage;
+
+typedef struct
+{
+  // Screen pixels; what lies outside of the screen is left out
+  int x;
+  int y;
+  int width;
+  int height;
+  uint32_t color;   // 0xrrggbb
+  int tolerance;    // on every channel, 0 to 255
+  uint64_t timeout; // ns to keep looking for, or 0 to look once
+  int rate;         // looks a second while waiting
+} PixelSearch;
+
+typedef struct
+{
+  bool found;
+  int x; // on the screen
+  int y;
+  unsigned long polls;
+  bool cancelled;
+} PixelMatch;
+
+// Finds the first pixel, row by row, whose channels are all within
+// tolerance of color's. Returns false if there is none.
+bool pixel_find(const PixelImage *image, uint32_t color, int tolerance, int *x, int *y);
+// Reads the color of a screen pixel as 0xrrggbb. Returns -1 if there is no
+// display or the pixel is not on the screen.
+int pixel_read(int x, int y, uint32_t *color);
+// Looks for the color in the rectangle until it shows up, the timeout
+// passes or the job is cancelled. Returns -1 if the screen cannot be read
+// there.
+int pixel_search(const PixelSearch *search, PixelMatch *match);
+// One look of a search that began at start, for code that waits between
+// looks itself. Returns 1 and sets deadline to when to look again if the
+// color is not there yet and the timeout has not passed, 0 once the search
+// is over and -1 like pixel_search.
+int pixel_poll(const PixelSearch *search, uint64_t start, PixelMatch *match, uint64_t *deadline);
+// Copies the part of the rectangle that is on the screen into a gray image,
+// whose pixels the caller frees. Returns -1 if no part of it can be read.
+int pixel_grab_gray(int x, int y, int width, int height, GrayImage *image);
@@ -0,0 +1,346 @@
+#include "jobs.h"
+
+#include "counter.h"
+#include "profile.h"
+
+struct ProfileNode
+{
+  char name[PROFILE_NAME_LENGTH];
+  _Atomic(ProfileNode *) children;
+  ProfileNode *next; // the next sibling, or the root of the next thread
+  // The children named by a single register or command letter, which is
+  // most of them, found without comparing names. Only the owning thread
+  // looks at these, readers walk the list.
+  ProfileNode *letters[PROFILE_LETTERS];
+  atomic_ulong calls;
+  atomic_ullong wall_ns;
+  atomic_ullong cpu_ns;
+  atomic_ullong cpu_wall_ns; // wall time of the calls that took CPU time
+  // The counts as profile_reset() last saw them, taken off when writing
+  atomic_ulong reset_calls;
+  atomic_ullong reset_wall_ns;
+  atomic_ullong reset_cpu_ns;
+  atomic_ullong reset_cpu_wall_ns;
+};
+
+static _Atomic(ProfileNode *) roots = NULL;
+static _Thread_local ProfileNode *current = NULL;
+// Random rather than every so many calls, which could keep picking the same
+// frame of a loop, or a frame together with the frames inside of it, whose
+// clock reads would then count towards its own CPU time
+static _Thread_local uint32_t cpu_sampler = 0;
+// What reading the CPU time twice costs, which is taken off every sample.
+// Most frames take less time than the system call.
+static _Thread_local uint64_t cpu_overhead_ns = 0;
+
+// Roots live as long as the program, like the threads that own them
+static ProfileNode *thread_root()
+{
+  ProfileNode *root = calloc(1, sizeof(ProfileNode));
+  ProfileNode *head = atomic_load(&roots);
+  do
+  {
+    root->next = head;
+  } while (!atomic_compare_exchange_weak(&roots, &head, root));
+  return root;
+}
+
+// bump() for the wider counters, nodes being only written by their own thread
+static void add(atomic_ullong *counter, unsigned long long amount)
+{
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+// Finds the child of parent by name, or adds it
+static ProfileNode *find_child(ProfileNode *parent, const char *name, size_t length)
+{
+  // ';' separates the frames of a stack, and a line holds one stack
+  char clean[PROFILE_NAME_LENGTH];
+  if (length > PROFILE_NAME_LENGTH - 1)
+  {
+    length = PROFILE_NAME_LENGTH - 1;
+  }
+  for (size_t i = 0; i < length; ++i)
+  {
+    clean[i] = name[i] == ';' || name[i] == '\n' || name[i] == '\r' ? '_' : name[i];
+  }
+  clean[length] = '\0';
+
+  ProfileNode *node = atomic_load_explicit(&parent->children, memory_order_relaxed);
+  while (node != NULL && strcmp(node->name, clean) != 0)
+  {
+    node = node->next;
+  }
+  if (node == NULL)
+  {
+    node = calloc(1, sizeof(ProfileNode));
+    memcpy(node->name, clean, length + 1);
+    node->next = atomic_load_explicit(&parent->children, memory_order_relaxed);
+    atomic_store_explicit(&parent->children, node, memory_order_release);
+  }
+  return node;
+}
+
+void profile_enter(ProfileFrame *frame, const char *name, size_t length, bool cpu)
+{
+  if (current == NULL)
+  {
+    current = thread_root();
+    cpu_sampler = (uint32_t)monotonic_ns() | 1;
+    cpu_overhead_ns = UINT64_MAX;
+    for (int i = 0; i < 16; ++i)
+    {
+      uint64_t start = thread_cpu_ns();
+      uint64_t elapsed = thread_cpu_ns() - start;
+      cpu_overhead_ns = elapsed < cpu_overhead_ns ? elapsed : cpu_overhead_ns;
+    }
+  }
+
+  ProfileNode *parent = current;
+  int letter = length == 1 ? (unsigned char)name[0] : PROFILE_LETTERS;
+  ProfileNode *node = letter < PROFILE_LETTERS ? parent->letters[letter] : NULL;
+  if (node == NULL)
+  {
+    node = find_child(parent, name, length);
+    if (letter < PROFILE_LETTERS)
+    {
+      parent->letters[letter] = node;
+    }
+  }
+
+  current = node;
+  frame->node = node;
+  frame->parent = parent;
+  if (cpu)
+  {
+    // xorshift32
+    cpu_sampler ^= cpu_sampler << 13;
+    cpu_sampler ^= cpu_sampler >> 17;
+    cpu_sampler ^= cpu_sampler << 5;
+    cpu = cpu_sampler % PROFILE_CPU_SAMPLE_RATE == 0;
+  }
+  frame->cpu = cpu;
+  frame->cpu_start = frame->cpu ? thread_cpu_ns() : 0;
+  frame->wall_start = monotonic_ns();
+}
+
+void profile_record(ProfileFrame *frame)
+{
+  ProfileNode *node = frame->node;
+  uint64_t wall_ns = monotonic_ns() - frame->wall_start;
+  add(&node->wall_ns, wall_ns);
+  if (frame->cpu)
+  {
+    uint64_t cpu_ns = thread_cpu_ns() - frame->cpu_start;
+    add(&node->cpu_ns, cpu_ns > cpu_overhead_ns ? cpu_ns - cpu_overhead_ns : 0);
+    add(&node->cpu_wall_ns, wall_ns);
+  }
+  bump(&node->calls, 1);
+  current = frame->parent;
+}
+
+typedef struct
+{
+  char *stack;
+  unsigned long calls;
+  unsigned long long wall_ns;
+  unsigned long long self_wall_ns;
+  unsigned long long cpu_ns;
+  unsigned long long self_cpu_ns;
+} StackTotal;
+
+typedef struct
+{
+  StackTotal *totals;
+  size_t count;
+  size_t capacity;
+} StackList;
+
+// Adds the stacks from node down to the list, and returns the wall and CPU
+// time of node, children included
+static void collect(const ProfileNode *node, char *stack, size_t length, StackList *list, unsigned long long *wall_ns, unsigned long long *cpu_ns)
+{
+  unsigned long long children_wall_ns = 0;
+  unsigned long long children_cpu_ns = 0;
+  for (const ProfileNode *child = atomic_load_explicit(&node->children, memory_order_acquire); child != NULL; child = child->next)
+  {
+    size_t child_length = length;
+    if (length > 0 && child_length < PROFILE_STACK_LENGTH - 1)
+    {
+      stack[child_length++] = ';';
+    }
+    for (const char *c = child->name; *c != '\0' && child_length < PROFILE_STACK_LENGTH - 1; ++c)
+    {
+      stack[child_length++] = *c;
+    }
+    stack[child_length] = '\0';
+
+    unsigned long long child_wall_ns, child_cpu_ns;
+    collect(child, stack, child_length, list, &child_wall_ns, &child_cpu_ns);
+    children_wall_ns += child_wall_ns;
+    children_cpu_ns += child_cpu_ns;
+    stack[length] = '\0';
+  }
+
+  unsigned long calls = atomic_load_explicit(&node->calls, memory_order_relaxed) - atomic_load_explicit(&node->reset_calls, memory_order_relaxed);
+  *wall_ns = atomic_load_explicit(&node->wall_ns, memory_order_relaxed) - atomic_load_explicit(&node->reset_wall_ns, memory_order_relaxed);
+  // The share of its wall time a frame spent on the CPU, as far as the
+  // sample tells. The calls that read the clock run slower than the rest,
+  // so the share is a better guess than the CPU time per call.
+  unsigned long long sampled_cpu_ns = atomic_load_explicit(&node->cpu_ns, memory_order_relaxed) - atomic_load_explicit(&node->reset_cpu_ns, memory_order_relaxed);
+  unsigned long long sampled_wall_ns = atomic_load_explicit(&node->cpu_wall_ns, memory_order_relaxed) - atomic_load_explicit(&node->reset_cpu_wall_ns, memory_order_relaxed);
+  *cpu_ns = 0;
+  if (sampled_wall_ns > 0)
+  {
+    double share = (double)sampled_cpu_ns / sampled_wall_ns;
+    *cpu_ns = (unsigned long long)(*wall_ns * (share < 1 ? share : 1));
+  }
+  // A frame that is still open, like a loop that runs until cancelled, has
+  // not added its time yet, while its children have. Neither have leaves
+  // taken any CPU time, which stays with their parent.
+  if (*wall_ns < children_wall_ns)
+  {
+    *wall_ns = children_wall_ns;
+  }
+  if (*cpu_ns < children_cpu_ns)
+  {
+    *cpu_ns = children_cpu_ns;
+  }
+  if (length == 0)
+  {
+    return;
+  }
+
+  if (list->count == list->capacity)
+  {
+    list->capacity = list->capacity > 0 ? list->capacity * 2 : 64;
+    list->totals = realloc(list->totals, sizeof(StackTotal) * list->capacity);
+  }
+  list->totals[list->count++] = (StackTotal){
+      .stack = strdup(stack),
+      .calls = calls,
+      .wall_ns = *wall_ns,
+      .self_wall_ns = *wall_ns - children_wall_ns,
+      .cpu_ns = *cpu_ns,
+      .self_cpu_ns = *cpu_ns - children_cpu_ns,
+  };
+}
+
+static int compare_stacks(const void *a, const void *b)
+{
+  return strcmp(((const StackTotal *)a)->stack, ((const StackTotal *)b)->stack);
+}
+
+static int compare_self_wall(const void *a, const void *b)
+{
+  unsigned long long x = ((const StackTotal *)a)->self_wall_ns;
+  unsigned long long y = ((const StackTotal *)b)->self_wall_ns;
+  return x < y ? 1 : x > y ? -1 : compare_stacks(a, b);
+}
+
+// Threads that ran the same stacks, like the workers of two REPEATs of the
+// same register, are merged into one total per stack
+static void collect_stacks(StackList *list)
+{
+  char stack[PROFILE_STACK_LENGTH] = "";
+  *list = (StackList){0};
+  for (ProfileNode *root = atomic_load(&roots); root != NULL; root = root->next)
+  {
+    unsigned long long wall_ns, cpu_ns;
+    collect(root, stack, 0, list, &wall_ns, &cpu_ns);
+  }
+  if (list->count == 0)
+  {
+    return;
+  }
+
+  qsort(list->totals, list->count, sizeof(StackTotal), compare_stacks);
+  size_t merged = 0;
+  for (size_t i = 1; i < list->count; ++i)
+  {
+    StackTotal *total = &list->totals[merged];
+    StackTotal *other = &list->totals[i];
+    if (strcmp(total->stack, other->stack) != 0)
+    {
+      list->totals[++merged] = *other;
+      continue;
+    }
+    total->calls += other->calls;
+    total->wall_ns += other->wall_ns;
+    total->self_wall_ns += other->self_wall_ns;
+    total->cpu_ns += other->cpu_ns;
+    total->self_cpu_ns += other->self_cpu_ns;
+    free(other->stack);
+  }
+  list->count = merged + 1;
+}
+
+static void free_stacks(StackList *list)
+{
+  for (size_t i = 0; i < list->count; ++i)
+  {
+    free(list->totals[i].stack);
+  }
+  free(list->totals);
+}
+
+int profile_write_folded(FILE *fp, bool cpu)
+{
+  StackList list;
+  collect_stacks(&list);
+  for (size_t i = 0; i < list.count; ++i)
+  {
+    unsigned long long us = (cpu ? list.totals[i].self_cpu_ns : list.totals[i].self_wall_ns) / 1000;
+    if (us > 0)
+    {
+      fprintf(fp, "%s %llu\n", list.totals[i].stack, us);
+    }
+  }
+  free_stacks(&list);
+  return ferror(fp) ? -1 : 0;
+}
+
+int profile_write_summary(FILE *fp)
+{
+  StackList list;
+  collect_stacks(&list);
+  qsort(list.totals, list.count, sizeof(StackTotal), compare_self_wall);
+
+  unsigned long long wall_ns = 0;
+  for (size_t i = 0; i < list.count; ++i)
+  {
+    wall_ns += list.totals[i].self_wall_ns;
+  }
+  fprintf(fp, "%6s %12s %12s %12s %12s %10s  %s\n", "self", "self ms", "total ms", "self cpu ms", "cpu ms", "calls", "stack");
+  for (size_t i = 0; i < list.count; ++i)
+  {
+    const StackTotal *total = &list.totals[i];
+    if (total->calls == 0 && total->wall_ns == 0)
+    {
+      continue;
+    }
+    fprintf(fp, "%5.1f%% %12.3f %12.3f %12.3f %12.3f %10lu  %s\n", wall_ns > 0 ? 100.0 * total->self_wall_ns / wall_ns : 0, total->self_wall_ns / 1e6, total->wall_ns / 1e6, total->self_cpu_ns / 1e6, total->cpu_ns / 1e6, total->calls, total->stack);
+  }
+  free_stacks(&list);
+  return ferror(fp) ? -1 : 0;
+}
+
+static void reset_node(ProfileNode *node)
+{
+  atomic_store_explicit(&node->reset_calls, atomic_load_explicit(&node->calls, memory_order_relaxed), memory_order_relaxed);
+  atomic_store_explicit(&node->reset_wall_ns, atomic_load_explicit(&node->wall_ns, memory_order_relaxed), memory_order_relaxed);
+  atomic_store_explicit(&node->reset_cpu_wall_ns, atomic_load_explicit(&node->cpu_wall_ns, memory_order_relaxed), memory_order_relaxed);
+  atomic_store_explicit(&node->reset_cpu_ns, atomic_load_explicit(&node->cpu_ns, memory_order_relaxed), memory_order_relaxed);
+  for (ProfileNode *child = atomic_load_explicit(&node->children, memory_order_acquire); child != NULL; child = child->next)
+  {
+    reset_node(child);
+  }
+}
+
+void profile_reset()
+{
+  for (ProfileNode *root = atomic_load(&roots); root != NULL; root = root->next)
+  {
+    reset_node(root);
+  }
+}
@@ -0,0 +1,62 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Register-level profiler. Every thread grows a tree of the frames it has
+// run: a job or task at the top, a node for every register recalled or
+// looped over below it and, with the profile_commands option, a leaf for
+// every command letter run inside those. A node adds up its calls and wall
+// time, children included; job, task and register frames also take the
+// thread's CPU time. Only the owning thread writes a node and nodes are
+// never freed, so entering a register or command frame is an array lookup
+// by its letter plus the clock reads, and the writer can read every tree
+// while they grow. Reading a thread's CPU time is a
+// system call on Linux, so only one in PROFILE_CPU_SAMPLE_RATE frames,
+// picked at random, takes it, and the rest are estimated from those.
+// Include jobs.h first, for monotonic_ns() and thread_cpu_ns().
+
+#define PROFILE_CPU_SAMPLE_RATE 64
+#define PROFILE_NAME_LENGTH 64
+#define PROFILE_LETTERS 128
+#define PROFILE_STACK_LENGTH 1024
+
+typedef struct ProfileNode ProfileNode;
+
+typedef struct
+{
+  ProfileNode *node; // NULL unless the frame was entered
+  ProfileNode *parent;
+  uint64_t wall_start;
+  uint64_t cpu_start;
+  bool cpu;
+} ProfileFrame;
+
+// Enters the frame named by the first length characters of name, below the
+// frame the calling thread is in. With cpu set, the frame counts towards the
+// CPU time sample.
+void profile_enter(ProfileFrame *frame, const char *name, size_t length, bool cpu);
+void profile_record(ProfileFrame *frame);
+
+// Does nothing for a frame that was not entered, so that profiling can be
+// turned on or off while frames are open
+static inline void profile_exit(ProfileFrame *frame)
+{
+  if (frame->node != NULL)
+  {
+    profile_record(frame);
+  }
+}
+
+// Writes one line per stack, its frames separated by ';' and followed by
+// its self time in microseconds, wall or CPU, which is the folded format
+// flamegraph.pl and speedscope read. Returns -1 if the output fails.
+int profile_write_folded(FILE *fp, bool cpu);
+// Writes the stacks ranked by their self wall time. Returns -1 if the
+// output fails.
+int profile_write_summary(FILE *fp);
+// Counts from zero again
+void profile_reset();
@@ -0,0 +1,350 @@
+#include "main.h"
+
+#include "files.h"
+#include "script.h"
+
+// Events queued since the last flush, whose lateness is taken once they
+// are actually sent
+#define REPLAY_BATCH 256
+
+typedef struct
+{
+  const uint8_t *next;
+  const uint8_t *end;
+  uint64_t time; // microseconds since the capture started
+  int x;
+  int y;
+  bool moved; // x and y are where the pointer was
+} Decoder;
+
+typedef struct
+{
+  uint64_t time;
+  CaptureEventType type;
+  int a; // x, button or keycode
+  int b; // y, or the character + 1
+} ReplayEvent;
+
+typedef struct
+{
+  uint64_t deadlines[REPLAY_BATCH];
+  int count;
+  unsigned long late[INTERVAL_BUCKETS];
+  uint32_t buttons; // held, a bit each
+  short keys[256];  // the character each keycode holds down, or -1
+  // The capture's screen, and the one to scale to if it differs, or 0
+  int width;
+  int height;
+  int screen_width;
+  int screen_height;
+} Replay;
+
+// Returns false at the end of the file and at a record that is cut short,
+// as the last one of a capture that is still being written can be
+static bool decode(Decoder *decoder, ReplayEvent *event)
+{
+  const uint8_t *in = decoder->next;
+  if (in >= decoder->end)
+  {
+    return false;
+  }
+  int type = *in++;
+  uint64_t delta, a = 0, b = 0;
+  if (!varint_get(&in, decoder->end, &delta))
+  {
+    return false;
+  }
+  switch (type)
+  {
+  case CAPTURE_MOTION:
+  case CAPTURE_KEY_DOWN:
+  case CAPTURE_KEY_UP:
+    if (!varint_get(&in, decoder->end, &a) || !varint_get(&in, decoder->end, &b))
+    {
+      return false;
+    }
+    break;
+  case CAPTURE_BUTTON_DOWN:
+  case CAPTURE_BUTTON_UP:
+  case CAPTURE_DROPPED:
+    if (!varint_get(&in, decoder->end, &a))
+    {
+      return false;
+    }
+    break;
+  default:
+    return false;
+  }
+
+  decoder->next = in;
+  decoder->time += delta;
+  event->time = decoder->time;
+  event->type = type;
+  if (type == CAPTURE_MOTION)
+  {
+    decoder->x += (int)unzigzag(a);
+    decoder->y += (int)unzigzag(b);
+    decoder->moved = true;
+    event->a = decoder->x;
+    event->b = decoder->y;
+  }
+  else
+  {
+    event->a = (int)a;
+    event->b = (int)b;
+  }
+  return true;
+}
+
+static void move_to(const Replay *replay, int x, int y)
+{
+  if (replay->screen_width > 0)
+  {
+    x = (int)((int64_t)x * replay->screen_width / replay->width);
+    y = (int)((int64_t)y * replay->screen_height / replay->height);
+  }
+  mouseMove(x, y);
+}
+
+static void flush_batch(Replay *replay)
+{
+  mkb_flush();
+  uint64_t now = monotonic_ns();
+  for (int i = 0; i < replay->count; ++i)
+  {
+    replay->late[interval_bucket((now - replay->deadlines[i]) / 1000)]++;
+  }
+  replay->count = 0;
+}
+
+static void release_held(Replay *replay)
+{
+  for (int button = 0; replay->buttons != 0; ++button)
+  {
+    if (replay->buttons & (1u << button))
+    {
+      mouseUp(button);
+      replay->buttons &= ~(1u << button);
+    }
+  }
+  for (int code = 0; code < 256; ++code)
+  {
+    if (replay->keys[code] >= 0)
+    {
+      keyUp((char)replay->keys[code]);
+      replay->keys[code] = -1;
+    }
+  }
+  mkb_flush();
+}
+
+// Returns false if the event sent nothing. Releases only what the replay
+// pressed, so a capture that starts with a key already down does not leave
+// a stray release behind.
+static bool send_event(Replay *replay, const ReplayEvent *event, ReplayStats *stats)
+{
+  switch (event->type)
+  {
+  case CAPTURE_MOTION:
+    move_to(replay, event->a, event->b);
+    break;
+  case CAPTURE_BUTTON_DOWN:
+    if ((unsigned int)event->a >= 32)
+    {
+      return false;
+    }
+    mouseDown(event->a);
+    replay->buttons |= 1u << event->a;
+    break;
+  case CAPTURE_BUTTON_UP:
+    if ((unsigned int)event->a >= 32 || !(replay->buttons & (1u << event->a)))
+    {
+      return false;
+    }
+    mouseUp(event->a);
+    replay->buttons &= ~(1u << event->a);
+    break;
+  case CAPTURE_KEY_DOWN:
+    if (event->b <= 0 || event->b > 256 || (unsigned int)event->a >= 256)
+    {
+      stats->skipped++;
+      return false;
+    }
+    keyDown((char)(event->b - 1));
+    replay->keys[event->a] = (short)(event->b - 1);
+    break;
+  case CAPTURE_KEY_UP:
+    // Shift may have come up first, so the key lets go of what it typed
+    if ((unsigned int)event->a >= 256 || replay->keys[event->a] < 0)
+    {
+      return false;
+    }
+    keyUp((char)replay->keys[event->a]);
+    replay->keys[event->a] = -1;
+    break;
+  case CAPTURE_DROPPED:
+    stats->dropped += event->a;
+    return false;
+  }
+  stats->events++;
+  return true;
+}
+
+static double percentile(const unsigned long *late, unsigned long total, double fraction)
+{
+  unsigned long rank = (unsigned long)(total * fraction);
+  unsigned long seen = 0;
+  for (int i = 0; i < INTERVAL_BUCKETS; ++i)
+  {
+    seen += late[i];
+    if (seen > rank)
+    {
+      return interval_bucket_value(i);
+    }
+  }
+  return 0;
+}
+
+int replay_file(const char *path, const ReplayOptions *options, ReplayStats *stats)
+{
+  MappedFile file;
+  if (map_file(path, &file) != 0)
+  {
+    return -1;
+  }
+  const uint8_t *data = (const uint8_t *)file.data;
+  const uint8_t *end = data + file.length;
+  const uint8_t *in = data + 8;
+  uint64_t width, height;
+  if (file.length < 8 || memcmp(data, CAPTURE_MAGIC, 8) != 0 ||
+      !varint_get(&in, end, &width) || !varint_get(&in, end, &height) ||
+      width == 0 || height == 0 || width > INT_MAX || height > INT_MAX)
+  {
+    unmap_file(&file);
+    return -1;
+  }
+#ifdef __linux__
+  madvise((void *)data, file.length, MADV_SEQUENTIAL);
+#endif
+
+  Replay *replay = calloc(1, sizeof(Replay));
+  memset(replay->keys, -1, sizeof(replay->keys));
+  replay->width = (int)width;
+  replay->height = (int)height;
+  int screen_width, screen_height;
+  if (mkb_screen_size(&screen_width, &screen_height) && screen_width > 0 && screen_height > 0 &&
+      (screen_width != replay->width || screen_height != replay->height))
+  {
+    replay->screen_width = screen_width;
+    replay->screen_height = screen_height;
+  }
+
+  *stats = (ReplayStats){0};
+  uint64_t started = monotonic_ns();
+  // Where options->start falls on the monotonic clock in this loop, taken
+  // once the events before it have been skipped
+  uint64_t base = 0;
+  // Loops after the first pick up decoding right before options->start
+  Decoder from = {in, end};
+  mkb_batch_begin();
+  while (!stats->cancelled && (options->loops == 0 || stats->loops < options->loops))
+  {
+    Decoder decoder = from;
+    Decoder before = from;
+    ReplayEvent event;
+    uint64_t last = options->start;
+    bool any = false;
+#ifdef __linux__
+    size_t released = (size_t)(from.next - data) & ~(size_t)(REPLAY_RELEASE_BYTES - 1);
+#endif
+    for (; decode(&decoder, &event); before = decoder)
+    {
+#ifdef __linux__
+      size_t done = (size_t)(decoder.next - data) & ~(size_t)(REPLAY_RELEASE_BYTES - 1);
+      if (done > released)
+      {
+        madvise((void *)(data + released), done - released, MADV_DONTNEED);
+        released = done;
+      }
+#endif
+      if (event.time < options->start)
+      {
+        continue;
+      }
+      if (options->end != 0 && event.time > options->end)
+      {
+        break;
+      }
+      if (!any)
+      {
+        from = before;
+        base = base != 0 ? base : monotonic_ns();
+      }
+
+      uint64_t deadline = base + (uint64_t)((event.time - options->start) * 1000 / options->speed);
+      if (deadline > monotonic_ns())
+      {
+        flush_batch(replay);
+        if (!job_sleep_until(deadline))
+        {
+          stats->cancelled = true;
+          break;
+        }
+      }
+      else if (job_cancelled())
+      {
+        stats->cancelled = true;
+        break;
+      }
+
+      // Starting partway, the pointer first goes where the capture had it
+      if (!any && event.type != CAPTURE_MOTION && decoder.moved)
+      {
+        move_to(replay, decoder.x, decoder.y);
+      }
+      any = true;
+      last = event.time;
+      if (send_event(replay, &event, stats))
+      {
+        replay->deadlines[replay->count++] = deadline;
+      }
+      if (replay->count == REPLAY_BATCH)
+      {
+        flush_batch(replay);
+      }
+    }
+    flush_batch(replay);
+    release_held(replay);
+    if (!any)
+    {
+      // Nothing to replay in this range, however often
+      break;
+    }
+    if (!stats->cancelled)
+    {
+      stats->loops++;
+    }
+    // The next loop picks up right after the last event of this one
+    base += (uint64_t)((last - options->start) * 1000 / options->speed);
+  }
+  mkb_batch_end();
+
+  unsigned long total = 0;
+  int max = -1;
+  for (int i = 0; i < INTERVAL_BUCKETS; ++i)
+  {
+    total += replay->late[i];
+    max = replay->late[i] > 0 ? i : max;
+  }
+  stats->seconds = (monotonic_ns() - started) / 1e9;
+  if (total > 0)
+  {
+    stats->late_p50_us = percentile(replay->late, total, 0.5);
+    stats->late_p99_us = percentile(replay->late, total, 0.99);
+    stats->late_p999_us = percentile(replay->late, total, 0.999);
+    stats->late_max_us = interval_bucket_value(max);
+  }
+  free(replay);
+  unmap_file(&file);
+  return 0;
+}
@@ -0,0 +1,44 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Replay of capture files (see capture.h). The file is mapped rather than
+// read, and decoded one event at a time as its turn comes, so a recording
+// of any length costs the same memory; on Linux the part already replayed
+// is handed back every REPLAY_RELEASE_BYTES. Every event has an absolute
+// deadline on the recording's timeline, divided by the speed, and events
+// that are due together go out in one batch. How late each event went out
+// is kept in a histogram, which gives the timing error against the
+// recording. Keys and buttons still held when a replay ends, is cancelled
+// or starts over are released.
+
+#define REPLAY_MIN_SPEED 0.5
+#define REPLAY_MAX_SPEED 10.0
+#define REPLAY_RELEASE_BYTES (1 << 20)
+
+typedef struct
+{
+  double speed;
+  uint64_t start;      // microseconds into the capture
+  uint64_t end;        // microseconds into the capture, or 0 for all of it
+  unsigned long loops; // 0 replays until the job is cancelled
+} ReplayOptions;
+
+typedef struct
+{
+  unsigned long events;  // sent
+  unsigned long skipped; // keys that type no character
+  unsigned long dropped; // lost while capturing
+  unsigned long loops;   // finished
+  bool cancelled;
+  double seconds;
+  // How late events went out, to within a histogram bucket
+  double late_p50_us;
+  double late_p99_us;
+  double late_p999_us;
+  double late_max_us;
+} ReplayStats;
+
+// Replays the capture at path on the calling thread. Returns -1 if the file
+// cannot be mapped or is not a capture.
+int replay_file(const char *path, const ReplayOptions *options, ReplayStats *stats);
@@ -0,0 +1,250 @@
+#include "main.h"
+
+#include "files.h"
+#include "script.h"
+
+#define SCRIPT_CACHE_MAGIC "CLKSCRPT"
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  uint64_t size; // of the script
+  uint64_t mtime;
+  uint64_t hash;
+  uint64_t text_length;
+  uint32_t token_count;
+  uint32_t token_size; // sizeof(Token) of the build that wrote it
+} CacheHeader; // followed by the lines, the tokens and the text
+
+// Only has to tell an edited script from the cached one when its size and
+// modification time did not change, so it takes 8 bytes at a time and makes
+// no claims beyond that
+static uint64_t hash_bytes(const char *data, size_t length)
+{
+  uint64_t hash = 0x9e3779b97f4a7c15ULL ^ length;
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8)
+  {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 32;
+  }
+  uint64_t word = 0;
+  if (i < length)
+  {
+    memcpy(&word, data + i, length - i);
+  }
+  hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 29;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  return hash ^ (hash >> 32);
+}
+
+// Splits the script at newlines, cutting every line short at its first
+// '\r' as well, and tokenizes the lines in the same pass
+static void parse_script(const MappedFile *file, Script *script)
+{
+  char *text = malloc(file->length + 1);
+  if (file->length > 0)
+  {
+    memcpy(text, file->data, file->length);
+  }
+  text[file->length] = '\0';
+
+  uint32_t line_capacity = 64;
+  uint32_t token_capacity = 256;
+  ScriptLine *lines = malloc(sizeof(ScriptLine) * line_capacity);
+  Token *tokens = malloc(sizeof(Token) * token_capacity);
+  uint32_t count = 0;
+  uint32_t token_count = 0;
+
+  char *end = text + file->length;
+  for (char *line = text; line < end;)
+  {
+    char *newline = memchr(line, '\n', end - line);
+    char *next = newline != NULL ? newline + 1 : end;
+    if (newline != NULL)
+    {
+      *newline = '\0';
+    }
+    line[strcspn(line, "\r")] = '\0';
+
+    Command cmd;
+    if (parse_command(line, &cmd) == 0)
+    {
+      if (count == line_capacity)
+      {
+        line_capacity *= 2;
+        lines = realloc(lines, sizeof(ScriptLine) * line_capacity);
+      }
+      while (token_count + cmd.argc > token_capacity)
+      {
+        token_capacity *= 2;
+        tokens = realloc(tokens, sizeof(Token) * token_capacity);
+      }
+      lines[count++] = (ScriptLine){line - text, cmd.argc, token_count, (unsigned char)cmd.command};
+      memcpy(tokens + token_count, cmd.args, sizeof(Token) * cmd.argc);
+      token_count += cmd.argc;
+    }
+    free_command(&cmd);
+    line = next;
+  }
+
+  script->lines = lines;
+  script->count = count;
+  script->tokens = tokens;
+  script->token_count = token_count;
+  script->text = text;
+  script->text_length = file->length + 1;
+  script->cached = false;
+}
+
+static void write_cache(const char *path, const MappedFile *file, uint64_t hash, const Script *script)
+{
+  char temp[4096];
+  if (snprintf(temp, sizeof(temp), "%s.tmp", path) >= (int)sizeof(temp))
+  {
+    return;
+  }
+  FILE *fp = fopen(temp, "wb");
+  if (fp == NULL)
+  {
+    return;
+  }
+
+  CacheHeader header = {SCRIPT_CACHE_MAGIC, SCRIPT_CACHE_VERSION, script->count, file->length, file->mtime, hash, script->text_length, script->token_count, sizeof(Token)};
+  bool written = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+                 fwrite(script->lines, sizeof(ScriptLine), script->count, fp) == script->count &&
+                 fwrite(script->tokens, sizeof(Token), script->token_count, fp) == script->token_count &&
+                 fwrite(script->text, 1, script->text_length, fp) == script->text_length;
+  if (fclose(fp) != 0 || !written)
+  {
+    remove(temp);
+    return;
+  }
+  if (replace_file(temp, path) != 0)
+  {
+    remove(temp);
+  }
+}
+
+// Maps the cache if it was written for this very script. What it points to
+// is checked to lie inside of it, so that a damaged cache is passed over
+// rather than read out of bounds.
+static bool load_cache(const char *path, const MappedFile *file, uint64_t hash, Script *script)
+{
+  if (map_file(path, &script->cache) != 0)
+  {
+    return false;
+  }
+
+  const char *data = script->cache.data;
+  size_t length = script->cache.length;
+  const CacheHeader *header = (const CacheHeader *)data;
+  if (length < sizeof(CacheHeader) ||
+      memcmp(header->magic, SCRIPT_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != SCRIPT_CACHE_VERSION ||
+      header->token_size != sizeof(Token) ||
+      header->size != file->length ||
+      header->mtime != file->mtime ||
+      header->hash != hash ||
+      header->text_length == 0 ||
+      header->text_length > length ||
+      length != sizeof(CacheHeader) + (uint64_t)header->count * sizeof(ScriptLine) + (uint64_t)header->token_count * sizeof(Token) + header->text_length ||
+      data[length - 1] != '\0')
+  {
+    unmap_file(&script->cache);
+    return false;
+  }
+
+  script->lines = (const ScriptLine *)(data + sizeof(CacheHeader));
+  script->count = header->count;
+  script->tokens = (const Token *)(script->lines + script->count);
+  script->token_count = header->token_count;
+  script->text = (const char *)(script->tokens + script->token_count);
+  script->text_length = header->text_length;
+
+  for (uint32_t i = 0; i < script->count; ++i)
+  {
+    const ScriptLine *line = &script->lines[i];
+    bool valid = line->source < script->text_length && line->argc > 0 &&
+                 (uint64_t)line->first + line->argc <= script->token_count;
+    for (uint32_t j = 0; valid && j < line->argc; ++j)
+    {
+      const Token *token = &script->tokens[line->first + j];
+      valid = token->offset >= 0 && token->length >= 0 &&
+              (uint64_t)token->offset + token->length < script->text_length - line->source &&
+              token->reg >= -1 && token->reg < REGISTERCOUNT;
+    }
+    if (!valid)
+    {
+      unmap_file(&script->cache);
+      return false;
+    }
+  }
+
+  script->cached = true;
+  return true;
+}
+
+int script_load(const char *filename, bool use_cache, Script *script)
+{
+  MappedFile file;
+  if (map_file(filename, &file) != 0)
+  {
+    return -1;
+  }
+  // Lines and tokens are found by 32-bit offsets
+  if (file.length >= UINT32_MAX)
+  {
+    unmap_file(&file);
+    return -1;
+  }
+
+  char path[4096];
+  use_cache = use_cache && snprintf(path, sizeof(path), "%s" SCRIPT_CACHE_SUFFIX, filename) < (int)sizeof(path);
+  uint64_t hash = use_cache ? hash_bytes(file.data, file.length) : 0;
+  if (!use_cache || !load_cache(path, &file, hash, script))
+  {
+    parse_script(&file, script);
+    if (use_cache)
+    {
+      write_cache(path, &file, hash, script);
+    }
+  }
+
+  unmap_file(&file);
+  return 0;
+}
+
+void script_command(const Script *script, uint32_t i, Command *cmd)
+{
+  const ScriptLine *line = &script->lines[i];
+  cmd->command = (char)line->command;
+  cmd->source = script->text + line->source;
+  cmd->argc = line->argc;
+  cmd->args = cmd->argc > INLINE_ARGS ? malloc(sizeof(Token) * cmd->argc) : cmd->inline_args;
+  memcpy(cmd->args, script->tokens + line->first, sizeof(Token) * cmd->argc);
+  resolve_command(cmd);
+}
+
+void script_free(Script *script)
+{
+  if (script->cached)
+  {
+    unmap_file(&script->cache);
+  }
+  else
+  {
+    free((void *)script->lines);
+    free((void *)script->tokens);
+    free((void *)script->text);
+  }
+  script->lines = NULL;
+  script->tokens = NULL;
+  script->text = NULL;
+  script->count = 0;
+}
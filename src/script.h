@@ -0,0 +1,47 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Script files, for LOAD and the .clickerrc. A script is mapped into memory
+// and split into lines and tokens in one pass, with no limit on the length
+// of a line. With the cache on, the result is written to <file>.cache along
+// with the size, modification time and a hash of the script, and as long as
+// all three match, loading the script again maps the cache and uses its
+// tokens as they are. The cache is in the machine's own byte order and is
+// replaced atomically; if it cannot be written, the script is simply parsed
+// every time. Include main.h and files.h first, for Token, Command and
+// MappedFile.
+
+#define SCRIPT_CACHE_SUFFIX ".cache"
+#define SCRIPT_CACHE_VERSION 1 // bump when tokenize() changes
+
+// A line that holds a command; blank lines are left out
+typedef struct
+{
+  uint32_t source; // offset of the line in text
+  uint32_t argc;
+  uint32_t first; // index of its first token in tokens
+  uint32_t command;
+} ScriptLine;
+
+typedef struct
+{
+  const ScriptLine *lines;
+  uint32_t count;
+  const Token *tokens;
+  uint32_t token_count;
+  const char *text; // the lines, each ending in a '\0'
+  size_t text_length;
+  bool cached; // the above point into the cache, or else were allocated
+  MappedFile cache;
+} Script;
+
+// Returns -1 if the script cannot be read
+int script_load(const char *filename, bool use_cache, Script *script);
+// Fills cmd with the i-th command of the script, which is valid until the
+// script is freed. Free it with free_command().
+void script_command(const Script *script, uint32_t i, Command *cmd);
+void script_free(Script *script);
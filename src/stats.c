@@ -0,0 +1,161 @@
+#include "jobs.h"
+
+#include "stats.h"
+
+typedef struct
+{
+  _Alignas(64) atomic_ulong count[STATCOUNT];
+  atomic_ulong intervals[STATCOUNT][INTERVAL_BUCKETS];
+} StatShard;
+
+static StatShard shards[STAT_SHARDS];
+static atomic_uint next_shard = 0;
+static _Thread_local StatShard *shard = NULL;
+static _Thread_local uint64_t last_event[STATCOUNT];
+
+int interval_bucket(uint64_t us)
+{
+  if (us < 16)
+  {
+    return (int)us;
+  }
+  int msb = 4;
+  while (us >> (msb + 1))
+  {
+    msb++;
+  }
+  int bucket = (msb - 2) * 8 + (int)((us >> (msb - 3)) & 7);
+  return bucket < INTERVAL_BUCKETS ? bucket : INTERVAL_BUCKETS - 1;
+}
+
+double interval_bucket_value(int bucket)
+{
+  if (bucket < 16)
+  {
+    return bucket;
+  }
+  int shift = bucket / 8 - 1;
+  return (double)((uint64_t)(8 + bucket % 8) << shift) + (double)((uint64_t)1 << shift) / 2;
+}
+
+void stats_count(StatKind kind)
+{
+  if (shard == NULL)
+  {
+    shard = &shards[atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed) % STAT_SHARDS];
+  }
+  uint64_t now = monotonic_ns();
+  if (last_event[kind] != 0)
+  {
+    int bucket = interval_bucket((now - last_event[kind]) / 1000);
+    atomic_fetch_add_explicit(&shard->intervals[kind][bucket], 1, memory_order_relaxed);
+  }
+  last_event[kind] = now;
+  atomic_fetch_add_explicit(&shard->count[kind], 1, memory_order_relaxed);
+}
+
+// Shard totals at one point in time. The sampler keeps the last second's
+// worth, and the figures are the difference between the newest and the
+// oldest.
+typedef struct
+{
+  uint64_t time;
+  unsigned long count[STATCOUNT];
+  unsigned long intervals[STATCOUNT][INTERVAL_BUCKETS];
+} StatSample;
+
+#define SAMPLE_RING (STAT_SAMPLES_PER_SECOND + 1)
+
+static StatSample samples[SAMPLE_RING];
+static int samples_taken = 0;
+
+typedef struct
+{
+  InputStat stats[STATCOUNT];
+} StatSummary;
+
+static _Atomic(StatSummary *) summary = NULL;
+
+static void summarize(const StatSample *oldest, const StatSample *newest, StatKind kind, InputStat *stat)
+{
+  stat->total = newest->count[kind];
+  double seconds = (newest->time - oldest->time) / 1e9;
+  stat->rate = seconds > 0 ? (newest->count[kind] - oldest->count[kind]) / seconds : 0;
+
+  unsigned long window[INTERVAL_BUCKETS];
+  unsigned long intervals = 0;
+  for (int i = 0; i < INTERVAL_BUCKETS; ++i)
+  {
+    window[i] = newest->intervals[kind][i] - oldest->intervals[kind][i];
+    intervals += window[i];
+  }
+  stat->intervals = intervals;
+
+  unsigned long p50 = (intervals + 1) / 2;
+  unsigned long p99 = intervals - intervals / 100;
+  unsigned long seen = 0;
+  for (int i = 0; i < INTERVAL_BUCKETS; ++i)
+  {
+    if (window[i] == 0)
+    {
+      continue;
+    }
+    if (seen < p50 && seen + window[i] >= p50)
+    {
+      stat->interval_p50_us = interval_bucket_value(i);
+    }
+    if (seen < p99 && seen + window[i] >= p99)
+    {
+      stat->interval_p99_us = interval_bucket_value(i);
+    }
+    stat->interval_max_us = interval_bucket_value(i);
+    seen += window[i];
+  }
+}
+
+void stats_sample()
+{
+  StatSample *newest = &samples[samples_taken % SAMPLE_RING];
+  memset(newest, 0, sizeof(StatSample));
+  newest->time = monotonic_ns();
+  for (int s = 0; s < STAT_SHARDS; ++s)
+  {
+    for (int k = 0; k < STATCOUNT; ++k)
+    {
+      newest->count[k] += atomic_load_explicit(&shards[s].count[k], memory_order_relaxed);
+      for (int i = 0; i < INTERVAL_BUCKETS; ++i)
+      {
+        newest->intervals[k][i] += atomic_load_explicit(&shards[s].intervals[k][i], memory_order_relaxed);
+      }
+    }
+  }
+  samples_taken++;
+
+  const StatSample *oldest = &samples[samples_taken > STAT_SAMPLES_PER_SECOND ? samples_taken % SAMPLE_RING : 0];
+  StatSummary *next = calloc(1, sizeof(StatSummary));
+  for (int k = 0; k < STATCOUNT; ++k)
+  {
+    summarize(oldest, newest, k, &next->stats[k]);
+  }
+
+  StatSummary *previous = atomic_exchange_explicit(&summary, next, memory_order_acq_rel);
+  if (previous != NULL)
+  {
+    epoch_retire(previous, free);
+  }
+}
+
+void input_stats(InputStat stats[STATCOUNT])
+{
+  epoch_enter();
+  StatSummary *current = atomic_load_explicit(&summary, memory_order_acquire);
+  if (current != NULL)
+  {
+    memcpy(stats, current->stats, sizeof(current->stats));
+  }
+  else
+  {
+    memset(stats, 0, sizeof(InputStat) * STATCOUNT);
+  }
+  epoch_exit();
+}
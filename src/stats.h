@@ -0,0 +1,51 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "epoch.h"
+
+// Input telemetry. Every thread counts the clicks, key presses and moves it
+// sends in a shard of its own, so counting never contends with other
+// threads, and a sampler sums the shards STAT_SAMPLES_PER_SECOND times a
+// second into rates over the last second. Shards also keep histograms of
+// the time between a thread's consecutive events of a kind, which is the
+// cadence its loops achieve. Include jobs.h first, for monotonic_ns().
+
+#define STAT_SHARDS 32
+#define STAT_SAMPLES_PER_SECOND 10
+// Exact below 16 us, then 8 buckets per power of two, up to about 38 hours
+#define INTERVAL_BUCKETS 288
+
+typedef enum
+{
+  STAT_CLICKS, // button presses
+  STAT_KEYS,   // key presses
+  STAT_MOVES,
+  STATCOUNT
+} StatKind;
+
+typedef struct
+{
+  double rate;         // per second, over the last second
+  unsigned long total; // since startup
+  unsigned long intervals;
+  // Of the intervals that ended in the last second, to within a bucket
+  double interval_p50_us;
+  double interval_p99_us;
+  double interval_max_us;
+} InputStat;
+
+void stats_count(StatKind kind);
+// Takes a sample. Call it STAT_SAMPLES_PER_SECOND times a second from one
+// thread.
+void stats_sample();
+// Copies the figures of the latest sample, all zero before the first one
+void input_stats(InputStat stats[STATCOUNT]);
+// The histogram bucket of an interval, for anything else that wants
+// percentiles of microseconds
+int interval_bucket(uint64_t us);
+// The middle of the bucket, in microseconds
+double interval_bucket_value(int bucket);
@@ -0,0 +1,777 @@
+#include "pixel.h"
+#include "template.h"
+
+// A level of a pyramid. Rows of the image's coarsest level are padded with
+// zeros, far enough for a block of positions that starts at the last one.
+typedef struct
+{
+  float *values;
+  int width;
+  int height;
+  int stride;
+} Plane;
+
+typedef struct
+{
+  Plane plane;   // with the mean taken out
+  double energy; // the sum of its squares
+} TemplateLevel;
+
+struct Template
+{
+  int levels;
+  TemplateLevel level[TEMPLATE_LEVELS];
+  atomic_int refs; // one for the cache, one per search using it
+};
+
+typedef struct
+{
+  int x;
+  int y;
+  double score;
+} Candidate;
+
+// The best positions, best first, none of them within apart_x and apart_y
+// of a better one
+typedef struct
+{
+  Candidate best[TEMPLATE_CANDIDATES];
+  int count;
+  int apart_x;
+  int apart_y;
+} Candidates;
+
+typedef void (*BandFunc)(void *arg, int band);
+
+typedef struct
+{
+  BandFunc func;
+  void *arg;
+  int count;
+  atomic_int next;
+} Bands;
+
+typedef struct
+{
+  const Template *template;
+  const GrayImage *image;
+  // The image's levels from 1 down to the coarsest, and level 0 only if it
+  // is the coarsest
+  Plane planes[TEMPLATE_LEVELS];
+  int coarsest;
+  int level; // being built or refined
+  // Integral images of the coarsest level, a row and a column larger
+  double *sums;
+  double *squares;
+  Candidates *bands; // of the coarsest level
+  Candidates candidates;
+} Search;
+
+typedef struct
+{
+  char *filename;
+  uint64_t mtime; // ns since the epoch, whole seconds on Windows
+  long long size;
+  Template *template;
+} CachedTemplate;
+
+#ifdef _WIN32
+static SRWLOCK cache_lock = SRWLOCK_INIT;
+
+#define LOCK_CACHE() AcquireSRWLockExclusive(&cache_lock)
+#define UNLOCK_CACHE() ReleaseSRWLockExclusive(&cache_lock)
+#elif defined(__linux__)
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define LOCK_CACHE() pthread_mutex_lock(&cache_lock)
+#define UNLOCK_CACHE() pthread_mutex_unlock(&cache_lock)
+#endif
+
+// Guarded by cache_lock. Templates that are replaced or evicted lose the
+// cache's reference, and the last search still using one frees it.
+static CachedTemplate cache[TEMPLATE_CACHE];
+static int cache_next = 0;
+
+#ifdef __linux__
+// The pool is started by the first search and serves one at a time
+static pthread_mutex_t search_lock = PTHREAD_MUTEX_INITIALIZER;
+// Guarded by pool_lock
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_idle = PTHREAD_COND_INITIALIZER;
+static int pool_threads = -1;
+static unsigned long pool_round = 0;
+static int pool_busy = 0;
+static Bands *pool_work = NULL;
+#endif
+
+// Square root by Newton's method, which needs no libm. Starting above the
+// root, every step comes down until the last bit.
+static double root(double value)
+{
+  if (value <= 0)
+  {
+    return 0;
+  }
+  double guess = value > 1 ? value : 1;
+  for (int i = 0; i < 128; ++i)
+  {
+    double next = (guess + value / guess) / 2;
+    if (next >= guess)
+    {
+      break;
+    }
+    guess = next;
+  }
+  return guess;
+}
+
+static Plane new_plane(int width, int height, int padding)
+{
+  Plane plane = {NULL, width, height, width + padding};
+  plane.values = calloc((size_t)plane.stride * height, sizeof(float));
+  return plane;
+}
+
+// A value of a level is a mean of the 4x4 around the four it covers a level
+// up, weighted 1 3 3 1 each way. Detail finer than the level, which a plain
+// mean of the four would keep or lose depending on where an image starts on
+// the screen, is smoothed away, so that a template's levels look like the
+// screen's wherever it is. Edges repeat.
+static float halve_edge(const float *sums, int width, int x)
+{
+  int left = 2 * x > 0 ? 2 * x - 1 : 0;
+  int right = 2 * x + 2 < width ? 2 * x + 2 : width - 1;
+  return (sums[left] + 3 * (sums[2 * x] + sums[2 * x + 1]) + sums[right]) * (1.0f / 64);
+}
+
+static void halve_row(const float *sums, int width, float *out, int out_width)
+{
+  // Only the first and last reach past an edge
+  out[0] = halve_edge(sums, width, 0);
+  for (int x = 1; x < out_width - 1; ++x)
+  {
+    out[x] = (sums[2 * x - 1] + 3 * (sums[2 * x] + sums[2 * x + 1]) + sums[2 * x + 2]) * (1.0f / 64);
+  }
+  out[out_width - 1] = halve_edge(sums, width, out_width - 1);
+}
+
+static void halve_gray(const GrayImage *in, const Plane *out, int first, int last)
+{
+  float *sums = malloc(in->width * sizeof(float));
+  for (int y = first; y < last; ++y)
+  {
+    const uint8_t *above = in->pixels + (size_t)(y > 0 ? 2 * y - 1 : 0) * in->width;
+    const uint8_t *top = in->pixels + (size_t)2 * y * in->width;
+    const uint8_t *bottom = top + in->width;
+    const uint8_t *below = 2 * y + 2 < in->height ? bottom + in->width : bottom;
+    for (int x = 0; x < in->width; ++x)
+    {
+      sums[x] = above[x] + 3 * (top[x] + bottom[x]) + below[x];
+    }
+    halve_row(sums, in->width, out->values + (size_t)y * out->stride, out->width);
+  }
+  free(sums);
+}
+
+static void halve(const Plane *in, const Plane *out, int first, int last)
+{
+  float *sums = malloc(in->width * sizeof(float));
+  for (int y = first; y < last; ++y)
+  {
+    const float *above = in->values + (size_t)(y > 0 ? 2 * y - 1 : 0) * in->stride;
+    const float *top = in->values + (size_t)2 * y * in->stride;
+    const float *bottom = top + in->stride;
+    const float *below = 2 * y + 2 < in->height ? bottom + in->stride : bottom;
+    for (int x = 0; x < in->width; ++x)
+    {
+      sums[x] = above[x] + 3 * (top[x] + bottom[x]) + below[x];
+    }
+    halve_row(sums, in->width, out->values + (size_t)y * out->stride, out->width);
+  }
+  free(sums);
+}
+
+static void copy_gray(const GrayImage *in, int x, int y, const Plane *out, int first, int last)
+{
+  for (int row = first; row < last; ++row)
+  {
+    const uint8_t *pixels = in->pixels + (size_t)(y + row) * in->width + x;
+    float *values = out->values + (size_t)row * out->stride;
+    for (int column = 0; column < out->width; ++column)
+    {
+      values[column] = pixels[column];
+    }
+  }
+}
+
+// The normalized cross-correlation of the template with the values under
+// it, or 0 where they are flat
+static double correlate(const TemplateLevel *level, const float *values, int stride)
+{
+  const Plane *template = &level->plane;
+  double product = 0, sum = 0, squares = 0;
+  for (int y = 0; y < template->height; ++y)
+  {
+    const float *weights = template->values + (size_t)y * template->stride;
+    const float *row = values + (size_t)y * stride;
+    for (int x = 0; x < template->width; ++x)
+    {
+      product += weights[x] * row[x];
+      sum += row[x];
+      squares += row[x] * row[x];
+    }
+  }
+  double count = (double)template->width * template->height;
+  double variance = squares - sum * sum / count;
+  return variance < count / 4 ? 0 : product / root(variance * level->energy);
+}
+
+static void offer(Candidates *candidates, int x, int y, double score)
+{
+  int count = candidates->count;
+  if (count == TEMPLATE_CANDIDATES && score <= candidates->best[count - 1].score)
+  {
+    return;
+  }
+  // A better one nearby wins, and worse ones nearby go
+  int kept = 0;
+  for (int i = 0; i < count; ++i)
+  {
+    Candidate *candidate = &candidates->best[i];
+    bool near = abs(candidate->x - x) < candidates->apart_x && abs(candidate->y - y) < candidates->apart_y;
+    if (near && candidate->score >= score)
+    {
+      return;
+    }
+    if (!near)
+    {
+      candidates->best[kept++] = *candidate;
+    }
+  }
+  int at = kept < TEMPLATE_CANDIDATES ? kept : TEMPLATE_CANDIDATES - 1;
+  while (at > 0 && candidates->best[at - 1].score < score)
+  {
+    if (at < TEMPLATE_CANDIDATES)
+    {
+      candidates->best[at] = candidates->best[at - 1];
+    }
+    at--;
+  }
+  candidates->best[at] = (Candidate){x, y, score};
+  candidates->count = kept < TEMPLATE_CANDIDATES ? kept + 1 : TEMPLATE_CANDIDATES;
+}
+
+static void take_bands(Bands *bands)
+{
+  for (int band = atomic_fetch_add(&bands->next, 1); band < bands->count; band = atomic_fetch_add(&bands->next, 1))
+  {
+    bands->func(bands->arg, band);
+  }
+}
+
+#ifdef __linux__
+static void *pool_thread(void *arg)
+{
+  unsigned long seen = 0;
+  pthread_mutex_lock(&pool_lock);
+  for (;;)
+  {
+    while (pool_round == seen)
+    {
+      pthread_cond_wait(&pool_wake, &pool_lock);
+    }
+    seen = pool_round;
+    Bands *bands = pool_work;
+    pthread_mutex_unlock(&pool_lock);
+    take_bands(bands);
+    pthread_mutex_lock(&pool_lock);
+    if (--pool_busy == 0)
+    {
+      pthread_cond_signal(&pool_idle);
+    }
+  }
+  return NULL;
+}
+
+// With search_lock held
+static void start_pool()
+{
+  if (pool_threads >= 0)
+  {
+    return;
+  }
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int wanted = cpus > TEMPLATE_MAX_THREADS ? TEMPLATE_MAX_THREADS - 1 : cpus > 1 ? (int)cpus - 1 : 0;
+  pool_threads = 0;
+  for (int i = 0; i < wanted; ++i)
+  {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, pool_thread, NULL) != 0)
+    {
+      break;
+    }
+    pthread_detach(thread);
+    pool_threads++;
+  }
+}
+#endif
+
+// Calls func for every band, on the pool and the calling thread, and
+// returns once all of them are done
+static void run_bands(BandFunc func, void *arg, int count)
+{
+  Bands bands = {func, arg, count, 0};
+#ifdef __linux__
+  pthread_mutex_lock(&pool_lock);
+  pool_work = &bands;
+  pool_busy = pool_threads;
+  pool_round++;
+  pthread_cond_broadcast(&pool_wake);
+  pthread_mutex_unlock(&pool_lock);
+#endif
+  take_bands(&bands);
+#ifdef __linux__
+  pthread_mutex_lock(&pool_lock);
+  while (pool_busy > 0)
+  {
+    pthread_cond_wait(&pool_idle, &pool_lock);
+  }
+  pthread_mutex_unlock(&pool_lock);
+#endif
+}
+
+static void build_band(void *arg, int band)
+{
+  Search *search = arg;
+  const Plane *out = &search->planes[search->level];
+  int first = band * TEMPLATE_BAND;
+  int last = first + TEMPLATE_BAND < out->height ? first + TEMPLATE_BAND : out->height;
+  if (search->level == 0)
+  {
+    copy_gray(search->image, 0, 0, out, first, last);
+  }
+  else if (search->level == 1)
+  {
+    halve_gray(search->image, out, first, last);
+  }
+  else
+  {
+    halve(&search->planes[search->level - 1], out, first, last);
+  }
+}
+
+// Scores TEMPLATE_BAND rows of positions on the coarsest level. The sums
+// of the template times the image for a block of positions side by side
+// grow together, one template value at a time, so the loop that does most
+// of the work has a fixed length and no branch.
+static void score_band(void *arg, int band)
+{
+  Search *search = arg;
+  const TemplateLevel *level = &search->template->level[search->coarsest];
+  const Plane *template = &level->plane;
+  const Plane *plane = &search->planes[search->coarsest];
+  int columns = plane->width - template->width + 1;
+  int rows = plane->height - template->height + 1;
+  int first = band * TEMPLATE_BAND;
+  int last = first + TEMPLATE_BAND < rows ? first + TEMPLATE_BAND : rows;
+  Candidates *candidates = &search->bands[band];
+  *candidates = (Candidates){.apart_x = (template->width + 1) / 2, .apart_y = (template->height + 1) / 2};
+
+  double count = (double)template->width * template->height;
+  int across = plane->width + 1;
+  for (int y = first; y < last; ++y)
+  {
+    for (int x0 = 0; x0 < columns; x0 += TEMPLATE_BLOCK)
+    {
+      float products[TEMPLATE_BLOCK] = {0};
+      for (int ty = 0; ty < template->height; ++ty)
+      {
+        const float *weights = template->values + (size_t)ty * template->stride;
+        const float *row = plane->values + (size_t)(y + ty) * plane->stride + x0;
+        for (int tx = 0; tx < template->width; ++tx)
+        {
+          float weight = weights[tx];
+          const float *values = row + tx;
+          for (int i = 0; i < TEMPLATE_BLOCK; ++i)
+          {
+            products[i] += weight * values[i];
+          }
+        }
+      }
+
+      // Ranked by the square of the score, with its sign, to leave the
+      // root for the few that are followed down
+      int end = columns - x0 < TEMPLATE_BLOCK ? columns - x0 : TEMPLATE_BLOCK;
+      for (int i = 0; i < end; ++i)
+      {
+        size_t top = (size_t)y * across + x0 + i;
+        size_t bottom = top + (size_t)template->height * across;
+        double sum = search->sums[bottom + template->width] - search->sums[bottom] - search->sums[top + template->width] + search->sums[top];
+        double squares = search->squares[bottom + template->width] - search->squares[bottom] - search->squares[top + template->width] + search->squares[top];
+        double variance = squares - sum * sum / count;
+        double product = products[i];
+        double score = variance < count / 4 ? 0 : product * (product < 0 ? -product : product) / (variance * level->energy);
+        offer(candidates, x0 + i, y, score);
+      }
+    }
+  }
+}
+
+static void integrate(Search *search)
+{
+  const Plane *plane = &search->planes[search->coarsest];
+  int across = plane->width + 1;
+  search->sums = calloc((size_t)across * (plane->height + 1), sizeof(double));
+  search->squares = calloc((size_t)across * (plane->height + 1), sizeof(double));
+  for (int y = 0; y < plane->height; ++y)
+  {
+    const float *row = plane->values + (size_t)y * plane->stride;
+    double sum = 0, squares = 0;
+    for (int x = 0; x < plane->width; ++x)
+    {
+      sum += row[x];
+      squares += (double)row[x] * row[x];
+      size_t at = (size_t)(y + 1) * across + x + 1;
+      search->sums[at] = search->sums[at - across] + sum;
+      search->squares[at] = search->squares[at - across] + squares;
+    }
+  }
+}
+
+// Moves a candidate from the level above to the best position within
+// TEMPLATE_RADIUS of where it lands on this one, and scores it there. On
+// the coarsest level it stays where it is.
+static void refine_band(void *arg, int band)
+{
+  Search *search = arg;
+  int level = search->level;
+  const TemplateLevel *template = &search->template->level[level];
+  const Plane *plane = level > 0 || search->coarsest == 0 ? &search->planes[level] : NULL;
+  int width = plane != NULL ? plane->width : search->image->width;
+  int height = plane != NULL ? plane->height : search->image->height;
+  int max_x = width - template->plane.width;
+  int max_y = height - template->plane.height;
+  int scale = level == search->coarsest ? 1 : 2;
+  int radius = level == search->coarsest ? 0 : TEMPLATE_RADIUS;
+
+  Candidate *candidate = &search->candidates.best[band];
+  int left = scale * candidate->x - radius > 0 ? scale * candidate->x - radius : 0;
+  int top = scale * candidate->y - radius > 0 ? scale * candidate->y - radius : 0;
+  int right = scale * candidate->x + radius < max_x ? scale * candidate->x + radius : max_x;
+  int bottom = scale * candidate->y + radius < max_y ? scale * candidate->y + radius : max_y;
+  left = left < right ? left : right;
+  top = top < bottom ? top : bottom;
+
+  // Level 0 is only kept in gray, so the part under the search is copied
+  const float *values;
+  int stride;
+  Plane window = {NULL, right - left + template->plane.width, bottom - top + template->plane.height, 0};
+  if (plane != NULL)
+  {
+    values = plane->values + (size_t)top * plane->stride + left;
+    stride = plane->stride;
+  }
+  else
+  {
+    window.stride = window.width;
+    window.values = malloc((size_t)window.width * window.height * sizeof(float));
+    copy_gray(search->image, left, top, &window, 0, window.height);
+    values = window.values;
+    stride = window.stride;
+  }
+
+  Candidate best = {left, top, -2};
+  for (int y = top; y <= bottom; ++y)
+  {
+    for (int x = left; x <= right; ++x)
+    {
+      double score = correlate(template, values + (size_t)(y - top) * stride + (x - left), stride);
+      if (score > best.score)
+      {
+        best = (Candidate){x, y, score};
+      }
+    }
+  }
+  *candidate = best;
+  free(window.values);
+}
+
+static void find(Search *search, TemplateMatch *match)
+{
+  const Template *template = search->template;
+  const GrayImage *image = search->image;
+  // The coarsest level that both have, where the image is no smaller
+  int widths[TEMPLATE_LEVELS], heights[TEMPLATE_LEVELS];
+  search->coarsest = -1;
+  for (int level = 0; level < template->levels; ++level)
+  {
+    widths[level] = level == 0 ? image->width : widths[level - 1] / 2;
+    heights[level] = level == 0 ? image->height : heights[level - 1] / 2;
+    if (widths[level] < template->level[level].plane.width || heights[level] < template->level[level].plane.height)
+    {
+      break;
+    }
+    search->coarsest = level;
+  }
+  if (search->coarsest < 0)
+  {
+    return;
+  }
+
+  for (int level = search->coarsest == 0 ? 0 : 1; level <= search->coarsest; ++level)
+  {
+    search->planes[level] = new_plane(widths[level], heights[level], level == search->coarsest ? TEMPLATE_BLOCK : 0);
+    search->level = level;
+    run_bands(build_band, search, (heights[level] + TEMPLATE_BAND - 1) / TEMPLATE_BAND);
+  }
+  integrate(search);
+  const Plane *coarse = &template->level[search->coarsest].plane;
+  int rows = heights[search->coarsest] - coarse->height + 1;
+  int bands = (rows + TEMPLATE_BAND - 1) / TEMPLATE_BAND;
+  search->bands = malloc(bands * sizeof(Candidates));
+  run_bands(score_band, search, bands);
+
+  Candidates *candidates = &search->candidates;
+  *candidates = (Candidates){.apart_x = search->bands[0].apart_x, .apart_y = search->bands[0].apart_y};
+  for (int band = 0; band < bands; ++band)
+  {
+    for (int i = 0; i < search->bands[band].count; ++i)
+    {
+      Candidate *candidate = &search->bands[band].best[i];
+      offer(candidates, candidate->x, candidate->y, candidate->score);
+    }
+  }
+  for (search->level = search->coarsest; search->level >= 0; search->level--)
+  {
+    run_bands(refine_band, search, candidates->count);
+  }
+
+  for (int i = 0; i < candidates->count; ++i)
+  {
+    if (!match->found || candidates->best[i].score > match->score)
+    {
+      *match = (TemplateMatch){true, candidates->best[i].x, candidates->best[i].y, candidates->best[i].score};
+    }
+  }
+}
+
+void template_find(const Template *template, const GrayImage *image, TemplateMatch *match)
+{
+  *match = (TemplateMatch){0};
+  Search search = {.template = template, .image = image};
+#ifdef __linux__
+  pthread_mutex_lock(&search_lock);
+  start_pool();
+#endif
+  find(&search, match);
+#ifdef __linux__
+  pthread_mutex_unlock(&search_lock);
+#endif
+  for (int level = 0; level < TEMPLATE_LEVELS; ++level)
+  {
+    free(search.planes[level].values);
+  }
+  free(search.sums);
+  free(search.squares);
+  free(search.bands);
+}
+
+// Takes the mean out of the level and returns false if it is flat
+static bool center(TemplateLevel *level)
+{
+  Plane *plane = &level->plane;
+  size_t count = (size_t)plane->width * plane->height;
+  double sum = 0;
+  for (size_t i = 0; i < count; ++i)
+  {
+    sum += plane->values[i];
+  }
+  float mean = sum / count;
+  level->energy = 0;
+  for (size_t i = 0; i < count; ++i)
+  {
+    plane->values[i] -= mean;
+    level->energy += (double)plane->values[i] * plane->values[i];
+  }
+  return level->energy >= count / 4.0;
+}
+
+Template *template_create(const GrayImage *image)
+{
+  Template *template = calloc(1, sizeof(Template));
+  atomic_init(&template->refs, 1);
+  template->level[0].plane = new_plane(image->width, image->height, 0);
+  copy_gray(image, 0, 0, &template->level[0].plane, 0, image->height);
+  template->levels = 1;
+  while (template->levels < TEMPLATE_LEVELS)
+  {
+    const Plane *finer = &template->level[template->levels - 1].plane;
+    if (finer->width / 2 < TEMPLATE_MIN_SIDE || finer->height / 2 < TEMPLATE_MIN_SIDE)
+    {
+      break;
+    }
+    Plane *plane = &template->level[template->levels].plane;
+    *plane = new_plane(finer->width / 2, finer->height / 2, 0);
+    halve(finer, plane, 0, plane->height);
+    template->levels++;
+  }
+
+  // A level that comes out flat cannot be searched, nor can those under it
+  for (int level = 0; level < template->levels; ++level)
+  {
+    if (!center(&template->level[level]))
+    {
+      for (int i = level; i < template->levels; ++i)
+      {
+        free(template->level[i].plane.values);
+      }
+      template->levels = level;
+      break;
+    }
+  }
+  if (template->levels == 0)
+  {
+    free(template);
+    return NULL;
+  }
+  return template;
+}
+
+void template_release(Template *template)
+{
+  if (atomic_fetch_sub(&template->refs, 1) != 1)
+  {
+    return;
+  }
+  for (int i = 0; i < template->levels; ++i)
+  {
+    free(template->level[i].plane.values);
+  }
+  free(template);
+}
+
+void template_size(const Template *template, int *width, int *height)
+{
+  *width = template->level[0].plane.width;
+  *height = template->level[0].plane.height;
+}
+
+// Reads a number of a PNM header, after white space and comments, and the
+// one white space character that ends it. Returns -1 if there is none.
+static long header_number(FILE *file)
+{
+  int c = fgetc(file);
+  while (c == '#' || isspace(c))
+  {
+    if (c == '#')
+    {
+      while (c != '\n' && c != EOF)
+      {
+        c = fgetc(file);
+      }
+    }
+    c = fgetc(file);
+  }
+  long value = 0;
+  int digits = 0;
+  for (; isdigit(c) && digits < 6; ++digits)
+  {
+    value = value * 10 + c - '0';
+    c = fgetc(file);
+  }
+  return digits > 0 && isspace(c) ? value : -1;
+}
+
+// Binary PPM (P6) or PGM (P5) with 8 bits a channel
+static Template *read_template(const char *filename)
+{
+  FILE *file = fopen(filename, "rb");
+  if (file == NULL)
+  {
+    return NULL;
+  }
+  int magic = fgetc(file);
+  int kind = fgetc(file);
+  int channels = magic != 'P' ? 0 : kind == '6' ? 3 : kind == '5' ? 1 : 0;
+  long width = channels > 0 ? header_number(file) : -1;
+  long height = width > 0 ? header_number(file) : -1;
+  long maximum = height > 0 ? header_number(file) : -1;
+
+  Template *template = NULL;
+  if (width > 0 && height > 0 && width <= 4096 && height <= 4096 && maximum > 0 && maximum <= 255)
+  {
+    size_t count = (size_t)width * height;
+    uint8_t *data = malloc(count * channels);
+    GrayImage image = {malloc(count), width, height, 0, 0};
+    if (fread(data, channels, count, file) == count)
+    {
+      for (size_t i = 0; i < count; ++i)
+      {
+        const uint8_t *pixel = data + i * channels;
+        image.pixels[i] = channels == 1 ? pixel[0] : (pixel[0] * 77 + pixel[1] * 150 + pixel[2] * 29) >> 8;
+      }
+      template = template_create(&image);
+    }
+    free(data);
+    free(image.pixels);
+  }
+  fclose(file);
+  return template;
+}
+
+Template *template_load(const char *filename)
+{
+  struct stat info;
+  if (stat(filename, &info) != 0)
+  {
+    return NULL;
+  }
+  // A file rewritten within the same second still differs in the
+  // nanoseconds, or else usually in its size
+#ifdef _WIN32
+  uint64_t mtime = (uint64_t)info.st_mtime * 1000000000ULL;
+#elif defined(__linux__)
+  uint64_t mtime = (uint64_t)info.st_mtim.tv_sec * 1000000000ULL + info.st_mtim.tv_nsec;
+#endif
+
+  LOCK_CACHE();
+  CachedTemplate *entry = NULL;
+  for (int i = 0; i < TEMPLATE_CACHE && entry == NULL; ++i)
+  {
+    if (cache[i].filename != NULL && strcmp(cache[i].filename, filename) == 0)
+    {
+      entry = &cache[i];
+    }
+  }
+  if (entry != NULL && entry->mtime == mtime && entry->size == (long long)info.st_size)
+  {
+    Template *cached = entry->template;
+    atomic_fetch_add(&cached->refs, 1);
+    UNLOCK_CACHE();
+    return cached;
+  }
+
+  Template *template = read_template(filename);
+  if (template != NULL)
+  {
+    // A file that is not cached yet takes the slot cached longest ago
+    if (entry == NULL)
+    {
+      entry = &cache[cache_next];
+      cache_next = (cache_next + 1) % TEMPLATE_CACHE;
+      free(entry->filename);
+      entry->filename = strdup(filename);
+    }
+    if (entry->template != NULL)
+    {
+      template_release(entry->template);
+    }
+    entry->mtime = mtime;
+    entry->size = info.st_size;
+    entry->template = template;
+    atomic_fetch_add(&template->refs, 1);
+  }
+  UNLOCK_CACHE();
+  return template;
+}
@@ -0,0 +1,65 @@
+#include <ctype.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// Finding a reference image on the screen, for FIND_IMAGE. Images are
+// binary PPM or PGM files, loaded once into gray and halved down to a
+// pyramid with the mean taken out of every level. A search scores every
+// position of the coarsest level by normalized cross-correlation, keeps the
+// TEMPLATE_CANDIDATES best ones that are apart from one another and follows
+// each down the pyramid, looking around it on every finer level. Levels are
+// split into bands of rows, and the candidates into a band each, that a
+// pool of threads, one for each CPU beside the caller, takes in turn. The
+// coarsest level sums TEMPLATE_BLOCK positions at once, and the sums of the
+// screen under each position come from integral images. On Windows the
+// caller takes every band itself. Include pixel.h first, for GrayImage.
+
+#define TEMPLATE_CACHE 32
+#define TEMPLATE_LEVELS 4
+#define TEMPLATE_MIN_SIDE 12 // of a template's coarsest level
+#define TEMPLATE_CANDIDATES 8
+#define TEMPLATE_RADIUS 2 // pixels around a candidate looked at on a finer level
+#define TEMPLATE_BLOCK 8
+#define TEMPLATE_BAND 8 // rows a thread takes at a time
+#define TEMPLATE_MAX_THREADS 16
+#define TEMPLATE_THRESHOLD 0.8f // score FIND_IMAGE wants unless told otherwise
+
+typedef struct Template Template;
+
+typedef struct
+{
+  bool found; // false if the image is larger than where it is looked for
+  int x;      // of the top left corner, within the image looked in
+  int y;
+  double score; // -1 to 1, where 1 is the same image up to brightness and contrast
+} TemplateMatch;
+
+// Loads a PPM or PGM file, or returns the copy loaded before unless the
+// file has changed since. Returns NULL if it cannot be read or is flat.
+// The caller holds a reference until template_release(), so a template
+// replaced in the cache meanwhile stays valid.
+Template *template_load(const char *filename);
+// Builds a template from gray pixels, with one reference. Returns NULL if
+// they are flat.
+Template *template_create(const GrayImage *image);
+// Drops a reference, freeing the template with the last one
+void template_release(Template *template);
+void template_size(const Template *template, int *width, int *height);
+// Finds where the template looks most like the image. One search runs at a
+// time.
+void template_find(const Template *template, const GrayImage *image, TemplateMatch *match);
@@ -0,0 +1,176 @@
+#include "timerwheel.h"
+
+static uint64_t to_ticks(uint64_t ns)
+{
+  return (ns + TIMER_TICK_NS - 1) >> TIMER_TICK_SHIFT;
+}
+
+static void link_timer(Timer *head, Timer *timer)
+{
+  timer->next = head->next;
+  timer->prev = head;
+  head->next->prev = timer;
+  head->next = timer;
+}
+
+static void unlink_timer(Timer *timer)
+{
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = NULL;
+  timer->prev = NULL;
+}
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now_ns)
+{
+  wheel->now = now_ns >> TIMER_TICK_SHIFT;
+  wheel->count = 0;
+  for (int level = 0; level < TIMER_LEVELS; ++level)
+  {
+    for (int slot = 0; slot < TIMER_SLOTS; ++slot)
+    {
+      Timer *head = &wheel->slots[level][slot];
+      head->next = head;
+      head->prev = head;
+    }
+  }
+}
+
+static void place_timer(TimerWheel *wheel, Timer *timer)
+{
+  uint64_t deadline = timer->deadline > wheel->now ? timer->deadline : wheel->now + 1;
+  uint64_t delta = deadline - wheel->now;
+  int level = 0;
+  while (level < TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_SLOT_BITS * (level + 1))))
+  {
+    level++;
+  }
+  int slot = (deadline >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1);
+  link_timer(&wheel->slots[level][slot], timer);
+}
+
+void timer_add(TimerWheel *wheel, Timer *timer, uint64_t deadline_ns)
+{
+  timer->deadline = to_ticks(deadline_ns);
+  place_timer(wheel, timer);
+  wheel->count++;
+}
+
+void timer_remove(TimerWheel *wheel, Timer *timer)
+{
+  if (timer_pending(timer))
+  {
+    unlink_timer(timer);
+    wheel->count--;
+  }
+}
+
+bool timer_pending(const Timer *timer)
+{
+  return timer->prev != NULL;
+}
+
+// Re-files the timers of a higher level slot now that it is within reach of
+// the levels below
+static void cascade(TimerWheel *wheel, int level, int slot)
+{
+  // Detach the slot first: timers beyond the top level can land in the slot
+  // they came from
+  Timer *head = &wheel->slots[level][slot];
+  if (head->next == head)
+  {
+    return;
+  }
+  Timer *timer = head->next;
+  head->prev->next = NULL;
+  head->next = head;
+  head->prev = head;
+  while (timer != NULL)
+  {
+    Timer *next = timer->next;
+    place_timer(wheel, timer);
+    timer = next;
+  }
+}
+
+Timer *timer_advance(TimerWheel *wheel, uint64_t now_ns)
+{
+  uint64_t target = now_ns >> TIMER_TICK_SHIFT;
+  Timer *expired = NULL;
+
+  while (wheel->now < target && wheel->count > 0)
+  {
+    // Jump over empty ticks. Nothing happens before the next expiry, not
+    // even a cascade of a non-empty slot.
+    const Timer *upcoming = &wheel->slots[0][(wheel->now + 1) & (TIMER_SLOTS - 1)];
+    if (upcoming->next == upcoming)
+    {
+      uint64_t next = timer_next_expiry(wheel) >> TIMER_TICK_SHIFT;
+      if (next > target)
+      {
+        break;
+      }
+      wheel->now = next - 1;
+    }
+    wheel->now++;
+
+    for (int level = 1; level < TIMER_LEVELS; ++level)
+    {
+      if ((wheel->now & ((1ULL << (TIMER_SLOT_BITS * level)) - 1)) != 0)
+      {
+        break;
+      }
+      cascade(wheel, level, (wheel->now >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1));
+    }
+
+    Timer *head = &wheel->slots[0][wheel->now & (TIMER_SLOTS - 1)];
+    while (head->next != head)
+    {
+      Timer *timer = head->next;
+      unlink_timer(timer);
+      wheel->count--;
+      timer->next = expired;
+      expired = timer;
+    }
+  }
+
+  if (wheel->now < target)
+  {
+    // Nothing left to fire, so skip straight ahead
+    wheel->now = target;
+  }
+
+  // The expired list reuses next; unlink_timer already cleared prev, which
+  // marks them as no longer pending
+  return expired;
+}
+
+uint64_t timer_next_expiry(const TimerWheel *wheel)
+{
+  if (wheel->count == 0)
+  {
+    return UINT64_MAX;
+  }
+
+  // A timer on a higher level can be due before one on a lower level, so
+  // take the earliest over all of them
+  uint64_t earliest = UINT64_MAX;
+  for (int level = 0; level < TIMER_LEVELS; ++level)
+  {
+    int shift = TIMER_SLOT_BITS * level;
+    for (uint64_t i = 1; i <= TIMER_SLOTS; ++i)
+    {
+      uint64_t tick = ((wheel->now >> shift) + i) << shift;
+      const Timer *head = &wheel->slots[level][(tick >> shift) & (TIMER_SLOTS - 1)];
+      if (head->next != head)
+      {
+        if (tick < earliest)
+        {
+          earliest = tick;
+        }
+        break;
+      }
+    }
+  }
+  return earliest << TIMER_TICK_SHIFT;
+}
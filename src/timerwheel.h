@@ -0,0 +1,39 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel. Deadlines are in nanoseconds on any monotonic
+// clock and are rounded up to TIMER_TICK_NS, so timers never fire early and
+// at most one tick late.
+
+#define TIMER_TICK_SHIFT 14 // ~16us ticks
+#define TIMER_TICK_NS (1ULL << TIMER_TICK_SHIFT)
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 8
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+typedef struct Timer
+{
+  uint64_t deadline; // in ticks
+  struct Timer *next;
+  struct Timer *prev;
+} Timer;
+
+typedef struct
+{
+  uint64_t now; // in ticks, everything up to and including it has fired
+  Timer slots[TIMER_LEVELS][TIMER_SLOTS]; // list heads
+  size_t count;
+} TimerWheel;
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now_ns);
+void timer_add(TimerWheel *wheel, Timer *timer, uint64_t deadline_ns);
+void timer_remove(TimerWheel *wheel, Timer *timer);
+bool timer_pending(const Timer *timer);
+// Moves the wheel forward to now_ns and returns the expired timers as a
+// list linked through next
+Timer *timer_advance(TimerWheel *wheel, uint64_t now_ns);
+// When the next timer may expire, or UINT64_MAX if the wheel is empty. Timers
+// further out than the first level are reported at the time they move down
+// a level, which is never later than their deadline.
+uint64_t timer_next_expiry(const TimerWheel *wheel);